@@ -9,6 +9,9 @@ void setup()
 	Serial.begin(115200);
 	delay(1000);
 	SPIFFS.begin();
+#if(PSTORAGE_TEST_ENABLED)
+	Serial.println("Test suites: " + String(pStorageTest()) + " failures");
+#endif
 
 	// we create 2 PStoraged, one that will be recreated each time, the other will be persisted
 
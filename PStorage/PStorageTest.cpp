@@ -7,11 +7,15 @@
 
 #include "PStorageTest.h"
 
+static unsigned int _pStorageTestFailures = 0;
 
 void _pStorageTestResult(boolean result, const char *testSuite , const char *format, va_list argList) {
 	char logBuffer[256];
 	vsnprintf(logBuffer, sizeof(logBuffer), format, argList);
 	Serial.println((result? "SUCCESS \t\t" : "FAILURE \t\t") + String(testSuite) + ": " + String(logBuffer));
+	if (!result) {
+		_pStorageTestFailures++;
+	}
 }
 
 void pStorageTestSuccess(const char *testSuite, const char *format, ...) {
@@ -29,9 +33,1372 @@ void pStorageTestFailure(const char *testSuite, const char *format, ...) {
 	va_end(argList);
 }
 
+/*
+ * Reports a failure unless condition holds, returns condition.
+ */
+static boolean _pStorageTestExpect(boolean condition, const char *testSuite, const char *format, ...) {
+	if (!condition) {
+		va_list argList;
+		va_start(argList, format);
+		_pStorageTestResult(false, testSuite, format, argList);
+		va_end(argList);
+	}
+	return condition;
+}
+
+/*
+ * More keys than the RAM index holds: the first ones are found in RAM, the others by a walk of the chain.
+ */
+static void _pStorageTestIndexCache() {
+	const char *suite = "RAM index";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int keys = PSTORAGE_INDEX_CACHE_MAXENTRIES + 8;
+	char name[PSTORAGE_INDEX_NAME_MAXSIZE + 1];
+	int value;
+
+	PStorage p("TestIndex");
+	if (!_pStorageTestExpect(p.create(keys * 48), suite, "create() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "k%u", i);
+		_pStorageTestExpect(p.map(name, (int) i), suite, "map(%s) failed", name);
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "k%u", i);
+		_pStorageTestExpect(p.get(name, &value) && (value == (int) i), suite, "get(%s) of a full index", name);
+	}
+	_pStorageTestExpect(!p.get("none", &value), suite, "get() of a missing key succeeded");
+	for (unsigned int i = 0; i < keys; i += 5) {  // cached and uncached ones
+		snprintf(name, sizeof(name), "k%u", i);
+		_pStorageTestExpect(p.remove(name), suite, "remove(%s) failed", name);
+	}
+	_pStorageTestExpect(p.map("new", (int) -1), suite, "map() after remove() failed");
+
+	PStorage q("TestIndex");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "k%u", i);
+		const boolean found = q.get(name, &value);
+		_pStorageTestExpect((i % 5 == 0) ? !found : (found && (value == (int) i)), suite, "get(%s) after open()", name);
+	}
+	_pStorageTestExpect(q.get("new", &value) && (value == -1), suite, "get(new) after open()");
+	_pStorageTestExpect(p.getAllocatedSize() == q.getAllocatedSize(), suite, "getAllocatedSize() differs");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u keys", keys);
+	}
+}
+
+/*
+ * A store without spare room: removed entries have to be reused, the neighbours a1 and a2 merged into one.
+ */
+static void _pStorageTestFreeBins() {
+	const char *suite = "Free bins";
+	const unsigned int failures = _pStorageTestFailures;
+	// new stores pack the index entries of a store below 64 KB into 10 bytes and keep the name "a0" behind the value
+	const unsigned int entrySize = 10 + 32 + 2;
+	const unsigned int bigSize = 2 * entrySize - 10 - 3;
+	char name[PSTORAGE_INDEX_NAME_MAXSIZE + 1];
+	byte value[2 * entrySize];
+	byte buf[2 * entrySize];
+
+	PStorage p("TestBins");
+	if (!_pStorageTestExpect(p.create(6 * entrySize), suite, "create() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < 6; i++) {
+		snprintf(name, sizeof(name), "a%u", i);
+		memset(value, i, 32);
+		_pStorageTestExpect(p.map(name, value, 32), suite, "map(%s) failed", name);
+	}
+	_pStorageTestExpect(!p.map("full", (int) 0), suite, "map() of a full store succeeded");
+	_pStorageTestExpect(p.remove("a1") && p.remove("a2") && p.remove("a4"), suite, "remove() failed");
+	memset(value, 0xbb, bigSize);
+	_pStorageTestExpect(p.map("big", value, bigSize), suite, "map() into the merged entries failed");
+	memset(value, 4, 32);
+	_pStorageTestExpect(p.map("a4", value, 32), suite, "map() into a removed entry failed");
+	_pStorageTestExpect(!p.map("full", (int) 0), suite, "map() of a full store succeeded");
+
+	PStorage q("TestBins");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < 6; i++) {
+		snprintf(name, sizeof(name), "a%u", i);
+		memset(value, i, 32);
+		const boolean found = q.get(name, buf, 32);
+		_pStorageTestExpect(((i == 1) || (i == 2)) ? !found : (found && (memcmp(buf, value, 32) == 0)), suite,
+				"get(%s) after open()", name);
+	}
+	memset(value, 0xbb, bigSize);
+	_pStorageTestExpect(q.get("big", buf, bigSize) && (memcmp(buf, value, bigSize) == 0), suite, "get(big) after open()");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u byte entries reused", entrySize);
+	}
+}
+
+/*
+ * Values below, at and above the page size of the I/O buffer, across page boundaries and rewritten in place.
+ */
+static void _pStorageTestIOBuffer() {
+	const char *suite = "Page buffer";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int sizes[] = { 1, PSTORAGE_IO_BUFFER_SIZE - 1, PSTORAGE_IO_BUFFER_SIZE, 2 * PSTORAGE_IO_BUFFER_SIZE + 3, 7 };
+	const unsigned int count = sizeof(sizes) / sizeof(sizes[0]);
+	char name[PSTORAGE_INDEX_NAME_MAXSIZE + 1];
+	byte value[2 * PSTORAGE_IO_BUFFER_SIZE + 3];
+	byte buf[2 * PSTORAGE_IO_BUFFER_SIZE + 3];
+
+	PStorage p("TestIOBuffer");
+	if (!_pStorageTestExpect(p.create(4 * PSTORAGE_IO_BUFFER_SIZE + count * (sizeof(PStorageIndexEntry) + PSTORAGE_ENTRY_MINSIZE)), suite, "create() failed")) {
+		return;
+	}
+	for (unsigned int round = 0; round < 2; round++) {  // the second round rewrites all values in place
+		for (unsigned int i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "v%u", i);
+			for (unsigned int j = 0; j < sizes[i]; j++) {
+				value[j] = (byte) (i + j + round);
+			}
+			_pStorageTestExpect(p.map(name, value, sizes[i]), suite, "map(%s) of %u bytes failed", name, sizes[i]);
+			_pStorageTestExpect(p.get(name, buf, sizes[i]) && (memcmp(buf, value, sizes[i]) == 0), suite,
+					"get(%s) of %u bytes", name, sizes[i]);
+		}
+	}
+
+	PStorage q("TestIOBuffer");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "v%u", i);
+		for (unsigned int j = 0; j < sizes[i]; j++) {
+			value[j] = (byte) (i + j + 1);
+		}
+		_pStorageTestExpect(q.get(name, buf, sizes[i]) && (memcmp(buf, value, sizes[i]) == 0), suite,
+				"get(%s) of %u bytes after open()", name, sizes[i]);
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u values around %u byte pages", count, PSTORAGE_IO_BUFFER_SIZE);
+	}
+}
+
+/*
+ * Writes of a nested batch, of a PStorageBatch and of a batch left open at ~PStorage() all reach the file.
+ */
+static void _pStorageTestBatch() {
+	const char *suite = "Batch";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int keys = 40;
+	char name[PSTORAGE_INDEX_NAME_MAXSIZE + 1];
+	int value;
+
+	{
+		PStorage p("TestBatch");
+		if (!_pStorageTestExpect(p.create(keys * 64), suite, "create() failed")) {
+			return;
+		}
+		p.beginBatch();
+		for (unsigned int i = 0; i < keys / 2; i++) {
+			snprintf(name, sizeof(name), "k%u", i);
+			p.beginBatch();
+			_pStorageTestExpect(p.map(name, (int) i), suite, "map(%s) failed", name);
+			_pStorageTestExpect(p.commit(), suite, "nested commit() failed");
+		}
+		_pStorageTestExpect(p.get("k3", &value) && (value == 3), suite, "get() inside a batch");
+		_pStorageTestExpect(p.commit(), suite, "commit() failed");
+		{
+			PStorageBatch batch(p);
+			for (unsigned int i = keys / 2; i < keys; i++) {
+				snprintf(name, sizeof(name), "k%u", i);
+				_pStorageTestExpect(p.map(name, (int) i), suite, "map(%s) failed", name);
+			}
+		}
+		p.beginBatch();  // left open
+		_pStorageTestExpect(p.map("k0", (int) -1) && p.remove("k1"), suite, "map() and remove() of an open batch failed");
+	}
+
+	PStorage q("TestBatch");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "k%u", i);
+		const boolean found = q.get(name, &value);
+		_pStorageTestExpect((i == 1) ? !found : (found && (value == ((i == 0) ? -1 : (int) i))), suite,
+				"get(%s) after open()", name);
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u keys", keys);
+	}
+}
+
+/*
+ * Random updates of keys wrap the log many times over, with removals, compact() and a replay at open().
+ * Compaction has to find room to move the live record at the head whenever map() appends.
+ */
+static void _pStorageTestLog() {
+	const char *suite = "Log engine";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int keys = 7;
+	const unsigned int rounds = 1000;
+	byte values[keys];  // fill byte of the latest value, 0 if removed
+	char name[16];
+	byte value[64];
+	byte buf[64];
+	unsigned long random = 1;
+
+	PStorage p("TestLog");
+	if (!_pStorageTestExpect(p.create(2048, P_LOG), suite, "create() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		values[i] = 0;
+	}
+	for (unsigned int round = 0; round < rounds; round++) {
+		random = random * 1103515245 + 12345;
+		const unsigned int key = (random >> 16) % keys;
+		snprintf(name, sizeof(name), "k%u", key);
+		if (round % 13 == 12) {
+			_pStorageTestExpect(p.remove(name), suite, "remove(%s) in round %u failed", name, round);
+			values[key] = 0;
+		}
+		else {
+			values[key] = 1 + round % 255;
+			memset(value, values[key], sizeof(value));
+			_pStorageTestExpect(p.map(name, value, sizeof(value)), suite, "map(%s) in round %u failed", name, round);
+		}
+		if (round % 100 == 99) {
+			_pStorageTestExpect(p.compact(1000), suite, "compact() in round %u failed", round);
+		}
+	}
+	unsigned int live = 0;
+	for (unsigned int i = 0; i < keys; i++) {
+		live += (values[i] > 0) ? 1 : 0;
+	}
+	for (unsigned int i = PSTORAGE_INDEX_CACHE_MAXENTRIES - live; i > 0; i--) {  // fill the RAM index
+		snprintf(name, sizeof(name), "f%u", i);
+		_pStorageTestExpect(p.map(name, (int) i), suite, "map(%s) failed", name);
+	}
+	_pStorageTestExpect(!p.map("over", (int) 0), suite, "map() beyond the RAM index succeeded");
+
+	PStorage q("TestLog");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "k%u", i);
+		memset(value, values[i], sizeof(value));
+		const boolean found = q.get(name, buf, sizeof(buf));
+		_pStorageTestExpect((values[i] == 0) ? !found : (found && (memcmp(buf, value, sizeof(value)) == 0)), suite,
+				"get(%s) after open()", name);
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u updates of %u keys", rounds, keys);
+	}
+}
+
+/*
+ * Removing every second string leaves free blocks too small for a large value until compact() merges them.
+ */
+static void _pStorageTestCompaction() {
+	const char *suite = "Compaction";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int keys = 40;
+	char name[16];
+	char value[65];
+	char buf[65];
+	byte large[1024];
+	unsigned int largestFree, totalFree;
+
+	PStorage p("TestCompact");
+	if (!_pStorageTestExpect(p.create(4096), suite, "create() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "s%u", i);
+		memset(value, 'a' + i % 26, 64);
+		value[64] = '\0';
+		_pStorageTestExpect(p.map(name, value), suite, "map(%s) failed", name);
+	}
+	for (unsigned int i = 0; i < keys; i += 2) {
+		snprintf(name, sizeof(name), "s%u", i);
+		_pStorageTestExpect(p.remove(name), suite, "remove(%s) failed", name);
+	}
+	_pStorageTestExpect(p.getFragmentation(&largestFree, &totalFree) > 50, suite, "fragmentation of %u of %u bytes",
+			largestFree, totalFree);
+	memset(large, 0x5a, sizeof(large));
+	_pStorageTestExpect(!p.map("large", large, sizeof(large)), suite, "map() into fragmented space succeeded");
+	unsigned int calls = 0;
+	while ((p.getFragmentation() > 0) && (calls < 100)) {
+		_pStorageTestExpect(p.compact(0), suite, "compact() failed");
+		calls++;
+	}
+	_pStorageTestExpect(p.getFragmentation(&largestFree, &totalFree) == 0, suite, "%u compact() calls left %u of %u bytes",
+			calls, largestFree, totalFree);
+	_pStorageTestExpect(p.map("large", large, sizeof(large)), suite, "map() after compact() failed");
+
+	PStorage q("TestCompact");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "s%u", i);
+		memset(value, 'a' + i % 26, 64);
+		value[64] = '\0';
+		const boolean found = q.get(name, buf, sizeof(buf));
+		_pStorageTestExpect((i % 2 == 0) ? !found : (found && (strcmp(buf, value) == 0)), suite, "get(%s) after open()", name);
+	}
+	_pStorageTestExpect(q.get("large", (byte *) buf, 1) && (buf[0] == 0x5a), suite, "get(large) after open()");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u compact() calls", calls);
+	}
+}
+
+/*
+ * A lazy store starts with its headers only and grows with the values, a filled one is written at create().
+ */
+static void _pStorageTestLazyCreate() {
+	const char *suite = "Lazy create";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int maxSize = 4096;
+	const unsigned int keys = 30;
+	char name[16];
+	char value[101];
+	char buf[101];
+
+	for (unsigned int engine = P_INPLACE; engine <= P_LOG; engine++) {
+		PStorage f("TestFilled");
+		_pStorageTestExpect(f.create(maxSize, (PStorageEngine) engine), suite, "create() of a filled store failed");
+		File file = SPIFFS.open("/pstorage/TestFilled.psf", "r");
+		const unsigned int filled = file ? file.size() : 0;
+		_pStorageTestExpect(filled >= maxSize, suite, "filled store of %u bytes", filled);
+		file.close();
+
+		PStorage p("TestLazy");
+		if (!_pStorageTestExpect(p.create(maxSize, (PStorageEngine) engine, true), suite, "create() failed")) {
+			return;
+		}
+		file = SPIFFS.open("/pstorage/TestLazy.psf", "r");
+		_pStorageTestExpect(file && (file.size() + maxSize * 3 / 4 < filled), suite, "lazy store of %u bytes, filled %u", file ? file.size() : 0,
+				filled);  // both hold the params, the write counts and the checkpoint in front of the first entry
+		file.close();
+		for (unsigned int i = 0; i < keys; i++) {
+			snprintf(name, sizeof(name), "s%u", i);
+			memset(value, 'a' + (i + engine) % 26, 100);
+			value[100] = '\0';
+			_pStorageTestExpect(p.map(name, value), suite, "map(%s) failed", name);
+		}
 
+		PStorage q("TestLazy");
+		if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+			return;
+		}
+		for (unsigned int i = 0; i < keys; i++) {
+			snprintf(name, sizeof(name), "s%u", i);
+			memset(value, 'a' + (i + engine) % 26, 100);
+			value[100] = '\0';
+			_pStorageTestExpect(q.get(name, buf, sizeof(buf)) && (strcmp(buf, value) == 0), suite, "get(%s) after open()", name);
+		}
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u strings in stores of both engines", keys);
+	}
+}
+
+/*
+ * getView() shows the value in the file, also right after a map() that only reached the page buffer. Without
+ * PSTORAGE_MMAP_ENABLED it fails.
+ */
+static void _pStorageTestView() {
+	const char *suite = "View";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int keys = 20;
+	char name[16];
+	byte value[48];
+	const byte *data;
+	unsigned int size;
+
+	PStorage p("TestView");
+	if (!_pStorageTestExpect(p.create(4096), suite, "create() failed")) {
+		return;
+	}
+	_pStorageTestExpect(p.map("l", -2L), suite, "map(l) failed");
+#if(PSTORAGE_MMAP_ENABLED)
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "a%u", i);
+		memset(value, i, sizeof(value));
+		_pStorageTestExpect(p.map(name, value, 16 + i), suite, "map(%s) failed", name);
+		_pStorageTestExpect(p.getView(name, &data, &size) && (size == 16 + i) && (memcmp(data, value, size) == 0), suite,
+				"getView(%s) right after map()", name);
+	}
+	for (unsigned int i = 0; i < keys; i++) {
+		snprintf(name, sizeof(name), "a%u", i);
+		memset(value, i, sizeof(value));
+		_pStorageTestExpect(p.getView(name, &data, &size) && (size == 16 + i) && (memcmp(data, value, size) == 0), suite,
+				"getView(%s)", name);
+	}
+	int32_t stored = 0;
+	_pStorageTestExpect(p.getView("l", &data, &size) && (size == sizeof(stored)), suite, "long not stored in 32 bits");
+	if (size == sizeof(stored)) {
+		memcpy(&stored, data, sizeof(stored));
+		_pStorageTestExpect(stored == -2, suite, "getView(l) is %ld", (long) stored);
+	}
+	_pStorageTestExpect(!p.getView("missing", &data, &size), suite, "getView() of a missing key succeeded");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u arrays and a long viewed in the mapping", keys);
+	}
+#else
+	(void) keys;
+	(void) name;
+	(void) value;
+	_pStorageTestExpect(!p.getView("l", &data, &size), suite, "getView() succeeded without PSTORAGE_MMAP_ENABLED");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "getView() fails without PSTORAGE_MMAP_ENABLED");
+	}
+#endif
+}
+
+static boolean _pStorageTestChunk(const byte *chunk, unsigned int size, unsigned int offset, void *context) {
+	return memcmp((byte *) context + offset, chunk, size) == 0;
+}
 
+/*
+ * write() patches in place, grows past the end of the allocation and creates, append() extends, read() returns
+ * parts and streams the whole value in chunks. The allocated size must not change once the value stops growing.
+ */
+static void _pStorageTestStream() {
+	const char *suite = "Stream";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int length = 300;
+	byte expected[length], buf[length];
+	unsigned int size;
+
+	for (unsigned int i = 0; i < length; i++) {
+		expected[i] = (byte) (i * 7);
+	}
+	for (unsigned int engine = P_INPLACE; engine <= P_LOG; engine++) {
+		PStorage p("TestStream");
+		if (!_pStorageTestExpect(p.create(4096, (PStorageEngine) engine), suite, "create() failed")) {
+			return;
+		}
+		_pStorageTestExpect(p.write("a", 0, expected, 10), suite, "write() of a new value failed");
+		for (unsigned int offset = 10; offset < length; offset += 29) {  // moves P_INPLACE values several times
+			_pStorageTestExpect(p.append("a", expected + offset, min(29U, length - offset)), suite, "append() at %u failed", offset);
+		}
+		_pStorageTestExpect(p.getSize("a", &size) && (size == length), suite, "getSize() is %u", size);
+		expected[100] = 0xAA;
+		expected[101] = 0x55;
+		_pStorageTestExpect(p.write("a", 100, expected + 100, 2), suite, "write() in place failed");
+		const unsigned int allocated = p.getAllocatedSize();
+		_pStorageTestExpect(p.write("a", 200, expected + 200, 50), suite, "write() within the value failed");
+		_pStorageTestExpect((engine == P_LOG) || (p.getAllocatedSize() == allocated), suite, "write() in place allocated %u bytes",
+				p.getAllocatedSize() - allocated);
+		_pStorageTestExpect(p.read("a", 95, buf, 10) == 10, suite, "read() at 95");
+		_pStorageTestExpect(memcmp(buf, expected + 95, 10) == 0, suite, "read() at 95 returned other bytes");
+		_pStorageTestExpect(p.read("a", length - 5, buf, 10) == 5, suite, "read() over the end");
+		_pStorageTestExpect(p.read("a", length + 1, buf, 10) == -1, suite, "read() behind the end");
+		_pStorageTestExpect(p.read("a", _pStorageTestChunk, expected), suite, "read() in chunks differs");
+
+		PStorage q("TestStream");
+		_pStorageTestExpect(q.open() && (q.read("a", 0, buf, length) == (int) length) && (memcmp(buf, expected, length) == 0),
+				suite, "value differs after open()");
+		_pStorageTestExpect(!q.write("missing", 1, expected, 1), suite, "write() behind the end of a missing value succeeded");
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u bytes written and appended in parts in stores of both engines", length);
+	}
+}
+
+struct PStorageTestConfig {
+	int interval;
+	float threshold;
+	byte flags[6];
+};
+
+struct PStorageTestPair {  // the size of PStorageTestConfig on the ESP8266 and the host
+	unsigned int first;
+	float second;
+	byte rest[6];
+};
+PSTORAGE_TYPE_ID(PStorageTestPair, 1)
+
+/*
+ * Structs round-trip with the templated map() and get(), which fail for another type of the same size and for
+ * the scalar stored under the same name.
+ */
+static void _pStorageTestTyped() {
+	const char *suite = "Typed values";
+	const unsigned int failures = _pStorageTestFailures;
+	PStorageTestConfig config = {1000, 2.5f, {1, 2, 3, 4, 5, 6}}, readConfig;
+	PStorageTestPair pair;
+	int number;
 
+	for (unsigned int engine = P_INPLACE; engine <= P_LOG; engine++) {
+		PStorage p("TestTyped");
+		if (!_pStorageTestExpect(p.create(2048, (PStorageEngine) engine), suite, "create() failed")) {
+			return;
+		}
+		_pStorageTestExpect(p.map("cfg", config), suite, "map(cfg) failed");
+		config.interval = 2000;
+		_pStorageTestExpect(p.map("cfg", config), suite, "map(cfg) again failed");
+		_pStorageTestExpect(p.map("n", 5) && p.map<short>("short", -3), suite, "map() of scalars failed");
 
+		PStorage q("TestTyped");
+		_pStorageTestExpect(q.open(), suite, "open() failed");
+		memset(&readConfig, 0, sizeof(readConfig));
+		_pStorageTestExpect(q.get("cfg", &readConfig) && (memcmp(&readConfig, &config, sizeof(config)) == 0), suite,
+				"get(cfg) differs");
+		_pStorageTestExpect(!q.get("cfg", &pair), suite, "get() of another type of the same size succeeded");
+		_pStorageTestExpect(!q.get("cfg", &number), suite, "get() of an int from a struct succeeded");
+		short s = 0;
+		_pStorageTestExpect(q.get("short", &s) && (s == -3), suite, "get(short) is %d", s);
+		_pStorageTestExpect(q.get("n", &number) && (number == 5), suite, "get(n) is %d", number);
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "structs and scalars in stores of both engines");
+	}
+}
+
+/*
+ * mapMany() and getMany() of more keys than the RAM index holds: the second mapMany() finds every key, also those
+ * beyond the RAM index, and rewrites them in place.
+ */
+static void _pStorageTestMany() {
+	const char *suite = "Many";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int count = PSTORAGE_INDEX_CACHE_MAXENTRIES + 8;
+	char names[count][8];
+	int values[count];
+	PStorageItem items[count];
+
+	PStorage p("TestMany");
+	if (!_pStorageTestExpect(p.create(8192), suite, "create() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(names[i], sizeof(names[i]), "m%u", i);
+		values[i] = i;
+		items[i].name = names[i];
+		items[i].type = P_INT;
+		items[i].value = &values[i];
+		items[i].size = sizeof(values[i]);
+	}
+	_pStorageTestExpect(p.mapMany(items, count), suite, "mapMany() of new keys failed");
+	const unsigned int allocated = p.getAllocatedSize();
+	for (unsigned int i = 0; i < count; i++) {
+		values[i] = 1000 + i;
+	}
+	_pStorageTestExpect(p.mapMany(items, count), suite, "mapMany() of present keys failed");
+	_pStorageTestExpect(p.getAllocatedSize() == allocated, suite, "mapMany() of present keys allocated %u bytes",
+			p.getAllocatedSize() - allocated);
+
+	PStorage q("TestMany");
+	_pStorageTestExpect(q.open(), suite, "open() failed");
+	memset(values, 0, sizeof(values));
+	_pStorageTestExpect(q.getMany(items, count), suite, "getMany() failed");
+	for (unsigned int i = 0; i < count; i++) {
+		_pStorageTestExpect(items[i].done && (values[i] == (int) (1000 + i)), suite, "getMany() of %s is %d", names[i], values[i]);
+	}
+	int number;
+	_pStorageTestExpect(q.remove("m0") && !q.getMany(items, count) && !items[0].done && items[1].done, suite,
+			"getMany() with a missing key");
+	_pStorageTestExpect(!q.get("m0", &number), suite, "removed key found");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u ints mapped twice and read in one call", count);
+	}
+}
+
+/*
+ * A store created with keys finds more keys than the RAM index holds through the sorted index, also after open() and
+ * once it overflowed. Without keys the file ends with the data area.
+ */
+static void _pStorageTestSortedIndex() {
+	const char *suite = "Sorted index";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int count = PSTORAGE_INDEX_CACHE_MAXENTRIES + 40;
+	const unsigned int maxSize = 8192;
+	char name[16];
+	int value;
+
+	PStorage none("TestSorted");
+	if (!_pStorageTestExpect(none.create(maxSize), suite, "create() without keys failed")) {
+		return;
+	}
+	File file = SPIFFS.open("/pstorage/TestSorted.psf", "r");
+	const unsigned int noneSize = file ? file.size() : 0;
+	_pStorageTestExpect(file && (none.getFileSize() == noneSize), suite, "store without keys of %u bytes", noneSize);
+	file.close();
+
+	for (unsigned int round = 0; round < 2; round++) {
+		const unsigned int keys = (round == 0) ? count : 16;  // the second store overflows its index
+		PStorage p("TestSorted");
+		if (!_pStorageTestExpect(p.create(maxSize, P_INPLACE, false, keys), suite, "create() with %u keys failed", keys)) {
+			return;
+		}
+		for (unsigned int i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "k%u", i);
+			_pStorageTestExpect(p.map(name, (int) i), suite, "map(%s) failed", name);
+		}
+		for (unsigned int i = 0; i < count; i += 4) {
+			snprintf(name, sizeof(name), "K%u", i);  // names compare without case
+			_pStorageTestExpect(p.remove(name), suite, "remove(%s) failed", name);
+		}
+
+		PStorage q("TestSorted");
+		if (!_pStorageTestExpect(q.open(), suite, "open() with %u keys failed", keys)) {
+			return;
+		}
+		for (unsigned int i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "k%u", i);
+			const boolean found = q.get(name, &value);
+			_pStorageTestExpect((found == (i % 4 != 0)) && (!found || (value == (int) i)), suite, "get(%s) of %u keys", name, keys);
+		}
+		file = SPIFFS.open("/pstorage/TestSorted.psf", "r");
+		_pStorageTestExpect(file && (q.getFileSize() == file.size()), suite, "getFileSize() is %u for a file of %u bytes",
+				q.getFileSize(), file ? file.size() : 0);
+		_pStorageTestExpect(q.getFileSize() >= noneSize + keys * sizeof(PStorageSortedRecord), suite,
+				"index of %u keys in %u bytes, %u without", keys, q.getFileSize(), noneSize);
+		file.close();
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u ints with room for all and for 16 keys", count);
+	}
+}
+
+/*
+ * New stores keep names of up to PSTORAGE_NAME_MAXSIZE characters behind the value, they compare without case also
+ * when a lookup walks the chain.
+ */
+static void _pStorageTestHashedNames() {
+	const char *suite = "Hashed names";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int keys = PSTORAGE_INDEX_CACHE_MAXENTRIES + 8;
+	char name[PSTORAGE_NAME_MAXSIZE + 2];
+	char value[32];
+	char buf[32];
+
+	for (unsigned int engine = P_INPLACE; engine <= P_LOG; engine++) {
+		const unsigned int count = (engine == P_LOG) ? PSTORAGE_INDEX_CACHE_MAXENTRIES : keys;  // the log keeps all in RAM
+		PStorage p("TestHashed");
+		if (!_pStorageTestExpect(p.create(8192, (PStorageEngine) engine), suite, "create() failed")) {
+			return;
+		}
+		for (unsigned int i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "%0*u_a_name_longer_than_an_index_entry", (i % 3 == 0) ? PSTORAGE_NAME_MAXSIZE - 34 : 3, i);
+			snprintf(value, sizeof(value), "value %u", i);
+			_pStorageTestExpect(p.map(name, value), suite, "map(%s) failed", name);
+		}
+		memset(name, 'n', PSTORAGE_NAME_MAXSIZE + 1);
+		name[PSTORAGE_NAME_MAXSIZE + 1] = '\0';
+		_pStorageTestExpect(!p.map(name, (int) 0), suite, "map() of a name of %u characters succeeded", PSTORAGE_NAME_MAXSIZE + 1);
+
+		PStorage q("TestHashed");
+		if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+			return;
+		}
+		for (unsigned int i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "%0*u_A_NAME_LONGER_THAN_AN_INDEX_ENTRY", (i % 3 == 0) ? PSTORAGE_NAME_MAXSIZE - 34 : 3, i);
+			snprintf(value, sizeof(value), "value %u", i);
+			_pStorageTestExpect(q.get(name, buf, sizeof(buf)) && (strcmp(buf, value) == 0), suite, "get(%s) after open()", name);
+		}
+		_pStorageTestExpect(q.remove("001_a_name_longer_than_an_index_entry") && !q.get("001_a_name_longer_than_an_index_entry", buf, sizeof(buf)),
+				suite, "remove() of a long name failed");
+		_pStorageTestExpect(!q.get("001_a_name_longer_than_an_index_entr", buf, sizeof(buf)), suite, "prefix of a name found");
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "names of up to %u characters in stores of both engines", PSTORAGE_NAME_MAXSIZE);
+	}
+}
 
+struct PStorageTestWide {  // its type id does not fit the type byte of a packed index entry
+	int value;
+};
+PSTORAGE_TYPE_ID(PStorageTestWide, 300)
 
+/*
+ * New stores pack their index entries, a full store holds more ints than it could with PStorageIndexEntry structs,
+ * and reuses the entries freed in between after open() and compact().
+ */
+static void _pStorageTestPacked() {
+	const char *suite = "Packed entries";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int maxSize = 4096;
+	char name[16];
+	int value;
+
+	PStorage p("TestPacked");
+	if (!_pStorageTestExpect(p.create(maxSize), suite, "create() failed")) {
+		return;
+	}
+	unsigned int count = 0;
+	for (; count < maxSize; count++) {
+		snprintf(name, sizeof(name), "p%u", count);
+		if (!p.map(name, (int) count)) {
+			break;
+		}
+	}
+	_pStorageTestExpect(count > maxSize / (sizeof(PStorageIndexEntry) + sizeof(int)), suite, "full with %u ints", count);
+	for (unsigned int i = 0; i < count; i += 2) {
+		snprintf(name, sizeof(name), "p%u", i);
+		_pStorageTestExpect(p.remove(name), suite, "remove(%s) failed", name);
+	}
+	const PStorageTestWide wide = {1};
+	_pStorageTestExpect(!p.map("wide", wide), suite, "map() of type id 300 succeeded");
+
+	PStorage q("TestPacked");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	_pStorageTestExpect(q.compact(10000), suite, "compact() failed");
+	for (unsigned int i = 0; i < count; i += 2) {
+		snprintf(name, sizeof(name), "P%u", i);
+		_pStorageTestExpect(q.map(name, (int) (i + 1000)), suite, "map(%s) into the freed room failed", name);
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "p%u", i);
+		_pStorageTestExpect(q.get(name, &value) && (value == (int) ((i % 2 == 0) ? i + 1000 : i)), suite, "get(%s) is %d", name,
+				value);
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u ints in %u bytes", count, maxSize);
+	}
+}
+
+/*
+ * Scalars with short names share slab pages: they take less room than entries of their own, a page goes with its last
+ * slot, and all value calls see them after open().
+ */
+static void _pStorageTestSlabs() {
+	const char *suite = "Slab pages";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int count = 3 * PSTORAGE_SLAB_SLOTS;
+	char name[16];
+	int value;
+	float number;
+	unsigned int size;
+
+	PStorage p("TestSlabs");
+	if (!_pStorageTestExpect(p.create(8192), suite, "create() failed")) {
+		return;
+	}
+	const unsigned int empty = p.getAllocatedSize();
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "i%u", i);
+		_pStorageTestExpect(p.map(name, (int) i), suite, "map(%s) failed", name);
+	}
+	const unsigned int allocated = p.getAllocatedSize();
+	_pStorageTestExpect(allocated - empty < count * 16, suite, "%u ints take %u bytes", count, allocated - empty);
+	_pStorageTestExpect(p.map("f", 2.5f), suite, "map(f) failed");
+	for (unsigned int i = PSTORAGE_SLAB_SLOTS; i < count; i++) {  // the slots of two pages, in the order of their names
+		snprintf(name, sizeof(name), "i%u", i);
+		_pStorageTestExpect(p.remove(name), suite, "remove(%s) failed", name);
+	}
+	_pStorageTestExpect(p.getAllocatedSize() < allocated, suite, "emptied pages kept");  // two pages went, the one of f came
+	_pStorageTestExpect(!p.write("i0", 0, (const byte *) "ab", 2), suite, "write() into a scalar succeeded");
+
+	PStorage q("TestSlabs");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "I%u", i);  // names compare without case
+		const boolean found = q.get(name, &value);
+		_pStorageTestExpect((found == (i < PSTORAGE_SLAB_SLOTS)) && (!found || (value == (int) i)), suite, "get(%s) after open()", name);
+	}
+	_pStorageTestExpect(q.get("f", &number) && (number == 2.5f) && !q.get("f", &value), suite, "get(f) after open()");
+	_pStorageTestExpect(q.getSize("i1", &size) && (size == sizeof(int)), suite, "getSize(i1) is %u", size);
+	_pStorageTestExpect(q.map("i1", (int) 100) && q.get("i1", &value) && (value == 100), suite, "map() of a slotted value");
+	int values[2] = {0, 0};
+	PStorageItem items[] = {{"i2", P_INT, &values[0], sizeof(int), false}, {"i3", P_INT, &values[1], sizeof(int), false}};
+	_pStorageTestExpect(q.getMany(items, 2) && (values[0] == 2) && (values[1] == 3), suite, "getMany() of slotted values");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u ints and a float", count);
+	}
+}
+
+/*
+ * map() with compress stores repetitive values in fewer bytes and incompressible ones raw. get(), getSize() and both
+ * read() decode them, also after open(), while write(), append() and getView() refuse them.
+ */
+static void _pStorageTestCompression() {
+	const char *suite = "Compression";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int length = 512;
+	byte expected[length], buf[length];
+	char str[64];
+	unsigned int size;
+	const byte *data;
+
+	for (unsigned int i = 0; i < length; i++) {  // records that repeat with a few digits changed
+		expected[i] = (byte) "{\"id\":0,\"value\":\"sensor\"},"[i % 27];
+		if (i % 27 == 6) {
+			expected[i] = (byte) ('0' + (i / 27) % 10);
+		}
+	}
+	PStorage p("TestCompression");
+	if (!_pStorageTestExpect(p.create(4096), suite, "create() failed")) {
+		return;
+	}
+	unsigned int allocated = p.getAllocatedSize();
+	_pStorageTestExpect(p.map("a", expected, length, true), suite, "map(a) failed");
+	const unsigned int packed = p.getAllocatedSize() - allocated;
+	_pStorageTestExpect(packed < length / 2, suite, "%u bytes take %u", length, packed);
+	allocated = p.getAllocatedSize();
+	memset(str, 'x', sizeof(str) - 1);
+	str[sizeof(str) - 1] = 0;
+	_pStorageTestExpect(p.map("s", str, true), suite, "map(s) failed");
+	_pStorageTestExpect(p.getAllocatedSize() - allocated < sizeof(str) / 2, suite, "string not compressed");
+	allocated = p.getAllocatedSize();
+	for (unsigned int i = 0; i < 64; i++) {  // no repeats in 64 bytes
+		buf[i] = (byte) (i * 37 + 11);
+	}
+	_pStorageTestExpect(p.map("raw", buf, 64, true), suite, "map(raw) failed");
+	_pStorageTestExpect(p.getAllocatedSize() - allocated >= 64, suite, "incompressible value stored in fewer bytes");
+	_pStorageTestExpect(p.write("raw", 60, (const byte *) "tail", 4), suite, "write() into a raw value failed");
+	_pStorageTestExpect(!p.write("a", 0, (const byte *) "ab", 2), suite, "write() into a compressed value succeeded");
+	_pStorageTestExpect(!p.append("a", (const byte *) "ab", 2), suite, "append() to a compressed value succeeded");
+	_pStorageTestExpect(!p.getView("a", &data, &size), suite, "getView() of a compressed value succeeded");
+
+	PStorage q("TestCompression");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	memset(buf, 0, length);
+	_pStorageTestExpect(q.getSize("a", &size) && (size == length), suite, "getSize(a) is %u", size);
+	_pStorageTestExpect(q.get("a", buf, length) && (memcmp(buf, expected, length) == 0), suite, "get(a) after open()");
+	memset(buf, 0, length);
+	_pStorageTestExpect((q.read("a", 400, buf, 100) == 100) && (memcmp(buf, expected + 400, 100) == 0), suite,
+			"read(a) at an offset");
+	_pStorageTestExpect(q.read("a", 500, buf, 100) == 12, suite, "read(a) past the end");
+	_pStorageTestExpect(q.read("a", _pStorageTestChunk, expected), suite, "read(a) in chunks");
+	_pStorageTestExpect(q.get("s", (char *) buf, length) && (strcmp((char *) buf, str) == 0), suite, "get(s) after open()");
+	_pStorageTestExpect(q.map("a", (const char *) "plain"), suite, "map() over a compressed value failed");
+	_pStorageTestExpect(q.get("a", (char *) buf, length) && (strcmp((char *) buf, "plain") == 0), suite, "get(a) after map()");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u bytes in %u", length, packed);
+	}
+}
+
+/*
+ * With write-behind map() only queues: get() sees the queued values before poll() writes them, a key mapped again
+ * takes one record, remove() drops it, and write() of a new name writes at once. All of them are in the store after
+ * endWriteBehind().
+ */
+static void _pStorageTestWriteBehind() {
+	const char *suite = "Write-behind";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int count = 8;
+	char name[16], str[16];
+	int value = 0;
+	byte buf[4];
+
+	PStorage p("TestWriteBehind");
+	if (!_pStorageTestExpect(p.create(4096) && p.beginWriteBehind(), suite, "create() or beginWriteBehind() failed")) {
+		return;
+	}
+	const unsigned int empty = p.getAllocatedSize();
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "i%u", i);
+		for (unsigned int update = 0; update <= i; update++) {  // replaces its queued value
+			_pStorageTestExpect(p.map(name, (int) (i * 10 + update)), suite, "map(%s) failed", name);
+		}
+	}
+	_pStorageTestExpect(p.map("s", "queued"), suite, "map(s) failed");
+	_pStorageTestExpect(p.getAllocatedSize() == empty, suite, "map() wrote before poll()");
+	_pStorageTestExpect(p.get("i7", &value) && (value == 77), suite, "get(i7) of a queued value is %d", value);
+	_pStorageTestExpect(p.get("s", str, sizeof(str)) && (strcmp(str, "queued") == 0), suite, "get(s) of a queued value");
+	_pStorageTestExpect(p.remove("i3") && !p.get("i3", &value), suite, "remove() of a queued value");
+	_pStorageTestExpect(p.write("w", 0, (const byte *) "abc", 3), suite, "write(w) failed");
+	_pStorageTestExpect((p.getAllocatedSize() > empty) && (p.read("w", 0, buf, 3) == 3) && (memcmp(buf, "abc", 3) == 0),
+			suite, "write() of a new name queued");
+	_pStorageTestExpect(p.poll(1000) && p.sync(), suite, "poll() or sync() failed");
+	_pStorageTestExpect(p.map("i0", (int) -1) && p.endWriteBehind(), suite, "endWriteBehind() failed");
+
+	PStorage q("TestWriteBehind");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "i%u", i);
+		const boolean found = q.get(name, &value);
+		_pStorageTestExpect((found == (i != 3)) && (!found || (value == ((i == 0) ? -1 : (int) (i * 11)))), suite,
+				"get(%s) after open()", name);
+	}
+	_pStorageTestExpect(q.get("s", str, sizeof(str)) && (strcmp(str, "queued") == 0), suite, "get(s) after open()");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u ints mapped up to %u times and a string", count, count);
+	}
+}
+
+static boolean _pStorageTestStored(const char *name, unsigned long *value) {  // as in the file, by a handle of its own
+	PStorage q("TestDeferred");
+	return q.open() && q.get(name, value);
+}
+
+/*
+ * map() of a deferred key updates RAM only until maxUpdates is reached: get() sees the value, another handle of the
+ * file does not. undefer() and the destructor write the pending value, remove() drops it. A value that finds no room
+ * stays pending until sync() can write it.
+ */
+static void _pStorageTestDeferred() {
+	const char *suite = "Deferred keys";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int maxUpdates = 10;
+	unsigned long value = 0, stored = 0;
+
+	{
+		PStorage p("TestDeferred");
+		if (!_pStorageTestExpect(p.create(4096) && p.map("c", 0UL) && p.map("r", 0UL) && p.map("u", 0UL), suite,
+				"create() failed")) {
+			return;
+		}
+		_pStorageTestExpect(p.defer("c", maxUpdates, 0) && p.defer("r", maxUpdates, 0) && p.defer("u", maxUpdates, 0), suite,
+				"defer() failed");
+		for (unsigned long i = 1; i < maxUpdates; i++) {
+			_pStorageTestExpect(p.map("c", i), suite, "map(c, %lu) failed", i);
+		}
+		_pStorageTestExpect(p.get("c", &value) && (value == maxUpdates - 1), suite, "get(c) is %lu", value);
+		_pStorageTestExpect(_pStorageTestStored("c", &stored) && (stored == 0), suite, "update %lu written", stored);
+		_pStorageTestExpect(p.getWritesAvoided() == maxUpdates - 2, suite, "%lu writes avoided", p.getWritesAvoided());
+		_pStorageTestExpect(p.map("c", (unsigned long) maxUpdates) && _pStorageTestStored("c", &stored) &&
+				(stored == maxUpdates), suite, "update %u not written", maxUpdates);
+		_pStorageTestExpect(p.map("u", 7UL) && p.undefer("u") && _pStorageTestStored("u", &stored) && (stored == 7), suite,
+				"undefer() did not write");
+		_pStorageTestExpect(p.map("u", 8UL) && _pStorageTestStored("u", &stored) && (stored == 8), suite,
+				"map() after undefer() deferred");
+		_pStorageTestExpect(p.map("r", 3UL) && p.remove("r") && !p.get("r", &value), suite, "remove() kept the deferred value");
+		_pStorageTestExpect(p.map("c", 42UL), suite, "map(c) failed");
+	}
+	PStorage q("TestDeferred");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	_pStorageTestExpect(q.get("c", &value) && (value == 42), suite, "get(c) after the destructor is %lu", value);
+	_pStorageTestExpect(!q.get("r", &value), suite, "get(r) after remove()");
+
+	char name[16];
+	unsigned int count = 0;
+	PStorage full("TestDeferredFull");
+	if (!_pStorageTestExpect(full.create(1024), suite, "create() failed")) {
+		return;
+	}
+	do {
+		snprintf(name, sizeof(name), "f%u", count++);
+	} while ((count < 1024) && full.map(name, 1UL));
+	_pStorageTestExpect((count < 1024) && full.defer("d", maxUpdates, 0) && full.map("d", 5UL), suite, "map(d) failed");
+	_pStorageTestExpect(!full.sync() && full.get("d", &value) && (value == 5), suite, "value without room lost");
+	_pStorageTestExpect(full.remove("f0") && full.remove("f1") && full.sync(), suite, "sync() with room failed");
+	PStorage reopened("TestDeferredFull");
+	_pStorageTestExpect(reopened.open() && reopened.get("d", &value) && (value == 5), suite, "get(d) after sync()");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u updates of a counter", maxUpdates + 1);
+	}
+}
+
+static unsigned int _pStorageTestWorn(PStorage &p, unsigned int counts[]) {  // regions written since counts, which it updates
+	unsigned int now[PSTORAGE_WEAR_REGIONS + 1], worn = 0;
+	const unsigned int regions = p.getWearHistogram(now, PSTORAGE_WEAR_REGIONS + 1);
+	for (unsigned int i = 0; i < regions; i++) {
+		worn += (now[i] > counts[i]) ? 1 : 0;
+		counts[i] = now[i];
+	}
+	return worn;
+}
+
+/*
+ * A new store counts the writes to each region of its file, reads count nothing, and the counts survive open().
+ * Allocation is next-fit: a value mapped and removed again and again, alone or by mapMany(), moves on through the
+ * holes of the store instead of taking the same one each time.
+ */
+static void _pStorageTestWear() {
+	const char *suite = "Wear counts";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int rounds = 24;
+	unsigned int counts[PSTORAGE_WEAR_REGIONS + 1], regions = 0, regionSize = 0, total = 0, worn;
+	char value[64], read[sizeof(value)];
+	memset(value, 'w', sizeof(value) - 1);
+	value[sizeof(value) - 1] = '\0';
+
+	{
+		PStorage p("TestWear");
+		if (!_pStorageTestExpect(p.create(4096), suite, "create() failed")) {
+			return;
+		}
+		regions = p.getWearHistogram(counts, PSTORAGE_WEAR_REGIONS + 1, &regionSize);
+		_pStorageTestExpect((regions == PSTORAGE_WEAR_REGIONS) && (regions * regionSize >= p.getFileSize()), suite,
+				"%u regions of %u bytes", regions, regionSize);
+		if (regions == 0) {
+			pStorageTestSuccess(suite, "store without counts");
+			return;
+		}
+		char name[16];
+		for (unsigned int i = 0; i < 16; i++) {  // holes of the same size all over the store
+			snprintf(name, sizeof(name), "s%u", i);
+			_pStorageTestExpect(p.map(name, value), suite, "map(%s) failed", name);
+		}
+		for (unsigned int i = 0; i < 16; i += 2) {
+			snprintf(name, sizeof(name), "s%u", i);
+			_pStorageTestExpect(p.remove(name), suite, "remove(%s) failed", name);
+		}
+		_pStorageTestWorn(p, counts);
+
+		for (unsigned int i = 0; i < rounds; i++) {
+			_pStorageTestExpect(p.map("v", value) && p.remove("v"), suite, "map() and remove() %u failed", i);
+		}
+		worn = _pStorageTestWorn(p, counts);
+		_pStorageTestExpect(worn >= regions / 4, suite, "%u rounds of map() wrote %u regions", rounds, worn);
+
+		PStorageItem items[2] = {{"m0", P_STRING, value, 0, false}, {"m1", P_STRING, value, 0, false}};
+		for (unsigned int i = 0; i < rounds; i++) {
+			_pStorageTestExpect(p.mapMany(items, 2) && p.remove("m0") && p.remove("m1"), suite, "mapMany() %u failed", i);
+		}
+		worn = _pStorageTestWorn(p, counts);
+		_pStorageTestExpect(worn >= regions / 4, suite, "%u rounds of mapMany() wrote %u regions", rounds, worn);
+
+		_pStorageTestExpect(p.map("v", value), suite, "map(v) failed");
+		_pStorageTestWorn(p, counts);
+		for (unsigned int i = 0; i < rounds; i++) {
+			_pStorageTestExpect(p.get("v", read, sizeof(read)), suite, "get(v) failed");
+		}
+		worn = _pStorageTestWorn(p, counts);
+		_pStorageTestExpect(worn == 0, suite, "get() wrote %u regions", worn);
+		for (unsigned int i = 0; i < regions; i++) {
+			total += counts[i];
+		}
+	}
+	PStorage q("TestWear");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	unsigned int reopened[PSTORAGE_WEAR_REGIONS + 1], sum = 0;
+	_pStorageTestExpect(q.getWearHistogram(reopened, PSTORAGE_WEAR_REGIONS + 1) == regions, suite, "regions after open()");
+	for (unsigned int i = 0; i < regions; i++) {
+		_pStorageTestExpect(reopened[i] >= counts[i], suite, "region %u counts %u after open(), %u before", i, reopened[i],
+				counts[i]);
+		sum += reopened[i];
+	}
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u of %u writes counted before open()", total, sum);
+	}
+}
+
+static unsigned int _pStorageTestCalls(const unsigned int histogram[]) {
+	unsigned int calls = 0;
+	for (unsigned int i = 0; i < PSTORAGE_STATS_BUCKETS; i++) {
+		calls += histogram[i];
+	}
+	return calls;
+}
+
+/*
+ * getStats() counts every map(), get() and remove() once in its histogram, the allocations, splits and merges they
+ * cause, a value no free entry fits and the updates of a deferred key, resetStats() starts from 0.
+ */
+static void _pStorageTestStats() {
+	const char *suite = "Stats";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int count = 8;
+	PStorageStats stats;
+	char name[16], value[32];
+	unsigned long counter = 0;
+
+	PStorage p("TestStats");
+	if (!_pStorageTestExpect(p.create(2048), suite, "create() failed")) {
+		return;
+	}
+	p.resetStats();
+	p.getStats(&stats);
+	_pStorageTestExpect((stats.lookups == 0) && (stats.seeks == 0) && (_pStorageTestCalls(stats.mapMicros) == 0), suite,
+			"resetStats() kept %u lookups", stats.lookups);
+
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "s%u", i);
+		_pStorageTestExpect(p.map(name, "a string value"), suite, "map(%s) failed", name);
+	}
+	p.getStats(&stats);
+	_pStorageTestExpect(_pStorageTestCalls(stats.mapMicros) == count, suite, "%u map() timed", _pStorageTestCalls(stats.mapMicros));
+	_pStorageTestExpect((stats.allocations == count) && (stats.splits == count), suite, "%u allocations, %u splits",
+			stats.allocations, stats.splits);
+	_pStorageTestExpect((stats.bytesWritten > 0) && (stats.seeks > 0) && (stats.flushes >= count), suite,
+			"%u bytes written, %u flushes", stats.bytesWritten, stats.flushes);
+
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "s%u", i);
+		_pStorageTestExpect(p.get(name, value, sizeof(value)), suite, "get(%s) failed", name);
+	}
+	for (unsigned int i = 0; i < count; i += 2) {
+		snprintf(name, sizeof(name), "s%u", i);
+		_pStorageTestExpect(p.remove(name), suite, "remove(%s) failed", name);
+	}
+	_pStorageTestExpect(p.remove("s1") && p.remove("s3"), suite, "remove() of the neighbours failed");  // s0 to s4 join
+	p.getStats(&stats);
+	_pStorageTestExpect((_pStorageTestCalls(stats.getMicros) == count) && (_pStorageTestCalls(stats.removeMicros) == count / 2 + 2),
+			suite, "%u get(), %u remove() timed", _pStorageTestCalls(stats.getMicros), _pStorageTestCalls(stats.removeMicros));
+	_pStorageTestExpect(stats.lookups >= count + count / 2 + 2, suite, "%u lookups", stats.lookups);
+	_pStorageTestExpect(stats.merges >= 4, suite, "%u merges", stats.merges);
+
+	char large[3000];
+	memset(large, 'l', sizeof(large) - 1);
+	large[sizeof(large) - 1] = '\0';
+	_pStorageTestExpect(!p.map("l", large), suite, "map() of a value larger than the store");
+	_pStorageTestExpect(p.map("d", counter) && p.defer("d", 10, 0), suite, "defer() failed");
+	for (counter = 1; counter <= 3; counter++) {
+		_pStorageTestExpect(p.map("d", counter), suite, "map(d, %lu) failed", counter);
+	}
+	p.getStats(&stats);
+	_pStorageTestExpect(stats.allocationFailures == 1, suite, "%u allocation failures", stats.allocationFailures);
+	_pStorageTestExpect((stats.writesAvoided == 2) && (p.getWritesAvoided() == stats.writesAvoided), suite, "%u writes avoided",
+			stats.writesAvoided);
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u lookups, %u index entries read, %u bytes written", stats.lookups, stats.chainHops,
+				stats.bytesWritten);
+	}
+}
+
+struct PStorageTestTrace {
+	byte *buf;
+	unsigned int size, used;
+};
+
+static boolean _pStorageTestTraceChunk(const byte *chunk, unsigned int size, unsigned int offset, void *context) {
+	PStorageTestTrace *trace = (PStorageTestTrace *) context;
+	if ((offset != trace->used) || (trace->used + size > trace->size)) {
+		return false;
+	}
+	memcpy(trace->buf + offset, chunk, size);
+	trace->used += size;
+	return true;
+}
+
+/*
+ * dumpTrace() passes the header and then the records, oldest first: the ones of a map() bracket its allocation,
+ * write and flush, a get() follows, the times never go back and a full ring drops the oldest records. Without
+ * PSTORAGE_TRACE_RECORDS it fails.
+ */
+static void _pStorageTestTrace() {
+	const char *suite = "Trace";
+	const unsigned int failures = _pStorageTestFailures;
+	PStorageTestTrace trace;
+	char value[16];
+
+	trace.size = sizeof(PStorageTraceHeader) + PSTORAGE_TRACE_RECORDS * sizeof(PStorageTraceRecord);
+	trace.buf = (byte *) malloc(trace.size);
+	trace.used = 0;
+	PStorage p("TestTrace");
+	if (!_pStorageTestExpect((trace.buf != NULL) && p.create(2048), suite, "create() failed")) {
+		free(trace.buf);
+		return;
+	}
+	boolean dumped = p.map("t", "traced") && p.get("t", value, sizeof(value)) &&
+			PStorage::dumpTrace(_pStorageTestTraceChunk, &trace);
+#if(PSTORAGE_TRACE_RECORDS > 0)
+	const PStorageTraceHeader *header = (const PStorageTraceHeader *) trace.buf;
+	const PStorageTraceRecord *records = (const PStorageTraceRecord *) (trace.buf + sizeof(PStorageTraceHeader));
+	if (_pStorageTestExpect(dumped && (header->magic == PSTORAGE_TRACE_MAGIC) && (header->recordSize == sizeof(PStorageTraceRecord)) &&
+			(trace.used == sizeof(PStorageTraceHeader) + header->records * sizeof(PStorageTraceRecord)), suite,
+			"dump of %u bytes", trace.used)) {
+		const unsigned short expected[] = {P_TRACE_MAP, P_TRACE_ALLOCATE, P_TRACE_WRITE, P_TRACE_FLUSH, P_TRACE_MAP_END, P_TRACE_GET,
+				P_TRACE_GET_END};
+		unsigned int found = 0, map = header->records;
+		for (unsigned int i = 0; i < header->records; i++) {
+			map = (records[i].event == P_TRACE_MAP) ? i : map;  // of map("t")
+			_pStorageTestExpect((i == 0) || (records[i].micros >= records[i - 1].micros), suite, "record %u goes back in time", i);
+		}
+		for (unsigned int i = map; (i < header->records) && (found < sizeof(expected) / sizeof(expected[0])); i++) {
+			found += (records[i].event == expected[found]) ? 1 : 0;
+		}
+		_pStorageTestExpect((found == sizeof(expected) / sizeof(expected[0])) &&
+				(records[header->records - 1].event == P_TRACE_GET_END), suite, "%u events of map() and get() in order", found);
+	}
+
+	for (unsigned int i = 0; i < PSTORAGE_TRACE_RECORDS; i++) {
+		_pStorageTestExpect(p.get("t", value, sizeof(value)), suite, "get(t) failed");
+	}
+	trace.used = 0;
+	dumped = PStorage::dumpTrace(_pStorageTestTraceChunk, &trace);
+	_pStorageTestExpect(dumped && (header->records == PSTORAGE_TRACE_RECORDS) && (header->lost > 0) &&
+			(records[header->records - 1].event == P_TRACE_GET_END), suite, "full ring of %u records, %u lost", header->records,
+			header->lost);
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "%u records, %u lost", header->records, header->lost);
+	}
+#else
+	_pStorageTestExpect(!dumped, suite, "dumpTrace() without PSTORAGE_TRACE_RECORDS");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "compiled out");
+	}
+#endif
+	free(trace.buf);
+}
+
+static boolean _pStorageTestCheckpointed(PStorage &p, unsigned int count, const char *trial) {  // every value and no other
+	const char *suite = "Checkpoint";
+	char name[16], expected[32], value[32];
+	boolean result = true;
+	for (unsigned int i = 0; i < count; i++) {
+		snprintf(name, sizeof(name), "c%u", i);
+		snprintf(expected, sizeof(expected), "checkpoint %u", i);
+		const boolean found = p.get(name, value, sizeof(value));
+		result = _pStorageTestExpect((found == (i % 4 != 0)) && (!found || (strcmp(value, expected) == 0)), suite, "get(%s) %s",
+				name, trial) && result;
+	}
+	return result;
+}
+
+/*
+ * open() takes the RAM index from the checkpoint sync() saved and reads less than one that walks the chain because
+ * a map() made the checkpoint stale. The values beyond the RAM index are still found, and the free entries taken
+ * from the checkpoint are allocated again.
+ */
+static void _pStorageTestCheckpoint() {
+	const char *suite = "Checkpoint";
+	const unsigned int failures = _pStorageTestFailures;
+	const unsigned int count = PSTORAGE_INDEX_CACHE_MAXENTRIES + 16;  // misses of the RAM index walk the chain
+	PStorageStats fresh, stale;
+	char name[16], value[32];
+
+	{
+		PStorage p("TestCheckpoint");
+		if (!_pStorageTestExpect(p.create(16384), suite, "create() failed")) {
+			return;
+		}
+		for (unsigned int i = 0; i < count; i++) {
+			snprintf(name, sizeof(name), "c%u", i);
+			snprintf(value, sizeof(value), "checkpoint %u", i);
+			_pStorageTestExpect(p.map(name, value), suite, "map(%s) failed", name);
+		}
+		for (unsigned int i = 0; i < count; i += 4) {
+			snprintf(name, sizeof(name), "c%u", i);
+			_pStorageTestExpect(p.remove(name), suite, "remove(%s) failed", name);
+		}
+		_pStorageTestExpect(p.sync(), suite, "sync() failed");
+		{
+			PStorage q("TestCheckpoint");
+			_pStorageTestExpect(q.open(), suite, "open() failed");
+			q.getStats(&fresh);
+			_pStorageTestCheckpointed(q, count, "after open() from the checkpoint");
+		}
+		_pStorageTestExpect(p.map("n", "not checkpointed"), suite, "map(n) failed");
+		PStorage q("TestCheckpoint");
+		_pStorageTestExpect(q.open() && q.get("n", value, sizeof(value)), suite, "get(n) after open() with a stale checkpoint");
+		q.getStats(&stale);
+		_pStorageTestCheckpointed(q, count, "after open() with a stale checkpoint");
+#if(PSTORAGE_CHECKPOINT_ENABLED && PSTORAGE_JOURNAL_ENABLED)
+		_pStorageTestExpect(fresh.bytesRead < stale.bytesRead, suite, "open() from the checkpoint read %u bytes, walking %u",
+				fresh.bytesRead, stale.bytesRead);
+#endif
+	}
+
+	PStorage r("TestCheckpoint");
+	if (!_pStorageTestExpect(r.open(), suite, "open() after the destructor failed")) {
+		return;
+	}
+	_pStorageTestCheckpointed(r, count, "after the destructor");
+	for (unsigned int i = 0; i < count; i += 4) {  // into the holes
+		snprintf(name, sizeof(name), "d%u", i);
+		_pStorageTestExpect(r.map(name, "refilled"), suite, "map(%s) failed", name);
+	}
+	const unsigned int allocated = r.getAllocatedSize();
+	_pStorageTestExpect(r.sync(), suite, "sync() failed");
+	PStorage s("TestCheckpoint");
+	_pStorageTestExpect(s.open() && (s.getAllocatedSize() == allocated) && s.get("d0", value, sizeof(value)) &&
+			(strcmp(value, "refilled") == 0), suite, "get(d0) after the refill");
+	_pStorageTestCheckpointed(s, count, "after the refill");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "open() read %u bytes from the checkpoint, %u walking the chain", fresh.bytesRead,
+				stale.bytesRead);
+	}
+}
+
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+struct PStorageTestReader {
+	PStorage *storage;
+	boolean found;
+};
+
+static void *_pStorageTestReader(void *context) {
+	PStorageTestReader *reader = (PStorageTestReader *) context;
+	int value = 0;
+	reader->found = reader->storage->get("i1", &value) && (value == 1);
+	return NULL;
+}
+
+static boolean _pStorageTestNested(const byte *chunk, unsigned int size, unsigned int offset, void *context) {
+	PStorageTestReader *reader = (PStorageTestReader *) context;
+	int value = 0;
+	pthread_t thread;
+	if ((offset > 0) || !reader->storage->get("i2", &value) || (value != 2) ||  // nested in the shared lock
+			(pthread_create(&thread, NULL, _pStorageTestReader, reader) != 0)) {
+		return false;
+	}
+	pthread_join(thread, NULL);  // a reader of another task runs beside the shared lock held here
+	return memcmp(chunk, "streamed", min(size, 8u)) == 0;
+}
+
+/*
+ * Calls nested in another one of the same store run under its lock, a second task reads while the first holds the
+ * lock shared, and reads during a batch see the writes still in the page buffer.
+ */
+static void _pStorageTestConcurrency() {
+	const char *suite = "Concurrency";
+	const unsigned int failures = _pStorageTestFailures;
+	PStorageTestReader reader;
+	int value = 0;
+
+	PStorage p("TestConcurrency");
+	if (!_pStorageTestExpect(p.create(4096), suite, "create() failed")) {
+		return;
+	}
+	reader.storage = &p;
+	reader.found = false;
+	_pStorageTestExpect(p.map("i1", (int) 1) && p.map("i2", (int) 2) && p.map("s", "streamed"), suite, "map() failed");
+	_pStorageTestExpect(p.read("s", _pStorageTestNested, &reader) && reader.found, suite, "read() beside another reader");
+	int values[2] = {10, 20};
+	PStorageItem items[] = {{"i1", P_INT, &values[0], sizeof(int), false}, {"i3", P_INT, &values[1], sizeof(int), false}};
+	_pStorageTestExpect(p.mapMany(items, 2), suite, "mapMany() failed");
+	p.beginBatch();
+	_pStorageTestExpect(p.map("i4", (int) 4) && p.get("i4", &value) && (value == 4), suite, "get() in a batch");
+	_pStorageTestExpect(p.commit(), suite, "commit() failed");
+
+	PStorage q("TestConcurrency");
+	if (!_pStorageTestExpect(q.open(), suite, "open() failed")) {
+		return;
+	}
+	_pStorageTestExpect(q.get("i3", &value) && (value == 20) && q.get("i4", &value) && (value == 4), suite, "get() after open()");
+	if (_pStorageTestFailures == failures) {
+		pStorageTestSuccess(suite, "nested calls, a second reader and a batch");
+	}
+}
+#endif
+
+unsigned int pStorageTest() {
+	_pStorageTestFailures = 0;
+	_pStorageTestIndexCache();
+	_pStorageTestFreeBins();
+	_pStorageTestIOBuffer();
+	_pStorageTestBatch();
+	_pStorageTestLog();
+	_pStorageTestCompaction();
+	_pStorageTestLazyCreate();
+	_pStorageTestView();
+	_pStorageTestStream();
+	_pStorageTestTyped();
+	_pStorageTestMany();
+	_pStorageTestSortedIndex();
+	_pStorageTestHashedNames();
+	_pStorageTestPacked();
+	_pStorageTestSlabs();
+	_pStorageTestCompression();
+	_pStorageTestWriteBehind();
+	_pStorageTestDeferred();
+	_pStorageTestWear();
+	_pStorageTestStats();
+	_pStorageTestTrace();
+	_pStorageTestCheckpoint();
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	_pStorageTestConcurrency();
+#endif
+	return _pStorageTestFailures;
+}
@@ -14,6 +14,6 @@
 #include "PStorage.h"
 
 
-void pStorageTest();
+unsigned int pStorageTest();  // runs all suites on stores of their own, returns the number of failures
 
 #endif /* PSTORAGETEST_H_ */
@@ -0,0 +1,58 @@
+/*
+ * Arduino.h
+ *
+ *  Host stand-in for the parts of the ESP8266 Arduino core PStorage uses.
+ */
+
+#ifndef PSTORAGE_HOST_ARDUINO_H_
+#define PSTORAGE_HOST_ARDUINO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+using std::min;
+using std::max;
+
+class String {
+public:
+	String() {}
+	String(const char *s) : _s(s != NULL ? s : "") {}
+	String(const std::string &s) : _s(s) {}
+	String(int value) : _s(std::to_string(value)) {}
+	String(unsigned int value) : _s(std::to_string(value)) {}
+	String(long value) : _s(std::to_string(value)) {}
+	String(unsigned long value) : _s(std::to_string(value)) {}
+	String(float value) : _s(std::to_string(value)) {}
+	const char *c_str() const { return _s.c_str(); }
+	unsigned int length() const { return _s.size(); }
+	String operator+(const String &other) const { return String(_s + other._s); }
+	friend String operator+(const char *a, const String &b) { return String(std::string(a) + b._s); }
+private:
+	std::string _s;
+};
+
+class HardwareSerial {
+public:
+	void begin(unsigned long) {}
+	int printf(const char *format, ...);
+	void print(const String &s) { fputs(s.c_str(), stdout); }
+	void println(const String &s) { puts(s.c_str()); }
+};
+
+extern HardwareSerial Serial;
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+#endif /* PSTORAGE_HOST_ARDUINO_H_ */
@@ -0,0 +1,73 @@
+/*
+ * FS.h
+ *
+ *  Host stand-in for the SPIFFS File API of the ESP8266 core, backed by regular files below
+ *  PSTORAGE_HOST_ROOT (default ./pstorage_fs). Like SPIFFS it cannot seek behind the end of a file.
+ *  All calls are counted in hostFileStats, flush() does not sync to the disk of the host. PSTORAGE_HOST_READ_MICROS
+ *  delays every read() by that many microseconds, like a read of the flash, PSTORAGE_HOST_FLUSH_MICROS every flush().
+ *  hostWriteLimit cuts off the writes behind that many more bytes like a power loss, write() then writes short.
+ */
+
+#ifndef PSTORAGE_HOST_FS_H_
+#define PSTORAGE_HOST_FS_H_
+
+#include <Arduino.h>
+
+enum SeekMode {
+	SeekSet = 0,
+	SeekCur = 1,
+	SeekEnd = 2
+};
+
+struct HostFileStats {
+	unsigned long seeks;
+	unsigned long reads;
+	unsigned long writes;
+	unsigned long flushes;
+	unsigned long bytesRead;
+	unsigned long bytesWritten;
+};
+
+extern HostFileStats hostFileStats;
+extern long hostWriteLimit;  // bytes write() still writes, -1 for no limit
+
+struct HostFile;  // shared by all copies of a File, closed with the last one like the FileImpl of the core
+
+class File {
+public:
+	File() : _file(NULL) {}
+	explicit File(HostFile *file) : _file(file) {}
+	File(const File &other);
+	File &operator=(const File &other);
+	~File();
+	operator bool() const { return _file != NULL; }
+
+	size_t write(uint8_t c) { return write(&c, 1); }
+	size_t write(const uint8_t *buf, size_t size);
+	size_t read(uint8_t *buf, size_t size);
+	bool seek(uint32_t pos, SeekMode mode);
+	size_t position() const;
+	size_t size() const;
+	void flush();
+	void close();
+	int fd() const;  // host only, for PSTORAGE_MMAP_ENABLED
+private:
+	void _release();
+	HostFile *_file;
+};
+
+namespace fs {
+
+class FS {
+public:
+	bool begin();
+	File open(const char *path, const char *mode);
+	bool exists(const char *path);
+	bool remove(const char *path);
+};
+
+}
+
+extern fs::FS SPIFFS;
+
+#endif /* PSTORAGE_HOST_FS_H_ */
@@ -0,0 +1,200 @@
+/*
+ * HostShim.cpp
+ *
+ *  Implementation of the host stand-ins in Arduino.h and FS.h.
+ */
+
+#include <Arduino.h>
+#include <FS.h>
+#include <chrono>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+HardwareSerial Serial;
+HostFileStats hostFileStats;
+long hostWriteLimit = -1;
+fs::FS SPIFFS;
+
+static const std::chrono::steady_clock::time_point hostStart = std::chrono::steady_clock::now();
+
+int HardwareSerial::printf(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int result = vprintf(format, args);
+	va_end(args);
+	return result;
+}
+
+unsigned long millis() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - hostStart).count();
+}
+
+unsigned long micros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - hostStart).count();
+}
+
+void delay(unsigned long ms) {
+	usleep(ms * 1000);
+}
+
+struct HostFile {
+	int fd;
+	size_t position;
+	size_t size;
+	unsigned int copies;
+};
+
+static void hostCount(unsigned long *counter, unsigned long amount) {  // threads of pstorage_stress read concurrently
+	__atomic_fetch_add(counter, amount, __ATOMIC_RELAXED);
+}
+
+static unsigned long readMicros() {  // PSTORAGE_HOST_READ_MICROS emulates the latency of a flash read
+	static const char *micros = getenv("PSTORAGE_HOST_READ_MICROS");
+	return (micros != NULL) ? strtoul(micros, NULL, 10) : 0;
+}
+
+static unsigned long flushMicros() {  // PSTORAGE_HOST_FLUSH_MICROS the one of a flush, which programs the pages
+	static const char *micros = getenv("PSTORAGE_HOST_FLUSH_MICROS");
+	return (micros != NULL) ? strtoul(micros, NULL, 10) : 0;
+}
+
+size_t File::write(const uint8_t *buf, size_t size) {
+	hostCount(&hostFileStats.writes, 1);
+	if (hostWriteLimit >= 0) {  // the power is gone after these bytes
+		size = min(size, (size_t) hostWriteLimit);
+		hostWriteLimit -= size;
+	}
+	ssize_t written = pwrite(_file->fd, buf, size, _file->position);
+	if (written < 0) {
+		return 0;
+	}
+	_file->position += written;
+	_file->size = max(_file->size, _file->position);
+	hostCount(&hostFileStats.bytesWritten, written);
+	return written;
+}
+
+size_t File::read(uint8_t *buf, size_t size) {
+	hostCount(&hostFileStats.reads, 1);
+	if (readMicros() > 0) {
+		usleep(readMicros());
+	}
+	ssize_t bytesRead = pread(_file->fd, buf, size, _file->position);
+	if (bytesRead < 0) {
+		return 0;
+	}
+	_file->position += bytesRead;
+	hostCount(&hostFileStats.bytesRead, bytesRead);
+	return bytesRead;
+}
+
+bool File::seek(uint32_t pos, SeekMode mode) {
+	hostCount(&hostFileStats.seeks, 1);
+	size_t target = pos;
+	if (mode == SeekCur) {
+		target += _file->position;
+	}
+	else if (mode == SeekEnd) {
+		target += _file->size;
+	}
+	if (target > _file->size) {  // SPIFFS does not extend files by seeking
+		return false;
+	}
+	_file->position = target;
+	return true;
+}
+
+size_t File::position() const {
+	return _file->position;
+}
+
+size_t File::size() const {
+	return _file->size;
+}
+
+void File::flush() {
+	hostCount(&hostFileStats.flushes, 1);
+	if (flushMicros() > 0) {
+		usleep(flushMicros());
+	}
+}
+
+int File::fd() const {
+	return _file->fd;
+}
+
+File::File(const File &other) : _file(other._file) {
+	if (_file != NULL) {
+		_file->copies++;
+	}
+}
+
+File &File::operator=(const File &other) {
+	if (other._file != NULL) {
+		other._file->copies++;
+	}
+	_release();
+	_file = other._file;
+	return *this;
+}
+
+File::~File() {
+	_release();
+}
+
+void File::_release() {
+	if ((_file != NULL) && (--_file->copies == 0)) {
+		::close(_file->fd);
+		delete _file;
+	}
+	_file = NULL;
+}
+
+void File::close() {
+	_release();
+}
+
+static std::string hostPath(const char *path) {
+	const char *root = getenv("PSTORAGE_HOST_ROOT");
+	std::string result = (root != NULL) ? root : "pstorage_fs";
+	result += path;
+	for (size_t i = 1; i < result.size(); i++) {  // SPIFFS has no directories, create them on the fly
+		if (result[i] == '/') {
+			mkdir(result.substr(0, i).c_str(), 0755);
+		}
+	}
+	return result;
+}
+
+bool fs::FS::begin() {
+	return true;
+}
+
+File fs::FS::open(const char *path, const char *mode) {  // the modes PStorage uses
+	int flags = O_RDONLY;
+	if (strcmp(mode, "r+") == 0) {
+		flags = O_RDWR;
+	}
+	else if (strcmp(mode, "w+") == 0) {
+		flags = O_RDWR | O_CREAT | O_TRUNC;
+	}
+	int fd = ::open(hostPath(path).c_str(), flags, 0644);
+	if (fd < 0) {
+		return File();
+	}
+	HostFile *file = new HostFile;
+	file->fd = fd;
+	file->position = 0;
+	file->size = lseek(fd, 0, SEEK_END);
+	file->copies = 1;
+	return File(file);
+}
+
+bool fs::FS::exists(const char *path) {
+	return access(hostPath(path).c_str(), F_OK) == 0;
+}
+
+bool fs::FS::remove(const char *path) {
+	return ::remove(hostPath(path).c_str()) == 0;
+}
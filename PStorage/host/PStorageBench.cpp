@@ -0,0 +1,425 @@
+/*
+ * PStorageBench.cpp
+ *
+ *  Micro-benchmark of map(), get() and remove() on the host. For every combination of entry count and value
+ *  size a store is filled with that many P_ARRAY entries, then random keys are overwritten (map), read (get)
+ *  and removed (remove). With PSTORAGE_MMAP_ENABLED they are also read through getView() (view). Reported
+ *  are ops/sec, p50/p99 latency and the File calls and bytes per operation. A build of make MMAP=false IOBUFFER=false
+ *  reads without the page buffer, its get rows against those of make MMAP=false show what the buffer saves.
+ *
+ *  --engine log runs the same operations on P_LOG stores, which hold all keys in the RAM index: combinations with more
+ *  entries than PSTORAGE_INDEX_CACHE_MAXENTRIES are skipped. The stores get twice the room, a full log is compacted by
+ *  the map() that needs room.
+ *  P_INPLACE stores are created with a sorted index for their entries, --sorted no creates them without one, so
+ *  lookups beyond the RAM index walk the chain.
+ *  --create 512,65536,... times create() of stores of these sizes instead, min(--ops, 100) times each, with the data
+ *  area filled (create) and lazy (lazy). Every round deletes the store of the previous one first.
+ *
+ *  --name-length pads the keys with leading zeros to that many characters, lookups of long names share a prefix.
+ *  --scalars 1 stores the values of size 4 as int (P_INT) instead, so stores with slab pages keep them there.
+ *  --compress 1 fills the values with JSON records instead of a byte ramp, overwrites the keys once more with
+ *  compression (mapz) after get and reads them compressed (getz). wbytes/op of map and mapz is what compression
+ *  saves, their ops/sec and those of get and getz what it costs. P_LOG stores values raw.
+ *  --write-behind 1 also overwrites the keys with write-behind (mapwb), latencies are those of map(), the final
+ *  endWriteBehind() counts into ops/sec and I/O. Builds with PSTORAGE_CONCURRENCY_ENABLED write in a task, the
+ *  others in map() when the queue is full.
+ *  --deferred n also increments PSTORAGE_DEFERRED_MAXKEYS int counters of their own, deferred for n updates (mapdf),
+ *  the final sync() counts into ops/sec and I/O. They are removed before get.
+ *  --wear 1 prints the write counts per region of the file after each combination (PSTORAGE_WEAR_REGIONS).
+ *  --stats 1 prints the counters of getStats() after each combination and the latency histograms of map(), get()
+ *  and remove(), bucket n counts the calls of 2^n to 2^(n+1) - 1 us.
+ *  --trace <file> writes dumpTrace() to the file at the end, with a build of make TRACE=n, see pstorage_trace.
+ *
+ *  usage: pstorage_bench [--entries 10,100,...] [--sizes 4,64,...] [--ops n] [--max-bytes n] [--seed n] [--name-length n]
+ *  		[--engine inplace|log] [--sorted yes|no] [--create 512,...]
+ *  		[--scalars 0|1] [--compress 0|1] [--write-behind 0|1] [--deferred n] [--wear 0|1] [--stats 0|1]
+ *  		[--trace file]
+ */
+
+#include "PStorage.h"
+#include <chrono>
+#include <vector>
+
+static const unsigned int DEFAULT_ENTRIES[] = {10, 100, 1000, 10000};
+static const unsigned int DEFAULT_SIZES[] = {4, 64, 512, 4096};
+
+static PStorageEngine engine = P_INPLACE;
+static boolean sorted = true;
+
+struct BenchResult {
+	unsigned int ops;
+	double seconds;
+	std::vector<double> latencies;  // microseconds
+	HostFileStats io;
+};
+
+static unsigned int nameLength = 0;  // 0 keeps the keys short
+static boolean scalars = false;
+static boolean compress = false;
+static boolean writeBehind = false;
+static unsigned int deferred = 0;  // updates of a deferred counter before it is written, 0 skips mapdf
+static bool wear = false;
+static bool stats = false;
+static const char *traceFile = NULL;
+
+static void name(unsigned int i, char *buf) {  // at most PSTORAGE_NAME_MAXSIZE characters, unique below 0x10000
+	snprintf(buf, PSTORAGE_NAME_MAXSIZE + 1, "k%0*x", (nameLength > 1) ? nameLength - 1 : 1, i & 0xFFFF);
+}
+
+static void records(std::vector<byte> &value) {  // JSON as stored by sketches, compresses to about half
+	char record[64];
+	for (unsigned int i = 0, length = 0; length < value.size(); i++) {
+		int n = snprintf(record, sizeof(record), "{\"id\":%u,\"name\":\"sensor-%u\",\"value\":%u},", i, i % 7, (i * 7919) % 1000);
+		for (int j = 0; (j < n) && (length < value.size()); j++) {
+			value[length++] = (byte) record[j];
+		}
+	}
+}
+
+static boolean writeTrace(const byte *chunk, unsigned int size, unsigned int, void *context) {
+	return fwrite(chunk, size, 1, (FILE *) context) == 1;
+}
+
+static std::vector<unsigned int> parseList(const char *arg) {
+	std::vector<unsigned int> result;
+	char *end;
+	for (const char *p = arg; ; p = end + 1) {
+		result.push_back(strtoul(p, &end, 10));
+		if (*end != ',') {
+			return result;
+		}
+	}
+}
+
+static HostFileStats delta(const HostFileStats &from, const HostFileStats &to) {
+	HostFileStats result;
+	result.seeks = to.seeks - from.seeks;
+	result.reads = to.reads - from.reads;
+	result.writes = to.writes - from.writes;
+	result.flushes = to.flushes - from.flushes;
+	result.bytesRead = to.bytesRead - from.bytesRead;
+	result.bytesWritten = to.bytesWritten - from.bytesWritten;
+	return result;
+}
+
+static double percentile(std::vector<double> &values, double p) {
+	if (values.empty()) {
+		return 0;
+	}
+	std::sort(values.begin(), values.end());
+	size_t index = (size_t) (p * (values.size() - 1) + 0.5);
+	return values[index];
+}
+
+static void report(const char *op, unsigned int entries, unsigned int size, BenchResult &result) {
+	double ops = result.ops;
+	printf("%8u %6u  %-6s %10.0f %9.1f %9.1f %8.2f %8.2f %8.2f %10.1f %10.1f\n", entries, size, op,
+			ops / result.seconds, percentile(result.latencies, 0.50), percentile(result.latencies, 0.99),
+			result.io.seeks / ops, (result.io.reads + result.io.writes) / ops, result.io.flushes / ops,
+			result.io.bytesRead / ops, result.io.bytesWritten / ops);
+	fflush(stdout);
+}
+
+template<typename Op> static BenchResult measure(const std::vector<unsigned int> &keys, Op op) {
+	BenchResult result;
+	result.ops = 0;
+	HostFileStats before = hostFileStats;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < keys.size(); i++) {
+		std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+		if (!op(keys[i])) {
+			fprintf(stderr, "operation on key %u failed\n", keys[i]);
+			exit(1);
+		}
+		std::chrono::steady_clock::time_point t1 = std::chrono::steady_clock::now();
+		result.latencies.push_back(std::chrono::duration<double, std::micro>(t1 - t0).count());
+		result.ops++;
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.io = delta(before, hostFileStats);
+	return result;
+}
+
+static void run(unsigned int entries, unsigned int size, unsigned int ops) {
+	PStorage storage("bench");
+	unsigned long storeSize = (unsigned long) entries * (sizeof(PStorageIndexEntry) + size + max(nameLength, (unsigned int) PSTORAGE_INDEX_NAME_MAXSIZE)) + 1024;
+	if (engine == P_LOG) {  // room to append until compaction reclaims the dead records
+		storeSize *= 2;
+	}
+	if (!storage.create(storeSize, engine, false, sorted ? entries : 0)) {
+		fprintf(stderr, "create(%lu) failed\n", storeSize);
+		exit(1);
+	}
+	std::vector<byte> value(size);
+	for (unsigned int i = 0; i < size; i++) {
+		value[i] = (byte) i;
+	}
+	if (compress) {
+		records(value);
+	}
+	char key[PSTORAGE_NAME_MAXSIZE + 1];
+	const bool scalar = scalars && (size == sizeof(int));
+	int scalarValue = 0;
+	storage.beginBatch();
+	for (unsigned int i = 0; i < entries; i++) {
+		name(i, key);
+		if (!(scalar ? storage.map(key, (int) i) : storage.map(key, &value[0], size))) {
+			fprintf(stderr, "filling entry %u failed\n", i);
+			exit(1);
+		}
+	}
+	storage.commit();
+
+	std::vector<unsigned int> keys;
+	for (unsigned int i = 0; i < ops; i++) {
+		keys.push_back(rand() % entries);
+	}
+	BenchResult result = measure(keys, [&](unsigned int i) {
+		name(i, key);
+		value[0] = (byte) i;
+		return scalar ? storage.map(key, (int) i) : storage.map(key, &value[0], size);
+	});
+	report("map", entries, size, result);
+
+	if (writeBehind) {
+		HostFileStats before = hostFileStats;
+		if (!storage.beginWriteBehind(PSTORAGE_CONCURRENCY_ENABLED)) {
+			fprintf(stderr, "beginWriteBehind() failed\n");
+			exit(1);
+		}
+		result = measure(keys, [&](unsigned int i) {
+			name(i, key);
+			value[0] = (byte) (i + 1);
+			return scalar ? storage.map(key, (int) i + 1) : storage.map(key, &value[0], size);
+		});
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (!storage.endWriteBehind()) {
+			fprintf(stderr, "endWriteBehind() failed\n");
+			exit(1);
+		}
+		result.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.io = delta(before, hostFileStats);
+		report("mapwb", entries, size, result);
+	}
+
+	if (deferred > 0) {
+		char counter[8];
+		for (unsigned int i = 0; i < PSTORAGE_DEFERRED_MAXKEYS; i++) {
+			snprintf(counter, sizeof(counter), "c%u", i);
+			if (!storage.map(counter, 0) || !storage.defer(counter, deferred, 0)) {
+				fprintf(stderr, "defer() failed\n");
+				exit(1);
+			}
+		}
+		HostFileStats before = hostFileStats;
+		result = measure(keys, [&](unsigned int i) {
+			snprintf(counter, sizeof(counter), "c%u", i % PSTORAGE_DEFERRED_MAXKEYS);
+			return storage.map(counter, (int) i);
+		});
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (!storage.sync()) {
+			fprintf(stderr, "sync() failed\n");
+			exit(1);
+		}
+		result.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.io = delta(before, hostFileStats);
+		report("mapdf", entries, size, result);
+		for (unsigned int i = 0; i < PSTORAGE_DEFERRED_MAXKEYS; i++) {
+			snprintf(counter, sizeof(counter), "c%u", i);
+			storage.undefer(counter);
+			storage.remove(counter);
+		}
+	}
+
+	result = measure(keys, [&](unsigned int i) {
+		name(i, key);
+		return scalar ? storage.get(key, &scalarValue) : storage.get(key, &value[0], size);
+	});
+	report("get", entries, size, result);
+
+	const byte *data;
+	unsigned int dataSize;
+	name(0, key);
+	if (storage.getView(key, &data, &dataSize)) {  // only with PSTORAGE_MMAP_ENABLED
+		result = measure(keys, [&](unsigned int i) {
+			name(i, key);
+			return storage.getView(key, &data, &dataSize) && (dataSize == size);
+		});
+		report("view", entries, size, result);
+	}
+
+	if (compress && !scalar) {
+		result = measure(keys, [&](unsigned int i) {
+			name(i, key);
+			value[0] = (byte) i;
+			return storage.map(key, &value[0], size, true);
+		});
+		report("mapz", entries, size, result);
+		for (unsigned int i = 0; i < entries; i++) {  // the keys mapz did not hit
+			name(i, key);
+			if (!storage.map(key, &value[0], size, true)) {
+				fprintf(stderr, "compressing entry %u failed\n", i);
+				exit(1);
+			}
+		}
+		result = measure(keys, [&](unsigned int i) {
+			name(i, key);
+			return storage.get(key, &value[0], size);
+		});
+		report("getz", entries, size, result);
+	}
+
+	std::vector<unsigned int> removeKeys;  // distinct keys
+	for (unsigned int i = 0; i < entries; i++) {
+		removeKeys.push_back(i);
+	}
+	for (unsigned int i = entries - 1; i > 0; i--) {
+		std::swap(removeKeys[i], removeKeys[rand() % (i + 1)]);
+	}
+	removeKeys.resize(min(ops, entries));
+	result = measure(removeKeys, [&](unsigned int i) {
+		name(i, key);
+		return storage.remove(key);
+	});
+	report("remove", entries, size, result);
+
+	unsigned int counts[PSTORAGE_WEAR_REGIONS + 1], regionSize;
+	const unsigned int regions = wear ? storage.getWearHistogram(counts, PSTORAGE_WEAR_REGIONS + 1, &regionSize) : 0;
+	if (regions > 0) {
+		printf("%8u %6u  wear: %u regions of %u bytes, writes", entries, size, regions, regionSize);
+		for (unsigned int i = 0; i < min(regions, (unsigned int) PSTORAGE_WEAR_REGIONS + 1); i++) {
+			printf(" %u", counts[i]);
+		}
+		printf("\n");
+	}
+
+	if (stats) {
+		PStorageStats counters;
+		storage.getStats(&counters);
+		printf("%8u %6u  stats: lookups %u hops %u seeks %u rbytes %u wbytes %u flushes %u allocations %u splits %u"
+				" merges %u failures %u avoided %u\n", entries, size, counters.lookups, counters.chainHops, counters.seeks,
+				counters.bytesRead, counters.bytesWritten, counters.flushes, counters.allocations, counters.splits,
+				counters.merges, counters.allocationFailures, counters.writesAvoided);
+		const char *ops[] = {"map", "get", "remove"};
+		const unsigned int *histograms[] = {counters.mapMicros, counters.getMicros, counters.removeMicros};
+		for (unsigned int h = 0; h < 3; h++) {
+			printf("%8u %6u  stats: %-6s us", entries, size, ops[h]);
+			for (unsigned int i = 0; i < PSTORAGE_STATS_BUCKETS; i++) {
+				printf(" %u", histograms[h][i]);
+			}
+			printf("\n");
+		}
+	}
+}
+
+static void runCreate(unsigned int storeSize, unsigned int rounds) {
+	PStorage storage("bench");
+	std::vector<unsigned int> keys(rounds, 0);
+	for (int lazy = 0; lazy <= 1; lazy++) {
+		BenchResult result = measure(keys, [&](unsigned int) {
+			return storage.create(storeSize, engine, lazy == 1);
+		});
+		report(lazy ? "lazy" : "create", 0, storeSize, result);
+	}
+}
+
+int main(int argc, char **argv) {
+	std::vector<unsigned int> entries(DEFAULT_ENTRIES, DEFAULT_ENTRIES + sizeof(DEFAULT_ENTRIES) / sizeof(DEFAULT_ENTRIES[0]));
+	std::vector<unsigned int> sizes(DEFAULT_SIZES, DEFAULT_SIZES + sizeof(DEFAULT_SIZES) / sizeof(DEFAULT_SIZES[0]));
+	unsigned int ops = 1000;
+	unsigned long maxBytes = 16UL * 1024 * 1024;  // skips combinations with larger stores
+	unsigned int seed = 1;
+	std::vector<unsigned int> createSizes;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--entries") == 0) {
+			entries = parseList(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "--sizes") == 0) {
+			sizes = parseList(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "--ops") == 0) {
+			ops = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--max-bytes") == 0) {
+			maxBytes = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--seed") == 0) {
+			seed = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--create") == 0) {
+			createSizes = parseList(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "--sorted") == 0) {
+			sorted = (strcmp(argv[i + 1], "no") != 0);
+		}
+		else if (strcmp(argv[i], "--engine") == 0) {
+			if (strcmp(argv[i + 1], "log") == 0) {
+				engine = P_LOG;
+			}
+			else if (strcmp(argv[i + 1], "inplace") != 0) {
+				fprintf(stderr, "unknown engine %s\n", argv[i + 1]);
+				return 2;
+			}
+		}
+		else if (strcmp(argv[i], "--name-length") == 0) {
+			nameLength = min((unsigned int) strtoul(argv[i + 1], NULL, 10), (unsigned int) PSTORAGE_NAME_MAXSIZE);
+		}
+		else if (strcmp(argv[i], "--scalars") == 0) {
+			scalars = strtoul(argv[i + 1], NULL, 10) != 0;
+		}
+		else if (strcmp(argv[i], "--compress") == 0) {
+			compress = strtoul(argv[i + 1], NULL, 10) != 0;
+		}
+		else if (strcmp(argv[i], "--write-behind") == 0) {
+			writeBehind = strtoul(argv[i + 1], NULL, 10) != 0;
+		}
+		else if (strcmp(argv[i], "--deferred") == 0) {
+			deferred = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--wear") == 0) {
+			wear = strtoul(argv[i + 1], NULL, 10) != 0;
+		}
+		else if (strcmp(argv[i], "--stats") == 0) {
+			stats = strtoul(argv[i + 1], NULL, 10) != 0;
+		}
+		else if (strcmp(argv[i], "--trace") == 0) {
+			traceFile = argv[i + 1];
+		}
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 2;
+		}
+	}
+	srand(seed);
+	printf(" entries   size  op          ops/s   p50(us)   p99(us)  seeks/op calls/op flush/op  rbytes/op  wbytes/op\n");
+	for (size_t c = 0; c < createSizes.size(); c++) {
+		if (createSizes[c] > maxBytes) {
+			printf("%8u %6u  skipped, store exceeds --max-bytes %lu\n", 0, createSizes[c], maxBytes);
+			continue;
+		}
+		runCreate(createSizes[c], max(min(ops, 100u), 1u));
+	}
+	for (size_t e = 0; createSizes.empty() && (e < entries.size()); e++) {
+		for (size_t s = 0; s < sizes.size(); s++) {
+			if ((entries[e] == 0) || (entries[e] > 0x10000) || ((unsigned long) entries[e] * (sizeof(PStorageIndexEntry) + sizes[s] + nameLength) > maxBytes)) {
+				printf("%8u %6u  skipped, store exceeds --max-bytes %lu\n", entries[e], sizes[s], maxBytes);
+				continue;
+			}
+			if ((engine == P_LOG) && (entries[e] > PSTORAGE_INDEX_CACHE_MAXENTRIES)) {
+				printf("%8u %6u  skipped, the log keeps at most PSTORAGE_INDEX_CACHE_MAXENTRIES %u keys\n", entries[e], sizes[s],
+						(unsigned int) PSTORAGE_INDEX_CACHE_MAXENTRIES);
+				continue;
+			}
+			run(entries[e], sizes[s], ops);
+		}
+	}
+	if (traceFile != NULL) {
+		FILE *file = fopen(traceFile, "wb");
+		if ((file == NULL) || !PStorage::dumpTrace(writeTrace, file)) {
+			fprintf(stderr, "dumpTrace() to %s failed, build with make TRACE=n\n", traceFile);
+			return 1;
+		}
+		fclose(file);
+	}
+	return 0;
+}
@@ -0,0 +1,417 @@
+/*
+ * PStorageHostTest.cpp
+ *
+ *  Regression test of PStorage on the host, the exit code is 1 if a check failed.
+ *
+ *  It runs the suites of PStorageTest.cpp, then the format tests and the power loss test.
+ *
+ *  The format test reopens a store with everything a new store can be created with (hashed long names, the sorted
+ *  index, compressed strings, typed values, mapMany(), write counts) and v1 stores written byte by byte. open() migrates these to
+ *  the v2 cookie, as they keep their short names, the larger one with a sorted index behind the data area.
+ *
+ *  The power loss test applies a list of updates to a store of strings, ints, arrays and compressed strings, more of
+ *  them than the RAM index holds, so lookups go through the sorted index. It counts the bytes an update and the
+ *  destructor behind it write and repeats the update from the same file once per byte with hostWriteLimit cutting
+ *  off all writes behind it, which tears _journalWrite(), the sorted index, the index entries, the moves of compact()
+ *  and the checkpoint at every position.
+ *  Every store open() repaired must walk its chain (getAllocatedSize()), hold the values the update does not write
+ *  as before or as after it, all of them after compact(), keep them after another open() and take the update again.
+ *  After that the store must not hold more than the one the update was not cut off in, so the nameless entry of an
+ *  interrupted move of write() is reclaimed. No write count may be lower than before the update, a torn copy of the
+ *  counts falls back to the other one.
+ *
+ *  usage: pstorage_test [--step n]  (cuts the writes behind every n-th byte, 1 by default)
+ */
+
+#include "PStorage.h"
+#include "PStorageTest.h"
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::map<std::string, std::string> Model;  // the values by name, ints as decimal text
+
+static const char *crashFile = "/pstorage/crash.psf";
+static unsigned long failures = 0;
+
+static boolean check(boolean condition, const char *what, const std::string &detail) {
+	if (!condition) {
+		printf("FAIL %s: %s\n", what, detail.c_str());
+		failures++;
+	}
+	return condition;
+}
+
+static std::vector<byte> snapshot(const char *path) {
+	File file = SPIFFS.open(path, "r");
+	std::vector<byte> image(file.size());
+	file.read(image.data(), image.size());
+	file.close();
+	return image;
+}
+
+static void restore(const char *path, const std::vector<byte> &image) {
+	File file = SPIFFS.open(path, "w+");
+	file.write(image.data(), image.size());
+	file.close();
+}
+
+// the first letter of a name picks the type: i an int, a an array, c a compressed string, else a string
+static boolean put(PStorage &storage, const std::string &name, const std::string &value) {
+	switch (name[0]) {
+	case 'i':
+		return storage.map(name.c_str(), atoi(value.c_str()));
+	case 'a':
+		return storage.map(name.c_str(), (byte *) value.data(), value.size());
+	case 'c':
+		return storage.map(name.c_str(), value.c_str(), true);
+	default:
+		return storage.map(name.c_str(), value.c_str());
+	}
+}
+
+static boolean fetch(PStorage &storage, const std::string &name, std::string *value) {
+	char buf[1024];
+	unsigned int size;
+	int number;
+	switch (name[0]) {
+	case 'i':
+		if (!storage.get(name.c_str(), &number)) {
+			return false;
+		}
+		snprintf(buf, sizeof(buf), "%d", number);
+		*value = buf;
+		return true;
+	case 'a':
+		if (!storage.getSize(name.c_str(), &size) || (size > sizeof(buf)) ||
+				(storage.read(name.c_str(), 0, (byte *) buf, size) != (int) size)) {
+			return false;
+		}
+		value->assign(buf, size);
+		return true;
+	default:
+		if (!storage.get(name.c_str(), buf, sizeof(buf))) {
+			return false;
+		}
+		*value = buf;
+		return true;
+	}
+}
+
+static std::string text(const char *format, int i) {
+	char buf[128];
+	snprintf(buf, sizeof(buf), format, i);
+	return buf;
+}
+
+static const unsigned int updates = 11;
+
+/*
+ * Applies update n to the store and the model, false if the store failed. Repeating one gives the same values.
+ */
+static boolean update(PStorage &storage, unsigned int n, Model *model, const char **what) {
+	const char *names[] = {"map a new string", "grow a string", "shrink a string", "remove a string", "map a new int",
+			"map an int", "grow an array with write()", "mapMany()", "map a compressed string",
+			"remove an int", "compact()"};
+	*what = names[n];
+	switch (n) {
+	case 0:
+		(*model)["s_new_string_with_a_long_name"] = "fresh";
+		return put(storage, "s_new_string_with_a_long_name", "fresh");
+	case 1:
+		(*model)["s3"] = std::string(90, 'g');
+		return put(storage, "s3", (*model)["s3"]);
+	case 2:
+		(*model)["s5"] = "x";
+		return put(storage, "s5", "x");
+	case 3:
+		model->erase("s7");
+		storage.remove("s7");  // false if repeated
+		return true;
+	case 4:
+		(*model)["i99"] = "4242";
+		return put(storage, "i99", "4242");
+	case 5:
+		(*model)["i2"] = "-7";
+		return put(storage, "i2", "-7");
+	case 6: {
+		const unsigned int offset = 11;  // the initial size of a1
+		(*model)["a1"] = (*model)["a1"].substr(0, offset) + "appended by write()";
+		return storage.write("a1", offset, (const byte *) "appended by write()", 19);
+	}
+	case 7: {
+		int number = 31337;
+		char many[] = "many", again[] = "mapped again by mapMany()";
+		PStorageItem items[] = {{"s9", P_STRING, again, 0, false}, {"smany", P_STRING, many, 0, false},
+				{"i4", P_INT, &number, sizeof(number), false}};
+		(*model)["s9"] = again;
+		(*model)["smany"] = many;
+		(*model)["i4"] = "31337";
+		return storage.mapMany(items, 3);
+	}
+	case 8:
+		(*model)["c1"] = std::string(300, 'z') + "end";
+		return put(storage, "c1", (*model)["c1"]);
+	case 9:
+		model->erase("i6");
+		storage.remove("i6");
+		return true;
+	default:
+		return storage.compact(10000);
+	}
+}
+
+static void fill(PStorage &storage, Model *model) {
+	for (int i = 0; i < 40; i++) {
+		(*model)[text("s%d", i)] = text("string value %d", i * 7);
+	}
+	for (int i = 0; i < 12; i++) {
+		(*model)[text("i%d", i)] = text("%d", i * 1000 + 1);
+	}
+	(*model)["a1"] = "array bytes";
+	(*model)["a2"] = std::string("with\0zero", 9);
+	(*model)["c1"] = std::string(200, 'c');
+	for (Model::iterator it = model->begin(); it != model->end(); ++it) {
+		check(put(storage, it->first, it->second), "fill", it->first);
+	}
+}
+
+/*
+ * Every value as in before or as in after, the same as in seen if it is there. Values an interrupted update writes
+ * are not journaled, they may be torn or, if their entry moved, missing.
+ */
+static boolean consistent(PStorage &storage, const Model &before, const Model &after, Model *seen, const std::string &trial) {
+	boolean result = check(storage.getAllocatedSize() > 0, "chain walk", trial);
+	Model names = before;
+	names.insert(after.begin(), after.end());
+	for (Model::iterator it = names.begin(); it != names.end(); ++it) {
+		std::string value;
+		const boolean found = fetch(storage, it->first, &value);
+		const Model::const_iterator b = before.find(it->first), a = after.find(it->first);
+		const boolean written = (a != after.end()) && ((b == before.end()) || (b->second != a->second));
+		const boolean ok = written ||
+				(found && (((b != before.end()) && (b->second == value)) || ((a != after.end()) && (a->second == value)))) ||
+				(!found && ((b == before.end()) || (a == after.end())));
+		result = check(ok, "value", trial + " " + it->first + (found ? " = '" + value + "'" : " missing")) && result;
+		if (seen->count(it->first) > 0) {
+			result = check(found && ((*seen)[it->first] == value), "value after another open()", trial + " " + it->first) && result;
+		}
+		else if (found) {
+			(*seen)[it->first] = value;
+		}
+	}
+	return result;
+}
+
+static boolean kept(PStorage &storage, const unsigned int counts[], unsigned int regions) {  // no write count went back
+	unsigned int now[PSTORAGE_WEAR_REGIONS + 1];
+	if (storage.getWearHistogram(now, PSTORAGE_WEAR_REGIONS + 1) != regions) {
+		return false;
+	}
+	for (unsigned int i = 0; i < regions; i++) {
+		if (now[i] < counts[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void testPowerLoss(unsigned int step) {
+	Model model;
+	{
+		PStorage storage("crash");
+		check(storage.create(12000, P_INPLACE, false, 100), "create", "crash");
+		fill(storage, &model);
+	}
+	unsigned long trials = 0;
+	for (unsigned int n = 0; n < updates; n++) {
+		const std::vector<byte> image = snapshot(crashFile);
+		Model after = model;
+		const char *what;
+		unsigned long before;
+		unsigned int allocated, counts[PSTORAGE_WEAR_REGIONS + 1], regions;
+		{
+			PStorage storage("crash");
+			check(storage.open(), "open", "crash");
+			regions = storage.getWearHistogram(counts, PSTORAGE_WEAR_REGIONS + 1);
+			before = hostFileStats.bytesWritten;
+			const boolean updated = update(storage, n, &after, &what);
+			check(updated, "update", what);
+			allocated = storage.getAllocatedSize();
+		}
+		const unsigned long written = hostFileStats.bytesWritten - before;  // with the checkpoint the destructor saves
+		const std::vector<byte> next = snapshot(crashFile);
+		for (unsigned long cut = 0; cut < written; cut += step) {
+			const std::string trial = what + text(", cut after %d bytes", (int) cut);
+			restore(crashFile, image);
+			PStorage *storage = new PStorage("crash");
+			Model ignored = model, seen;
+			check(storage->open(), "open", trial);
+			hostWriteLimit = cut;
+			update(*storage, n, &ignored, &what);
+			delete storage;  // its writes are cut off too
+			hostWriteLimit = -1;
+			trials++;
+			PStorage repaired("crash");
+			if (!check(repaired.open(), "open() after the power loss", trial) ||
+					!consistent(repaired, model, after, &seen, trial) || !check(kept(repaired, counts, regions), "write counts", trial)) {
+				continue;
+			}
+			PStorage reopened("crash");
+			if (!check(reopened.open(), "another open()", trial) || !consistent(reopened, model, after, &seen, trial) ||
+					!check(update(reopened, n, &ignored, &what), "repeated update", trial)) {
+				continue;
+			}
+			seen = after;
+			consistent(reopened, after, after, &seen, trial + " repeated");
+			check(reopened.getAllocatedSize() <= allocated, "leaked entry", trial + text(", %d bytes allocated", reopened.getAllocatedSize()));
+		}
+		restore(crashFile, next);
+		model = after;
+		printf("%-28s %6lu bytes written, cut after each %u\n", what, written, step);
+		fflush(stdout);
+	}
+	PStorage storage("crash");
+	Model seen;
+	check(storage.open(), "open", "crash");
+	consistent(storage, model, model, &seen, "after all updates");
+	printf("power loss: %lu trials\n", trials);
+}
+
+struct PStorageTestPoint {
+	int x, y;
+	float z;
+};
+
+static void testFormats() {
+	Model model;
+	PStorageTestPoint point = {3, -4, 5.5f}, readPoint;
+	{
+		PStorage storage("features");
+		check(storage.create(24000, P_INPLACE, false, 200), "create", "features");
+		for (int i = 0; i < 100; i++) {  // more than the RAM index holds
+			model[text("s%03d", i)] = text("string %d", i);
+		}
+		for (int i = 0; i < 40; i++) {  // hashed names, up to PSTORAGE_NAME_MAXSIZE characters
+			model[text("a_rather_long_name_of_string_%03d", i)] = text("long named %d", i);
+		}
+		for (int i = 0; i < 20; i++) {
+			model[text("i%d", i)] = text("%d", -i);
+		}
+		model["c_compressed"] = std::string(500, 'q');
+		for (Model::iterator it = model.begin(); it != model.end(); ++it) {
+			check(put(storage, it->first, it->second), "map", it->first);
+		}
+		check(storage.map("point", point), "map", "point");
+		for (int i = 0; i < 100; i += 3) {
+			check(storage.remove(text("s%03d", i).c_str()), "remove", text("s%03d", i));
+			model.erase(text("s%03d", i));
+		}
+		for (int i = 0; i < 40; i += 4) {
+			check(storage.remove(text("A_RATHER_LONG_NAME_OF_STRING_%03d", i).c_str()), "remove", "a_rather_long_name");
+			model.erase(text("a_rather_long_name_of_string_%03d", i));
+		}
+		char first[] = "first of many", second[] = "second of many";
+		PStorageItem items[] = {{"many1", P_STRING, first, 0, false}, {"many2", P_STRING, second, 0, false}};
+		check(storage.mapMany(items, 2), "mapMany()", "many");
+		model["many1"] = first;
+		model["many2"] = second;
+		check(storage.compact(10000), "compact()", "features");
+	}
+	PStorage storage("features");
+	Model seen;
+	check(storage.open(), "open", "features");
+	consistent(storage, model, model, &seen, "features");
+	check(storage.get("point", &readPoint) && (readPoint.x == point.x) && (readPoint.y == point.y) && (readPoint.z == point.z),
+			"typed value", "point");
+	check(storage.getFileSize() == snapshot("/pstorage/features.psf").size(), "getFileSize()", "features");
+	unsigned int counts[PSTORAGE_WEAR_REGIONS + 1], regionSize = 0;
+	const unsigned int regions = storage.getWearHistogram(counts, PSTORAGE_WEAR_REGIONS + 1, &regionSize);
+	unsigned int written = 0;
+	for (unsigned int i = 0; i < regions; i++) {
+		written += (counts[i] > 0) ? 1 : 0;
+	}
+	check((regions == PSTORAGE_WEAR_REGIONS) && (regions * regionSize >= storage.getFileSize()) && (written > 0),
+			"getWearHistogram()", text("features, %d regions written", written));
+}
+
+/*
+ * A v1 store of count ints, its chain with some stale back pointers, migrated by open(). It gets a sorted index behind
+ * the data area if the RAM index cannot hold its keys.
+ */
+static void testMigration(unsigned int count) {
+	const unsigned int v1Params = 3 * sizeof(unsigned int), size = 2000;  // magic cookie, size, first entry
+	std::vector<byte> image(v1Params + size, PSTORAGE_FILLER);
+	const unsigned int params[3] = {PSTORAGE_MAGIC_COOKIE_V1, size, v1Params};
+	memcpy(image.data(), params, sizeof(params));
+	unsigned int position = v1Params, previous = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		PStorageIndexEntry ie;
+		memset(&ie, 0, sizeof(ie));
+		const std::string name = text("v%d", i);  // count stays below 10000
+		memcpy(ie.name, name.c_str(), name.size() + 1);
+		ie.type = P_INT;
+		ie.thisEntry = position;
+		ie.previousEntry = (i % 3 == 0) ? 7777 : previous;
+		ie.nextEntry = position + sizeof(ie) + sizeof(int);
+		const int value = i * 11;
+		memcpy(&image[position], &ie, sizeof(ie));
+		memcpy(&image[position + sizeof(ie)], &value, sizeof(value));
+		previous = position;
+		position = ie.nextEntry;
+	}
+	PStorageIndexEntry ie;
+	memset(&ie, 0, sizeof(ie));
+	ie.type = P_FREE;
+	ie.thisEntry = position;
+	ie.previousEntry = previous;
+	ie.nextEntry = v1Params + size;
+	memcpy(&image[position], &ie, sizeof(ie));
+	restore("/pstorage/v1.psf", image);
+	const std::string store = text("v1 store of %d ints", count);
+	{
+		PStorage storage("v1");
+		check(storage.open(), "open", store);
+		for (unsigned int i = 0; i < count; i += 2) {
+			check(storage.remove(text("V%d", i).c_str()), "remove", store);  // names compare without case
+		}
+		for (unsigned int i = count; i < count + 20; i++) {
+			check(storage.map(text("v%d", i).c_str(), (int) i), "map", store);
+		}
+	}
+	PStorage storage("v1");
+	check(storage.open(), "open", store + " migrated");
+	for (unsigned int i = 0; i < count + 20; i++) {
+		int value;
+		const boolean found = storage.get(text("v%d", i).c_str(), &value);
+		check((found == ((i >= count) || (i % 2 == 1))) && (!found || (value == (int) ((i >= count) ? i : i * 11))), "value",
+				store + text(", v%d", i));
+	}
+	image = snapshot("/pstorage/v1.psf");
+	unsigned int cookie;
+	memcpy(&cookie, image.data(), sizeof(cookie));
+	check(cookie == PSTORAGE_MAGIC_COOKIE_V2, "cookie", store + text(", %d", cookie));
+	check(storage.getFileSize() == image.size(), "getFileSize()", store + text(", %d", storage.getFileSize()) + text(" for a file of %d bytes", image.size()));
+	check((storage.getFileSize() > v1Params + size) == (count > PSTORAGE_INDEX_CACHE_MAXENTRIES), "sorted index", store);
+	check(storage.getPStorageSize() == size, "getPStorageSize()", store);
+}
+
+int main(int argc, char **argv) {
+	unsigned int step = 1;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--step") == 0) {
+			step = max((unsigned int) strtoul(argv[i + 1], NULL, 10), 1U);
+		}
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 2;
+		}
+	}
+	failures += pStorageTest();
+	testFormats();
+	testMigration(10);
+	testMigration(PSTORAGE_INDEX_CACHE_MAXENTRIES + 8);
+	testPowerLoss(step);
+	printf("%lu failures\n", failures);
+	return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,232 @@
+/*
+ * PStorageStress.cpp
+ *
+ *  Multi-threaded stress test of PSTORAGE_CONCURRENCY_ENABLED on the host. One store of P_ARRAY entries is read by
+ *  1, 2, 4, ... std::threads with get() for a fixed time while a writer thread overwrites random keys with map().
+ *  Every value is the key number and a generation followed by its low byte repeated. The writer publishes the
+ *  generation of a key before and after its map(), every get() is checked against that model: a reader that sees
+ *  a mixed value, one outside the two or misses a key counts an error. Reported are the gets/sec of all readers and
+ *  per reader and the maps/sec of the writer, the exit code is 1 if there were errors.
+ *
+ *  --write-behind 1 queues the maps for a task of the store, 2 for poll(), which the writer calls every 8 maps.
+ *  --deferred n adds n deferred unsigned long counters the writer maps and the readers get along with the keys.
+ *  At the end the store is opened again and must hold the last generation of every key and counter.
+ *
+ *  usage: pstorage_stress [--entries n] [--size n] [--readers 1,2,4,...] [--millis n] [--writer 0|1]
+ *         [--write-behind 0|1|2] [--deferred n]
+ */
+
+#include "PStorage.h"
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+
+static const unsigned int header = 2 * sizeof(unsigned int);  // key number and generation
+
+static void name(unsigned int i, char *buf) {
+	snprintf(buf, PSTORAGE_NAME_MAXSIZE + 1, "k%x", i);
+}
+
+static void counterName(unsigned int i, char *buf) {
+	snprintf(buf, PSTORAGE_NAME_MAXSIZE + 1, "d%x", i);
+}
+
+static void fill(byte *value, unsigned int size, unsigned int key, unsigned int generation) {
+	memcpy(value, &key, sizeof(key));
+	memcpy(value + sizeof(key), &generation, sizeof(generation));
+	memset(value + header, (byte) generation, size - header);
+}
+
+static boolean valid(const byte *value, unsigned int size, unsigned int key, unsigned int *generation) {
+	unsigned int stored;
+	memcpy(&stored, value, sizeof(stored));
+	memcpy(generation, value + sizeof(stored), sizeof(*generation));
+	for (unsigned int i = header; i < size; i++) {
+		if (value[i] != (byte) *generation) {
+			return false;
+		}
+	}
+	return stored == key;
+}
+
+static std::vector<unsigned int> parseList(const char *arg) {
+	std::vector<unsigned int> result;
+	char *end;
+	for (const char *p = arg; ; p = end + 1) {
+		result.push_back(strtoul(p, &end, 10));
+		if (*end != ',') {
+			return result;
+		}
+	}
+}
+
+int main(int argc, char **argv) {
+	unsigned int entries = 100, size = 64, millis = 1000, writeBehind = 0, deferred = 0;
+	std::vector<unsigned int> readers = {1, 2, 4, 8};
+	bool writer = true;
+	for (int i = 1; i + 1 < argc; i += 2) {
+		if (strcmp(argv[i], "--entries") == 0) {
+			entries = max((unsigned int) strtoul(argv[i + 1], NULL, 10), 1U);
+		}
+		else if (strcmp(argv[i], "--size") == 0) {
+			size = max((unsigned int) strtoul(argv[i + 1], NULL, 10), header + 1);
+		}
+		else if (strcmp(argv[i], "--readers") == 0) {
+			readers = parseList(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "--millis") == 0) {
+			millis = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--writer") == 0) {
+			writer = strtoul(argv[i + 1], NULL, 10) != 0;
+		}
+		else if (strcmp(argv[i], "--write-behind") == 0) {
+			writeBehind = strtoul(argv[i + 1], NULL, 10);
+		}
+		else if (strcmp(argv[i], "--deferred") == 0) {
+			deferred = strtoul(argv[i + 1], NULL, 10);
+		}
+		else {
+			fprintf(stderr, "unknown option %s\n", argv[i]);
+			return 2;
+		}
+	}
+#if(!PSTORAGE_CONCURRENCY_ENABLED)
+	fprintf(stderr, "built without PSTORAGE_CONCURRENCY_ENABLED\n");
+	return 2;
+#endif
+	std::unique_ptr<PStorage> owner(new PStorage("stress"));
+	PStorage &storage = *owner;
+	if (!storage.create(entries * (size + PSTORAGE_NAME_MAXSIZE + sizeof(PStorageIndexEntry)) + 4096)) {
+		fprintf(stderr, "could not create the store\n");
+		return 2;
+	}
+	std::vector<byte> value(size);
+	char key[PSTORAGE_NAME_MAXSIZE + 1];
+	for (unsigned int i = 0; i < entries; i++) {
+		name(i, key);
+		fill(value.data(), size, i, 0);
+		if (!storage.map(key, value.data(), size)) {
+			fprintf(stderr, "could not map %s\n", key);
+			return 2;
+		}
+	}
+	for (unsigned int i = 0; i < deferred; i++) {
+		counterName(i, key);
+		if (!storage.map(key, 0UL) || !storage.defer(key, 5 + i, 20)) {
+			fprintf(stderr, "could not defer %s\n", key);
+			return 2;
+		}
+	}
+
+	if ((writeBehind > 0) && !storage.beginWriteBehind(writeBehind == 1)) {
+		fprintf(stderr, "could not start write-behind\n");
+		return 2;
+	}
+	// the model: the writer raises started before and published after the map() of a generation
+	std::vector<std::atomic<unsigned int> > started(entries + deferred), published(entries + deferred);
+	for (unsigned int i = 0; i < entries + deferred; i++) {
+		started[i] = published[i] = 0;
+	}
+	unsigned long errors = 0;
+	printf("readers  writer      gets/s  gets/s/reader      maps/s  errors\n");
+	for (size_t r = 0; r < readers.size(); r++) {
+		std::atomic<bool> stop(false);
+		std::atomic<unsigned long> gets(0), maps(0), failed(0);
+		std::vector<std::thread> threads;
+		for (unsigned int t = 0; t < readers[r]; t++) {
+			threads.push_back(std::thread([&, t]() {
+				std::vector<byte> buf(size);
+				char key[PSTORAGE_NAME_MAXSIZE + 1];
+				unsigned int seed = t + 1;
+				unsigned long count = 0;
+				while (!stop) {
+					unsigned int i = rand_r(&seed) % (entries + deferred), generation;
+					const unsigned int low = published[i];
+					boolean ok;
+					if (i < entries) {
+						name(i, key);
+						ok = storage.get(key, buf.data(), size) && valid(buf.data(), size, i, &generation);
+					}
+					else {
+						unsigned long counter;
+						counterName(i - entries, key);
+						ok = storage.get(key, &counter);
+						generation = counter;
+					}
+					if (!ok || (generation < low) || (generation > started[i])) {
+						failed++;
+					}
+					count++;
+				}
+				gets += count;
+			}));
+		}
+		if (writer) {
+			threads.push_back(std::thread([&]() {
+				std::vector<byte> buf(size);
+				char key[PSTORAGE_NAME_MAXSIZE + 1];
+				unsigned int seed = 12345;
+				unsigned long count = 0;
+				while (!stop) {
+					unsigned int i = rand_r(&seed) % (entries + deferred), generation = started[i] + 1;
+					started[i] = generation;
+					boolean ok;
+					if (i < entries) {
+						name(i, key);
+						fill(buf.data(), size, i, generation);
+						ok = storage.map(key, buf.data(), size);
+					}
+					else {
+						counterName(i - entries, key);
+						ok = storage.map(key, (unsigned long) generation);
+					}
+					published[i] = generation;
+					if (!ok || ((writeBehind == 2) && (count % 8 == 7) && !storage.poll(1))) {
+						failed++;
+					}
+					count++;
+				}
+				maps += count;
+			}));
+		}
+		delay(millis);
+		stop = true;
+		for (size_t t = 0; t < threads.size(); t++) {
+			threads[t].join();
+		}
+		double seconds = millis / 1000.0;
+		printf("%7u  %6s  %10.0f  %13.0f  %10.0f  %6lu\n", readers[r], writer ? "yes" : "no", gets / seconds,
+				gets / seconds / readers[r], maps / seconds, (unsigned long) failed);
+		fflush(stdout);
+		errors += failed;
+	}
+	if (!storage.endWriteBehind()) {
+		errors++;
+	}
+	owner.reset();  // writes the pending deferred counters
+	PStorage reopened("stress");
+	unsigned long lost = reopened.open() ? 0 : entries + deferred;
+	for (unsigned int i = 0; (lost == 0) && (i < entries + deferred); i++) {
+		unsigned int generation;
+		unsigned long counter;
+		if (i < entries) {
+			name(i, key);
+			if (!reopened.get(key, value.data(), size) || !valid(value.data(), size, i, &generation) || (generation != published[i])) {
+				lost++;
+			}
+		}
+		else {
+			counterName(i - entries, key);
+			if (!reopened.get(key, &counter) || (counter != published[i])) {
+				lost++;
+			}
+		}
+	}
+	if (lost > 0) {
+		printf("%lu values not the last ones after open()\n", lost);
+		errors += lost;
+	}
+	return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,87 @@
+/*
+ * PStorageTraceDump.cpp
+ *
+ *  Decodes a dump of PStorage::dumpTrace() into a timeline, one line per record with its micros(), the micros since
+ *  the record before, the event and its arguments. Records between the begin and the end of a map(), get() or
+ *  remove() are indented below it. The dump must come from a device of the same byte order, ESP8266 and ESP32 are
+ *  little-endian like the usual hosts.
+ *
+ *  usage: pstorage_trace [dump]  (standard input without dump)
+ */
+
+#include "PStorage.h"
+
+struct TraceEventFormat {
+	const char *name;
+	const char *args[3];  // NULL for unused arguments
+};
+
+static const TraceEventFormat FORMATS[P_TRACE_EVENTS] = {
+	{"?", {NULL, NULL, NULL}},
+	{"map", {NULL, NULL, NULL}},
+	{"map end", {"micros", NULL, NULL}},
+	{"get", {NULL, NULL, NULL}},
+	{"get end", {"micros", NULL, NULL}},
+	{"remove", {NULL, NULL, NULL}},
+	{"remove end", {"micros", NULL, NULL}},
+	{"open", {"fileSize", "firstEntry", "features"}},
+	{"create", {"size", NULL, "engine"}},
+	{"lookup", {"hash", NULL, "type"}},
+	{"hop", {"thisEntry", "nextEntry", "type"}},
+	{"read", {"position", "length", "mapped"}},
+	{"write", {"position", "length", NULL}},
+	{"flush", {NULL, NULL, NULL}},
+	{"allocate", {"thisEntry", "nextEntry", "type"}},
+	{"split", {"thisEntry", "nextEntry", NULL}},
+	{"free", {"thisEntry", "nextEntry", NULL}},
+	{"merge", {"thisEntry", "nextEntry", NULL}},
+	{"allocation failed", {"minSize", NULL, NULL}},
+	{"journal", {"sequence", "copyDone", "images"}},
+	{"journal apply", {"thisEntry", "nextEntry", "recover"}},
+};
+
+int main(int argc, char **argv) {
+	FILE *dump = (argc > 1) ? fopen(argv[1], "rb") : stdin;
+	if (dump == NULL) {
+		fprintf(stderr, "cannot open %s\n", argv[1]);
+		return 2;
+	}
+	PStorageTraceHeader header;
+	if ((fread(&header, sizeof(header), 1, dump) != 1) || (header.magic != PSTORAGE_TRACE_MAGIC) ||
+			(header.recordSize != sizeof(PStorageTraceRecord))) {
+		fprintf(stderr, "no trace dump of this version and byte order\n");
+		return 1;
+	}
+	printf("# %u records, %u overwritten before the dump\n", header.records, header.lost);
+	printf("    micros    delta  event\n");
+	PStorageTraceRecord record;
+	unsigned int previous = 0, depth = 0, i;
+	for (i = 0; (i < header.records) && (fread(&record, sizeof(record), 1, dump) == 1); i++) {
+		const TraceEventFormat &format = FORMATS[(record.event < P_TRACE_EVENTS) ? record.event : 0];
+		const boolean begin = (record.event == P_TRACE_MAP) || (record.event == P_TRACE_GET) || (record.event == P_TRACE_REMOVE);
+		const boolean end = (record.event == P_TRACE_MAP_END) || (record.event == P_TRACE_GET_END) || (record.event == P_TRACE_REMOVE_END);
+		if (end && (depth > 0)) {
+			depth--;
+		}
+		printf("%10u %8u  %*s%s", record.micros, (i > 0) ? record.micros - previous : 0, 2 * depth, "", format.name);
+		if (format.name[0] == '?') {
+			printf(" %u", record.event);
+		}
+		const unsigned int args[3] = {record.arg0, record.arg1, record.arg2};
+		for (unsigned int a = 0; a < 3; a++) {
+			if (format.args[a] != NULL) {
+				printf((strcmp(format.args[a], "hash") == 0) ? " %s 0x%08x" : " %s %u", format.args[a], args[a]);
+			}
+		}
+		printf("\n");
+		if (begin) {
+			depth++;
+		}
+		previous = record.micros;
+	}
+	if (i < header.records) {
+		fprintf(stderr, "dump ends after %u of %u records\n", i, header.records);
+		return 1;
+	}
+	return 0;
+}
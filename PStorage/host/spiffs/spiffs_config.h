@@ -0,0 +1,12 @@
+/*
+ * spiffs_config.h
+ *
+ *  Host stand-in, PStorage only needs the maximal object name length.
+ */
+
+#ifndef PSTORAGE_HOST_SPIFFS_CONFIG_H_
+#define PSTORAGE_HOST_SPIFFS_CONFIG_H_
+
+#define SPIFFS_OBJ_NAME_LEN		32
+
+#endif /* PSTORAGE_HOST_SPIFFS_CONFIG_H_ */
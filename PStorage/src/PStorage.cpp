@@ -7,34 +7,156 @@
 
 #include "PStorage.h"
 
+#if(PSTORAGE_MMAP_ENABLED)
+#include <sys/mman.h>
+#endif
+
+#define PSTORAGE_COPY_CHUNK			32
+#define PSTORAGE_PACKED_NAME		5  // bytes of a packed name: the inline name or the hash and the length
+#define PSTORAGE_PACKED_FIXED		8  // name, type and slack of a packed entry
+#define PSTORAGE_PACKED_TYPE_MAX	0xFF
+
+#if(PSTORAGE_FREE_BLOCKS_MAXENTRIES > PSTORAGE_FREE_BLOCK_NONE - 1)
+#error "PSTORAGE_FREE_BLOCKS_MAXENTRIES must not exceed 254"
+#endif
+
+static void _putBytes(byte *buf, unsigned int value, unsigned int bytes) {  // little endian
+	for (unsigned int i = 0; i < bytes; i++, value >>= 8) {
+		buf[i] = (byte) value;
+	}
+}
+
+static unsigned int _getBytes(const byte *buf, unsigned int bytes) {
+	unsigned int value = 0;
+	for (unsigned int i = bytes; i > 0; i--) {
+		value = (value << 8) | buf[i - 1];
+	}
+	return value;
+}
+
 PStorage::~PStorage() {
+	_deferredDue(true);
+	free(_deferred);
+	_deferred = NULL;
+	endWriteBehind();
+	if (_batchDepth > 0) {  // an uncommitted batch must not be lost
+		_batchDepth = 0;
+		_flush();
+	}
+	_checkpointSave();
+	_wearDrop();
+	_freeIndexCache();
+	_unmapFile();
+	_readerClose();
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_cond_destroy(&_queueChanged);
+	pthread_mutex_destroy(&_queueMutex);
+	pthread_mutex_destroy(&_writerGate);
+	pthread_rwlock_destroy(&_lock);
+#endif
 }
 
 PStorage::PStorage(const char* name) {
 	this->_name = name;
+	snprintf(_storageFileName, sizeof(_storageFileName), "/pstorage/%s.psf", name);
+	_cache = NULL;
+	_cacheCount = 0;
+	_cacheCapacity = 0;
+	_cacheOverflow = false;
+	_freeBlocks = NULL;
+	_slabs = NULL;
+	_slabCount = 0;
+	_slabCapacity = 0;
+	_slabsTracked = false;
+	_resetIOBuffer();
+	_fileSize = 0;
+#if(PSTORAGE_MMAP_ENABLED)
+	_map = NULL;
+	_mapLength = 0;
+#endif
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_rwlock_init(&_lock, NULL);
+	pthread_mutex_init(&_writerGate, NULL);
+	_writersWaiting = 0;
+	for (unsigned int i = 0; i < PSTORAGE_READER_HANDLES; i++) {
+		_readerSizes[i] = 0;
+		_readerBusy[i] = false;
+		_readerPageValid[i] = false;
+	}
+#endif
+	_batchDepth = 0;
+	_flushPending = false;
+	_queue = NULL;
+	_queueUsed = 0;
+	_queueSequence = 0;
+	_queueFailed = false;
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_mutex_init(&_queueMutex, NULL);
+	pthread_cond_init(&_queueChanged, NULL);
+	_queueStarted = _queueStop = false;
+#endif
+	_deferred = NULL;
+	memset(&_stats, 0, sizeof(PStorageStats));
+	_compactCursor = 0;
+	memset(&_journal, 0, sizeof(PStorageJournal));
+	_sortedStart = _sortedCapacity = 0;
+	_sortedReset();
+	_wearCounts = NULL;
+	_wearUnsaved = 0;
+	memset(&_params, 0, sizeof(PStorageParams));
+	_checkpointGeneration = 0;
+	_checkpointValid = false;
 	SPIFFS.begin();  // make sure that SPIFFS is mounted, should not harm if called multiple times
 }
 
 boolean PStorage::open() {
 	PSTORAGE_DEBUG("open(): Called");
+	PStorageLock lock(*this, false);
+
+	_wearDrop();
+	_unmapFile();
+	_readerClose();
 	_storageFile = SPIFFS.open(_getStorageFileName(), "r+"); // open for reading and writing, stream is positioned at the beginning
 	if (!_storageFile) {
 		PSTORAGE_DEBUG("open(): Could not open %s", _getStorageFileName());
 		return false;
 	}
+	_resetIOBuffer();
+	_fileSize = _storageFile.size();
 	if (!_readParams()) {
 		PSTORAGE_DEBUG("open(): Could not read parameters from %s", _getStorageFileName());
 		return false;
 	}
-	if (_params.magicCookie != PSTORAGE_MAGIC_COOKIE) {  // incompatible
+	if ((_params.magicCookie != PSTORAGE_MAGIC_COOKIE) && (_params.magicCookie != PSTORAGE_MAGIC_COOKIE_V2) &&
+			(_params.magicCookie != PSTORAGE_MAGIC_COOKIE_V1)) {  // incompatible
+		return false;
+	}
+	PSTORAGE_TRACE(P_TRACE_OPEN, _fileSize, _params.firstEntry, _params.features);
+	_wearLoad();  // counts only, a store without them works the same
+	if (!_sortedLoad() || !_journalRecover()) {
+		PSTORAGE_DEBUG("open(): Could not complete the interrupted update of %s", _getStorageFileName());
+		return false;
+	}
+	if ((_params.magicCookie == PSTORAGE_MAGIC_COOKIE_V1) ? !_sortedMigrate() : !_sortedCheck()) {
+		PSTORAGE_DEBUG("open(): Could not migrate or rebuild the sorted index of %s", _getStorageFileName());
+		return false;
+	}
+	if (!_buildIndexCache() && (_params.engine == P_LOG)) {  // a missing RAM index only costs performance, except for the log
+		PSTORAGE_DEBUG("open(): Could not recover the log of %s", _getStorageFileName());
 		return false;
 	}
 	return true;
 }
 
-boolean PStorage::create(unsigned int size) {
+boolean PStorage::create(unsigned int size, PStorageEngine engine, boolean lazy, unsigned int keys) {
 	PSTORAGE_DEBUG("create(): Called");
+	PSTORAGE_TRACE(P_TRACE_CREATE, size, 0, engine);
+	PStorageLock lock(*this, false);
 
+	if ((engine == P_LOG) && (PSTORAGE_INDEX_CACHE_MAXENTRIES == 0)) {
+		PSTORAGE_DEBUG("create(): The log engine requires the RAM index");
+		return false;
+	}
 	PStorageIndexEntry ie;
 	size += sizeof(PStorageParams);  // always add the storage header
 	const unsigned int minSize = sizeof(PStorageParams) + sizeof(PStorageIndexEntry) + PSTORAGE_ENTRY_MINSIZE;
@@ -48,26 +170,43 @@ boolean PStorage::create(unsigned int size) {
 		SPIFFS.remove(_getStorageFileName());
 		PSTORAGE_DEBUG("create(): Previous storage file deleted");
 	}
+	_wearUnsaved = 0;  // the counts of the deleted file are not saved
+	_wearDrop();
+	_freeIndexCache();
+	_unmapFile();
+	_readerClose();
 	// now create & initialize the new storage file
 	_storageFile = SPIFFS.open(_getStorageFileName(), "w+"); // open for reading and writing, stream is positioned at the beginning
 	if (!_storageFile) {
 		PSTORAGE_DEBUG("create(): Could not create %s", _getStorageFileName());
 		return false;
 	}
+	_resetIOBuffer();
+	_fileSize = 0;
+	memset(&_params, 0, sizeof(PStorageParams));  // also an empty journal
+	memset(&_journal, 0, sizeof(PStorageJournal));
 	_params.magicCookie = PSTORAGE_MAGIC_COOKIE;
 	_params.size = size - sizeof(PStorageParams);
 	_params.firstEntry = sizeof(PStorageParams);
+	_params.engine = engine;
+	_sortedPlan(keys);
+	_wearPlan();
+	_checkpointPlan();
+	_params.logHead = _params.firstEntry;
+	_params.logSequence = 1;  // the initial free entry below carries 0 and thus is no record
+	_params.features |= PSTORAGE_FEATURE_LENGTH | PSTORAGE_FEATURE_HASHED | PSTORAGE_FEATURE_PACKED | PSTORAGE_FEATURE_SLABS |
+			PSTORAGE_FEATURE_COMPRESSION;  // PSTORAGE_FEATURE_WEAR and PSTORAGE_FEATURE_CHECKPOINT come from their plans
 	if (!_writeParams()) {
 		_storageFile.close();
 		SPIFFS.remove(_getStorageFileName());
 		PSTORAGE_DEBUG("create(): Could not write storage file parameters, storage removed");
 		return false;
 	}
-	if (!_storageFile.seek(_params.firstEntry, SeekSet)) {
+	if (!_seek(_params.firstEntry)) {
 		PSTORAGE_DEBUG("create(): Could not set file position %d", _params.firstEntry);
 		return false;
 	}
-	strcpy(ie.name, "");
+	_setName(&ie, "");
 	ie.thisEntry = _params.firstEntry;
 	ie.nextEntry = ie.thisEntry + _params.size; // this is the right limit
 	ie.previousEntry = 0;
@@ -79,128 +218,186 @@ boolean PStorage::create(unsigned int size) {
 		PSTORAGE_DEBUG("create(): Could not write first index entry, storage removed");
 		return false;
 	}
-	for (unsigned int i = 0; i < _size(ie); i++) {
-		if (_storageFile.write(' ') != 1) {
-			PSTORAGE_DEBUG("create(): Could not allocate %s bytes, storage removed", ie.size);
-			_storageFile.close();
-			SPIFFS.remove(_getStorageFileName());
-			return false;
-		}
+	if (!_sortedFormat() || !_wearFormat() || !_flush()) {
+		PSTORAGE_DEBUG("create(): Could not flush %s, storage removed", _getStorageFileName());
+		_storageFile.close();
+		SPIFFS.remove(_getStorageFileName());
+		return false;
+	}
+	// a lazy store grows with its first writes, the I/O layer reads the missing part as filler
+	if (!lazy && (!_extendFile(ie.nextEntry) || !_flush())) {
+		PSTORAGE_DEBUG("create(): Could not allocate %d bytes, storage removed", _params.size);
+		_storageFile.close();
+		SPIFFS.remove(_getStorageFileName());
+		return false;
+	}
+	if (!_buildIndexCache() && (engine == P_LOG)) {
+		return false;
 	}
-	_storageFile.flush();
 	return true;
 }
 
 
 boolean PStorage::map(const char *name, int value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_INT, name, &ie)) {
-		_allocate(name, sizeof(value), P_INT, &ie);
-	}
-	return _writeEntry(ie, (byte *) &value, sizeof(value));
+	return map<int>(name, value);
 }
 
 boolean PStorage::map(const char *name, unsigned int value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_UINT, name, &ie)) {
-		_allocate(name, sizeof(value), P_UINT, &ie);
-	}
-	return _writeEntry(ie, (byte *) &value, sizeof(value));
+	return map<unsigned int>(name, value);
 }
 
 boolean PStorage::map(const char *name, long value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_LONG, name, &ie)) {
-		_allocate(name, sizeof(value), P_LONG, &ie);
+	PStorageTimer timer(_stats.mapMicros, P_TRACE_MAP);
+	int32_t stored = value;  // 32 bits like on the ESP8266, so stores can move between device and host
+	boolean result;
+	if (_deferredUpdate(name, P_LONG, (byte *) &stored, sizeof(stored), &result)) {
+		return result;
+	}
+	if (_queue != NULL) {
+		return _queuePush(name, P_LONG, (byte *) &stored, sizeof(stored), false);
 	}
-	return _writeEntry(ie, (byte *) &value, sizeof(value));
+	PStorageLock lock(*this, false);
+	return _mapValue(name, P_LONG, (byte *) &stored, sizeof(stored));
 }
 
 boolean PStorage::map(const char *name, unsigned long value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_ULONG, name, &ie)) {
-		_allocate(name, sizeof(value), P_ULONG, &ie);
+	PStorageTimer timer(_stats.mapMicros, P_TRACE_MAP);
+	uint32_t stored = value;  // see map(long)
+	boolean result;
+	if (_deferredUpdate(name, P_ULONG, (byte *) &stored, sizeof(stored), &result)) {
+		return result;
+	}
+	if (_queue != NULL) {
+		return _queuePush(name, P_ULONG, (byte *) &stored, sizeof(stored), false);
 	}
-	return _writeEntry(ie, (byte *) &value, sizeof(value));
+	PStorageLock lock(*this, false);
+	return _mapValue(name, P_ULONG, (byte *) &stored, sizeof(stored));
 }
 
 boolean PStorage::map(const char *name, float value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_FLOAT, name, &ie)) {
-		_allocate(name, sizeof(value), P_FLOAT, &ie);
+	return map<float>(name, value);
+}
+
+boolean PStorage::map(const char* name, byte b[], unsigned int size, boolean compress) {
+	PStorageTimer timer(_stats.mapMicros, P_TRACE_MAP);
+	if (_queue != NULL) {
+		return _queuePush(name, P_ARRAY, b, size, compress);
+	}
+	PStorageLock lock(*this, false);
+	return _mapArray(name, b, size, compress);
+}
+
+boolean PStorage::map(const char* name, const char* str, boolean compress) {
+	PStorageTimer timer(_stats.mapMicros, P_TRACE_MAP);
+	if (_queue != NULL) {
+		return _queuePush(name, P_STRING, (const byte *) str, strlen(str) + 1, compress);
 	}
-	return _writeEntry(ie, (byte *) &value, sizeof(value));
+	PStorageLock lock(*this, false);
+	return _mapString(name, str, compress);
 }
 
-boolean PStorage::map(const char* name, byte b[], unsigned int size) {
+boolean PStorage::_mapArray(const char *name, const byte *b, unsigned int size, boolean compress) {
+	if (_params.engine == P_LOG) {
+		return _logMap(name, P_ARRAY, (byte *) b, size);
+	}
+	unsigned int packed;
+	if (compress && _lzPacked(b, size, &packed)) {
+		return _mapCompressed(name, P_ARRAY, b, size, packed);
+	}
 	PStorageIndexEntry ie;
 	if (!_searchIndexEntry(P_ARRAY, name, &ie)) {
-		_allocate(name, size, P_ARRAY, &ie);
+		if (!_allocate(name, size, P_ARRAY, &ie)) {
+			return false;
+		}
 	}
 	else { // found but probably not large enough
-		if (_size(ie) < size) {
+		if ((ie.type != P_ARRAY) || (_size(ie) < size) || (_size(ie) - size > PSTORAGE_SLACK_MAX)) {  // or compressed
 			_free(&ie);
-			_allocate(name, size, P_ARRAY, &ie);
+			if (!_allocate(name, size, P_ARRAY, &ie)) {
+				return false;
+			}
 		}
 	}
-	return _writeEntry(ie, b, size);
+	return _writeEntry(ie, (byte *) b, size) && _setLength(&ie, size);
 }
 
-boolean PStorage::map(const char* name, const char* str) {
+boolean PStorage::_mapString(const char *name, const char *str, boolean compress) {
+	if (_params.engine == P_LOG) {
+		return _logMap(name, P_STRING, (byte *) str, strlen(str) + 1);
+	}
+	unsigned int packed;
+	if (compress && _lzPacked((const byte *) str, strlen(str) + 1, &packed)) {  // with the \0
+		return _mapCompressed(name, P_STRING, (const byte *) str, strlen(str) + 1, packed);
+	}
 	PStorageIndexEntry ie;
 	if (!_searchIndexEntry(P_STRING, name, &ie)) {
-		_allocate(name, strlen(str), P_STRING, &ie);
+		if (!_allocate(name, strlen(str), P_STRING, &ie)) {
+			return false;
+		}
 	}
 	else { // found but probably not large enough
-		if (_size(ie) < strlen(str)) {
+		if ((ie.type != P_STRING) || (_size(ie) < strlen(str)) || (_size(ie) - strlen(str) > PSTORAGE_SLACK_MAX)) {
 			_free(&ie);
-			_allocate(name, strlen(str), P_STRING, &ie);
+			if (!_allocate(name, strlen(str), P_STRING, &ie)) {
+				return false;
+			}
 		}
 	}
-	return _writeEntry(ie, (byte *) str, strlen(str) + 1);
+	// the \0 is only stored if there is room for it
+	return _writeEntry(ie, (byte *) str, strlen(str) + 1) && _setLength(&ie, min(_size(ie), (unsigned int) strlen(str) + 1));
 }
 
 boolean PStorage::get(const char *name, int *value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_INT, name, &ie)) {
-		return false;
-	}
-	return (_readEntry(ie, (byte *) value, sizeof(value)) >= 0);
+	return get<int>(name, value);
 }
 
 boolean PStorage::get(const char *name, unsigned int *value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_UINT, name, &ie)) {
-		return false;
-	}
-	return (_readEntry(ie, (byte *) value, sizeof(value)) >= 0);
+	return get<unsigned int>(name, value);
 }
 
 boolean PStorage::get(const char *name, long *value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_LONG, name, &ie)) {
+	PStorageTimer timer(_stats.getMicros, P_TRACE_GET);
+	int32_t stored;
+	boolean result;
+	if (_queueGet(name, P_LONG, (byte *) &stored, sizeof(stored), &result)) {
+		*value = stored;
+		return result;
+	}
+	PStorageLock lock(*this, true);
+	if (!_getValue(name, P_LONG, (byte *) &stored, sizeof(stored))) {
 		return false;
 	}
-	return (_readEntry(ie, (byte *) value, sizeof(value)) >= 0);
+	*value = stored;
+	return true;
 }
 
 boolean PStorage::get(const char *name, unsigned long *value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_ULONG, name, &ie)) {
+	PStorageTimer timer(_stats.getMicros, P_TRACE_GET);
+	uint32_t stored;
+	boolean result;
+	if (_queueGet(name, P_ULONG, (byte *) &stored, sizeof(stored), &result)) {
+		*value = stored;
+		return result;
+	}
+	PStorageLock lock(*this, true);
+	if (!_getValue(name, P_ULONG, (byte *) &stored, sizeof(stored))) {
 		return false;
 	}
-	return (_readEntry(ie, (byte *) value, sizeof(value)) >= 0);
+	*value = stored;
+	return true;
 }
 
 boolean PStorage::get(const char *name, float *value) {
-	PStorageIndexEntry ie;
-	if (!_searchIndexEntry(P_FLOAT, name, &ie)) {
-		return false;
-	}
-	return (_readEntry(ie, (byte *) value, sizeof(value)) >= 0);
+	return get<float>(name, value);
 }
 
 boolean PStorage::get(const char* name, byte buf[], unsigned int bufSize) {
+	PStorageTimer timer(_stats.getMicros, P_TRACE_GET);
+	boolean result;
+	if (_queueGet(name, P_ARRAY, buf, bufSize, &result)) {
+		return result;
+	}
+	PStorageLock lock(*this, true);
 	PStorageIndexEntry ie;
 	if (!_searchIndexEntry(P_ARRAY, name, &ie)) {
 		return false;
@@ -209,6 +406,12 @@ boolean PStorage::get(const char* name, byte buf[], unsigned int bufSize) {
 }
 
 boolean PStorage::get(const char* name, char* buf, unsigned int bufSize) {
+	PStorageTimer timer(_stats.getMicros, P_TRACE_GET);
+	boolean result;
+	if (_queueGet(name, P_STRING, (byte *) buf, bufSize, &result)) {
+		return result;
+	}
+	PStorageLock lock(*this, true);
 	PStorageIndexEntry ie;
 	if (!_searchIndexEntry(P_STRING, name, &ie)) {
 		return false;
@@ -220,34 +423,119 @@ boolean PStorage::get(const char* name, char* buf, unsigned int bufSize) {
 	return bytesRead >= 0;
 }
 
+boolean PStorage::getView(const char *name, const byte **data, unsigned int *size) {
+	PSTORAGE_DEBUG("getView(): Called");
+	PStorageLock lock(*this, false);
+
+#if(PSTORAGE_MMAP_ENABLED)
+	unsigned int start, length;
+	EntryType type;
+	if (!_searchValue(name, &start, &length, &type)) {
+		return false;
+	}
+	if (_compressed(type)) {
+		PSTORAGE_DEBUG("getView(): %s is stored compressed", name);
+		return false;
+	}
+	// the view shows the file, so pending writes go there first and the value must not lie behind its end
+	if (!_writeBackIOBuffer() || !_extendFile(start + length) || !_mapFile(start + length)) {
+		return false;
+	}
+	*data = _map + start;
+	*size = length;
+	return true;
+#else
+	(void) name;
+	(void) data;
+	(void) size;
+	return false;
+#endif
+}
+
+void PStorage::beginBatch() {
+	PSTORAGE_DEBUG("beginBatch(): Called");
+	PStorageLock lock(*this, false);
+
+	_batchDepth++;
+}
+
+boolean PStorage::commit() {
+	PSTORAGE_DEBUG("commit(): Called");
+	PStorageLock lock(*this, false);
+
+	if (_batchDepth == 0) {
+		return false;
+	}
+	if (--_batchDepth > 0) {  // nested, the outermost commit flushes
+		return true;
+	}
+	return _flushPending ? _flush() : true;
+}
+
+boolean PStorage::compact(unsigned long maxMillis) {
+	PSTORAGE_DEBUG("compact(): Called");
+	PStorageLock lock(*this, false);
+
+	if (_params.engine == P_LOG) {
+		return _logCompact(maxMillis);
+	}
+	unsigned long start = millis();
+	boolean done = false;
+	do {  // at least one step, so that every call makes progress
+		beginBatch();
+		boolean success = _compactStep(&done);
+		if (!commit() || !success) {
+			return false;
+		}
+	} while (!done && (millis() - start < maxMillis));
+	return true;
+}
+
 boolean PStorage::remove(const char *name) {
 	PSTORAGE_DEBUG("remove(): Called");
+	PStorageTimer timer(_stats.removeMicros, P_TRACE_REMOVE);
+	PStorageLock lock(*this, false);
 
+	_queueDrop(name, P_FREE);  // a queued value must not return
+
+	if (_params.engine == P_LOG) {
+		return _logRemove(name);
+	}
 	PStorageIndexEntry ie;
 	while (_searchIndexEntry(name, &ie)) {
 		if (!_free(&ie)) {
 			return false;
 		}
 	}
-	return true;
+	return _slabClear(name);
 }
 
 
 unsigned int PStorage::getAllocatedSize() {
 	PSTORAGE_DEBUG("getAllocatedSize(): Called");
+	PStorageLock lock(*this, true);
 
 	unsigned int result = sizeof(PStorageParams);
 	PStorageIndexEntry ie;
+	if ((_cache != NULL) && !_cacheOverflow) {
+		for (unsigned int i = 0; i < _cacheCount; i++) {
+			result += _headerSize() + (_cache[i].nextEntry - _cache[i].thisEntry);
+		}
+		return result;
+	}
+	if (_params.engine == P_LOG) {  // the log has no chain to walk
+		return 0;
+	}
 	if (!_readFirstIndexEntry(&ie)) {
 		return 0;
 	}
 	boolean entriesAvailable = true;
 	while (entriesAvailable) {
 		if (ie.type != P_FREE) {
-			result += sizeof(PStorageIndexEntry) + (ie.nextEntry - ie.thisEntry);  // compute the real consumption
+			result += _headerSize() + (ie.nextEntry - ie.thisEntry);  // compute the real consumption
 		}
 		if (!_isLastIndexEntry(ie)) {
-			if (!_storageFile.seek(ie.nextEntry, SeekSet)) {
+			if (!_seek(ie.nextEntry)) {
 				PSTORAGE_DEBUG("getAllocatedSize(): Corruption, could not set position %d", ie.nextEntry);
 				return 0;
 			}
@@ -262,49 +550,138 @@ unsigned int PStorage::getAllocatedSize() {
 	return result;
 }
 
+unsigned int PStorage::getFragmentation(unsigned int *largestFree, unsigned int *totalFree) {
+	PSTORAGE_DEBUG("getFragmentation(): Called");
+	PStorageLock lock(*this, true);
+
+	unsigned int largest = 0, total = 0;
+	if (_params.engine == P_LOG) {  // the free space between tail and head, split at most by the end of the file
+		total = _logFree();
+		if (_logTail < _logHead) {
+			largest = total;
+		}
+		else {
+			largest = max(_logEnd() - _logTail, _logHead - _params.firstEntry);
+			largest = min(largest, total);
+		}
+	}
+	else if (_freeBlocks != NULL) {
+		for (unsigned int bin = 0; bin < PSTORAGE_FREE_BINS; bin++) {
+			for (unsigned char i = _freeBins[bin]; i != PSTORAGE_FREE_BLOCK_NONE; i = _freeBlocks[i].nextInBin) {
+				unsigned int size = _freeBlocks[i].nextEntry - (_freeBlocks[i].thisEntry + _headerSize());
+				largest = max(largest, size);
+				total += size;
+			}
+		}
+	}
+	else {
+		PStorageIndexEntry ie;
+		if (!_readFirstIndexEntry(&ie)) {
+			return 0;
+		}
+		while (true) {
+			if (ie.type == P_FREE) {
+				largest = max(largest, _size(ie));
+				total += _size(ie);
+			}
+			if (_isLastIndexEntry(ie)) {
+				break;
+			}
+			if (!_seek(ie.nextEntry) || !_readIndexEntry(&ie)) {
+				PSTORAGE_DEBUG("getFragmentation(): Corruption, could not read entry at %d", ie.nextEntry);
+				return 0;
+			}
+		}
+	}
+	if (largestFree != NULL) {
+		*largestFree = largest;
+	}
+	if (totalFree != NULL) {
+		*totalFree = total;
+	}
+	if (total == 0) {
+		return 0;
+	}
+	return 100 - (unsigned int) (((unsigned long) largest * 100) / total);
+}
+
 unsigned int PStorage::getPStorageSize() {
 	PSTORAGE_DEBUG("getPStorageSize(): Called");
+	PStorageLock lock(*this, true);
 
 	return _params.size;
 }
 
+unsigned int PStorage::getFileSize() {
+	PSTORAGE_DEBUG("getFileSize(): Called");
+
+	const unsigned int end = _params.firstEntry + _params.size;
+	if (_sortedStart < end) {  // in front or none
+		return end;
+	}
+	return _sortedStart + sizeof(PStorageSortedHeader) + _sortedCapacity * sizeof(PStorageSortedRecord);
+}
+
 void PStorage::dumpPStorage() {
+	PStorageLock lock(*this, true);
 	boolean stop = false;
 	PStorageIndexEntry ie;
-	_readFirstIndexEntry(&ie);
+	if (_params.engine == P_LOG) {  // records from the oldest to the newest
+		stop = (_logHead == _logTail);
+		_seek(_logHead);
+		_readIndexEntry(&ie);
+	}
+	else {
+		_readFirstIndexEntry(&ie);
+	}
 	Serial.printf("\n\nDump of %s ---------------------------------------------------------------\n", _name);
 	Serial.printf("Storage size: %d bytes, Allocated size: %d bytes\n", getPStorageSize(), getAllocatedSize());
-	do {
+	while (!stop) {
 		Serial.printf("---------------------\n");
-		Serial.printf("Name: %s, Type %s, Size: %d\n", ie.name, _printType(ie.type).c_str(), _size(ie));
-		Serial.printf("This Entry: %d, Value starts at: %d \n", ie.thisEntry, ie.thisEntry + sizeof(PStorageIndexEntry));
+		char name[PSTORAGE_NAME_MAXSIZE + 1];
+		if (!_readName(ie, name)) {
+			name[0] = '\0';
+		}
+		Serial.printf("Name: %s, Type %s, Size: %d\n", name, _printType(ie.type).c_str(), _size(ie));
+		Serial.printf("This Entry: %d, Value starts at: %d \n", ie.thisEntry, ie.thisEntry + _headerSize());
 		Serial.printf("Previous Entry: %d, Next Entry: %d\n", ie.previousEntry, ie.nextEntry);
 		Serial.printf("Value:\n");
 		_printEntry(ie);
 		Serial.printf("\n");
-		if (!_isLastIndexEntry(ie)) {
-			_storageFile.seek(ie.nextEntry, SeekSet);
+		if (_params.engine == P_LOG) {
+			unsigned int next = (ie.nextEntry == _logEnd()) ? _params.firstEntry : ie.nextEntry;
+			stop = (next == _logTail);
+			_seek(next);
+			_readIndexEntry(&ie);
+		}
+		else if (!_isLastIndexEntry(ie)) {
+			_seek(ie.nextEntry);
 			_readIndexEntry(&ie);
 		}
 		else {
 			stop = true;
 		}
-	} while (!stop);
+	}
 	Serial.printf("%s -----------------------------------------------------------------------\n", _name);
 }
 
 boolean PStorage::_readParams() {
 	PSTORAGE_DEBUG("_readParams(): Called");
 
-	if (!_storageFile.seek(0, SeekSet)) {
+	if (!_seek(0)) {
 		PSTORAGE_DEBUG("_readParams(): Could not set file position");
 		return false;
 	}
 
-	byte *ptr = (byte *) &_params;
-	for (unsigned int i = 0; i < sizeof(PStorageParams); i++) {
-		if (_storageFile.read(ptr + i, 1) != 1) {
-			PSTORAGE_DEBUG("_readParams(): Could not read parameters at position %d", _storageFile.position());
+	const unsigned int legacySize = offsetof(PStorageParams, engine);
+	if (!_read((byte *) &_params, legacySize)) {
+		PSTORAGE_DEBUG("_readParams(): Could not read parameters at position %d", _position);
+		return false;
+	}
+	memset(((byte *) &_params) + legacySize, 0, sizeof(PStorageParams) - legacySize);
+	if (_params.firstEntry > legacySize) {
+		if (!_read(((byte *) &_params) + legacySize, min(_params.firstEntry, (unsigned int) sizeof(PStorageParams)) - legacySize)) {
+			PSTORAGE_DEBUG("_readParams(): Could not read parameters at position %d", _position);
 			return false;
 		}
 	}
@@ -314,56 +691,114 @@ boolean PStorage::_readParams() {
 boolean PStorage::_writeParams() {
 	PSTORAGE_DEBUG("_writeParams(): Called");
 
-	if (!_storageFile.seek(0, SeekSet)) {
+	if (!_seek(0)) {
 		PSTORAGE_DEBUG("_writeParams(): Could not set file position");
 		return false;
 	}
-	byte *ptr = (byte *) &_params;
-	for (unsigned int i = 0; i < sizeof(PStorageParams); i++) {
-		if (_storageFile.write(*(ptr + i)) != 1) {
-			PSTORAGE_DEBUG("_writeParams(): Could not write parameters at position %d", _storageFile.position());
+	if (!_write((byte *) &_params, min(_params.firstEntry, (unsigned int) sizeof(PStorageParams)))) {  // never into the first entry
+		PSTORAGE_DEBUG("_writeParams(): Could not write parameters at position %d", _position);
+		return false;
+	}
+	return true;
+}
+
+
+/*
+ * Fixed size values (scalars and the types of the templated map()/get()) are one entry of exactly their size,
+ * a changed size (e.g. a struct that grew) reallocates it. New scalars with short names take a slab slot instead.
+ */
+boolean PStorage::_mapValue(const char *name, EntryType type, const byte *buf, unsigned int size) {
+	if (_params.engine == P_LOG) {
+		return _logMap(name, type, (byte *) buf, size);
+	}
+	const boolean slotted = _slabbed(type, size);
+	PStorageSlab page;
+	unsigned int slot;
+	if (slotted && _slabSearch(type, name, &page, &slot)) {
+		return _slabWrite(page, slot, buf);
+	}
+	PStorageIndexEntry ie;
+	boolean found = _searchIndexEntry(type, name, &ie);
+	if (found && !_holds(ie, size)) {
+		if (!_free(&ie)) {
 			return false;
 		}
+		found = false;
 	}
-	return true;
+	if (!found && slotted && _slabInsert(type, name, buf)) {
+		return true;
+	}
+	if (!found && !_allocate(name, size, type, &ie)) {
+		return false;
+	}
+	return _writeEntry(ie, (byte *) buf, size);
 }
 
+boolean PStorage::_getValue(const char *name, EntryType type, byte *buf, unsigned int size) {
+	if (_slabGet(type, name, buf, size)) {
+		return true;
+	}
+	PStorageIndexEntry ie;
+	if (!_searchIndexEntry(type, name, &ie)) {
+		return false;
+	}
+	if (!_holds(ie, size)) {
+		PSTORAGE_DEBUG("_getValue(): %s holds %d bytes, not %d", name, _length(ie), size);
+		return false;
+	}
+	return (_readEntry(ie, buf, size) >= 0);
+}
 
 boolean PStorage::_allocate(const char *name, unsigned int size, EntryType type, PStorageIndexEntry *ie) {
 	PSTORAGE_DEBUG("_allocate(): Called");
 
-	if (strlen(name) > PSTORAGE_INDEX_NAME_MAXSIZE) {
-		PSTORAGE_DEBUG("_allocate(): Name %s exceeds max length of %d bytes", name, PSTORAGE_INDEX_NAME_MAXSIZE);
+	if (strlen(name) > _nameMaxSize()) {
+		PSTORAGE_DEBUG("_allocate(): Name %s exceeds max length of %d bytes", name, _nameMaxSize());
 		return false;
 	}
-	if (!_searchFreeIndexEntry(size, ie)) {
+	if (!_typeFits(type)) {
 		return false;
 	}
+	return _searchFreeIndexEntry(size + _nameSize(name), ie) && _allocateIn(name, size, type, ie);
+}
+
+boolean PStorage::_allocateIn(const char *name, unsigned int size, EntryType type, PStorageIndexEntry *ie) {
+	PSTORAGE_DEBUG("_allocateIn(): Called");
+
+	_binRemove(ie->thisEntry);
+	_journalBegin();
+	const unsigned int area = size + _nameSize(name);
 	// check if the entry can be further split
-	if (_size(*ie) > size + sizeof(PStorageIndexEntry) + PSTORAGE_ENTRY_MINSIZE) {
+	if (_size(*ie) > area + _headerSize() + PSTORAGE_ENTRY_MINSIZE) {
 		PStorageIndexEntry newIE;
-		newIE.thisEntry = ie->thisEntry + sizeof(PStorageIndexEntry) + size;
+		newIE.thisEntry = ie->thisEntry + _headerSize() + area;
 		newIE.nextEntry = ie->nextEntry;
 		newIE.previousEntry = ie->thisEntry;
 		newIE.type = P_FREE;
-		strcpy(newIE.name, "");
-		if (!_storageFile.seek(newIE.thisEntry, SeekSet)) {
-			PSTORAGE_DEBUG("_allocate(): Could not set file position to new splitted free index entry %d", newIE.thisEntry);
-			return false;
-		}
-		if (!_writeIndexEntry(newIE)) {
+		_setName(&newIE, "");
+		if (!_journalAdd(newIE) || (!_isLastIndexEntry(newIE) && !_journalPatchPrevious(newIE.nextEntry, newIE.thisEntry))) {
+			_freeIndexCache();
 			return false;
 		}
 		ie->nextEntry = newIE.thisEntry; // wire in
+		_binInsert(newIE);
+		_pStorageCount(_stats.splits);
+		PSTORAGE_TRACE(P_TRACE_SPLIT, newIE.thisEntry, newIE.nextEntry);
 	}
 	ie->type = type;
-	strcpy(ie->name, name);
-	if (!_storageFile.seek(ie->thisEntry, SeekSet)) {
-		PSTORAGE_DEBUG("_allocate(): Could not set file position to new free index entry %d", ie->thisEntry);
+	_setName(ie, name);
+	ie->slack = _size(*ie) - size;
+	_sortedAdded = _sortedRecord(*ie);
+	if (!_writeName(*ie, name) || !_journalAdd(*ie) || !_journalCommit()) {
+		PSTORAGE_DEBUG("_allocate(): Could not write index entry %d", ie->thisEntry);
+		_freeIndexCache();
 		return false;
 	}
-	if (!_writeIndexEntry(*ie)) {
-		return false;
+	_cacheUpdate(*ie);
+	_pStorageCount(_stats.allocations);
+	PSTORAGE_TRACE(P_TRACE_ALLOCATE, ie->thisEntry, ie->nextEntry, type);
+	if (_wearCounts != NULL) {
+		_wear.cursor = ie->thisEntry + _headerSize() + area;  // saved with the counts
 	}
 	return true;
 }
@@ -371,45 +806,181 @@ boolean PStorage::_allocate(const char *name, unsigned int size, EntryType type,
 boolean PStorage::_free(PStorageIndexEntry *ie) {
 	PSTORAGE_DEBUG("_free(): Called");
 
-	strcpy(ie->name, "");
+	_cacheRemove(ie->thisEntry);
+	const PStorageSortedRecord removed = _sortedRecord(*ie);
+	_setName(ie, "");
 	ie->type = P_FREE;
+	const unsigned int freedEntry = ie->thisEntry, freedNextEntry = ie->nextEntry;
 
 	if (!_isFirstIndexEntry(*ie)) {
 		// if previous entry is also free it can be merged
-		if (!_storageFile.seek(ie->previousEntry, SeekSet)) {
-			PSTORAGE_DEBUG("_free(): Could not set file position to %d", ie->previousEntry);
-			return false;
+		if (_freeBlocks != NULL) {
+			unsigned char i = _binFindPredecessor(ie->thisEntry);
+			if (i != PSTORAGE_FREE_BLOCK_NONE) {
+				ie->previousEntry = _freeBlocks[i].previousEntry;
+				ie->thisEntry = _freeBlocks[i].thisEntry;  // take over previous entry
+				_pStorageCount(_stats.merges);
+				PSTORAGE_TRACE(P_TRACE_MERGE, ie->thisEntry, ie->nextEntry);
+				_binRemove(ie->thisEntry);
+			}
 		}
-		PStorageIndexEntry prevIE;
-		_readIndexEntry(&prevIE);
-		if (prevIE.type == P_FREE) {
-			ie->previousEntry = prevIE.previousEntry;
-			ie->thisEntry = prevIE.thisEntry;  // take over previous entry
+		else {
+			PStorageIndexEntry prevIE;
+			boolean found;
+			if (!_searchFreePredecessor(*ie, &prevIE, &found)) {
+				_freeIndexCache();
+				return false;
+			}
+			if (found) {
+				ie->previousEntry = prevIE.previousEntry;
+				ie->thisEntry = prevIE.thisEntry;  // take over previous entry
+				_pStorageCount(_stats.merges);
+				PSTORAGE_TRACE(P_TRACE_MERGE, ie->thisEntry, ie->nextEntry);
+			}
 		}
 	}
 	if (!_isLastIndexEntry(*ie)) {
 		// if next entry is free it can be merged
-		if (!_storageFile.seek(ie->nextEntry, SeekSet)) {
-			PSTORAGE_DEBUG("_free(): Could not set file position to %d", ie->nextEntry);
+		if (_freeBlocks != NULL) {
+			unsigned char i = _binFind(ie->nextEntry);
+			if (i != PSTORAGE_FREE_BLOCK_NONE) {
+				unsigned int nextEntry = _freeBlocks[i].nextEntry;
+				_binRemove(ie->nextEntry);
+				ie->nextEntry = nextEntry;  // extend
+				_pStorageCount(_stats.merges);
+				PSTORAGE_TRACE(P_TRACE_MERGE, ie->thisEntry, ie->nextEntry);
+			}
+		}
+		else {
+			if (!_seek(ie->nextEntry)) {
+				PSTORAGE_DEBUG("_free(): Could not set file position to %d", ie->nextEntry);
+				return false;
+			}
+			PStorageIndexEntry nextIE;
+			if (!_readIndexEntry(&nextIE)) {
+				_freeIndexCache();
+				return false;
+			}
+			if (nextIE.type == P_FREE) {
+				ie->nextEntry = nextIE.nextEntry;  // extend
+				_pStorageCount(_stats.merges);
+				PSTORAGE_TRACE(P_TRACE_MERGE, ie->thisEntry, ie->nextEntry);
+			}
+		}
+	}
+	PSTORAGE_TRACE(P_TRACE_FREE, ie->thisEntry, ie->nextEntry);
+	_journalBegin();
+	_sortedRemoved = removed;
+	if (!_journalAdd(*ie)) {
+		_freeIndexCache();
+		return false;
+	}
+	// the entry behind a merged block has to point back to its new start
+	if (!_isLastIndexEntry(*ie) && ((ie->thisEntry != freedEntry) || (ie->nextEntry != freedNextEntry))) {
+		if (!_journalPatchPrevious(ie->nextEntry, ie->thisEntry)) {
+			_freeIndexCache();
+			return false;
+		}
+	}
+	if (!_journalCommit()) {
+		PSTORAGE_DEBUG("_free(): Could not write index entry %d", ie->thisEntry);
+		_freeIndexCache();
+		return false;
+	}
+	_binInsert(*ie);
+	if (ie->thisEntry < _compactCursor) {
+		_compactCursor = ie->thisEntry;
+	}
+	return true;
+}
+
+/*
+ * One step of compact() moves the first allocated entry behind the first free block F to the start of F, so
+ * that F moves up behind it and merges with a following free block. All entries before _compactCursor are
+ * allocated, so the first free block is found without walking the chain from its start.
+ */
+boolean PStorage::_compactStep(boolean *done) {
+	PSTORAGE_DEBUG("_compactStep(): Called");
+
+	PStorageIndexEntry freeIE, movedIE, nextIE;
+	*done = true;
+	if ((_compactCursor < _params.firstEntry) || !_seek(_compactCursor) || !_readIndexEntry(&freeIE)) {
+		return false;
+	}
+	while (freeIE.type != P_FREE) {
+		if (_orphaned(freeIE)) {  // the next step starts at its free entry
+			*done = false;
+			return _free(&freeIE);
+		}
+		if (_isLastIndexEntry(freeIE)) {  // nothing free at all
+			return true;
+		}
+		_compactCursor = freeIE.nextEntry;
+		if ((freeIE.nextEntry <= freeIE.thisEntry) || !_seek(freeIE.nextEntry) || !_readIndexEntry(&freeIE)) {
+			PSTORAGE_DEBUG("_compactStep(): Corruption, could not read entry at %d", freeIE.nextEntry);
+			return false;
+		}
+	}
+	if (_isLastIndexEntry(freeIE)) {  // all free space is merged at the end
+		return true;
+	}
+	if (!_seek(freeIE.nextEntry) || !_readIndexEntry(&movedIE)) {
+		PSTORAGE_DEBUG("_compactStep(): Corruption, could not read entry at %d", freeIE.nextEntry);
+		return false;
+	}
+	if (movedIE.type == P_FREE) {  // free neighbours are always merged by _free()
+		PSTORAGE_DEBUG("_compactStep(): Corruption, unmerged free entries at %d", freeIE.thisEntry);
+		return false;
+	}
+	if (_orphaned(movedIE)) {  // merges with freeIE
+		*done = false;
+		return _free(&movedIE);
+	}
+	const unsigned int size = movedIE.nextEntry - (movedIE.thisEntry + _headerSize());  // with the name
+	const unsigned int movedEntry = movedIE.thisEntry;
+	PStorageIndexEntry newFreeIE = freeIE;
+	movedIE.thisEntry = freeIE.thisEntry;
+	movedIE.previousEntry = freeIE.previousEntry;
+	movedIE.nextEntry = freeIE.thisEntry + _headerSize() + size;
+	newFreeIE.thisEntry = movedIE.nextEntry;
+	newFreeIE.previousEntry = movedIE.thisEntry;
+	newFreeIE.nextEntry = movedEntry + _headerSize() + size;
+	if (!_isLastIndexEntry(newFreeIE)) {
+		if (!_seek(newFreeIE.nextEntry) || !_readIndexEntry(&nextIE)) {
+			_freeIndexCache();
 			return false;
 		}
-		PStorageIndexEntry nextIE;
-		_readIndexEntry(&nextIE);
 		if (nextIE.type == P_FREE) {
-			ie->nextEntry = nextIE.nextEntry;  // extend
+			_binRemove(nextIE.thisEntry);
+			newFreeIE.nextEntry = nextIE.nextEntry;  // merge
 		}
 	}
-	if (!_storageFile.seek(ie->thisEntry, SeekSet)) {
-		PSTORAGE_DEBUG("_free(): Could not set file position to %d", ie->thisEntry);
+	// the value moves down, the journal copies it before the index entries are written
+	_journalBegin();
+	_sortedAdded = _sortedRemoved = _sortedRecord(movedIE);
+	_sortedRemoved.entry = movedEntry;
+	_journal.copyFrom = movedEntry + _headerSize();
+	_journal.copyTo = movedIE.thisEntry + _headerSize();
+	_journal.copyLength = size;
+	if (!_journalAdd(movedIE) || !_journalAdd(newFreeIE) ||
+			(!_isLastIndexEntry(newFreeIE) && !_journalPatchPrevious(newFreeIE.nextEntry, newFreeIE.thisEntry)) ||
+			!_journalCommit()) {
+		_freeIndexCache();
 		return false;
 	}
-	_writeIndexEntry(*ie);
+	_cacheRemove(movedEntry);
+	_cacheUpdate(movedIE);
+	_slabMoved(movedEntry, movedIE.thisEntry);
+	_binRemove(freeIE.thisEntry);
+	_binInsert(newFreeIE);
+	_compactCursor = newFreeIE.thisEntry;
+	*done = _isLastIndexEntry(newFreeIE);
 	return true;
 }
 
 
 boolean PStorage::_isFirstIndexEntry(PStorageIndexEntry ie) {
-	return ie.previousEntry == 0;
+	return ie.thisEntry == _params.firstEntry;
 }
 
 boolean PStorage::_isLastIndexEntry(PStorageIndexEntry ie) {
@@ -417,82 +988,375 @@ boolean PStorage::_isLastIndexEntry(PStorageIndexEntry ie) {
 }
 
 unsigned int PStorage::_size(PStorageIndexEntry ie) {
-	return (ie.nextEntry - (ie.thisEntry + sizeof(PStorageIndexEntry)));
+	return (ie.nextEntry - (ie.thisEntry + _headerSize())) - (_hashed() ? _nameLength(ie) : 0);
 }
 
-boolean PStorage::_readFirstIndexEntry(PStorageIndexEntry *ie) {
-	if (!_storageFile.seek(_params.firstEntry, SeekSet)) {
-		PSTORAGE_DEBUG("_readFirstIndexEntry(): Could not find first index entry");
-		return false;
+unsigned int PStorage::_length(PStorageIndexEntry ie) {
+	if (!(_params.features & PSTORAGE_FEATURE_LENGTH) || (ie.slack > _size(ie))) {  // older stores only know the size
+		return _size(ie);
 	}
-	return _readIndexEntry(ie);
+	return _size(ie) - ie.slack;
 }
 
-boolean PStorage::_readIndexEntry(PStorageIndexEntry* ie) {
-	PSTORAGE_DEBUG("_readIndexEntry(): Called");
+boolean PStorage::_holds(PStorageIndexEntry ie, unsigned int size) {
+	// older stores do not know the length, their entries may be larger
+	return (_length(ie) == size) || (!(_params.features & PSTORAGE_FEATURE_LENGTH) && (_length(ie) > size));
+}
 
-	byte *ptr = (byte *) ie;
-	for (unsigned int i = 0; i < sizeof(PStorageIndexEntry); i++) {
-		if (_storageFile.read(ptr + i, 1) != 1) {
-			PSTORAGE_DEBUG("_readIndexEntry(): Could not read index entry at position %d", _storageFile.position());
-			return false;
-		}
+boolean PStorage::_setLength(PStorageIndexEntry *ie, unsigned int length) {
+	const unsigned int slack = _size(*ie) - length;
+	if (!(_params.features & PSTORAGE_FEATURE_LENGTH) || (ie->slack == slack)) {
+		return true;
 	}
-	return true;
+	ie->slack = slack;
+	return _rewriteIndexEntry(*ie);
 }
 
-boolean PStorage::_writeIndexEntry(const PStorageIndexEntry ie) {
-	PSTORAGE_DEBUG("_writeIndexEntry(): Called");
+boolean PStorage::_rewriteIndexEntry(const PStorageIndexEntry ie) {
+	_journalBegin();
+	if (!_journalAdd(ie) || !_journalCommit()) {
+		PSTORAGE_DEBUG("_rewriteIndexEntry(): Could not write index entry %d", ie.thisEntry);
+		_freeIndexCache();
+		return false;
+	}
+	_cacheUpdate(ie);
+	return true;
+}
 
-	byte *ptr = (byte *) &ie;
-	for (unsigned int i = 0; i < sizeof(PStorageIndexEntry); i++) {
-		if (_storageFile.write(*(ptr + i)) != 1) {
-			PSTORAGE_DEBUG("_writeIndexEntry(): Could not write index entry at position %d", _storageFile.position());
+boolean PStorage::_copyBytes(unsigned int from, unsigned int to, unsigned int length) {  // overlapping ranges may move either way
+	byte chunk[PSTORAGE_COPY_CHUNK];
+	const boolean up = (to > from);  // back to front then
+	for (unsigned int done = 0; done < length; done += sizeof(chunk)) {
+		unsigned int bytes = min(length - done, (unsigned int) sizeof(chunk));
+		unsigned int offset = up ? length - done - bytes : done;
+		if (!_seek(from + offset) || !_read(chunk, bytes) || !_seek(to + offset) || !_write(chunk, bytes)) {
+			PSTORAGE_DEBUG("_copyBytes(): Could not copy %d bytes at %d", bytes, from + offset);
 			return false;
 		}
 	}
-	_storageFile.flush();
 	return true;
 }
 
-boolean PStorage::_searchIndexEntry(EntryType type, const char* name, PStorageIndexEntry *ie) {
-	PSTORAGE_DEBUG("_searchIndexEntry(): Called");
-
-	if (!_readFirstIndexEntry(ie)) {
-		return false;
-	}
-	while ( (type != ie->type) || (strcasecmp(name, ie->name) != 0) ) {
-		if (_isLastIndexEntry(*ie)) {  // we have reached the last entry without match
-			return false;
-		}
-		if (!_storageFile.seek(ie->nextEntry, SeekSet)) {
-			PSTORAGE_DEBUG("_searchIndexEntry(): Corruption, could not set %d position", ie->nextEntry);
-			return false;
-		}
-		if (!_readIndexEntry(ie)) {  // read the next index entry
-			return false;
+/*
+ * Names of stores with PSTORAGE_FEATURE_HASHED are kept out of line: the index entry holds the _nameHash() of the
+ * name and its length, the name itself takes the last bytes of the entry's area, behind the value and its slack.
+ * Walks compare the hashes and read a name only on a hit. A name without a length is no name, as before.
+ */
+void PStorage::_setName(PStorageIndexEntry *ie, const char *name) {
+	memset(ie->name, 0, offsetof(PStorageIndexEntry, type));  // with the padding in front of type
+	unsigned int length = strlen(name);
+	if (_hashed()) {
+		if (length > 0) {
+			const unsigned int hash = _nameHash(name);
+			memcpy(ie->name, &hash, sizeof(hash));
+			ie->name[sizeof(hash)] = (char) min(length, (unsigned int) PSTORAGE_NAME_MAXSIZE);
 		}
+		return;
 	}
-	return true;
+	memcpy(ie->name, name, (length < PSTORAGE_INDEX_NAME_MAXSIZE) ? length : PSTORAGE_INDEX_NAME_MAXSIZE);
+}
+
+boolean PStorage::_writeName(const PStorageIndexEntry ie, const char *name) {
+	const unsigned int length = _hashed() ? _nameLength(ie) : 0;
+	if ((length > 0) && (!_seek(ie.nextEntry - length) || !_write((const byte *) name, length))) {
+		PSTORAGE_DEBUG("_writeName(): Could not write the name of %d", ie.thisEntry);
+		return false;
+	}
+	return true;
+}
+
+boolean PStorage::_readName(const PStorageIndexEntry ie, char *name) {
+	if (!_hashed()) {
+		strcpy(name, ie.name);
+		return true;
+	}
+	const unsigned int length = _nameLength(ie);
+	if ((length > PSTORAGE_NAME_MAXSIZE) || (ie.nextEntry < ie.thisEntry + _headerSize() + length) ||
+			(ie.nextEntry > _params.firstEntry + _params.size) || !_seek(ie.nextEntry - length) || !_read((byte *) name, length)) {
+		PSTORAGE_DEBUG("_readName(): Could not read the name of %d", ie.thisEntry);
+		return false;
+	}
+	name[length] = '\0';
+	return true;
+}
+
+boolean PStorage::_nameMatches(const PStorageIndexEntry ie, const char *name, unsigned int hash) {
+	if (!_hashed()) {
+		return strcasecmp(name, ie.name) == 0;
+	}
+	if (_nameLength(ie) == 0) {
+		return name[0] == '\0';
+	}
+	char stored[PSTORAGE_NAME_MAXSIZE + 1];
+	return (_entryHash(ie) == hash) && _readName(ie, stored) && (strcasecmp(name, stored) == 0);
+}
+
+boolean PStorage::_sameName(const PStorageIndexEntry a, const PStorageIndexEntry b) {
+	if (!_hashed()) {
+		return strcasecmp(a.name, b.name) == 0;
+	}
+	if ((_entryHash(a) != _entryHash(b)) || (_nameLength(a) != _nameLength(b))) {
+		return false;
+	}
+	char name[PSTORAGE_NAME_MAXSIZE + 1];
+	return (_nameLength(a) == 0) || (_readName(a, name) && _nameMatches(b, name, _entryHash(b)));
+}
+
+boolean PStorage::_hashed() {
+	return (_params.features & PSTORAGE_FEATURE_HASHED) != 0;
+}
+
+unsigned int PStorage::_nameHash(const char *name) {  // FNV-1a of the lower case name, as names compare with strcasecmp()
+	unsigned int hash = 2166136261U;
+	for (; *name != '\0'; name++) {
+		hash = (hash ^ (byte) tolower((byte) *name)) * 16777619U;
+	}
+	return hash;
+}
+
+unsigned int PStorage::_entryHash(const PStorageIndexEntry ie) {
+	if (!_hashed()) {
+		return _nameHash(ie.name);
+	}
+	unsigned int hash;
+	memcpy(&hash, ie.name, sizeof(hash));
+	return hash;
+}
+
+unsigned int PStorage::_nameLength(const PStorageIndexEntry ie) {
+	return _hashed() ? (byte) ie.name[sizeof(unsigned int)] : strlen(ie.name);
+}
+
+unsigned int PStorage::_nameSize(const char *name) {
+	return _hashed() ? min((unsigned int) strlen(name), (unsigned int) PSTORAGE_NAME_MAXSIZE) : 0;
+}
+
+unsigned int PStorage::_nameMaxSize() {
+	return _hashed() ? PSTORAGE_NAME_MAXSIZE : PSTORAGE_INDEX_NAME_MAXSIZE;
+}
+
+boolean PStorage::_readFirstIndexEntry(PStorageIndexEntry *ie) {
+	if (!_seek(_params.firstEntry)) {
+		PSTORAGE_DEBUG("_readFirstIndexEntry(): Could not find first index entry");
+		return false;
+	}
+	return _readIndexEntry(ie);
+}
+
+boolean PStorage::_readIndexEntry(PStorageIndexEntry* ie) {
+	PSTORAGE_DEBUG("_readIndexEntry(): Called");
+
+	byte buf[sizeof(PStorageIndexEntry)];
+	const unsigned int position = _tell();
+	if (!_read(buf, _headerSize())) {
+		PSTORAGE_DEBUG("_readIndexEntry(): Could not read index entry at position %d", _position);
+		return false;
+	}
+	_decodeIndexEntry(buf, position, ie);
+	return true;
+}
+
+boolean PStorage::_writeIndexEntry(const PStorageIndexEntry ie) {
+	PSTORAGE_DEBUG("_writeIndexEntry(): Called");
+
+	return _putIndexEntry(ie) && _flush();
+}
+
+boolean PStorage::_putIndexEntry(const PStorageIndexEntry ie) {
+	byte buf[sizeof(PStorageIndexEntry)];
+	if (!_write(buf, _encodeIndexEntry(ie, buf))) {
+		PSTORAGE_DEBUG("_putIndexEntry(): Could not write index entry at position %d", _position);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * A packed index entry is, little endian: the name (PSTORAGE_PACKED_NAME bytes, with PSTORAGE_FEATURE_HASHED the hash
+ * and the length), the type and the slack (1 and 2 bytes), nextEntry (2 bytes if the store ends below 64 KB,
+ * otherwise 4) and for P_LOG the sequence number (4 bytes). thisEntry is the position the entry is read from, the
+ * back pointer of P_INPLACE is derived where it is needed. Other stores hold the RAM image.
+ */
+unsigned int PStorage::_encodeIndexEntry(const PStorageIndexEntry ie, byte *buf) {
+	if (!_packed()) {
+		memcpy(buf, &ie, sizeof(PStorageIndexEntry));
+		return sizeof(PStorageIndexEntry);
+	}
+	if (_hashed()) {
+		_putBytes(buf, _entryHash(ie), 4);
+		buf[4] = (byte) _nameLength(ie);
+	}
+	else {
+		memcpy(buf, ie.name, PSTORAGE_PACKED_NAME);
+	}
+	buf[PSTORAGE_PACKED_NAME] = (byte) ie.type;
+	_putBytes(buf + PSTORAGE_PACKED_NAME + 1, ie.slack, 2);
+	const unsigned int offsetSize = (_params.firstEntry + _params.size <= 0xFFFF) ? 2 : 4;
+	_putBytes(buf + PSTORAGE_PACKED_FIXED, ie.nextEntry, offsetSize);
+	if (_params.engine == P_LOG) {
+		_putBytes(buf + PSTORAGE_PACKED_FIXED + offsetSize, ie.previousEntry, 4);
+	}
+	return _headerSize();
+}
+
+void PStorage::_decodeIndexEntry(const byte *buf, unsigned int position, PStorageIndexEntry *ie) {
+	if (!_packed()) {
+		memcpy(ie, buf, sizeof(PStorageIndexEntry));
+		return;
+	}
+	memset(ie->name, 0, offsetof(PStorageIndexEntry, type));
+	if (_hashed()) {
+		const unsigned int hash = _getBytes(buf, 4);
+		memcpy(ie->name, &hash, sizeof(hash));
+		ie->name[4] = (char) buf[4];
+	}
+	else {
+		memcpy(ie->name, buf, PSTORAGE_PACKED_NAME);
+	}
+	ie->type = (EntryType) buf[PSTORAGE_PACKED_NAME];
+	ie->slack = _getBytes(buf + PSTORAGE_PACKED_NAME + 1, 2);
+	const unsigned int offsetSize = (_params.firstEntry + _params.size <= 0xFFFF) ? 2 : 4;
+	ie->nextEntry = _getBytes(buf + PSTORAGE_PACKED_FIXED, offsetSize);
+	ie->previousEntry = (_params.engine == P_LOG) ? _getBytes(buf + PSTORAGE_PACKED_FIXED + offsetSize, 4) : 0;
+	ie->thisEntry = position;
+}
+
+unsigned int PStorage::_headerSize() {
+	if (!_packed()) {
+		return sizeof(PStorageIndexEntry);
+	}
+	return PSTORAGE_PACKED_FIXED + ((_params.firstEntry + _params.size <= 0xFFFF) ? 2 : 4) + ((_params.engine == P_LOG) ? 4 : 0);
+}
+
+boolean PStorage::_packed() {
+	return (_params.features & PSTORAGE_FEATURE_PACKED) != 0;
+}
+
+boolean PStorage::_typeFits(EntryType type) {
+	if (_packed() && (type > PSTORAGE_PACKED_TYPE_MAX)) {
+		PSTORAGE_DEBUG("_typeFits(): Type %d exceeds the type byte of packed entries", type);
+		return false;
+	}
+	if ((_params.features & PSTORAGE_FEATURE_SLABS) && (type == P_SLAB)) {
+		PSTORAGE_DEBUG("_typeFits(): Type %d is taken by the slab pages", type);
+		return false;
+	}
+	if (_compressed(type)) {
+		PSTORAGE_DEBUG("_typeFits(): Type %d is taken by compressed values", type);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Reads the entry in front of ie and tells whether it is a free entry linked to ie, for _free() without the free
+ * bins. Packed entries have no back pointer, the walk starts at _compactCursor as all entries in front of it are
+ * allocated. A complete RAM index holds all named entries, the walk then starts where the last of them in front of
+ * ie ends, which mostly leaves one read.
+ */
+boolean PStorage::_searchFreePredecessor(const PStorageIndexEntry ie, PStorageIndexEntry *previousIE, boolean *found) {
+	*found = false;
+	if (!_packed()) {
+		if (!_seek(ie.previousEntry) || !_readIndexEntry(previousIE)) {
+			PSTORAGE_DEBUG("_searchFreePredecessor(): Could not read index entry at %d", ie.previousEntry);
+			return false;
+		}
+		// stores written by earlier versions may hold stale back pointers, so check the forward link too
+		*found = (previousIE->type == P_FREE) && (previousIE->nextEntry == ie.thisEntry);
+		return true;
+	}
+	unsigned int start = max(_compactCursor, _params.firstEntry);
+	if ((_cache != NULL) && !_cacheOverflow) {
+		for (unsigned int i = 0; i < _cacheCount; i++) {
+			if ((_cache[i].nextEntry > start) && (_cache[i].nextEntry <= ie.thisEntry)) {
+				start = _cache[i].nextEntry;
+			}
+		}
+	}
+	for (unsigned int position = start; position < ie.thisEntry; position = previousIE->nextEntry) {
+		if (!_seek(position) || !_readIndexEntry(previousIE) || (previousIE->nextEntry <= position)) {
+			PSTORAGE_DEBUG("_searchFreePredecessor(): Corruption, could not read entry at %d", position);
+			return false;
+		}
+		*found = (previousIE->type == P_FREE) && (previousIE->nextEntry == ie.thisEntry);
+	}
+	return true;
+}
+
+boolean PStorage::_searchIndexEntry(EntryType type, const char* name, PStorageIndexEntry *ie) {
+	PSTORAGE_DEBUG("_searchIndexEntry(): Called");
+	_pStorageCount(_stats.lookups);
+	PSTORAGE_TRACE(P_TRACE_LOOKUP, _nameHash(name), 0, type);
+
+	if (_cache != NULL) {
+		if (_cacheSearch(type, name, ie)) {
+			return true;
+		}
+		if (!_cacheOverflow) {  // the RAM index holds all allocated entries
+			return false;
+		}
+	}
+	if ((_sortedCapacity > 0) && (name[0] != '\0')) {
+		return _sortedSearch(type, name, ie);
+	}
+	const unsigned int hash = _nameHash(name);
+	if (!_readFirstIndexEntry(ie)) {
+		return false;
+	}
+	_pStorageCount(_stats.chainHops);
+	PSTORAGE_TRACE(P_TRACE_HOP, ie->thisEntry, ie->nextEntry, ie->type);
+	while ( !_typeMatches(type, ie->type) || !_nameMatches(*ie, name, hash) ) {
+		if (_isLastIndexEntry(*ie)) {  // we have reached the last entry without match
+			return false;
+		}
+		if (!_seek(ie->nextEntry)) {
+			PSTORAGE_DEBUG("_searchIndexEntry(): Corruption, could not set %d position", ie->nextEntry);
+			return false;
+		}
+		if (!_readIndexEntry(ie)) {  // read the next index entry
+			return false;
+		}
+		_pStorageCount(_stats.chainHops);
+		PSTORAGE_TRACE(P_TRACE_HOP, ie->thisEntry, ie->nextEntry, ie->type);
+	}
+	return true;
 }
 
 boolean PStorage::_searchIndexEntry(const char* name, PStorageIndexEntry *ie) {
 	PSTORAGE_DEBUG("_searchIndexEntry(): Called");
+	_pStorageCount(_stats.lookups);
+	PSTORAGE_TRACE(P_TRACE_LOOKUP, _nameHash(name));
 
+	if (_cache != NULL) {
+		if (_cacheSearch(P_FREE, name, ie)) {
+			return true;
+		}
+		if (!_cacheOverflow) {
+			return false;
+		}
+	}
+	if ((_sortedCapacity > 0) && (name[0] != '\0')) {
+		return _sortedSearch(P_FREE, name, ie);
+	}
+	const unsigned int hash = _nameHash(name);
 	if (!_readFirstIndexEntry(ie)) {
 		return false;
 	}
-	while ( strcasecmp(name, ie->name) != 0) {
+	_pStorageCount(_stats.chainHops);
+	PSTORAGE_TRACE(P_TRACE_HOP, ie->thisEntry, ie->nextEntry, ie->type);
+	while ( !_nameMatches(*ie, name, hash) || (ie->type == P_SLAB) ) {  // slab pages have no name
 		if (_isLastIndexEntry(*ie)) {  // we have reached the last entry without match
 			return false;
 		}
-		if (!_storageFile.seek(ie->nextEntry, SeekSet)) {
+		if (!_seek(ie->nextEntry)) {
 			PSTORAGE_DEBUG("_searchIndexEntry(): Corruption, could not set %d position", ie->nextEntry);
 			return false;
 		}
 		if (!_readIndexEntry(ie)) {  // read the next index entry
 			return false;
 		}
+		_pStorageCount(_stats.chainHops);
+		PSTORAGE_TRACE(P_TRACE_HOP, ie->thisEntry, ie->nextEntry, ie->type);
 	}
 	return true;
 }
@@ -500,26 +1364,27 @@ boolean PStorage::_searchIndexEntry(const char* name, PStorageIndexEntry *ie) {
 boolean PStorage::_searchFreeIndexEntry(unsigned int minSize, PStorageIndexEntry *ie) {
 	PSTORAGE_DEBUG("_searchFreeIndexEntry(): Called");
 
+	if (_freeBlocks != NULL) {
+		return _binSearch(minSize, ie) || _allocationFailed(minSize);
+	}
 	PStorageIndexEntry currentEntry;
 	if (!_readFirstIndexEntry(&currentEntry)) {
 		return false;
 	}
+	const boolean nextFit = (_wearCounts != NULL);
 	boolean found = false, terminate = false;
 	do {
 		if (
 				(!found && (currentEntry.type == P_FREE) && (_size(currentEntry) >= minSize)) ||
-				(found && (currentEntry.type == P_FREE) && (_size(currentEntry) >= minSize) && (_size(currentEntry) < _size(*ie)))
-				// fit or even better fit than the previously found
+				(found && (currentEntry.type == P_FREE) && (_size(currentEntry) >= minSize) && (nextFit ?
+						(_wearDistance(currentEntry.thisEntry) < _wearDistance(ie->thisEntry)) : (_size(currentEntry) < _size(*ie))))
+				// fit or even better fit than the previously found, next-fit: nearer behind the cursor
 		) {
 			found = true;
-			strcpy(ie->name, currentEntry.name);
-			ie->nextEntry = currentEntry.nextEntry;
-			ie->previousEntry = currentEntry.previousEntry;
-			ie->thisEntry = currentEntry.thisEntry;
-			ie->type = currentEntry.type;
+			*ie = currentEntry;
 		}
 		if (!_isLastIndexEntry(currentEntry)) {
-			if (!_storageFile.seek(currentEntry.nextEntry, SeekSet)) {
+			if (!_seek(currentEntry.nextEntry)) {
 				PSTORAGE_DEBUG("_searchFreeIndexEntry(): Corruption, could not set %d position", ie->nextEntry);
 				return false;
 			}
@@ -530,52 +1395,644 @@ boolean PStorage::_searchFreeIndexEntry(unsigned int minSize, PStorageIndexEntry
 			terminate = true;
 		}
 	} while (!terminate);
-	return found;
+	return found || _allocationFailed(minSize);
+}
+
+boolean PStorage::_searchValue(const char *name, unsigned int *start, unsigned int *length, EntryType *type) {
+	PStorageIndexEntry ie;
+	if (_searchIndexEntry(name, &ie)) {
+		*start = ie.thisEntry + _headerSize();
+		*length = _length(ie);
+		*type = ie.type;
+		return true;
+	}
+	PStorageSlab page;
+	unsigned int slot;
+	if (!_slabSearch(P_FREE, name, &page, &slot)) {
+		return false;
+	}
+	*start = _slabSlot(page, slot) + page.keySize;
+	*length = PSTORAGE_SLAB_VALUE_SIZE;
+	*type = (EntryType) page.type;
+	return true;
+}
+
+/*
+ * Adds the image of the index entry at entry with its back pointer set to previousEntry, taken from the RAM index
+ * if possible.
+ */
+boolean PStorage::_journalPatchPrevious(unsigned int entry, unsigned int previousEntry) {
+	PSTORAGE_DEBUG("_journalPatchPrevious(): Called");
+
+	PStorageIndexEntry ie;
+	boolean found = false;
+	for (unsigned int i = 0; i < _cacheCount; i++) {
+		if (_cache[i].thisEntry == entry) {
+			_cache[i].previousEntry = previousEntry;
+			ie = _cache[i];
+			found = true;
+		}
+	}
+	unsigned char i = _binFind(entry);
+	if (i != PSTORAGE_FREE_BLOCK_NONE) {
+		_freeBlocks[i].previousEntry = previousEntry;
+		_setName(&ie, "");
+		ie.type = P_FREE;
+		ie.thisEntry = entry;
+		ie.nextEntry = _freeBlocks[i].nextEntry;
+		found = true;
+	}
+	if (_packed()) {  // nothing on disk to patch
+		return true;
+	}
+	if (!found && (!_seek(entry) || !_readIndexEntry(&ie))) {
+		PSTORAGE_DEBUG("_journalPatchPrevious(): Could not read index entry at %d", entry);
+		return false;
+	}
+	ie.previousEntry = previousEntry;
+	return _journalAdd(ie);
 }
 
 boolean PStorage::_writeEntry(const PStorageIndexEntry ie, byte* buf, unsigned int maxBytes) {
 	PSTORAGE_DEBUG("_writeEntry(): Called");
 
-	unsigned int writePosition = ie.thisEntry + sizeof(PStorageIndexEntry);
-	if (!_storageFile.seek(writePosition, SeekSet)) {
+	unsigned int writePosition = ie.thisEntry + _headerSize();
+	if (!_seek(writePosition)) {
 		PSTORAGE_DEBUG("_writeEntry(): Could not set position %d", writePosition);
 		return false;
 	}
-	byte *ptr = buf;
-	for (unsigned int i = 0; i < min(_size(ie), maxBytes); i++) {
-		if (_storageFile.write(*(ptr + i)) != 1) {
-			PSTORAGE_DEBUG("_writeEntry(): Could not write at position %d", _storageFile.position());
-			return false;
-		}
+	if (!_write(buf, min(_size(ie), maxBytes))) {
+		PSTORAGE_DEBUG("_writeEntry(): Could not write at position %d", _position);
+		return false;
 	}
-	_storageFile.flush();
-	return true;
+	return _flush();
 }
 
 int PStorage::_readEntry(const PStorageIndexEntry ie, byte* buf, unsigned int maxBytes) {
 	PSTORAGE_DEBUG("_readEntry(): Called");
 
-	unsigned int readPosition = ie.thisEntry + sizeof(PStorageIndexEntry);
-	if (!_storageFile.seek(readPosition, SeekSet)) {
+	unsigned int readPosition = ie.thisEntry + _headerSize();
+	if (_compressed(ie.type)) {
+		return _lzDecode(readPosition, _length(ie), 0, buf, maxBytes, NULL, NULL);
+	}
+	if (!_seek(readPosition)) {
 		PSTORAGE_DEBUG("_readEntry(): Could not set position %d", readPosition);
 		return -1;
 	}
-	byte *ptr = buf;
-	for (unsigned int i = 0; i < min(_size(ie), maxBytes); i++) {
-		if (_storageFile.read(ptr + i, 1) != 1) {
-			PSTORAGE_DEBUG("_readEntry(): Could not read value at position %d", _storageFile.position());
-			return -1;
-		}
+	if (!_read(buf, min(_size(ie), maxBytes))) {
+		PSTORAGE_DEBUG("_readEntry(): Could not read value at position %d", _position);
+		return -1;
 	}
 	return min(_size(ie), maxBytes);
 }
 
+/*
+ * The RAM index mirrors the chain: allocated index entries are held in _cache, free ones in the size class
+ * bins of _freeBlocks. Both are built with one pass at open()/create() and kept current by _allocate() and
+ * _free(). Allocated entries beyond PSTORAGE_INDEX_CACHE_MAXENTRIES or the heap are left out of _cache, only
+ * searches it misses walk the chain (_cacheOverflow). The bins are dropped when they cannot hold all free
+ * entries and free searches walk the chain then. After I/O errors both are dropped.
+ */
+boolean PStorage::_buildIndexCache() {
+	PSTORAGE_DEBUG("_buildIndexCache(): Called");
+
+	_freeIndexCache();
+	_compactCursor = _params.firstEntry;
+	if (_params.engine == P_LOG) {
+		return _logRecover();
+	}
+#if(PSTORAGE_INDEX_CACHE_MAXENTRIES > 0)
+	_cacheCapacity = min(8, PSTORAGE_INDEX_CACHE_MAXENTRIES);
+	_cache = (PStorageIndexEntry *) malloc(_cacheCapacity * sizeof(PStorageIndexEntry));
+	if (_cache == NULL) {
+		_cacheCapacity = 0;
+	}
+#endif
+#if(PSTORAGE_FREE_BLOCKS_MAXENTRIES > 0)
+	_freeBlocks = (PStorageFreeBlock *) malloc(PSTORAGE_FREE_BLOCKS_MAXENTRIES * sizeof(PStorageFreeBlock));
+	if (_freeBlocks != NULL) {
+		for (unsigned int i = 0; i < PSTORAGE_FREE_BINS; i++) {
+			_freeBins[i] = PSTORAGE_FREE_BLOCK_NONE;
+		}
+		for (unsigned int i = 0; i < PSTORAGE_FREE_BLOCKS_MAXENTRIES; i++) {
+			_freeBlocks[i].nextInBin = (i + 1 < PSTORAGE_FREE_BLOCKS_MAXENTRIES) ? i + 1 : PSTORAGE_FREE_BLOCK_NONE;
+		}
+		_unusedFreeBlocks = 0;
+	}
+#endif
+	_slabsTracked = true;  // by the walk below
+	if ((_cache == NULL) && (_freeBlocks == NULL) && !(_params.features & PSTORAGE_FEATURE_SLABS)) {
+		return false;
+	}
+	if (_checkpointLoad()) {
+		return (_cache != NULL) || (_freeBlocks != NULL);
+	}
+	PStorageIndexEntry ie;
+	if (!_readFirstIndexEntry(&ie)) {
+		_freeIndexCache();
+		return false;
+	}
+	unsigned int previousEntry = 0;
+	boolean orphans = false;
+	while (true) {
+		ie.previousEntry = previousEntry;  // derived from the walk, stores of earlier versions may hold stale ones
+		orphans = orphans || _orphaned(ie);
+		if (ie.type == P_FREE) {
+			_binInsert(ie);
+		}
+		else {
+			_cacheUpdate(ie);
+		}
+		if (ie.type == P_SLAB) {
+			PStorageSlab page;
+			if (_slabRead(ie, &page)) {
+				_slabTrack(page);
+			}
+			else {
+				_slabDrop();
+			}
+		}
+		if (_isLastIndexEntry(ie)) {
+			if (orphans) {
+				_freeOrphans();
+			}
+			_checkpointSave();  // the next open() need not walk again
+			return (_cache != NULL) || (_freeBlocks != NULL);
+		}
+		previousEntry = ie.thisEntry;
+		if ((ie.nextEntry <= ie.thisEntry) || !_seek(ie.nextEntry) || !_readIndexEntry(&ie)) {
+			PSTORAGE_DEBUG("_buildIndexCache(): Corruption, could not read entry at %d", ie.nextEntry);
+			_freeIndexCache();
+			return false;
+		}
+	}
+}
+
+/*
+ * Frees the nameless P_ARRAY and P_STRING entries a move of write() leaves behind if a reset interrupts it before
+ * the new entry takes over the name. Each walk starts again from the first entry, a free merges its neighbours.
+ */
+boolean PStorage::_freeOrphans() {
+	PSTORAGE_DEBUG("_freeOrphans(): Called");
+
+	boolean freed = true;
+	while (freed) {
+		freed = false;
+		PStorageIndexEntry ie;
+		if (!_readFirstIndexEntry(&ie)) {
+			return false;
+		}
+		while (!freed) {
+			if (_orphaned(ie)) {
+				PSTORAGE_DEBUG("_freeOrphans(): Freeing the nameless entry at %d", ie.thisEntry);
+				if (!_free(&ie)) {
+					return false;
+				}
+				freed = true;
+			}
+			else if (_isLastIndexEntry(ie)) {
+				return true;
+			}
+			else if ((ie.nextEntry <= ie.thisEntry) || !_seek(ie.nextEntry) || !_readIndexEntry(&ie)) {
+				PSTORAGE_DEBUG("_freeOrphans(): Corruption, could not read entry at %d", ie.nextEntry);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+boolean PStorage::_orphaned(const PStorageIndexEntry ie) {
+	return ((ie.type == P_ARRAY) || (ie.type == P_STRING)) && (_nameLength(ie) == 0);
+}
+
+void PStorage::_freeIndexCache() {
+	if (_cache != NULL) {
+		free(_cache);
+		_cache = NULL;
+	}
+	_cacheCount = 0;
+	_cacheCapacity = 0;
+	_cacheOverflow = false;
+	if (_freeBlocks != NULL) {
+		free(_freeBlocks);
+		_freeBlocks = NULL;
+	}
+	_slabDrop();
+}
+
+boolean PStorage::_cacheSearch(EntryType type, const char *name, PStorageIndexEntry *ie) {
+	const unsigned int hash = _nameHash(name);
+	for (unsigned int i = 0; i < _cacheCount; i++) {
+		if (((type == P_FREE) ? (_cache[i].type != P_SLAB) : _typeMatches(type, _cache[i].type)) && _nameMatches(_cache[i], name, hash)) {
+			*ie = _cache[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+void PStorage::_cacheUpdate(const PStorageIndexEntry ie) {
+	if (_cache == NULL) {
+		return;
+	}
+	for (unsigned int i = 0; i < _cacheCount; i++) {
+		if (_cache[i].thisEntry == ie.thisEntry) {
+			_cache[i] = ie;
+			return;
+		}
+	}
+	if (_cacheCount == _cacheCapacity) {
+		unsigned int newCapacity = min(2 * _cacheCapacity, (unsigned int) PSTORAGE_INDEX_CACHE_MAXENTRIES);
+		PStorageIndexEntry *newCache = NULL;
+		if (newCapacity > _cacheCapacity) {
+			newCache = (PStorageIndexEntry *) realloc(_cache, newCapacity * sizeof(PStorageIndexEntry));
+		}
+		if (newCache == NULL) {
+			PSTORAGE_DEBUG("_cacheUpdate(): RAM index exhausted, misses walk the chain");
+			_cacheOverflow = true;
+			return;
+		}
+		_cache = newCache;
+		_cacheCapacity = newCapacity;
+	}
+	_cache[_cacheCount++] = ie;
+}
+
+void PStorage::_cacheRemove(unsigned int thisEntry) {
+	if (_cache == NULL) {
+		return;
+	}
+	for (unsigned int i = 0; i < _cacheCount; i++) {
+		if (_cache[i].thisEntry == thisEntry) {
+			_cache[i] = _cache[--_cacheCount];
+			return;
+		}
+	}
+}
+
+unsigned int PStorage::_bin(unsigned int size) {
+	unsigned int bin = 0;
+	for (size >>= 3; (size > 0) && (bin < PSTORAGE_FREE_BINS - 1); size >>= 1) {
+		bin++;
+	}
+	return bin;
+}
+
+void PStorage::_binInsert(const PStorageIndexEntry ie) {
+	if (_freeBlocks == NULL) {
+		return;
+	}
+	if (_unusedFreeBlocks == PSTORAGE_FREE_BLOCK_NONE) {
+		PSTORAGE_DEBUG("_binInsert(): Free bins exhausted, falling back to chain search");
+		free(_freeBlocks);
+		_freeBlocks = NULL;
+		return;
+	}
+	unsigned char i = _unusedFreeBlocks;
+	unsigned int bin = _bin(_size(ie));
+	_unusedFreeBlocks = _freeBlocks[i].nextInBin;
+	_freeBlocks[i].thisEntry = ie.thisEntry;
+	_freeBlocks[i].previousEntry = ie.previousEntry;
+	_freeBlocks[i].nextEntry = ie.nextEntry;
+	_freeBlocks[i].nextInBin = _freeBins[bin];
+	_freeBins[bin] = i;
+}
+
+void PStorage::_binRemove(unsigned int thisEntry) {
+	if (_freeBlocks == NULL) {
+		return;
+	}
+	for (unsigned int bin = 0; bin < PSTORAGE_FREE_BINS; bin++) {
+		unsigned char *link = &_freeBins[bin];
+		while (*link != PSTORAGE_FREE_BLOCK_NONE) {
+			unsigned char i = *link;
+			if (_freeBlocks[i].thisEntry == thisEntry) {
+				*link = _freeBlocks[i].nextInBin;
+				_freeBlocks[i].nextInBin = _unusedFreeBlocks;
+				_unusedFreeBlocks = i;
+				return;
+			}
+			link = &_freeBlocks[i].nextInBin;
+		}
+	}
+}
+
+/*
+ * Every block of a higher bin is larger than any block of a lower one, so the best fit of the first bin
+ * holding a fitting block is the overall best fit. Ties go to the lowest position like the chain walk does.
+ */
+boolean PStorage::_binSearch(unsigned int minSize, PStorageIndexEntry *ie) {
+	const boolean nextFit = (_wearCounts != NULL);  // the nearest behind the cursor of all bins
+	unsigned char best = PSTORAGE_FREE_BLOCK_NONE;
+	unsigned int bestSize = 0, bestDistance = 0;
+	for (unsigned int bin = _bin(minSize); (bin < PSTORAGE_FREE_BINS) && (nextFit || (best == PSTORAGE_FREE_BLOCK_NONE)); bin++) {
+		for (unsigned char i = _freeBins[bin]; i != PSTORAGE_FREE_BLOCK_NONE; i = _freeBlocks[i].nextInBin) {
+			unsigned int size = _freeBlocks[i].nextEntry - (_freeBlocks[i].thisEntry + _headerSize());
+			unsigned int distance = nextFit ? _wearDistance(_freeBlocks[i].thisEntry) : 0;
+			if ((size >= minSize) && ((best == PSTORAGE_FREE_BLOCK_NONE) || (nextFit ? (distance < bestDistance) : ((size < bestSize) ||
+					((size == bestSize) && (_freeBlocks[i].thisEntry < _freeBlocks[best].thisEntry)))))) {
+				best = i;
+				bestSize = size;
+				bestDistance = distance;
+			}
+		}
+	}
+	if (best == PSTORAGE_FREE_BLOCK_NONE) {
+		return false;
+	}
+	_setName(ie, "");
+	ie->type = P_FREE;
+	ie->thisEntry = _freeBlocks[best].thisEntry;
+	ie->previousEntry = _freeBlocks[best].previousEntry;
+	ie->nextEntry = _freeBlocks[best].nextEntry;
+	return true;
+}
+
+unsigned char PStorage::_binFind(unsigned int thisEntry) {
+	if (_freeBlocks == NULL) {
+		return PSTORAGE_FREE_BLOCK_NONE;
+	}
+	for (unsigned int bin = 0; bin < PSTORAGE_FREE_BINS; bin++) {
+		for (unsigned char i = _freeBins[bin]; i != PSTORAGE_FREE_BLOCK_NONE; i = _freeBlocks[i].nextInBin) {
+			if (_freeBlocks[i].thisEntry == thisEntry) {
+				return i;
+			}
+		}
+	}
+	return PSTORAGE_FREE_BLOCK_NONE;
+}
+
+unsigned char PStorage::_binFindPredecessor(unsigned int thisEntry) {
+	for (unsigned int bin = 0; bin < PSTORAGE_FREE_BINS; bin++) {
+		for (unsigned char i = _freeBins[bin]; i != PSTORAGE_FREE_BLOCK_NONE; i = _freeBlocks[i].nextInBin) {
+			if (_freeBlocks[i].nextEntry == thisEntry) {
+				return i;
+			}
+		}
+	}
+	return PSTORAGE_FREE_BLOCK_NONE;
+}
+
+/*
+ * All file I/O goes through one PSTORAGE_IO_BUFFER_SIZE aligned page buffer: reads fill the whole page, which
+ * also reads ahead the following index entries of a chain walk, writes are collected in the page and written
+ * back as one block when another page is needed or at _flush(). Transfers of at least a page bypass the buffer,
+ * without PSTORAGE_IO_BUFFER_ENABLED all of them do.
+ * Bytes behind the end of the file read as PSTORAGE_FILLER, writes behind it fill the gap first.
+ */
+void PStorage::_resetIOBuffer() {
+	_ioBufferStart = 0;
+	_ioBufferLength = 0;
+	_ioDirtyStart = _ioDirtyEnd = 0;
+	_position = 0;
+}
+
+boolean PStorage::_writeBackIOBuffer() {
+	if (_ioDirtyEnd > _ioDirtyStart) {
+		unsigned int length = _ioDirtyEnd - _ioDirtyStart;
+		if (!_extendFile(_ioBufferStart + _ioDirtyStart) || !_storageFile.seek(_ioBufferStart + _ioDirtyStart, SeekSet) ||
+				(_storageFile.write(_ioBuffer + _ioDirtyStart, length) != length)) {
+			PSTORAGE_DEBUG("_writeBackIOBuffer(): Could not write %d bytes at position %d", length, _ioBufferStart + _ioDirtyStart);
+			return false;
+		}
+		_pStorageCount(_stats.seeks);
+		_pStorageCount(_stats.bytesWritten, length);
+		PSTORAGE_TRACE(P_TRACE_WRITE, _ioBufferStart + _ioDirtyStart, length);
+		_wearCount(_ioBufferStart + _ioDirtyStart, length);
+		_fileSize = max(_fileSize, _ioBufferStart + _ioDirtyEnd);
+		_ioDirtyStart = _ioDirtyEnd = 0;
+	}
+	return true;
+}
+
+boolean PStorage::_fillIOBuffer(unsigned int position) {
+	if (!_writeBackIOBuffer()) {
+		return false;
+	}
+	_ioBufferStart = position - (position % PSTORAGE_IO_BUFFER_SIZE);
+	_ioBufferLength = 0;
+	unsigned int available = (_ioBufferStart < _fileSize) ? min(_fileSize - _ioBufferStart, (unsigned int) PSTORAGE_IO_BUFFER_SIZE) : 0;
+	if ((available > 0) && (!_storageFile.seek(_ioBufferStart, SeekSet) || (_storageFile.read(_ioBuffer, available) != available))) {
+		return false;
+	}
+	_pStorageCount(_stats.seeks, (available > 0) ? 1 : 0);
+	_pStorageCount(_stats.bytesRead, available);
+	PSTORAGE_TRACE(P_TRACE_READ, _ioBufferStart, available);
+	memset(_ioBuffer + available, PSTORAGE_FILLER, PSTORAGE_IO_BUFFER_SIZE - available);  // behind the end of the file
+	_ioBufferLength = PSTORAGE_IO_BUFFER_SIZE;
+	return true;
+}
+
+boolean PStorage::_seek(unsigned int position) {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	PStorageLock *reader = _reader();
+	if (reader != NULL) {
+		reader->_position = position;
+		return true;
+	}
+#endif
+	_position = position;
+	return true;
+}
+
+unsigned int PStorage::_tell() {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	PStorageLock *reader = _reader();
+	if (reader != NULL) {
+		return reader->_position;
+	}
+#endif
+	return _position;
+}
+
+boolean PStorage::_read(byte *buf, unsigned int size) {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	PStorageLock *reader = _reader();
+	if (reader != NULL) {
+		return _readShared(reader, buf, size);
+	}
+#endif
+#if(PSTORAGE_MMAP_ENABLED)
+	// pending writes in the range reach the file first, the mapping shows the file
+	if ((_ioDirtyEnd > _ioDirtyStart) && (_position < _ioBufferStart + _ioDirtyEnd) && (_position + size > _ioBufferStart + _ioDirtyStart) &&
+			!_writeBackIOBuffer()) {
+		return false;
+	}
+	unsigned int available = (_position < _fileSize) ? min(_fileSize - _position, size) : 0;
+	if ((available == 0) || _mapFile(_position + available)) {
+		if (available > 0) {
+			memcpy(buf, _map + _position, available);
+			_pStorageCount(_stats.bytesRead, available);  // no File call
+			PSTORAGE_TRACE(P_TRACE_READ, _position, available, true);
+		}
+		memset(buf + available, PSTORAGE_FILLER, size - available);
+		_position += size;
+		return true;
+	}
+	// without a mapping the page buffer is used
+#endif
+	while (size > 0) {
+		if ((_ioBufferLength == 0) || (_position < _ioBufferStart) || (_position >= _ioBufferStart + _ioBufferLength)) {
+			if (!PSTORAGE_IO_BUFFER_ENABLED || (size >= PSTORAGE_IO_BUFFER_SIZE) || (_ioDirtyEnd > _ioDirtyStart)) {  // large or pending writes in the page
+				unsigned int bufferEnd = _ioBufferStart + _ioBufferLength;
+				if ((_position < bufferEnd) && (_position + size > _ioBufferStart) && !_writeBackIOBuffer()) {
+					return false;
+				}
+				unsigned int available = (_position < _fileSize) ? min(_fileSize - _position, size) : 0;
+				if ((available > 0) && (!_storageFile.seek(_position, SeekSet) || (_storageFile.read(buf, available) != available))) {
+					return false;
+				}
+				_pStorageCount(_stats.seeks, (available > 0) ? 1 : 0);
+				_pStorageCount(_stats.bytesRead, available);
+				PSTORAGE_TRACE(P_TRACE_READ, _position, available);
+				memset(buf + available, PSTORAGE_FILLER, size - available);
+				_position += size;
+				return true;
+			}
+			if (!_fillIOBuffer(_position) || (_position >= _ioBufferStart + _ioBufferLength)) {
+				return false;
+			}
+		}
+		unsigned int chunk = min(size, _ioBufferStart + _ioBufferLength - _position);
+		memcpy(buf, _ioBuffer + (_position - _ioBufferStart), chunk);
+		buf += chunk;
+		size -= chunk;
+		_position += chunk;
+	}
+	return true;
+}
+
+boolean PStorage::_write(const byte *buf, unsigned int size) {
+	while (size > 0) {
+		if ((_ioBufferLength == 0) || (_position < _ioBufferStart) || (_position > _ioBufferStart + _ioBufferLength) ||
+				(_position >= _ioBufferStart + PSTORAGE_IO_BUFFER_SIZE)) {
+			if (!PSTORAGE_IO_BUFFER_ENABLED || (size >= PSTORAGE_IO_BUFFER_SIZE)) {
+				if (!_writeBackIOBuffer() || !_extendFile(_position) ||
+						!_storageFile.seek(_position, SeekSet) || (_storageFile.write(buf, size) != size)) {
+					return false;
+				}
+				_fileSize = max(_fileSize, _position + size);
+				_wearCount(_position, size);
+				_pStorageCount(_stats.seeks);
+				_pStorageCount(_stats.bytesWritten, size);
+				PSTORAGE_TRACE(P_TRACE_WRITE, _position, size);
+				if ((_position < _ioBufferStart + _ioBufferLength) && (_position + size > _ioBufferStart)) {
+					_ioBufferLength = 0;  // overwritten
+				}
+				_position += size;
+				return true;
+			}
+			if (!_fillIOBuffer(_position) || (_position > _ioBufferStart + _ioBufferLength)) {
+				return false;
+			}
+		}
+		unsigned int offset = _position - _ioBufferStart;
+		unsigned int chunk = min(size, PSTORAGE_IO_BUFFER_SIZE - offset);
+		memcpy(_ioBuffer + offset, buf, chunk);
+		if (_ioDirtyEnd == _ioDirtyStart) {
+			_ioDirtyStart = offset;
+			_ioDirtyEnd = offset + chunk;
+		}
+		else {
+			_ioDirtyStart = min(_ioDirtyStart, offset);
+			_ioDirtyEnd = max(_ioDirtyEnd, offset + chunk);
+		}
+		_ioBufferLength = max(_ioBufferLength, offset + chunk);
+		buf += chunk;
+		size -= chunk;
+		_position += chunk;
+	}
+	return true;
+}
+
+boolean PStorage::_flush() {
+	if (_batchDepth > 0) {  // staged in the I/O buffer until commit()
+		_flushPending = true;
+		return true;
+	}
+	_flushPending = false;
+	if (!_writeBackIOBuffer()) {
+		return false;
+	}
+	_storageFile.flush();
+	_pStorageCount(_stats.flushes);
+	PSTORAGE_TRACE(P_TRACE_FLUSH);
+	return (_wearUnsaved < PSTORAGE_WEAR_SAVE_WRITES) || _wearSave();
+}
+
+/*
+ * Writes filler up to position, large chunks keep create() fast and a lazy store grows on demand.
+ */
+boolean PStorage::_extendFile(unsigned int position) {
+	if (position <= _fileSize) {
+		return true;
+	}
+	byte filler[PSTORAGE_IO_BUFFER_SIZE];
+	memset(filler, PSTORAGE_FILLER, sizeof(filler));
+	if (!_storageFile.seek(_fileSize, SeekSet)) {
+		return false;
+	}
+	while (_fileSize < position) {
+		unsigned int bytes = min(position - _fileSize, (unsigned int) sizeof(filler));
+		if (_storageFile.write(filler, bytes) != bytes) {
+			PSTORAGE_DEBUG("_extendFile(): Could not write %d bytes at position %d", bytes, _fileSize);
+			return false;
+		}
+		_fileSize += bytes;
+	}
+	return true;
+}
+
+/*
+ * With PSTORAGE_MMAP_ENABLED reads come from a read-only shared mapping of the whole file, writes still go
+ * through the File, so the on-disk format does not change. The mapping grows with the file on demand.
+ */
+boolean PStorage::_mapFile(unsigned int length) {
+#if(PSTORAGE_MMAP_ENABLED)
+	if ((_map != NULL) && (length <= _mapLength)) {
+		return true;
+	}
+	_unmapFile();
+	if ((length > _fileSize) || !_storageFile) {
+		return false;
+	}
+	void *map = mmap(NULL, _fileSize, PROT_READ, MAP_SHARED, _storageFile.fd(), 0);
+	if (map == MAP_FAILED) {
+		PSTORAGE_DEBUG("_mapFile(): Could not map %d bytes", _fileSize);
+		return false;
+	}
+	_map = (const byte *) map;
+	_mapLength = _fileSize;
+	return true;
+#else
+	(void) length;
+	return false;
+#endif
+}
+
+void PStorage::_unmapFile() {
+#if(PSTORAGE_MMAP_ENABLED)
+	if (_map != NULL) {
+		munmap((void *) _map, _mapLength);
+		_map = NULL;
+		_mapLength = 0;
+	}
+#endif
+}
+
+PStorageBatch::PStorageBatch(PStorage &storage) : _storage(storage) {
+	_storage.beginBatch();
+}
+
+PStorageBatch::~PStorageBatch() {
+	_storage.commit();
+}
+
 const char* PStorage::_getStorageFileName() {
 	PSTORAGE_DEBUG("_getStorageFileName(): Called");
 
-	String result = "/pstorage/" + String(_name) + ".psf"
-			"";
-	return result.c_str();
+	return _storageFileName;
 }
 
 String PStorage::_printType(EntryType type) {
@@ -588,7 +2045,10 @@ String PStorage::_printType(EntryType type) {
 	case P_FLOAT: return "FLOAT"; break;
 	case P_ARRAY: return "ARRAY"; break;
 	case P_STRING: return "STRING"; break;
-	default: return "UNKNOWN"; break;
+	case P_SLAB: return "SLAB"; break;
+	case P_ARRAY_LZ: return "COMPRESSED ARRAY"; break;
+	case P_STRING_LZ: return "COMPRESSED STRING"; break;
+	default: return (type >= P_STRUCT) ? "STRUCT" : "UNKNOWN"; break;
 	}
 }
 
@@ -609,15 +2069,15 @@ void PStorage::_printUInt(PStorageIndexEntry ie) {
 }
 
 void PStorage::_printLong(PStorageIndexEntry ie) {
-	byte b[sizeof(long)];
-	_readEntry(ie, b, sizeof(long));
-	Serial.printf("%ld", (long) *b);
+	int32_t b = 0;  // stored in 32 bits, see map(long)
+	_readEntry(ie, (byte *) &b, sizeof(b));
+	Serial.printf("%ld", (long) b);
 }
 
 void PStorage::_printULong(PStorageIndexEntry ie) {
-	byte b[sizeof(unsigned long)];
-	_readEntry(ie, b, sizeof(unsigned long));
-	Serial.printf("%lu", (unsigned long) *b);
+	uint32_t b = 0;
+	_readEntry(ie, (byte *) &b, sizeof(b));
+	Serial.printf("%lu", (unsigned long) b);
 }
 
 
@@ -642,6 +2102,23 @@ void PStorage::_printArray(PStorageIndexEntry ie) {
 	}
 }
 
+void PStorage::_printSlab(PStorageIndexEntry ie) {
+	PStorageSlab page;
+	if (!_slabRead(ie, &page)) {
+		_printDefault();
+		return;
+	}
+	for (unsigned int slot = 0; slot < page.slots; slot++) {
+		char key[PSTORAGE_NAME_MAXSIZE + 1];
+		int32_t value;
+		if ((page.used & (1U << slot)) && _seek(_slabSlot(page, slot)) && _read((byte *) key, page.keySize) &&
+				_read((byte *) &value, sizeof(value))) {
+			key[page.keySize] = '\0';
+			Serial.printf("%s %s = %ld\n", _printType((EntryType) page.type).c_str(), key, (long) value);
+		}
+	}
+}
+
 void PStorage::_printDefault() {
 	Serial.printf("Unknown");
 }
@@ -657,7 +2134,17 @@ void PStorage::_printEntry(PStorageIndexEntry ie) {
 	case P_FLOAT: _printFloat(ie); break;
 	case P_ARRAY: _printArray(ie); break;
 	case P_STRING: _printString(ie); break;
-	default: _printDefault(); break;
+	case P_SLAB: _printSlab(ie); break;
+	case P_ARRAY_LZ: _printArray(ie); break;
+	case P_STRING_LZ: _printString(ie); break;
+	default:
+		if (ie.type >= P_STRUCT) {
+			_printArray(ie);
+		}
+		else {
+			_printDefault();
+		}
+		break;
 	}
 }
 
@@ -13,14 +13,87 @@
 #include <Arduino.h>
 #include <FS.h>
 #include <spiffs/spiffs_config.h>
+#include <type_traits>
 
-#define PSTORAGE_MAGIC_COOKIE			26202		// changing this will result in invalidation of all existing PStorages
+#ifndef PSTORAGE_CONCURRENCY_ENABLED
+#define PSTORAGE_CONCURRENCY_ENABLED	false	// ESP32 and hosts with pthreads: one store may be called from several tasks, see PStorageLock.cpp
+#endif
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+#include <atomic>
+#include <pthread.h>
+#endif
+
+#define PSTORAGE_MAGIC_COOKIE			26204		// v3, changing this will result in invalidation of all existing PStorages
+#define PSTORAGE_MAGIC_COOKIE_V2		26203		// v2 stores never have PSTORAGE_FEATURE_HASHED
+#define PSTORAGE_MAGIC_COOKIE_V1		26202		// open() migrates these stores to v2, see _sortedMigrate()
 
+#ifndef PSTORAGE_DEBUG_ENABLED
 #define PSTORAGE_DEBUG_ENABLED 			false
+#endif
 
-#define PSTORAGE_INDEX_NAME_MAXSIZE		5			// Max size of an entry name. A change may invalidate all existing PStorages
+#define PSTORAGE_INDEX_NAME_MAXSIZE		5			// Max size of an entry name kept in the index entry (stores without PSTORAGE_FEATURE_HASHED)
+#define PSTORAGE_NAME_MAXSIZE			64			// Max size of an entry name of stores with PSTORAGE_FEATURE_HASHED, at most 255
 // be careful (!!!)
+#ifndef PSTORAGE_ENTRY_MINSIZE
 #define PSTORAGE_ENTRY_MINSIZE 4  // increases reuse of entries against fragmentation
+#endif
+
+#ifndef PSTORAGE_INDEX_CACHE_MAXENTRIES
+#define PSTORAGE_INDEX_CACHE_MAXENTRIES	32	// Max number of allocated entries held in the RAM index, 0 disables the RAM index
+											// each entry costs sizeof(PStorageIndexEntry) bytes of heap, lookups of further ones walk the chain
+#endif
+#ifndef PSTORAGE_FREE_BLOCKS_MAXENTRIES
+#define PSTORAGE_FREE_BLOCKS_MAXENTRIES	32	// Max number of free entries held in the RAM free bins, 0 disables them (max 254)
+#endif
+#ifndef PSTORAGE_IO_BUFFER_SIZE
+#define PSTORAGE_IO_BUFFER_SIZE			256	// Size of the page buffer all file I/O goes through, should match the SPIFFS logical page size
+#endif
+#ifndef PSTORAGE_IO_BUFFER_ENABLED
+#define PSTORAGE_IO_BUFFER_ENABLED		true	// false makes every read and write one File call of its own, to measure the page buffer
+#endif
+#ifndef PSTORAGE_FREE_BINS
+#define PSTORAGE_FREE_BINS				8	// Number of size classes of the free bins, bin n holds entries of less than 8 << n bytes
+#endif
+#ifndef PSTORAGE_LOG_COMPACT_THRESHOLD
+#define PSTORAGE_LOG_COMPACT_THRESHOLD	50	// compact() of the log engine reclaims dead records while less than this percentage is free
+#endif
+#ifndef PSTORAGE_JOURNAL_ENABLED
+#define PSTORAGE_JOURNAL_ENABLED		true	// P_INPLACE: journal chain updates so that open() can repair an interrupted one
+#endif
+#ifndef PSTORAGE_MMAP_ENABLED
+#define PSTORAGE_MMAP_ENABLED			false	// hosts with mmap() only, reads come from a mapping of the file, see getView()
+#endif
+#define PSTORAGE_JOURNAL_IMAGES			3	// index entries one chain update writes at most. A change invalidates the journal layout
+#define PSTORAGE_STREAM_CHUNK_SIZE		64	// stack buffer of read() with a callback
+#define PSTORAGE_SLAB_SLOTS				16	// P_INPLACE: scalars of one type per slab page, at most 32, must not be lowered for existing stores
+#define PSTORAGE_SLAB_KEY_SIZE			8	// name bytes of a slab slot, scalars with longer names get an entry of their own
+#define PSTORAGE_READER_HANDLES			4	// with PSTORAGE_CONCURRENCY_ENABLED: file handles of concurrent readers, further ones wait
+											// each costs PSTORAGE_IO_BUFFER_SIZE bytes for its page buffer
+#define PSTORAGE_SLAB_MAXPAGES			32	// slab pages held in RAM, no more are created, 0 creates none
+											// each costs sizeof(PStorageSlab) bytes of heap
+#define PSTORAGE_QUEUE_SIZE				512	// bytes of heap of the write-behind queue, see beginWriteBehind()
+#define PSTORAGE_WEAR_REGIONS			16	// write counts of a new store, one per equal part of its file, 0 creates stores without them
+											// they also make its allocation next-fit instead of best-fit, see PStorageWear.cpp
+#define PSTORAGE_WEAR_SAVE_WRITES		64	// counted writes before the counts are saved, a reset loses at most these
+#define PSTORAGE_CHECKPOINT_ENABLED		true	// P_INPLACE: new stores keep a checkpoint of the RAM index, so open() need not walk the chain
+#define PSTORAGE_STATS_BUCKETS			16	// of the latency histograms of PStorageStats, the last one counts all longer calls
+#ifndef PSTORAGE_TRACE_RECORDS
+#define PSTORAGE_TRACE_RECORDS			0	// records of the binary trace in RAM, 16 bytes each, 0 compiles the trace out, see PStorageTrace.cpp
+#endif
+#define PSTORAGE_DEFERRED_MAXKEYS		8	// names defer() takes, each costs sizeof(PStorageDeferred) bytes of heap once it is called
+
+#define PSTORAGE_FEATURE_LENGTH			1	// index entries record the unused bytes behind their value (slack)
+#define PSTORAGE_FEATURE_HASHED			2	// index entries hold the hash and length of their name, the name is stored behind the value
+#define PSTORAGE_FEATURE_PACKED			4	// index entries are encoded byte by byte in 10 to 16 bytes, see _encodeIndexEntry()
+#define PSTORAGE_FEATURE_SLABS			8	// scalars with short names are slots of P_SLAB entries, see PStorageSlab.cpp
+#define PSTORAGE_FEATURE_COMPRESSION	16	// P_ARRAY and P_STRING values may be stored compressed, see PStorageCompression.cpp
+#define PSTORAGE_FEATURE_WEAR			32	// the store keeps write counts and allocates next-fit, see PStorageWear.cpp
+#define PSTORAGE_FEATURE_CHECKPOINT		64	// the store keeps a checkpoint of the RAM index, see PStorageCheckpoint.cpp
+#define PSTORAGE_SLACK_MAX				0xFFFF	// fits PStorageIndexEntry.slack, larger entries are not reused for smaller values
+#define PSTORAGE_FILLER					' '	// content of the not yet written part of a store
+#define PSTORAGE_SLAB_VALUE_SIZE		4	// of a slab slot, P_LONG and P_ULONG are stored in 32 bits
+#define PSTORAGE_DEFERRED_VALUE_SIZE	8	// of a deferred value, larger ones are written as usual
+#define PSTORAGE_FILLER					' '	// content of the not yet written part of a store
 
 enum EntryType {
 	P_FREE = 0,
@@ -30,11 +103,79 @@ enum EntryType {
 	P_ULONG = 4,
 	P_FLOAT = 5,
 	P_ARRAY = 6,
-	P_STRING = 7
+	P_STRING = 7,
+	P_STRUCT = 8,  // P_STRUCT + n holds a value of the type with the PSTORAGE_TYPE_ID n
+	P_ARRAY_LZ = 0xFD,  // stores with PSTORAGE_FEATURE_COMPRESSION: a compressed P_ARRAY
+	P_STRING_LZ = 0xFE,  // a compressed P_STRING
+	P_SLAB = 0xFF,  // stores with PSTORAGE_FEATURE_SLABS: a page of scalars
+	// new stores reserve 0xFD to 0xFF, PSTORAGE_TYPE_ID 245 to 247 are not available there
+	P_STRUCT_MAX = 0xFFFF
+} ;
+
+/*
+ * PStorageType<T>::type is the EntryType map() and get() tag a value of type T with. Types without their own tag
+ * are P_STRUCT, give them an id with PSTORAGE_TYPE_ID if several of the same size are stored under one name.
+ */
+template<class T> struct PStorageType {
+	static const EntryType type = P_STRUCT;
+};
+#define PSTORAGE_TYPE(T, entryType) \
+	template<> struct PStorageType<T> { static const EntryType type = (entryType); };
+#define PSTORAGE_TYPE_ID(T, id)		PSTORAGE_TYPE(T, (EntryType) (P_STRUCT + (id)))
+PSTORAGE_TYPE(int, P_INT)
+PSTORAGE_TYPE(unsigned int, P_UINT)
+PSTORAGE_TYPE(float, P_FLOAT)
+
+#if defined(__GNUC__) && !defined(__clang__) && (__GNUC__ < 5)  // the libstdc++ of older ESP8266 cores lacks is_trivially_copyable
+#define PSTORAGE_TRIVIALLY_COPYABLE(T)	(__has_trivial_copy(T) && __has_trivial_destructor(T))
+#else
+#define PSTORAGE_TRIVIALLY_COPYABLE(T)	(std::is_trivially_copyable<T>::value)
+#endif
+// the templated map() and get() take values stored as their bytes, pointers and arrays have their own overloads
+#define PSTORAGE_IF_VALUE(T, R) \
+	typename std::enable_if<PSTORAGE_TRIVIALLY_COPYABLE(T) && !std::is_pointer<T>::value && !std::is_array<T>::value, R>::type
+
+/*
+ * P_INPLACE keeps every value at a fixed position and rewrites it there (chain of index entries).
+ * P_LOG appends every new version of a value to a circular log and reclaims dead versions by compaction,
+ * it needs all keys to fit into the RAM index (PSTORAGE_INDEX_CACHE_MAXENTRIES).
+ */
+enum PStorageEngine {
+	P_INPLACE = 0,
+	P_LOG = 1
 } ;
 
+enum PStorageTraceEvent {  // the numbers are part of the dump format, pstorage_trace names them
+	P_TRACE_MAP = 1,  // a call begins
+	P_TRACE_MAP_END = 2,  // micros it took
+	P_TRACE_GET = 3,
+	P_TRACE_GET_END = 4,
+	P_TRACE_REMOVE = 5,
+	P_TRACE_REMOVE_END = 6,
+	P_TRACE_OPEN = 7,  // fileSize, firstEntry, features
+	P_TRACE_CREATE = 8,  // size, 0, engine
+	P_TRACE_LOOKUP = 9,  // _nameHash(), 0, type
+	P_TRACE_HOP = 10,  // thisEntry, nextEntry, type of an index entry a lookup read
+	P_TRACE_READ = 11,  // position, length of a File read
+	P_TRACE_WRITE = 12,  // position, length of a File write
+	P_TRACE_FLUSH = 13,
+	P_TRACE_ALLOCATE = 14,  // thisEntry, nextEntry, type
+	P_TRACE_SPLIT = 15,  // thisEntry, nextEntry of the free rest
+	P_TRACE_FREE = 16,  // thisEntry, nextEntry
+	P_TRACE_MERGE = 17,  // thisEntry, nextEntry of the joined free entry
+	P_TRACE_ALLOCATION_FAILED = 18,  // minSize
+	P_TRACE_JOURNAL = 19,  // sequence, copyDone, count of images
+	P_TRACE_JOURNAL_APPLY = 20,  // thisEntry, nextEntry, recover
+	P_TRACE_EVENTS
+};
+
+/*
+ * PStorageIndexEntry is the RAM image of an index entry. Stores without PSTORAGE_FEATURE_PACKED hold it as is, packed
+ * ones without thisEntry and back pointer, with the offsets in 16 bits below 64 KB.
+ */
 struct PStorageIndexEntry {
-	char name[PSTORAGE_INDEX_NAME_MAXSIZE  + 1];  // one more for the \0
+	char name[PSTORAGE_INDEX_NAME_MAXSIZE  + 1];  // one more for the \0, with PSTORAGE_FEATURE_HASHED the hash and length of the name
+	unsigned short slack;  // allocated bytes behind the value, kept in the former padding with PSTORAGE_FEATURE_LENGTH
 	EntryType type;
 	unsigned int thisEntry; // file position
 	unsigned int previousEntry; // file position
@@ -42,32 +183,282 @@ struct PStorageIndexEntry {
 };
 
 /*
- * PStorageCtrlParams are written at the beginning of the index file
+ * PStorageFreeBlock is the RAM image of a free index entry, chained into the size class bins
+ */
+#define PSTORAGE_FREE_BLOCK_NONE	0xFF  // the end of a bin
+struct PStorageFreeBlock {
+	unsigned int thisEntry;
+	unsigned int previousEntry;
+	unsigned int nextEntry;
+	unsigned char nextInBin;  // pool index of the next block in the same bin
+};
+
+/*
+ * PStorageSlab is the RAM image of a slab page, a P_SLAB entry holding the scalars of one type: occupancy and the low
+ * byte of the _nameHash() of every slot, so a lookup reads only the slots of a matching name.
+ */
+struct PStorageSlab {
+	unsigned int entry;  // file position of the P_SLAB entry
+	unsigned int used;  // bit n is set if slot n holds a value
+	byte type;  // of all slots
+	byte slots;
+	byte keySize;
+	byte tags[PSTORAGE_SLAB_SLOTS];
+};
+
+/*
+ * PStorageJournal is the intent record of the latest chain update of P_INPLACE: the index entries it writes (at their
+ * thisEntry) and the value compact() moves. It is written before the update, so open() can complete an interrupted
+ * update by writing it again. Records alternate between two slots, a torn one fails its checksum and leaves the
+ * previous one valid.
+ */
+struct PStorageJournal {
+	unsigned int sequence;  // the valid record with the higher one is the latest
+	unsigned int count;  // of images
+	unsigned int copyFrom;  // file position of the moved value
+	unsigned int copyTo;
+	unsigned int copyLength;
+	unsigned int copyDone;  // bytes known to be copied
+	PStorageIndexEntry images[PSTORAGE_JOURNAL_IMAGES];
+	unsigned int checksum;
+};
+
+/*
+ * PStorageSortedRecord is one slot of the sorted index of P_INPLACE (see PStorageSortedIndex.cpp), the hash of the name
+ * of an allocated entry and its file position. Slots are ordered by both, unused ones are all 0xFF and sort last in
+ * their bucket.
+ */
+struct PStorageSortedRecord {
+	unsigned int hash;
+	unsigned int entry;
+};
+
+/*
+ * PStorageQueued is the header of a write in the write-behind queue (see PStorageQueue.cpp), followed by the name with
+ * its \0 and the value, padded to 4 bytes.
+ */
+struct PStorageQueued {
+	unsigned int sequence;  // of the first write it holds, later ones of the same name and type replace the value
+	unsigned int size;  // of the value
+	EntryType type;
+	byte nameSize;  // with the \0
+	boolean compress;
+	boolean applying;  // being written to the store, a later write gets a record of its own
+};
+
+/*
+ * PStorageDeferred is the RAM shadow of a deferred key (see PStorageDeferred.cpp), an empty name marks an unused one.
+ */
+struct PStorageDeferred {
+	char name[PSTORAGE_NAME_MAXSIZE + 1];
+	unsigned int maxUpdates;  // the pending value is written after this many, 0 for no limit
+	unsigned long maxMillis;  // or this long after its first update, 0 for no limit
+	EntryType type;  // of the pending value, P_FREE if there is none
+	unsigned int size;
+	byte value[PSTORAGE_DEFERRED_VALUE_SIZE];
+	unsigned int updates;  // not yet written
+	unsigned long since;  // millis() of the first of them
+	unsigned int sequence;  // counts the updates, tells a write whether one came in between
+};
+
+struct PStorageSortedHeader {
+	unsigned int magic;
+	unsigned int capacity;  // slots behind the header, 0 if the index was given up
+};
+
+/*
+ * PStorageCtrlParams are written at the beginning of the index file.
+ * Fields were added over time behind firstEntry, a store holds as many of them as its firstEntry leaves room for,
+ * missing ones read as 0.
  */
 struct PStorageParams {
 	unsigned int magicCookie;
 	unsigned int size;
 	unsigned int firstEntry; // file position of the first entry
+	PStorageEngine engine;
+	unsigned int logHead;  // P_LOG: file position of the oldest record
+	unsigned int logSequence;  // P_LOG: sequence number of the oldest record
+	PStorageJournal journal[2];  // P_INPLACE
+	unsigned int features;  // PSTORAGE_FEATURE_* the store was created with
+	unsigned int indexStart;  // P_INPLACE: file position of the sorted index, 0 if there is none
+	unsigned int wearStart;  // with PSTORAGE_FEATURE_WEAR: file position of the two copies of the write counts
+	unsigned int wearRegions;  // with PSTORAGE_FEATURE_WEAR: counts of each copy
+	unsigned int checkpointStart;  // with PSTORAGE_FEATURE_CHECKPOINT: file position of the checkpoint of the RAM index
+	unsigned int checkpointSize;  // with PSTORAGE_FEATURE_CHECKPOINT: bytes reserved for it
+};
+
+/*
+ * PStorageWearHeader starts a copy of the write counts (see PStorageWear.cpp), followed by the counts and the
+ * checksum of both.
+ */
+struct PStorageWearHeader {
+	unsigned int magic;
+	unsigned int sequence;  // the valid copy with the higher one is the latest
+	unsigned int cursor;  // P_INPLACE: next-fit allocation takes the first fitting free entry from here on
+	unsigned int regions;
+	unsigned int regionSize;  // bytes of the file per count
+};
+
+/*
+ * PStorageCheckpointHeader starts the checkpoint of the RAM index (see PStorageCheckpoint.cpp), followed by the images
+ * of the RAM index, the free blocks, the file positions of the slab pages and the checksum of all.
+ */
+struct PStorageCheckpointHeader {
+	unsigned int magic;
+	unsigned int generation;  // _journal.sequence of the chain it was taken of
+	unsigned int limits;  // the PSTORAGE_*_MAXENTRIES and PSTORAGE_SLAB_MAXPAGES it was taken with
+	unsigned int entries;  // PSTORAGE_CHECKPOINT_NONE for a part that was not held in RAM
+	unsigned int overflow;  // 1 if allocated entries did not fit the RAM index (_cacheOverflow)
+	unsigned int freeBlocks;
+	unsigned int slabs;
+};
+
+/*
+ * PStorageItem is one value of getMany() and mapMany(). value points to the size bytes of a fixed size value (4 bytes
+ * for P_LONG/P_ULONG), the array of a P_ARRAY or the buffer of a P_STRING. mapMany() stores a P_STRING up to its \0
+ * and ignores size. done tells whether the item was read or written.
+ */
+struct PStorageItem {
+	const char *name;
+	EntryType type;
+	void *value;
+	unsigned int size;
+	boolean done;
+};
+
+/*
+ * PStorageStats are the counters of a store since its construction or the last resetStats(), see PStorageStats.cpp.
+ * Bucket n of a latency histogram counts the calls that took 2^n to 2^(n+1) - 1 microseconds, bucket 0 those below 2.
+ */
+struct PStorageStats {
+	unsigned int lookups;  // searches of a name in the index
+	unsigned int chainHops;  // index entries these read, lookups served by the RAM index read none
+	unsigned int seeks;  // File reads and writes, each at a seek, reads through the mapping take none
+	unsigned int bytesRead;
+	unsigned int bytesWritten;
+	unsigned int flushes;
+	unsigned int allocations;
+	unsigned int splits;  // allocations that left the rest of the free entry free
+	unsigned int merges;  // free entries joined with a free neighbour
+	unsigned int allocationFailures;  // no free entry large enough
+	unsigned int writesAvoided;  // values replaced in RAM before they were written, deferred or queued
+	unsigned int mapMicros[PSTORAGE_STATS_BUCKETS];
+	unsigned int getMicros[PSTORAGE_STATS_BUCKETS];
+	unsigned int removeMicros[PSTORAGE_STATS_BUCKETS];
+};
+
+inline void _pStorageCount(unsigned int &counter, unsigned int n = 1) {  // shared readers count side by side
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	__atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+#else
+	counter += n;
+#endif
+}
+
+/*
+ * PStorageTraceRecord is one event of the trace, the dump is a PStorageTraceHeader followed by the records, oldest first.
+ */
+struct PStorageTraceRecord {
+	unsigned int micros;
+	unsigned short event;  // PStorageTraceEvent
+	unsigned short arg2;  // a type, engine, count or flag
+	unsigned int arg0;
+	unsigned int arg1;
 };
 
+#define PSTORAGE_TRACE_MAGIC			0x52545350  // "PSTR"
+
+struct PStorageTraceHeader {
+	unsigned int magic;  // PSTORAGE_TRACE_MAGIC
+	unsigned int recordSize;
+	unsigned int records;
+	unsigned int lost;  // overwritten before the dump
+};
+
+void _pStorageTrace(PStorageTraceEvent event, unsigned int arg0 = 0, unsigned int arg1 = 0, unsigned int arg2 = 0);
+
+#if(PSTORAGE_TRACE_RECORDS > 0)
+#define PSTORAGE_TRACE(...) _pStorageTrace(__VA_ARGS__)
+#else
+#define PSTORAGE_TRACE(...)
+#endif
+
+typedef boolean (*PStorageChunkCallback)(const byte *chunk, unsigned int size, unsigned int offset, void *context);  // false stops
+
 void _pStoragedebug(const char *format, ...);
 
+class PStorage;
+
+/*
+ * PStorageLock holds the lock of a store for one public call, see PStorageLock.cpp. Calls nested in one of the same
+ * task run under the outer lock. Without PSTORAGE_CONCURRENCY_ENABLED it does nothing.
+ */
+class PStorageLock {
+public:
+	PStorageLock(PStorage &storage, boolean shared);  // shared: the call only reads
+	~PStorageLock();
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+private:
+	friend class PStorage;
+	PStorage &_storage;
+	PStorageLock *_outer;  // the next lock held by the same task
+	boolean _nested;
+	boolean _shared;  // reads go to _position of the reader, not the one of the store
+	int _handle;  // of _readers, -1 if the mapping covers the file
+	unsigned int _position;
+#endif
+};
+
+#if(!PSTORAGE_CONCURRENCY_ENABLED)
+inline PStorageLock::PStorageLock(PStorage &, boolean) {}
+inline PStorageLock::~PStorageLock() {}
+#endif
+
+/*
+ * PStorageTimer adds the duration of a public call to a latency histogram of PStorageStats and traces its begin and
+ * end (event + 1).
+ */
+class PStorageTimer {
+public:
+	PStorageTimer(unsigned int histogram[], PStorageTraceEvent event) : _histogram(histogram), _event(event), _start(micros()) {
+		PSTORAGE_TRACE(event);
+	}
+	~PStorageTimer();
+private:
+	unsigned int *_histogram;
+	PStorageTraceEvent _event;
+	unsigned long _start;
+};
+
 class PStorage {
 public:
 	PStorage(const char *name);
 	virtual ~PStorage();
 
 	boolean open();
-	boolean create(unsigned int maxSize);
+	// lazy writes only the headers, the file grows on demand. keys > 0 gives a P_INPLACE store a sorted index for about
+	// that many keys, so lookups beyond the RAM index need no walk of the chain
+	boolean create(unsigned int maxSize, PStorageEngine engine = P_INPLACE, boolean lazy = false, unsigned int keys = 0);
 
 	boolean map(const char *name, int value);
 	boolean map(const char *name, unsigned int value);
 	boolean map(const char *name, long value);
 	boolean map(const char *name, unsigned long value);
 	boolean map(const char *name, float value);
-	boolean map(const char *name, byte b[], unsigned int size);
-	boolean map(const char *name, const char *str);
-
+	boolean map(const char *name, byte b[], unsigned int size, boolean compress = false);  // compress: if that saves space
+	boolean map(const char *name, const char *str, boolean compress = false);
+	template<class T> PSTORAGE_IF_VALUE(T, boolean) map(const char *name, const T &value) {  // one entry, one write
+		PStorageTimer timer(_stats.mapMicros, P_TRACE_MAP);
+		boolean result;
+		if (_deferredUpdate(name, PStorageType<T>::type, (const byte *) &value, sizeof(T), &result)) {
+			return result;
+		}
+		if (_queue != NULL) {
+			return _queuePush(name, PStorageType<T>::type, (const byte *) &value, sizeof(T), false);
+		}
+		PStorageLock lock(*this, false);
+		return _mapValue(name, PStorageType<T>::type, (const byte *) &value, sizeof(T));
+	}
 
 	boolean get(const char *name, int *value);
 	boolean get(const char *name, unsigned int *value);
@@ -76,35 +467,263 @@ public:
 	boolean get(const char *name, float *value);
 	boolean get(const char* name, byte buf[], unsigned int bufSize);
 	boolean get(const char* name, char* buf, unsigned int bufSize);
+	template<class T> PSTORAGE_IF_VALUE(T, boolean) get(const char *name, T *value) {  // fails unless sizeof(T) bytes are stored
+		PStorageTimer timer(_stats.getMicros, P_TRACE_GET);
+		boolean result;
+		if (_queueGet(name, PStorageType<T>::type, (byte *) value, sizeof(T), &result)) {
+			return result;
+		}
+		PStorageLock lock(*this, true);
+		return _getValue(name, PStorageType<T>::type, (byte *) value, sizeof(T));
+	}
+	// zero-copy view of the value of any type, needs PSTORAGE_MMAP_ENABLED, valid until the next map(), remove() or compact()
+	boolean getView(const char *name, const byte **data, unsigned int *size);
+
+	// partial access to P_ARRAY and P_STRING values, e.g. to patch or stream large ones through a small buffer
+	int read(const char *name, unsigned int offset, byte buf[], unsigned int size);  // bytes read, -1 on failure
+	boolean read(const char *name, PStorageChunkCallback callback, void *context);  // callback must not change the storage
+	boolean write(const char *name, unsigned int offset, const byte buf[], unsigned int size);  // creates a P_ARRAY, grows the value
+	boolean append(const char *name, const byte buf[], unsigned int size);
+	boolean getSize(const char *name, unsigned int *size);  // of the value, any type
 
 	boolean remove(const char *name);
 
+	// several values with one pass over the chain, true if all items are done
+	boolean getMany(PStorageItem items[], unsigned int count);
+	boolean mapMany(PStorageItem items[], unsigned int count);  // flushes once, missing values share one free space pass
+
+	void beginBatch();  // defers all flushes until the matching commit(), batches may be nested, other tasks see their writes
+	boolean commit();
+
+	boolean compact(unsigned long maxMillis);  // reclaims space for at most maxMillis, can be called from loop()
+
+	// write-behind: map() queues the value and returns, get() and getMany() see it, read() and getSize() once it is written
+	boolean beginWriteBehind(boolean task = false);  // task writes in the background (PSTORAGE_CONCURRENCY_ENABLED), otherwise poll()
+	boolean poll(unsigned long maxMillis);  // writes queued values for at most maxMillis, at least one, false if one failed
+	boolean sync();  // waits until the values queued and deferred before are written and saves the checkpoint, false if a write failed since the last sync()
+	boolean endWriteBehind();  // writes all queued values, call it before open() or create()
+
+	// deferred keys: map() of a scalar of the name updates RAM only until the limits are reached, poll() checks the time
+	boolean defer(const char *name, unsigned int maxUpdates, unsigned long maxMillis);  // 0 for no limit, call it in setup()
+	boolean undefer(const char *name);  // writes the pending value
+	unsigned long getWritesAvoided();  // PStorageStats.writesAvoided
+
 	unsigned int getAllocatedSize();
+	unsigned int getFragmentation(unsigned int *largestFree = NULL, unsigned int *totalFree = NULL);  // 0..100, 0 if all free space is one block
 	unsigned int getPStorageSize();
+	unsigned int getFileSize();  // the params and the sorted index in front of the first entry, the store and a migrated v1 store's sorted index behind it
+	// write counts per region of the file, to estimate the flash lifetime, 0 regions if the store keeps none
+	unsigned int getWearHistogram(unsigned int counts[], unsigned int maxRegions, unsigned int *regionSize = NULL);
+	void getStats(PStorageStats *stats);  // cheap, always counted
+	void resetStats();
+	static boolean dumpTrace(PStorageChunkCallback callback, void *context);  // false without PSTORAGE_TRACE_RECORDS
 	void dumpPStorage();
 
 private:
+	friend class PStorageLock;
+
 	boolean _readParams();
 	boolean _writeParams();
 
 	boolean _allocate(const char *name, unsigned int size, EntryType type, PStorageIndexEntry *ie);
+	boolean _allocateIn(const char *name, unsigned int size, EntryType type, PStorageIndexEntry *ie);  // in the free entry ie
 	boolean _free(PStorageIndexEntry *ie);
+	boolean _mapValue(const char *name, EntryType type, const byte *buf, unsigned int size);
+	boolean _mapArray(const char *name, const byte *buf, unsigned int size, boolean compress);
+	boolean _mapString(const char *name, const char *str, boolean compress);
+	boolean _getValue(const char *name, EntryType type, byte *buf, unsigned int size);
+	boolean _resolveMany(PStorageItem items[], unsigned int count, PStorageIndexEntry *entries,
+			PStorageIndexEntry *candidates, unsigned int *candidateCount);
+	boolean _allocateMany(const char *name, unsigned int size, EntryType type, PStorageIndexEntry *candidates,
+			unsigned int *candidateCount, PStorageIndexEntry *ie);
+	boolean _readItem(PStorageItem &item, PStorageIndexEntry ie);
+	boolean _mapItem(PStorageItem &item);
+	boolean _compactStep(boolean *done);
+
+	void _sortedPlan(unsigned int keys);  // places the sorted index of a new store in front of its first entry
+	void _wearPlan();  // places the write counts of a new store in front of its first entry
+	boolean _wearFormat();
+	boolean _wearLoad();
+	boolean _wearSave();
+	void _wearCount(unsigned int position, unsigned int length);  // a write to the file
+	void _wearDrop();
+	unsigned int _wearCopySize();
+	unsigned int _wearChecksum(const PStorageWearHeader &header, const unsigned int *counts);
+	unsigned int _wearDistance(unsigned int entry);
+	void _checkpointPlan();  // places the checkpoint of a new store in front of its first entry
+	boolean _checkpointLoad();
+	boolean _checkpointSave();
+	unsigned int _checkpointLength(const PStorageCheckpointHeader &header);
+	boolean _sortedFormat();
+	boolean _sortedLoad();
+	boolean _sortedCheck();  // builds a stale index again
+	boolean _sortedInvalidate();
+	boolean _sortedMigrate();  // of a v1 store
+	boolean _sortedBuild(unsigned int start, unsigned int capacity);
+	boolean _sortedApply();
+	boolean _sortedSearch(EntryType type, const char *name, PStorageIndexEntry *ie);  // type P_FREE matches any type
+	boolean _sortedMatch(unsigned int entry, EntryType type, const char *name, PStorageIndexEntry *ie);
+	boolean _sortedInsert(PStorageSortedRecord key);
+	boolean _sortedRemove(const PStorageSortedRecord key);
+	boolean _sortedFind(const PStorageSortedRecord key, unsigned int *slot);  // the first slot not less than key
+	boolean _sortedBound(unsigned int bucket, const PStorageSortedRecord key, unsigned int *slot);  // within the bucket
+	unsigned int _sortedHome(unsigned int hash);  // the bucket of the hash range
+	boolean _sortedRead(unsigned int slot, PStorageSortedRecord *record);
+	boolean _sortedWrite(unsigned int slot, const PStorageSortedRecord record);
+	boolean _sortedClear(unsigned int from, unsigned int to);
+	boolean _sortedDrop();
+	unsigned int _sortedSlot(unsigned int slot);  // file position
+	unsigned int _sortedSlots(unsigned int keys);  // the capacity planned for keys
+	PStorageSortedRecord _sortedRecord(const PStorageIndexEntry ie);  // an unused slot without a name
+	unsigned int _sortedHash(unsigned int hash);
+	void _sortedReset();  // no changes noted
+
+	boolean _journaled();
+	void _journalBegin();
+	boolean _journalAdd(const PStorageIndexEntry ie);
+	boolean _journalPatchPrevious(unsigned int entry, unsigned int previousEntry);
+	boolean _journalCommit();  // writes the record, then copies and writes the images
+	boolean _journalWrite();
+	boolean _journalCopy();
+	boolean _journalApply(boolean recover);
+	boolean _journalRecover();
+	unsigned int _journalChecksum(const PStorageJournal &journal);
 
 	boolean _isFirstIndexEntry(PStorageIndexEntry ie);
 	boolean _isLastIndexEntry(PStorageIndexEntry ie);
-	unsigned int _size(PStorageIndexEntry ie);
+	unsigned int _size(PStorageIndexEntry ie);  // allocated for the value, without a name stored behind it
+	unsigned int _length(PStorageIndexEntry ie);  // of the value, _size() without the slack
+	boolean _setLength(PStorageIndexEntry *ie, unsigned int length);
+	boolean _holds(PStorageIndexEntry ie, unsigned int size);  // a fixed size value of size bytes
+	boolean _rewriteIndexEntry(const PStorageIndexEntry ie);
+	boolean _copyBytes(unsigned int from, unsigned int to, unsigned int length);
+	void _setName(PStorageIndexEntry *ie, const char *name);  // zero padded, so equal stores are byte-identical
+	boolean _writeName(const PStorageIndexEntry ie, const char *name);  // behind the value, once ie has its name
+	boolean _readName(const PStorageIndexEntry ie, char *name);  // name holds PSTORAGE_NAME_MAXSIZE + 1 bytes
+	boolean _nameMatches(const PStorageIndexEntry ie, const char *name, unsigned int hash);  // hash: _nameHash(name)
+	boolean _sameName(const PStorageIndexEntry a, const PStorageIndexEntry b);
+	boolean _hashed();
+	unsigned int _nameHash(const char *name);
+	unsigned int _entryHash(const PStorageIndexEntry ie);  // _nameHash() of its name
+	unsigned int _nameLength(const PStorageIndexEntry ie);
+	unsigned int _nameSize(const char *name);  // bytes the name takes behind the value
+	unsigned int _nameMaxSize();
 
 	boolean _readFirstIndexEntry(PStorageIndexEntry *ie);
 	boolean _readIndexEntry(PStorageIndexEntry *ie);  // from the current file position
 	boolean _writeIndexEntry(const PStorageIndexEntry ie);  // to the current file position
+	boolean _putIndexEntry(const PStorageIndexEntry ie);  // _writeIndexEntry() without the flush
+	boolean _searchFreePredecessor(const PStorageIndexEntry ie, PStorageIndexEntry *previousIE, boolean *found);
+	unsigned int _encodeIndexEntry(const PStorageIndexEntry ie, byte *buf);  // returns _headerSize()
+	void _decodeIndexEntry(const byte *buf, unsigned int position, PStorageIndexEntry *ie);
+	unsigned int _headerSize();  // of an index entry on disk
+	boolean _packed();
+	boolean _typeFits(EntryType type);
 
 	boolean _searchIndexEntry(EntryType type, const char *name, PStorageIndexEntry *ie);
 	boolean _searchIndexEntry(const char *name, PStorageIndexEntry *ie);
 	boolean _searchFreeIndexEntry(unsigned int minSize, PStorageIndexEntry *ie);
+	boolean _allocationFailed(unsigned int minSize);
+	boolean _searchValue(const char *name, unsigned int *start, unsigned int *length, EntryType *type);  // of any type, also in a slab
 
 	boolean _writeEntry(const PStorageIndexEntry ie, byte* buf, unsigned int maxBytes);
 	int _readEntry(const PStorageIndexEntry ie, byte* buf, unsigned int maxBytes);
 
+	void _resetIOBuffer();
+	boolean _writeBackIOBuffer();
+	boolean _fillIOBuffer(unsigned int position);
+	boolean _seek(unsigned int position);
+	boolean _read(byte *buf, unsigned int size);  // from the current position
+	boolean _write(const byte *buf, unsigned int size);  // to the current position
+	boolean _flush();
+	boolean _extendFile(unsigned int position);  // fills the file up to position
+	boolean _mapFile(unsigned int length);  // maps at least length bytes
+	void _unmapFile();
+	unsigned int _tell();  // current file position
+
+	PStorageLock *_reader();  // the shared lock of the calling task, NULL if it reads through _position
+	boolean _readShared(PStorageLock *reader, byte *buf, unsigned int size);
+	int _readerAcquire();  // waits for a free handle of _readers, -1 if the file cannot be opened
+	void _readerRelease(int handle);
+	void _readerClose();
+
+	boolean _queuePush(const char *name, EntryType type, const byte *buf, unsigned int size, boolean compress);
+	boolean _queueInsert(const char *name, EntryType type, const byte *buf, unsigned int size, boolean compress);
+	void _queueWait();  // until the full queue has room
+	boolean _queueGet(const char *name, EntryType type, byte *buf, unsigned int size, boolean *result);  // true if deferred or queued
+	PStorageQueued *_queueFind(const char *name, EntryType type, boolean writable);  // the latest, writable: not applying
+	boolean _queueApply(unsigned int count, unsigned long maxMillis);  // at least one, false if one failed
+	boolean _queueApplyFirst(boolean *written);  // the caller holds the lock, false if the queue is empty
+	void _queueDrain();
+	void _queueDrop(const char *name, EntryType type);  // also deferred ones, type P_FREE drops all types, the caller holds the lock
+	void _queueRemove(PStorageQueued *record);
+	boolean _queueWrite(const char *name, EntryType type, const byte *value, unsigned int size, boolean compress);
+	unsigned int _queueLength(const PStorageQueued *record);  // of the record in the queue
+	void _queueLock();
+	void _queueUnlock();
+	void _queueRun();  // of the task
+	static void *_queueTask(void *storage);
+
+	boolean _deferredUpdate(const char *name, EntryType type, const byte *buf, unsigned int size, boolean *result);  // true if deferred
+	PStorageDeferred *_deferredFind(const char *name);  // the caller holds the mutex of the queue
+	boolean _deferredWrite(PStorageDeferred *key);
+	boolean _deferredDue(boolean all);  // writes the pending values past maxMillis, all of them if all
+
+	boolean _logMap(const char *name, EntryType type, byte *buf, unsigned int size);
+	boolean _logRemove(const char *name);
+	boolean _logAppend(const char *name, EntryType type, const byte *buf, unsigned int size, PStorageIndexEntry *ie,
+			boolean patch = false, unsigned int offset = 0, unsigned int length = 0);
+	boolean _logReserve(unsigned int length, boolean compact);
+	boolean _logCompactStep();
+	boolean _logCompact(unsigned long maxMillis);
+	boolean _logPersistHead();
+	boolean _logRecover();
+	boolean _logIndex(const PStorageIndexEntry ie);
+	unsigned int _logDistance(unsigned int from, unsigned int to);
+	unsigned int _logFree();
+	unsigned int _logEnd();
+
+	boolean _typeMatches(EntryType type, EntryType stored);  // a compressed value matches its plain type
+	boolean _compressed(EntryType type);
+	boolean _mapCompressed(const char *name, EntryType type, const byte *buf, unsigned int size, unsigned int packed);
+	boolean _lzPacked(const byte *buf, unsigned int size, unsigned int *packed);  // true if compression saves space
+	boolean _lzCompress(const byte *buf, unsigned int size, boolean write, unsigned int *packed);  // write: to the current position
+	int _lzDecode(unsigned int start, unsigned int length, unsigned int offset, byte *buf, unsigned int size,
+			PStorageChunkCallback callback, void *context);  // bytes decoded from offset on, -1 on failure
+	boolean _lzLength(unsigned int start, unsigned int *length);  // of the decoded value
+
+	boolean _slabbed(EntryType type, unsigned int size);  // a value that is looked up in the slabs
+	boolean _slabSearch(EntryType type, const char *name, PStorageSlab *page, unsigned int *slot);  // type P_FREE matches any type
+	boolean _slabFind(const PStorageSlab &page, EntryType type, const char *name, unsigned int hash, unsigned int *slot);
+	boolean _slabGet(EntryType type, const char *name, byte *buf, unsigned int size);
+	boolean _slabWrite(const PStorageSlab &page, unsigned int slot, const byte *buf);
+	boolean _slabInsert(EntryType type, const char *name, const byte *buf);
+	boolean _slabCreate(EntryType type, const char *name, const byte *buf);
+	boolean _slabErase(const PStorageSlab &page, unsigned int slot);
+	boolean _slabClear(const char *name);  // all types
+	boolean _slabRead(const PStorageIndexEntry ie, PStorageSlab *page);
+	unsigned int _slabSlot(const PStorageSlab &page, unsigned int slot);  // file position
+	unsigned int _slabSize(unsigned int slots, unsigned int keySize);  // of the value of a P_SLAB entry
+	void _slabTrack(const PStorageSlab &page);
+	void _slabUntrack(unsigned int entry);
+	void _slabMoved(unsigned int from, unsigned int to);
+	void _slabDrop();  // lookups walk the chain then
+
+	boolean _buildIndexCache();
+	boolean _freeOrphans();
+	boolean _orphaned(const PStorageIndexEntry ie);  // nameless, left by an interrupted move of write()
+	void _freeIndexCache();
+	boolean _cacheSearch(EntryType type, const char *name, PStorageIndexEntry *ie);  // type P_FREE matches any type
+	void _cacheUpdate(const PStorageIndexEntry ie);
+	void _cacheRemove(unsigned int thisEntry);
+
+	unsigned int _bin(unsigned int size);
+	void _binInsert(const PStorageIndexEntry ie);
+	void _binRemove(unsigned int thisEntry);
+	boolean _binSearch(unsigned int minSize, PStorageIndexEntry *ie);
+	unsigned char _binFind(unsigned int thisEntry);
+	unsigned char _binFindPredecessor(unsigned int thisEntry);  // the free block ending at thisEntry
+
 	const char* _getStorageFileName();
 
 	String _printType(EntryType type);
@@ -116,6 +735,7 @@ private:
 	void _printFloat(PStorageIndexEntry ie);
 	void _printString(PStorageIndexEntry ie);
 	void _printArray(PStorageIndexEntry ie);
+	void _printSlab(PStorageIndexEntry ie);
 	void _printDefault();
 	void _printEntry(PStorageIndexEntry ie);
 
@@ -123,6 +743,87 @@ private:
 	char _storageFileName[SPIFFS_OBJ_NAME_LEN];
 	File _storageFile;
 	PStorageParams _params;
+
+	byte _ioBuffer[PSTORAGE_IO_BUFFER_SIZE];
+	unsigned int _ioBufferStart;  // file position of _ioBuffer[0]
+	unsigned int _ioBufferLength;  // valid bytes in _ioBuffer
+	unsigned int _ioDirtyStart, _ioDirtyEnd;  // range of _ioBuffer to be written back
+	unsigned int _position;  // current file position
+	unsigned int _fileSize;  // bytes in the file, a lazy store is shorter than its size
+#if(PSTORAGE_MMAP_ENABLED)
+	const byte *_map;  // read-only mapping of the file, NULL if not mapped
+	unsigned int _mapLength;
+#endif
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_rwlock_t _lock;
+	pthread_mutex_t _writerGate;  // held by a writer until it has the lock, so readers cannot starve it
+	std::atomic<unsigned int> _writersWaiting;
+	File _readers[PSTORAGE_READER_HANDLES];  // read-only handles of concurrent readers, opened on demand
+	unsigned int _readerSizes[PSTORAGE_READER_HANDLES];  // _fileSize when the handle was opened
+	byte _readerPages[PSTORAGE_READER_HANDLES][PSTORAGE_IO_BUFFER_SIZE];  // page buffer of each handle, valid for one call
+	unsigned int _readerPageStarts[PSTORAGE_READER_HANDLES];
+	boolean _readerPageValid[PSTORAGE_READER_HANDLES];
+	std::atomic<bool> _readerBusy[PSTORAGE_READER_HANDLES];  // the reader holding it may also reopen it
+#endif
+
+	unsigned int _batchDepth;
+	boolean _flushPending;
+	PStorageStats _stats;
+
+	byte *_queue;  // the write-behind queue of PSTORAGE_QUEUE_SIZE bytes, NULL without write-behind
+	unsigned int _queueUsed;  // bytes of the records from _queue on
+	unsigned int _queueSequence;  // of the latest write
+	boolean _queueFailed;  // since the last sync()
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_mutex_t _queueMutex;  // guards the records, taken after the lock of the store
+	pthread_cond_t _queueChanged;  // a record was added or removed
+	pthread_t _queueThread;
+	boolean _queueStarted, _queueStop;
+#endif
+	PStorageDeferred *_deferred;  // PSTORAGE_DEFERRED_MAXKEYS shadows, NULL until defer() is called
+
+	unsigned int _compactCursor;  // P_INPLACE, all entries before are allocated
+	PStorageJournal _journal;  // P_INPLACE, the record of the running chain update
+	unsigned int _sortedStart, _sortedCapacity;  // P_INPLACE, the sorted index, capacity 0 if there is none
+	PStorageSortedRecord _sortedAdded, _sortedRemoved;  // P_INPLACE, the changes of the running chain update
+	PStorageWearHeader _wear;  // the latest copy of the write counts
+	unsigned int *_wearCounts;  // _wear.regions counts, NULL if the store keeps none
+	unsigned int _wearUnsaved;  // counted writes since the last save
+	unsigned int _checkpointGeneration;  // of the checkpoint in the file
+	boolean _checkpointValid;  // the checkpoint in the file matches _checkpointGeneration
+
+	unsigned int _logHead, _logHeadSequence;  // P_LOG, may be ahead of the persisted _params.logHead
+	unsigned int _logTail, _logSequence;  // P_LOG, position and sequence number of the next record
+
+	PStorageIndexEntry *_cache;  // allocated entries only, NULL if the RAM index is disabled or invalid
+	unsigned int _cacheCount;
+	unsigned int _cacheCapacity;
+	boolean _cacheOverflow;  // some allocated entries did not fit, a miss in _cache has to walk the chain
+
+	PStorageSlab *_slabs;  // P_INPLACE, the slab pages
+	unsigned int _slabCount;
+	unsigned int _slabCapacity;
+	boolean _slabsTracked;  // _slabs holds all slab pages, otherwise lookups walk the chain
+
+	PStorageFreeBlock *_freeBlocks;  // pool of PSTORAGE_FREE_BLOCKS_MAXENTRIES, NULL if the free bins are disabled or invalid
+	unsigned char _freeBins[PSTORAGE_FREE_BINS];  // first pool index of each bin
+	unsigned char _unusedFreeBlocks;  // first unused pool index
+};
+
+/*
+ * PStorageBatch runs a batch for its lifetime, e.g.
+ * 	{
+ * 		PStorageBatch batch(storage);
+ * 		storage.map("c1", 1);
+ * 		storage.map("c2", 2);
+ * 	}  // flushed once here
+ */
+class PStorageBatch {
+public:
+	PStorageBatch(PStorage &storage);
+	virtual ~PStorageBatch();
+private:
+	PStorage &_storage;
 };
 
 #if(PSTORAGE_DEBUG_ENABLED)
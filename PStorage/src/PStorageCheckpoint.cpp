@@ -0,0 +1,199 @@
+/*
+ * PStorageCheckpoint.cpp
+ *
+ *  Checkpoint of the RAM index of P_INPLACE stores created with PSTORAGE_FEATURE_CHECKPOINT, so a cold open() need
+ *  not walk the chain: the images of the RAM index (name hash, positions, slack and type of each allocated entry),
+ *  the free blocks of the bins and the file positions of the slab pages, in front of the first entry
+ *  (_params.checkpointStart), read by open() with one sequential read.
+ *
+ *  Its generation is the sequence number of the journal record of the chain it was taken of. Every chain update
+ *  writes a journal record with the next one, so a checkpoint is stale as soon as the chain changes, without a
+ *  write to mark it. open() takes it only if its generation is the one of the latest journal record (after a
+ *  repeated update), its checksum matches and it was taken with the same RAM limits, otherwise it walks the chain
+ *  and saves a new one. sync(), the destructor and such walks save it if the chain changed since. A torn save fails
+ *  its checksum. The occupancy of slab pages changes without chain updates, open() reads the pages again.
+ *
+ *  Parts that were not held in RAM (exhausted, out of memory) are recorded as such and not held after open() either,
+ *  lookups then take the sorted index or walk the chain like before. So is a RAM index that could not hold all
+ *  allocated entries, its misses walk the chain after open() too. Stores without the journal are not
+ *  checkpointed, their changes would not show in the generation.
+ */
+
+#include "PStorage.h"
+
+#define PSTORAGE_CHECKPOINT_MAGIC		0x504B4843  // "CHKP"
+#define PSTORAGE_CHECKPOINT_NONE		0xFFFFFFFF
+#define PSTORAGE_CHECKPOINT_LIMITS		(PSTORAGE_INDEX_CACHE_MAXENTRIES * 65536 + PSTORAGE_FREE_BLOCKS_MAXENTRIES * 256 + PSTORAGE_SLAB_MAXPAGES)
+
+static unsigned int _checkpointMaxSize() {  // with the checksum, for the limits of this build
+	return sizeof(PStorageCheckpointHeader) + PSTORAGE_INDEX_CACHE_MAXENTRIES * sizeof(PStorageIndexEntry) +
+			PSTORAGE_FREE_BLOCKS_MAXENTRIES * sizeof(PStorageFreeBlock) + PSTORAGE_SLAB_MAXPAGES * sizeof(unsigned int) + sizeof(unsigned int);
+}
+
+static unsigned int _checkpointChecksum(const byte *bytes, unsigned int length) {  // FNV-1a
+	unsigned int hash = 2166136261U;
+	for (unsigned int i = 0; i < length; i++) {
+		hash = (hash ^ bytes[i]) * 16777619U;
+	}
+	return hash;
+}
+
+void PStorage::_checkpointPlan() {
+	PSTORAGE_DEBUG("_checkpointPlan(): Called");
+
+#if(PSTORAGE_CHECKPOINT_ENABLED && PSTORAGE_JOURNAL_ENABLED)
+	if (_params.engine != P_INPLACE) {
+		return;
+	}
+	const unsigned int page = PSTORAGE_IO_BUFFER_SIZE;
+	_params.checkpointStart = _params.firstEntry;
+	_params.checkpointSize = _checkpointMaxSize();
+	_params.firstEntry = (_params.checkpointStart + _params.checkpointSize + page - 1) / page * page;
+	_params.features |= PSTORAGE_FEATURE_CHECKPOINT;
+#endif
+}
+
+/*
+ * Called by _buildIndexCache() with the empty RAM index, free bins and slab pages, true if they are taken from the
+ * checkpoint.
+ */
+boolean PStorage::_checkpointLoad() {
+	PSTORAGE_DEBUG("_checkpointLoad(): Called");
+
+	_checkpointValid = false;
+	if (!(_params.features & PSTORAGE_FEATURE_CHECKPOINT) || !_journaled()) {
+		return false;
+	}
+	byte *buf = (byte *) malloc(_params.checkpointSize);
+	if ((buf == NULL) || !_seek(_params.checkpointStart) || !_read(buf, _params.checkpointSize)) {
+		PSTORAGE_DEBUG("_checkpointLoad(): Could not read %d bytes at %d", _params.checkpointSize, _params.checkpointStart);
+		free(buf);
+		return false;
+	}
+	const PStorageCheckpointHeader &header = *(const PStorageCheckpointHeader *) buf;
+	boolean valid = (header.magic == PSTORAGE_CHECKPOINT_MAGIC) && (header.generation == _journal.sequence) &&
+			(header.limits == PSTORAGE_CHECKPOINT_LIMITS) &&
+			((header.entries <= PSTORAGE_INDEX_CACHE_MAXENTRIES) || (header.entries == PSTORAGE_CHECKPOINT_NONE)) &&
+			((header.freeBlocks <= PSTORAGE_FREE_BLOCKS_MAXENTRIES) || (header.freeBlocks == PSTORAGE_CHECKPOINT_NONE)) &&
+			((header.slabs <= PSTORAGE_SLAB_MAXPAGES) || (header.slabs == PSTORAGE_CHECKPOINT_NONE));
+	const unsigned int length = valid ? _checkpointLength(header) : 0;
+	unsigned int checksum;
+	valid = valid && (length + sizeof(checksum) <= _params.checkpointSize);
+	if (valid) {
+		memcpy(&checksum, buf + length, sizeof(checksum));
+		valid = (checksum == _checkpointChecksum(buf, length));
+	}
+	if (!valid) {
+		PSTORAGE_DEBUG("_checkpointLoad(): Stale or invalid checkpoint, walking the chain");
+		free(buf);
+		return false;
+	}
+	const PStorageIndexEntry *entries = (const PStorageIndexEntry *) (buf + sizeof(PStorageCheckpointHeader));
+	const unsigned int entryCount = (header.entries == PSTORAGE_CHECKPOINT_NONE) ? 0 : header.entries;
+	const PStorageFreeBlock *blocks = (const PStorageFreeBlock *) (entries + entryCount);
+	const unsigned int blockCount = (header.freeBlocks == PSTORAGE_CHECKPOINT_NONE) ? 0 : header.freeBlocks;
+	const unsigned int *slabs = (const unsigned int *) (blocks + blockCount);
+	if (header.entries == PSTORAGE_CHECKPOINT_NONE) {
+		free(_cache);
+		_cache = NULL;
+		_cacheCapacity = 0;
+	}
+	for (unsigned int i = 0; i < entryCount; i++) {
+		_cacheUpdate(entries[i]);
+	}
+	_cacheOverflow = _cacheOverflow || (header.overflow != 0);
+	if (header.freeBlocks == PSTORAGE_CHECKPOINT_NONE) {
+		free(_freeBlocks);
+		_freeBlocks = NULL;
+	}
+	for (unsigned int i = 0; i < blockCount; i++) {
+		PStorageIndexEntry ie;
+		_setName(&ie, "");  // the size of a free entry has no name in it
+		ie.thisEntry = blocks[i].thisEntry;
+		ie.previousEntry = blocks[i].previousEntry;
+		ie.nextEntry = blocks[i].nextEntry;
+		_binInsert(ie);
+	}
+	if (header.slabs == PSTORAGE_CHECKPOINT_NONE) {
+		_slabDrop();
+	}
+	for (unsigned int i = 0; (header.slabs != PSTORAGE_CHECKPOINT_NONE) && (i < header.slabs); i++) {
+		PStorageIndexEntry ie;
+		PStorageSlab page;
+		if (_seek(slabs[i]) && _readIndexEntry(&ie) && _slabRead(ie, &page)) {
+			_slabTrack(page);
+		}
+		else {
+			_slabDrop();
+		}
+	}
+	_checkpointGeneration = header.generation;
+	_checkpointValid = true;
+	free(buf);
+	return true;
+}
+
+/*
+ * Writes the checkpoint unless the one in the file is still valid, _position is kept. A store of which neither the
+ * RAM index nor the free bins are held keeps the stale one, so the next open() walks again, as does a store created
+ * by a build with lower limits, its area may be too small.
+ */
+boolean PStorage::_checkpointSave() {
+	if (((_cache == NULL) && (_freeBlocks == NULL)) || !(_params.features & PSTORAGE_FEATURE_CHECKPOINT) || !_journaled() ||
+			(_batchDepth > 0) || (_checkpointValid && (_checkpointGeneration == _journal.sequence)) ||
+			(_params.checkpointSize < _checkpointMaxSize())) {
+		return true;
+	}
+	PSTORAGE_DEBUG("_checkpointSave(): Called");
+
+	byte *buf = (byte *) malloc(_params.checkpointSize);
+	if (buf == NULL) {
+		PSTORAGE_DEBUG("_checkpointSave(): Could not allocate %d bytes", _params.checkpointSize);
+		return false;
+	}
+	PStorageCheckpointHeader &header = *(PStorageCheckpointHeader *) buf;
+	header.magic = PSTORAGE_CHECKPOINT_MAGIC;
+	header.generation = _journal.sequence;
+	header.limits = PSTORAGE_CHECKPOINT_LIMITS;
+	header.entries = (_cache != NULL) ? _cacheCount : PSTORAGE_CHECKPOINT_NONE;
+	header.overflow = ((_cache != NULL) && _cacheOverflow) ? 1 : 0;
+	PStorageIndexEntry *entries = (PStorageIndexEntry *) (buf + sizeof(PStorageCheckpointHeader));
+	for (unsigned int i = 0; (_cache != NULL) && (i < _cacheCount); i++) {
+		entries[i] = _cache[i];
+	}
+	PStorageFreeBlock *blocks = (PStorageFreeBlock *) (entries + ((_cache != NULL) ? _cacheCount : 0));
+	header.freeBlocks = (_freeBlocks != NULL) ? 0 : PSTORAGE_CHECKPOINT_NONE;
+	for (unsigned int bin = 0; (_freeBlocks != NULL) && (bin < PSTORAGE_FREE_BINS); bin++) {
+		for (unsigned char i = _freeBins[bin]; i != PSTORAGE_FREE_BLOCK_NONE; i = _freeBlocks[i].nextInBin) {
+			blocks[header.freeBlocks++] = _freeBlocks[i];
+		}
+	}
+	unsigned int *slabs = (unsigned int *) (blocks + ((_freeBlocks != NULL) ? header.freeBlocks : 0));
+	header.slabs = _slabsTracked ? _slabCount : PSTORAGE_CHECKPOINT_NONE;
+	for (unsigned int i = 0; _slabsTracked && (i < _slabCount); i++) {
+		slabs[i] = _slabs[i].entry;
+	}
+	const unsigned int length = _checkpointLength(header), checksum = _checkpointChecksum(buf, length);
+	memcpy(buf + length, &checksum, sizeof(checksum));
+	const unsigned int position = _position;
+	const boolean result = _seek(_params.checkpointStart) && _write(buf, length + sizeof(checksum)) && _writeBackIOBuffer();
+	_position = position;
+	free(buf);
+	if (!result) {
+		PSTORAGE_DEBUG("_checkpointSave(): Could not write the checkpoint at %d", _params.checkpointStart);
+		return false;
+	}
+	_storageFile.flush();
+	_pStorageCount(_stats.flushes);
+	PSTORAGE_TRACE(P_TRACE_FLUSH);
+	_checkpointGeneration = _journal.sequence;
+	_checkpointValid = true;
+	return true;
+}
+
+unsigned int PStorage::_checkpointLength(const PStorageCheckpointHeader &header) {  // without the checksum
+	return sizeof(PStorageCheckpointHeader) +
+			((header.entries == PSTORAGE_CHECKPOINT_NONE) ? 0 : header.entries * sizeof(PStorageIndexEntry)) +
+			((header.freeBlocks == PSTORAGE_CHECKPOINT_NONE) ? 0 : header.freeBlocks * sizeof(PStorageFreeBlock)) +
+			((header.slabs == PSTORAGE_CHECKPOINT_NONE) ? 0 : header.slabs * sizeof(unsigned int));
+}
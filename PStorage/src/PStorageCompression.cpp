@@ -0,0 +1,244 @@
+/*
+ * PStorageCompression.cpp
+ *
+ *  Compressed P_ARRAY and P_STRING values of P_INPLACE stores with PSTORAGE_FEATURE_COMPRESSION: map() with compress
+ *  set stores the value as P_ARRAY_LZ or P_STRING_LZ if that takes fewer bytes, a string with its \0. Lookups of the
+ *  plain type find these entries and get() and read() decode them, getSize() returns the decoded length. P_LOG
+ *  stores values as they are.
+ *
+ *  The value is the decoded length (4 bytes, little endian), then groups of a flag byte and up to 8 tokens, the
+ *  lowest bit of the flags for the first token:
+ *
+ *  	literal		0		the byte
+ *  	match		1		(distance - 1) & 0xFF, ((distance - 1) >> 8) << 6 | (length - PSTORAGE_LZ_MIN_MATCH)
+ *
+ *  A match repeats length bytes (3 to 66) from distance bytes back (1 to PSTORAGE_LZ_WINDOW). The compressor finds
+ *  matches with a table of the last position of each hash of 3 bytes on the stack (512 bytes), the value is
+ *  compressed twice, once to count the bytes and once into the allocated entry. A decoder into a buffer from the
+ *  start uses that buffer as the history, read() at an offset or with a callback keeps the last
+ *  PSTORAGE_LZ_WINDOW bytes in a ring on the heap.
+ */
+
+#include "PStorage.h"
+
+#define PSTORAGE_LZ_HEADER			4  // the decoded length
+#define PSTORAGE_LZ_WINDOW			1024  // largest distance of a match, a power of 2
+#define PSTORAGE_LZ_MIN_MATCH		3
+#define PSTORAGE_LZ_MAX_MATCH		(PSTORAGE_LZ_MIN_MATCH + 63)
+#define PSTORAGE_LZ_HASH_BITS		8
+
+static unsigned int _lzHash(const byte *buf) {
+	const uint32_t bytes = ((uint32_t) buf[0] << 16) | ((uint32_t) buf[1] << 8) | buf[2];
+	return (uint32_t) (bytes * 2654435761U) >> (32 - PSTORAGE_LZ_HASH_BITS);
+}
+
+boolean PStorage::_typeMatches(EntryType type, EntryType stored) {
+	if (_compressed(stored)) {
+		return type == ((stored == P_ARRAY_LZ) ? P_ARRAY : P_STRING);
+	}
+	return type == stored;
+}
+
+boolean PStorage::_compressed(EntryType type) {
+	return (_params.features & PSTORAGE_FEATURE_COMPRESSION) && ((type == P_ARRAY_LZ) || (type == P_STRING_LZ));
+}
+
+boolean PStorage::_lzPacked(const byte *buf, unsigned int size, unsigned int *packed) {
+	if (!(_params.features & PSTORAGE_FEATURE_COMPRESSION) || (_params.engine != P_INPLACE)) {
+		return false;
+	}
+	return _lzCompress(buf, size, false, packed) && (*packed < size);
+}
+
+/*
+ * Stores buf, a value of type P_ARRAY or P_STRING, compressed into packed bytes, see _lzPacked().
+ */
+boolean PStorage::_mapCompressed(const char *name, EntryType type, const byte *buf, unsigned int size, unsigned int packed) {
+	PSTORAGE_DEBUG("_mapCompressed(): Called");
+
+	const EntryType packedType = (type == P_ARRAY) ? P_ARRAY_LZ : P_STRING_LZ;
+	PStorageIndexEntry ie;
+	boolean found = _searchIndexEntry(type, name, &ie);
+	if (found && ((ie.type != packedType) || (_size(ie) < packed) || (_size(ie) - packed > PSTORAGE_SLACK_MAX))) {
+		if (!_free(&ie)) {
+			return false;
+		}
+		found = false;
+	}
+	if (!found) {
+		if (strlen(name) > _nameMaxSize()) {
+			PSTORAGE_DEBUG("_mapCompressed(): Name %s exceeds max length of %d bytes", name, _nameMaxSize());
+			return false;
+		}
+		if (!_searchFreeIndexEntry(packed + _nameSize(name), &ie) || !_allocateIn(name, packed, packedType, &ie)) {
+			return false;
+		}
+	}
+	if (!_seek(ie.thisEntry + _headerSize()) || !_lzCompress(buf, size, true, &packed) || !_flush()) {
+		PSTORAGE_DEBUG("_mapCompressed(): Could not write %s at %d", name, ie.thisEntry);
+		return false;
+	}
+	return _setLength(&ie, packed);
+}
+
+/*
+ * Compresses buf and sets packed to the bytes of the result. With write the result goes to the current position,
+ * without it the count stops once it reaches size.
+ */
+boolean PStorage::_lzCompress(const byte *buf, unsigned int size, boolean write, unsigned int *packed) {
+	uint16_t table[1 << PSTORAGE_LZ_HASH_BITS];  // the lower 16 bits of the last position + 1
+	memset(table, 0, sizeof(table));
+	byte group[1 + 8 * 2];
+	unsigned int groupSize = 1, tokens = 0;
+	group[0] = 0;
+
+	*packed = PSTORAGE_LZ_HEADER;
+	if (write) {
+		const byte header[PSTORAGE_LZ_HEADER] = {(byte) size, (byte) (size >> 8), (byte) (size >> 16), (byte) (size >> 24)};
+		if (!_write(header, sizeof(header))) {
+			return false;
+		}
+	}
+	unsigned int position = 0;
+	while (position < size) {
+		unsigned int length = 1, distance = 0;
+		if (position + PSTORAGE_LZ_MIN_MATCH <= size) {
+			const unsigned int hash = _lzHash(buf + position);
+			distance = (position + 1 - table[hash]) & 0xFFFF;  // a stale or empty slot fails the compare below
+			table[hash] = (uint16_t) (position + 1);
+			if ((distance > 0) && (distance <= PSTORAGE_LZ_WINDOW) && (distance <= position)) {
+				const unsigned int limit = min(size - position, (unsigned int) PSTORAGE_LZ_MAX_MATCH);
+				length = 0;
+				while ((length < limit) && (buf[position - distance + length] == buf[position + length])) {
+					length++;
+				}
+			}
+		}
+		if (length >= PSTORAGE_LZ_MIN_MATCH) {
+			group[0] |= 1 << tokens;
+			group[groupSize++] = (byte) (distance - 1);
+			group[groupSize++] = (byte) ((((distance - 1) >> 8) << 6) | (length - PSTORAGE_LZ_MIN_MATCH));
+			for (unsigned int i = 1; (i < length) && (position + i + PSTORAGE_LZ_MIN_MATCH <= size); i++) {
+				table[_lzHash(buf + position + i)] = (uint16_t) (position + i + 1);
+			}
+		}
+		else {
+			length = 1;
+			group[groupSize++] = buf[position];
+		}
+		position += length;
+		if ((++tokens == 8) || (position == size)) {
+			*packed += groupSize;
+			if (write && !_write(group, groupSize)) {
+				return false;
+			}
+			if (!write && (*packed >= size)) {  // no gain
+				return true;
+			}
+			group[0] = 0;
+			groupSize = 1;
+			tokens = 0;
+		}
+	}
+	return true;
+}
+
+boolean PStorage::_lzLength(unsigned int start, unsigned int *length) {
+	byte header[PSTORAGE_LZ_HEADER];
+	if (!_seek(start) || !_read(header, sizeof(header))) {
+		PSTORAGE_DEBUG("_lzLength(): Could not read the header at %d", start);
+		return false;
+	}
+	*length = ((uint32_t) header[3] << 24) | ((uint32_t) header[2] << 16) | ((uint32_t) header[1] << 8) | header[0];
+	return true;
+}
+
+/*
+ * Decodes the compressed value of length bytes at start, the decoded bytes from offset on go to buf, at most size,
+ * or to callback in chunks of PSTORAGE_STREAM_CHUNK_SIZE.
+ */
+int PStorage::_lzDecode(unsigned int start, unsigned int length, unsigned int offset, byte *buf, unsigned int size,
+		PStorageChunkCallback callback, void *context) {
+	PSTORAGE_DEBUG("_lzDecode(): Called");
+
+	unsigned int total;
+	if ((length < PSTORAGE_LZ_HEADER) || !_lzLength(start, &total)) {
+		return -1;
+	}
+	if (offset > total) {
+		PSTORAGE_DEBUG("_lzDecode(): Offset %d is behind the value of %d bytes", offset, total);
+		return -1;
+	}
+	const unsigned int end = (size < total - offset) ? offset + size : total;
+	const boolean flat = (callback == NULL) && (offset == 0);  // buf holds the history
+	byte *window = flat ? buf : (byte *) malloc(PSTORAGE_LZ_WINDOW);
+	if (!flat && (window == NULL)) {
+		PSTORAGE_DEBUG("_lzDecode(): Could not allocate the window");
+		return -1;
+	}
+	const unsigned int mask = flat ? 0xFFFFFFFF : PSTORAGE_LZ_WINDOW - 1;
+	byte chunk[PSTORAGE_STREAM_CHUNK_SIZE];
+	unsigned int chunkSize = 0;
+
+	const unsigned int limit = start + length;
+	unsigned int in = start + PSTORAGE_LZ_HEADER, out = 0, distance = 0, copy = 0, tokens = 0;
+	byte flags = 0;
+	boolean result = true;
+	while (result && (out < end)) {
+		byte next = 0;
+		if (copy == 0) {
+			if (tokens == 0) {
+				result = (in < limit) && _read(&flags, 1);
+				in++;
+				tokens = 8;
+				continue;
+			}
+			byte token[2];
+			const unsigned int bytes = (flags & 1) ? 2 : 1;
+			flags >>= 1;
+			tokens--;
+			if ((in + bytes > limit) || !_read(token, bytes)) {
+				result = false;
+				break;
+			}
+			in += bytes;
+			if (bytes == 1) {
+				next = token[0];
+			}
+			else {
+				distance = (((unsigned int) (token[1] >> 6) << 8) | token[0]) + 1;
+				copy = (token[1] & 0x3F) + PSTORAGE_LZ_MIN_MATCH;
+				if (distance > out) {
+					result = false;
+					break;
+				}
+			}
+		}
+		if (copy > 0) {
+			next = window[(out - distance) & mask];
+			copy--;
+		}
+		window[out & mask] = next;
+		if (!flat && (out >= offset)) {
+			if (callback == NULL) {
+				buf[out - offset] = next;
+			}
+			else {
+				chunk[chunkSize++] = next;
+				if ((chunkSize == sizeof(chunk)) || (out + 1 == end)) {
+					result = callback(chunk, chunkSize, out + 1 - chunkSize, context) && _seek(in);  // the callback may use the store
+					chunkSize = 0;
+				}
+			}
+		}
+		out++;
+	}
+	if (!flat) {
+		free(window);
+	}
+	if (!result) {
+		PSTORAGE_DEBUG("_lzDecode(): Could not decode the value at %d", start);
+		return -1;
+	}
+	return end - offset;
+}
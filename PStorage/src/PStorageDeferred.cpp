@@ -0,0 +1,193 @@
+/*
+ * PStorageDeferred.cpp
+ *
+ *  Deferred keys: after defer() map() of a scalar or another value of at most PSTORAGE_DEFERRED_VALUE_SIZE bytes
+ *  of the name only updates a shadow in RAM, a counter incremented a thousand times a day is not written a thousand
+ *  times. The shadow is written after maxUpdates updates or maxMillis after its first unwritten update, by the map()
+ *  reaching the limit or by poll() once the time is up, and by sync(), undefer() and the destructor. With
+ *  write-behind it is queued, otherwise written at once. A value of another type of the name writes the pending one
+ *  first, larger values and mapMany() are written as usual. A shadow that could not be written stays pending and is
+ *  written again by the next poll() after maxMillis, sync() or undefer().
+ *
+ *  get() and getMany() look at the shadow first, remove() and mapMany() drop its value. A value lost with a reset
+ *  is at most maxUpdates - 1 updates or maxMillis old, unless nothing calls poll().
+ *
+ *  getWritesAvoided() counts the values replaced in RAM before they were written, by a shadow or a queued record.
+ *  Keys are found by name among PSTORAGE_DEFERRED_MAXKEYS slots, the table is allocated by the first defer(), call
+ *  it in setup() like beginWriteBehind(). The shadows are guarded by the mutex of the queue.
+ */
+
+#include "PStorage.h"
+
+boolean PStorage::defer(const char *name, unsigned int maxUpdates, unsigned long maxMillis) {
+	PSTORAGE_DEBUG("defer(): Called");
+
+	if ((PSTORAGE_DEFERRED_MAXKEYS == 0) || (*name == '\0') || (strlen(name) > _nameMaxSize())) {
+		PSTORAGE_DEBUG("defer(): Cannot defer %s", name);
+		return false;
+	}
+	if (_deferred == NULL) {
+		_deferred = (PStorageDeferred *) malloc(PSTORAGE_DEFERRED_MAXKEYS * sizeof(PStorageDeferred));
+		if (_deferred == NULL) {
+			PSTORAGE_DEBUG("defer(): Could not allocate %d keys", PSTORAGE_DEFERRED_MAXKEYS);
+			return false;
+		}
+		for (unsigned int i = 0; i < PSTORAGE_DEFERRED_MAXKEYS; i++) {
+			_deferred[i].name[0] = '\0';
+		}
+	}
+	_queueLock();
+	PStorageDeferred *key = _deferredFind(name);
+	if (key == NULL) {
+		key = _deferredFind("");  // an unused slot
+		if (key != NULL) {
+			strcpy(key->name, name);
+			key->type = P_FREE;
+			key->updates = 0;
+			key->sequence = 0;
+		}
+	}
+	if (key != NULL) {
+		key->maxUpdates = maxUpdates;
+		key->maxMillis = maxMillis;
+	}
+	_queueUnlock();
+	if (key == NULL) {
+		PSTORAGE_DEBUG("defer(): All %d keys are taken", PSTORAGE_DEFERRED_MAXKEYS);
+	}
+	return key != NULL;
+}
+
+boolean PStorage::undefer(const char *name) {
+	PSTORAGE_DEBUG("undefer(): Called");
+
+	if (_deferred == NULL) {
+		return false;
+	}
+	boolean result = true;
+	_queueLock();
+	PStorageDeferred *key = _deferredFind(name);
+	while ((key != NULL) && (key->type != P_FREE) && result) {  // until no update came in between
+		_queueUnlock();
+		result = _deferredWrite(key);
+		_queueLock();
+	}
+	if ((key != NULL) && result) {  // a value that could not be written stays deferred
+		key->name[0] = '\0';
+	}
+	_queueUnlock();
+	return (key != NULL) && result;
+}
+
+unsigned long PStorage::getWritesAvoided() {
+	PStorageStats stats;
+	getStats(&stats);
+	return stats.writesAvoided;
+}
+
+boolean PStorage::_deferredUpdate(const char *name, EntryType type, const byte *buf, unsigned int size, boolean *result) {
+	if ((_deferred == NULL) || (size > PSTORAGE_DEFERRED_VALUE_SIZE)) {
+		return false;
+	}
+	_queueLock();
+	PStorageDeferred *key = _deferredFind(name);
+	while ((key != NULL) && (key->type != P_FREE) && ((key->type != type) || (key->size != size))) {
+		_queueUnlock();  // another type is pending, it is older
+		if (!_deferredWrite(key)) {
+			*result = false;
+			return true;
+		}
+		_queueLock();
+	}
+	if (key == NULL) {
+		_queueUnlock();
+		return false;
+	}
+	if (key->type == P_FREE) {
+		key->type = type;
+		key->size = size;
+		key->updates = 0;
+		key->since = millis();
+	}
+	else {
+		_pStorageCount(_stats.writesAvoided);
+	}
+	memcpy(key->value, buf, size);
+	key->updates++;
+	key->sequence++;
+	const boolean due = ((key->maxUpdates > 0) && (key->updates >= key->maxUpdates)) ||
+			((key->maxMillis > 0) && (millis() - key->since >= key->maxMillis));
+	_queueUnlock();
+	*result = !due || _deferredWrite(key);
+	return true;
+}
+
+PStorageDeferred *PStorage::_deferredFind(const char *name) {
+	for (unsigned int i = 0; (_deferred != NULL) && (i < PSTORAGE_DEFERRED_MAXKEYS); i++) {
+		if (strcasecmp(_deferred[i].name, name) == 0) {
+			return &_deferred[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Writes the pending value of key. A queued value replaces the shadow under the mutex of the queue, a stored one
+ * is written under the lock of the store, so remove() cannot run in between. The shadow keeps the value until it is
+ * stored, get() finds it meanwhile, updates that came in between stay pending.
+ */
+boolean PStorage::_deferredWrite(PStorageDeferred *key) {
+	if (_queue != NULL) {
+		_queueLock();
+		while ((key->type != P_FREE) && !_queueInsert(key->name, key->type, key->value, key->size, false)) {
+			_queueWait();
+		}
+		key->type = P_FREE;
+		_queueUnlock();
+		return true;
+	}
+	PStorageLock lock(*this, false);
+	char name[PSTORAGE_NAME_MAXSIZE + 1];
+	byte value[PSTORAGE_DEFERRED_VALUE_SIZE];
+	_queueLock();
+	const EntryType type = key->type;
+	const unsigned int size = key->size, updates = key->updates, sequence = key->sequence;
+	strcpy(name, key->name);
+	memcpy(value, key->value, size);
+	_queueUnlock();
+	if (type == P_FREE) {
+		return true;
+	}
+	const boolean result = _mapValue(name, type, value, size);
+	if (!result) {
+		PSTORAGE_DEBUG("_deferredWrite(): Could not write %s", name);
+	}
+	_queueLock();
+	if (!result) {  // still pending, poll() or sync() tries again
+		key->since = millis();
+	}
+	else if (key->sequence == sequence) {
+		key->type = P_FREE;
+	}
+	else {  // updated meanwhile, same type: another one would have waited for the lock
+		key->updates -= updates;
+		key->since = millis();
+	}
+	_queueUnlock();
+	return result;
+}
+
+boolean PStorage::_deferredDue(boolean all) {
+	boolean result = true;
+	for (unsigned int i = 0; (_deferred != NULL) && (i < PSTORAGE_DEFERRED_MAXKEYS); i++) {
+		PStorageDeferred *key = &_deferred[i];
+		_queueLock();
+		const boolean due = (key->name[0] != '\0') && (key->type != P_FREE) &&
+				(all || ((key->maxMillis > 0) && (millis() - key->since >= key->maxMillis)));
+		_queueUnlock();
+		if (due) {
+			result = _deferredWrite(key) && result;
+		}
+	}
+	return result;
+}
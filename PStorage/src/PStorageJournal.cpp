@@ -0,0 +1,163 @@
+/*
+ * PStorageJournal.cpp
+ *
+ *  Intent journal of the P_INPLACE chain.
+ *
+ *  _allocate(), _free() and compact() collect the index entries they write as images in _journal.
+ *  _journalCommit() writes this record into the params area and flushes it before the first index entry is
+ *  touched. After a power loss open() takes the latest valid record and writes those of its images again that
+ *  differ on disk, which costs at most PSTORAGE_JOURNAL_IMAGES reads and needs no chain walk. Index entries are
+ *  only written through the journal, so repeating the latest update does no harm if it had completed.
+ *
+ *  Every write of the record goes to the other of the two slots in _params.journal with the next sequence
+ *  number. A record torn while being written fails its checksum and the previous one is taken: either the
+ *  completed update before, whose repetition does no harm, or an earlier state of the same update.
+ *
+ *  compact() also records the value it moves down. The copy goes in chunks no larger than the distance moved,
+ *  so a chunk never overwrites source bytes that are not copied yet, and copyDone is written after every chunk
+ *  of an overlapping move, so open() can resume it from the last recorded chunk.
+ *
+ *  The changes of the sorted index are applied after the record is written and before the images, if open() has
+ *  to write an image again, it has the sorted index built again.
+ *
+ *  Values written by map() are not journaled, an interrupted map() leaves a consistent chain but possibly a
+ *  partly written value.
+ *
+ *  Stores created before the journal existed have no room for it in front of their first entry and are not
+ *  journaled.
+ */
+
+#include "PStorage.h"
+
+#define PSTORAGE_JOURNAL_COPY_CHUNK		32
+
+boolean PStorage::_journaled() {
+#if(PSTORAGE_JOURNAL_ENABLED)
+	return (_params.engine == P_INPLACE) && (_params.firstEntry >= offsetof(PStorageParams, features));
+#else
+	return false;
+#endif
+}
+
+void PStorage::_journalBegin() {
+	unsigned int sequence = _journal.sequence;
+	memset(&_journal, 0, sizeof(PStorageJournal));
+	_journal.sequence = sequence;
+	_sortedReset();
+}
+
+boolean PStorage::_journalAdd(const PStorageIndexEntry ie) {
+	if (_journal.count >= PSTORAGE_JOURNAL_IMAGES) {
+		PSTORAGE_DEBUG("_journalAdd(): More than %d index entries", PSTORAGE_JOURNAL_IMAGES);
+		return false;
+	}
+	_journal.images[_journal.count++] = ie;
+	return true;
+}
+
+boolean PStorage::_journalCommit() {
+	PSTORAGE_DEBUG("_journalCommit(): Called");
+
+	return _journalWrite() && _journalCopy() && _sortedApply() && _journalApply(false);
+}
+
+boolean PStorage::_journalWrite() {
+	if (!_journaled()) {
+		return true;
+	}
+	_journal.sequence++;
+	_journal.checksum = _journalChecksum(_journal);
+	PSTORAGE_TRACE(P_TRACE_JOURNAL, _journal.sequence, _journal.copyDone, _journal.count);
+	unsigned int slot = _journal.sequence % 2;
+	_params.journal[slot] = _journal;
+	// separate write-backs keep the order on disk even if the record shares its page with copied bytes or entries
+	if (!_writeBackIOBuffer() || !_seek(offsetof(PStorageParams, journal) + slot * sizeof(PStorageJournal)) ||
+			!_write((byte *) &_journal, sizeof(PStorageJournal)) || !_writeBackIOBuffer() || !_flush()) {
+		PSTORAGE_DEBUG("_journalWrite(): Could not write the journal");
+		return false;
+	}
+	return true;
+}
+
+boolean PStorage::_journalCopy() {
+	PStorageJournal &journal = _journal;
+	if (journal.copyDone >= journal.copyLength) {
+		return true;
+	}
+	if (journal.copyFrom <= journal.copyTo) {  // values only move down
+		PSTORAGE_DEBUG("_journalCopy(): Invalid move from %d to %d", journal.copyFrom, journal.copyTo);
+		return false;
+	}
+	const boolean overlapping = (journal.copyTo + journal.copyLength > journal.copyFrom);
+	const unsigned int chunkSize = min((unsigned int) PSTORAGE_JOURNAL_COPY_CHUNK, journal.copyFrom - journal.copyTo);
+	byte chunk[PSTORAGE_JOURNAL_COPY_CHUNK];
+	while (journal.copyDone < journal.copyLength) {
+		unsigned int bytes = min(journal.copyLength - journal.copyDone, chunkSize);
+		if (!_seek(journal.copyFrom + journal.copyDone) || !_read(chunk, bytes) ||
+				!_seek(journal.copyTo + journal.copyDone) || !_write(chunk, bytes)) {
+			PSTORAGE_DEBUG("_journalCopy(): Could not copy %d bytes at %d", bytes, journal.copyFrom + journal.copyDone);
+			return false;
+		}
+		journal.copyDone += bytes;
+		if (overlapping && (journal.copyDone < journal.copyLength) && !_journalWrite()) {
+			return false;
+		}
+	}
+	return _journalWrite();  // from now on the images may overwrite the source
+}
+
+boolean PStorage::_journalApply(boolean recover) {
+	boolean repeated = false;
+	for (unsigned int i = 0; i < _journal.count; i++) {
+		const PStorageIndexEntry &image = _journal.images[i];
+		byte encoded[sizeof(PStorageIndexEntry)], stored[sizeof(PStorageIndexEntry)];
+		const unsigned int size = _encodeIndexEntry(image, encoded);
+		if (recover && _seek(image.thisEntry) && _read(stored, size) && (memcmp(stored, encoded, size) == 0)) {
+			continue;  // already written
+		}
+		if (recover && !repeated) {  // the interrupted update may have torn the sorted index
+			if (!_sortedInvalidate()) {
+				return false;
+			}
+			repeated = true;
+		}
+		PSTORAGE_TRACE(P_TRACE_JOURNAL_APPLY, image.thisEntry, image.nextEntry, recover);
+		if (!_seek(image.thisEntry) || !_write(encoded, size)) {
+			PSTORAGE_DEBUG("_journalApply(): Could not write index entry at %d", image.thisEntry);
+			return false;
+		}
+	}
+	return _flush();
+}
+
+boolean PStorage::_journalRecover() {
+	PSTORAGE_DEBUG("_journalRecover(): Called");
+
+	if (!_journaled()) {
+		return true;
+	}
+	memset(&_journal, 0, sizeof(PStorageJournal));
+	boolean found = false;
+	for (unsigned int slot = 0; slot < 2; slot++) {
+		const PStorageJournal &journal = _params.journal[slot];
+		if ((journal.count <= PSTORAGE_JOURNAL_IMAGES) && (journal.checksum == _journalChecksum(journal)) &&
+				(!found || (journal.sequence > _journal.sequence))) {
+			_journal = journal;
+			found = true;
+		}
+	}
+	if (!found) {
+		PSTORAGE_DEBUG("_journalRecover(): No valid record, nothing to complete");
+		return true;
+	}
+	return _journalCopy() && _journalApply(true);
+}
+
+unsigned int PStorage::_journalChecksum(const PStorageJournal &journal) {  // FNV-1a
+	const byte *bytes = (const byte *) &journal;
+	unsigned int hash = 2166136261U;
+	for (unsigned int i = 0; i < offsetof(PStorageJournal, checksum); i++) {
+		hash = (hash ^ bytes[i]) * 16777619U;
+	}
+	return hash;
+}
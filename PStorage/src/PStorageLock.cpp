@@ -0,0 +1,171 @@
+/*
+ * PStorageLock.cpp
+ *
+ *  With PSTORAGE_CONCURRENCY_ENABLED one store may be called from several tasks (ESP32 FreeRTOS tasks, host threads):
+ *  every public call holds a reader-writer lock of the store. Calls that change the store hold it exclusively,
+ *  calls that only read hold it shared and run side by side.
+ *
+ *  A shared reader must not move the file position and the page buffer of the store, so _seek() and _read() of a
+ *  task holding the shared lock use a position of its own and read at it, from the mapping if it covers the file,
+ *  otherwise with one of PSTORAGE_READER_HANDLES read-only handles of the file, further readers wait for one. The
+ *  searches above them only read the RAM index, so lookups served from it do not wait for each other. A read finds
+ *  pending writes of a batch in the page buffer only, it then takes the lock exclusively. A writer closes the gate
+ *  for new readers while it waits, so a steady stream of them cannot starve it.
+ *
+ *  The locks a task holds form a list, a call nested in another one of the same store (map() of mapMany(), get()
+ *  in the callback of read()) runs under the outer lock. A callback of a shared read must not change the store.
+ */
+
+#include "PStorage.h"
+
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+#include <sched.h>
+
+static thread_local PStorageLock *_heldLocks = NULL;  // of the calling task, the innermost first
+
+PStorageLock::PStorageLock(PStorage &storage, boolean shared) : _storage(storage), _outer(_heldLocks), _nested(false),
+		_shared(false), _handle(-1), _position(0) {
+	for (PStorageLock *lock = _heldLocks; lock != NULL; lock = lock->_outer) {
+		if (&lock->_storage == &storage) {
+			_nested = true;
+			return;
+		}
+	}
+	if (shared) {
+		if (storage._writersWaiting > 0) {  // behind the writer
+			pthread_mutex_lock(&storage._writerGate);
+			pthread_mutex_unlock(&storage._writerGate);
+		}
+		pthread_rwlock_rdlock(&storage._lock);
+		if (storage._ioDirtyEnd == storage._ioDirtyStart) {
+#if(PSTORAGE_MMAP_ENABLED)
+			const boolean mapped = (storage._map != NULL) && (storage._mapLength >= storage._fileSize);
+#else
+			const boolean mapped = false;
+#endif
+			_handle = mapped ? -1 : storage._readerAcquire();
+			_shared = mapped || (_handle >= 0);  // a store without a file is locked exclusively
+		}
+		if (!_shared) {
+			pthread_rwlock_unlock(&storage._lock);
+		}
+	}
+	if (!_shared) {
+		storage._writersWaiting++;
+		pthread_mutex_lock(&storage._writerGate);
+		pthread_rwlock_wrlock(&storage._lock);
+		pthread_mutex_unlock(&storage._writerGate);
+		storage._writersWaiting--;
+	}
+	_heldLocks = this;
+}
+
+PStorageLock::~PStorageLock() {
+	if (_nested) {
+		return;
+	}
+	_heldLocks = _outer;
+	if (_handle >= 0) {
+		_storage._readerRelease(_handle);
+	}
+	pthread_rwlock_unlock(&_storage._lock);
+}
+
+PStorageLock *PStorage::_reader() {
+	for (PStorageLock *lock = _heldLocks; lock != NULL; lock = lock->_outer) {
+		if (&lock->_storage == this) {
+			return lock->_shared ? lock : NULL;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Reads at the position of reader, the file does not change while it holds the shared lock.
+ */
+boolean PStorage::_readShared(PStorageLock *reader, byte *buf, unsigned int size) {
+	const unsigned int position = reader->_position;
+	reader->_position += size;
+	if (reader->_handle < 0) {
+#if(PSTORAGE_MMAP_ENABLED)
+		const unsigned int available = (position < _fileSize) ? min(_fileSize - position, size) : 0;
+		memcpy(buf, _map + position, available);
+		_pStorageCount(_stats.bytesRead, available);
+		PSTORAGE_TRACE(P_TRACE_READ, position, available, true);
+		memset(buf + available, PSTORAGE_FILLER, size - available);
+#endif
+		return true;
+	}
+	File &file = _readers[reader->_handle];
+	byte *page = _readerPages[reader->_handle];
+	unsigned int &pageStart = _readerPageStarts[reader->_handle];
+	for (unsigned int done = 0; done < size; ) {  // through the page buffer of the handle like _read()
+		const unsigned int at = position + done;
+		if (!_readerPageValid[reader->_handle] || (at < pageStart) || (at >= pageStart + PSTORAGE_IO_BUFFER_SIZE)) {
+			const boolean large = !PSTORAGE_IO_BUFFER_ENABLED || (size - done >= PSTORAGE_IO_BUFFER_SIZE);
+			const unsigned int start = large ? at : at - (at % PSTORAGE_IO_BUFFER_SIZE);
+			const unsigned int length = large ? size - done : PSTORAGE_IO_BUFFER_SIZE;
+			byte *target = large ? buf + done : page;
+			const unsigned int available = (start < _fileSize) ? min(_fileSize - start, length) : 0;
+			_readerPageValid[reader->_handle] = false;
+			if ((available > 0) && (!file.seek(start, SeekSet) || (file.read(target, available) != available))) {
+				PSTORAGE_DEBUG("_readShared(): Could not read %d bytes at %d", available, start);
+				return false;
+			}
+			_pStorageCount(_stats.seeks, (available > 0) ? 1 : 0);
+			_pStorageCount(_stats.bytesRead, available);
+			PSTORAGE_TRACE(P_TRACE_READ, start, available);
+			memset(target + available, PSTORAGE_FILLER, length - available);  // behind the end of a lazy store
+			if (large) {
+				return true;
+			}
+			pageStart = start;
+			_readerPageValid[reader->_handle] = true;
+		}
+		const unsigned int chunk = min(size - done, pageStart + PSTORAGE_IO_BUFFER_SIZE - at);
+		memcpy(buf + done, page + (at - pageStart), chunk);
+		done += chunk;
+	}
+	return true;
+}
+
+int PStorage::_readerAcquire() {
+	for (unsigned int i = 0; ; i++) {
+		if ((i > 0) && (i % PSTORAGE_READER_HANDLES == 0)) {  // all taken by readers, which do not wait for anything
+			sched_yield();
+		}
+		const unsigned int handle = i % PSTORAGE_READER_HANDLES;
+		if (_readerBusy[handle].exchange(true)) {
+			continue;
+		}
+		if (_readers[handle] && (_readerSizes[handle] != _fileSize)) {  // a handle may not read behind the size it was opened with
+			_readers[handle].close();
+		}
+		if (!_readers[handle]) {
+			_readers[handle] = SPIFFS.open(_getStorageFileName(), "r");
+			_readerSizes[handle] = _fileSize;
+		}
+		if (!_readers[handle]) {
+			_readerBusy[handle] = false;
+			return -1;
+		}
+		_readerPageValid[handle] = false;  // the file may have changed since
+		return handle;
+	}
+}
+
+void PStorage::_readerRelease(int handle) {
+	_readerBusy[handle] = false;
+}
+
+#endif
+
+void PStorage::_readerClose() {  // the file is replaced or closed, no reader holds a handle
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	for (unsigned int i = 0; i < PSTORAGE_READER_HANDLES; i++) {
+		if (_readers[i]) {
+			_readers[i].close();
+		}
+	}
+#endif
+}
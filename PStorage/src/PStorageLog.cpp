@@ -0,0 +1,334 @@
+/*
+ * PStorageLog.cpp
+ *
+ *  Log-structured engine (P_LOG) of PStorage.
+ *
+ *  The data area is a circular log of records. A record is laid out like a chained index entry followed by its
+ *  value: thisEntry is its own position, nextEntry the position behind it and previousEntry carries the record's
+ *  sequence number, which grows by one with every record. A P_FREE record with a name removes that name, one
+ *  without a name pads the log up to its end. _params.logHead/logSequence locate the oldest record; open() replays
+ *  the records from there until the sequence breaks, which also marks the tail.
+ *
+ *  The latest record of every key is held in the RAM index. Compaction takes the record at the head, copies it
+ *  to the tail if it still is the latest of its key and advances the head, thereby dropping dead versions.
+ *
+ *  write() and append() append a new version as well, the unchanged bytes are copied from the previous one.
+ */
+
+#include "PStorage.h"
+
+boolean PStorage::_logMap(const char *name, EntryType type, byte *buf, unsigned int size) {
+	PSTORAGE_DEBUG("_logMap(): Called");
+
+	if ((strlen(name) == 0) || (strlen(name) > _nameMaxSize())) {
+		PSTORAGE_DEBUG("_logMap(): Name %s is empty or exceeds max length of %d bytes", name, _nameMaxSize());
+		return false;
+	}
+	if (!_typeFits(type)) {
+		return false;
+	}
+	if (_cache == NULL) {
+		return false;
+	}
+	PStorageIndexEntry ie;
+	if (!_cacheSearch(type, name, &ie) && (_cacheCount >= PSTORAGE_INDEX_CACHE_MAXENTRIES)) {
+		PSTORAGE_DEBUG("_logMap(): RAM index is full");
+		return false;
+	}
+	if (!_logAppend(name, type, buf, size, &ie)) {
+		return false;
+	}
+	return _logIndex(ie);
+}
+
+boolean PStorage::_logRemove(const char *name) {
+	PSTORAGE_DEBUG("_logRemove(): Called");
+
+	if (_cache == NULL) {
+		return false;
+	}
+	PStorageIndexEntry ie;
+	if (!_cacheSearch(P_FREE, name, &ie)) {
+		return true;
+	}
+	if (_logAppend(name, P_FREE, NULL, 0, &ie)) {
+		while (_cacheSearch(P_FREE, name, &ie)) {
+			_cacheRemove(ie.thisEntry);
+		}
+		return true;
+	}
+	// no room for the removal record: the latest versions themselves become removal records
+	while (_cacheSearch(P_FREE, name, &ie)) {
+		ie.type = P_FREE;
+		if (!_seek(ie.thisEntry) || !_writeIndexEntry(ie)) {
+			return false;
+		}
+		_cacheRemove(ie.thisEntry);
+	}
+	return true;
+}
+
+/*
+ * Appends a record with the size bytes of buf as value. With patch the value is length bytes long instead: the latest
+ * version of name with buf written at offset.
+ */
+boolean PStorage::_logAppend(const char *name, EntryType type, const byte *buf, unsigned int size, PStorageIndexEntry *ie,
+		boolean patch, unsigned int offset, unsigned int length) {
+	PSTORAGE_DEBUG("_logAppend(): Called");
+
+	if (!patch) {
+		length = size;
+	}
+	const unsigned int nameSize = _nameSize(name);
+	if (!_logReserve(_headerSize() + length + nameSize, true)) {
+		return false;
+	}
+	PStorageIndexEntry base;
+	if (patch && !_cacheSearch(type, name, &base)) {  // looked up after compaction, which may have moved it
+		return false;
+	}
+	_setName(ie, name);
+	ie->type = type;
+	ie->thisEntry = _logTail;
+	ie->previousEntry = _logSequence;
+	ie->nextEntry = _logTail + _headerSize() + length + nameSize;
+	if (_logEnd() - ie->nextEntry < _headerSize()) {
+		ie->nextEntry = _logEnd();  // the rest could not hold another record
+	}
+	ie->slack = _size(*ie) - length;
+	const unsigned int value = ie->thisEntry + _headerSize();
+	if (patch) {
+		const unsigned int baseValue = base.thisEntry + _headerSize(), tail = offset + size;
+		if (!_copyBytes(baseValue, value, offset) ||
+				((tail < _length(base)) && !_copyBytes(baseValue + tail, value + tail, _length(base) - tail))) {
+			PSTORAGE_DEBUG("_logAppend(): Could not copy the previous version at %d", base.thisEntry);
+			return false;
+		}
+	}
+	// value, name and header go out as one block with a single flush
+	if (!_seek(value + offset) || !_write(buf, size) || !_writeName(*ie, name) ||
+			!_seek(ie->thisEntry) || !_writeIndexEntry(*ie)) {
+		PSTORAGE_DEBUG("_logAppend(): Could not write record at %d", ie->thisEntry);
+		return false;
+	}
+	_logSequence++;
+	_logTail = (ie->nextEntry == _logEnd()) ? _params.firstEntry : ie->nextEntry;
+	return true;
+}
+
+/*
+ * Makes room for a record of length bytes at _logTail, compacting if allowed. The tail never catches up with the
+ * head, so head == tail always means an empty log.
+ */
+boolean PStorage::_logReserve(unsigned int length, boolean compact) {
+	PSTORAGE_DEBUG("_logReserve(): Called");
+
+	unsigned int required, compacted = 0, largest = 0;
+	for (unsigned int i = 0; compact && (i < _cacheCount); i++) {  // compaction has to be able to move any live record,
+		largest = max(largest, 2 * (_cache[i].nextEntry - _cache[i].thisEntry));  // padding the end of the file first
+	}
+	while (true) {
+		unsigned int contiguous = _logEnd() - _logTail;
+		if (length > contiguous) {
+			required = contiguous + length;  // padding up to the end
+		}
+		else {
+			required = (contiguous - length < _headerSize()) ? contiguous : length;  // the rest gets absorbed
+		}
+		if (_logFree() > required + largest + (compacted > 0 ? _params.size / 8 : 0)) {  // once compacting, win some headroom
+			break;
+		}
+		unsigned int head = _logHead;
+		if (!compact || (compacted > _params.size) || !_logCompactStep()) {  // a full round only moved live records
+			if (_logFree() > required) {
+				break;
+			}
+			PSTORAGE_DEBUG("_logReserve(): No room for %d bytes", length);
+			return false;
+		}
+		compacted += _logDistance(head, _logHead);
+	}
+	// the head has to be persisted before the tail reaches the space it left behind
+	if ((_params.logHead != _logHead) && (required >= _logDistance(_logTail, _params.logHead))) {
+		if (!_logPersistHead()) {
+			return false;
+		}
+	}
+	if (length > _logEnd() - _logTail) {
+		PStorageIndexEntry pad;
+		_setName(&pad, "");
+		pad.type = P_FREE;
+		pad.thisEntry = _logTail;
+		pad.previousEntry = _logSequence;
+		pad.nextEntry = _logEnd();
+		if (!_seek(pad.thisEntry) || !_putIndexEntry(pad)) {  // flushed with the record
+			return false;
+		}
+		_logSequence++;
+		_logTail = _params.firstEntry;
+	}
+	return true;
+}
+
+boolean PStorage::_logCompactStep() {
+	PSTORAGE_DEBUG("_logCompactStep(): Called");
+
+	if (_logHead == _logTail) {  // empty
+		return false;
+	}
+	PStorageIndexEntry record, latest;
+	if (!_seek(_logHead) || !_readIndexEntry(&record)) {
+		return false;
+	}
+	boolean live = false;  // the RAM index holds the latest version of every key
+	for (unsigned int i = 0; (i < _cacheCount) && (record.type != P_FREE); i++) {
+		if (_cache[i].thisEntry == record.thisEntry) {
+			latest = _cache[i];
+			live = true;
+		}
+	}
+	if (live) {
+		// still the latest version, it moves to the tail
+		const unsigned int size = _length(record), nameSize = _hashed() ? _nameLength(record) : 0;
+		if (!_logReserve(_headerSize() + size + nameSize, false)) {
+			return false;
+		}
+		latest.thisEntry = _logTail;
+		latest.previousEntry = _logSequence;
+		latest.nextEntry = _logTail + _headerSize() + size + nameSize;
+		if (_logEnd() - latest.nextEntry < _headerSize()) {
+			latest.nextEntry = _logEnd();
+		}
+		latest.slack = _size(latest) - size;
+		if (!_copyBytes(record.thisEntry + _headerSize(), latest.thisEntry + _headerSize(), size) ||
+				!_copyBytes(record.nextEntry - nameSize, latest.nextEntry - nameSize, nameSize) ||
+				!_seek(latest.thisEntry) || !_writeIndexEntry(latest)) {
+			return false;
+		}
+		_logSequence++;
+		_logTail = (latest.nextEntry == _logEnd()) ? _params.firstEntry : latest.nextEntry;
+		if (!_logIndex(latest)) {
+			return false;
+		}
+	}
+	_logHead = (record.nextEntry == _logEnd()) ? _params.firstEntry : record.nextEntry;
+	_logHeadSequence = record.previousEntry + 1;
+	return true;
+}
+
+boolean PStorage::_logCompact(unsigned long maxMillis) {
+	PSTORAGE_DEBUG("_logCompact(): Called");
+
+	if (_cache == NULL) {
+		return false;
+	}
+	unsigned int live = 0;
+	for (unsigned int i = 0; i < _cacheCount; i++) {
+		live += _cache[i].nextEntry - _cache[i].thisEntry;
+	}
+	unsigned long start = millis();
+	unsigned int compacted = 0;
+	while ((millis() - start < maxMillis) && ((unsigned long) _logFree() * 100 < (unsigned long) _params.size * PSTORAGE_LOG_COMPACT_THRESHOLD) &&
+			(_params.size - _logFree() > live) && (compacted < _params.size)) {  // dead records left
+		unsigned int head = _logHead;
+		if (!_logCompactStep()) {  // no room to move the live record at the head
+			break;
+		}
+		compacted += _logDistance(head, _logHead);
+	}
+	if (_params.logHead != _logHead) {
+		return _logPersistHead();
+	}
+	return true;
+}
+
+boolean PStorage::_logPersistHead() {
+	PSTORAGE_DEBUG("_logPersistHead(): Called");
+
+	_params.logHead = _logHead;
+	_params.logSequence = _logHeadSequence;
+	return _writeParams() && _flush();
+}
+
+/*
+ * Replays the log from the persisted head into the RAM index, stopping at the first position that does not hold
+ * the next record in sequence.
+ */
+boolean PStorage::_logRecover() {
+	PSTORAGE_DEBUG("_logRecover(): Called");
+
+	_cacheCapacity = min(8, PSTORAGE_INDEX_CACHE_MAXENTRIES);
+	_cache = (PStorageIndexEntry *) malloc(_cacheCapacity * sizeof(PStorageIndexEntry));
+	if (_cache == NULL) {
+		_cacheCapacity = 0;
+		return false;
+	}
+	_logHead = _logTail = _params.logHead;
+	_logHeadSequence = _logSequence = _params.logSequence;
+	PStorageIndexEntry record;
+	while (true) {
+		if (!_seek(_logTail) || !_readIndexEntry(&record)) {
+			return false;
+		}
+		if ((record.thisEntry != _logTail) || (record.previousEntry != _logSequence) ||
+				(record.nextEntry < _logTail + _headerSize()) || (record.nextEntry > _logEnd())) {
+			return true;  // end of the log
+		}
+		if (record.type != P_FREE) {
+			if (!_logIndex(record)) {
+				return false;
+			}
+		}
+		else if (_nameLength(record) > 0) {
+			PStorageIndexEntry ie;
+			char name[PSTORAGE_NAME_MAXSIZE + 1];
+			if (!_readName(record, name)) {
+				return false;
+			}
+			while (_cacheSearch(P_FREE, name, &ie)) {
+				_cacheRemove(ie.thisEntry);
+			}
+		}
+		_logSequence++;
+		_logTail = (record.nextEntry == _logEnd()) ? _params.firstEntry : record.nextEntry;
+		if (_logTail == _logHead) {  // cannot happen with a consistent log
+			PSTORAGE_DEBUG("_logRecover(): Corruption, log has no end");
+			_freeIndexCache();
+			return false;
+		}
+	}
+}
+
+/*
+ * Makes ie the latest version of its key in the RAM index
+ */
+boolean PStorage::_logIndex(const PStorageIndexEntry ie) {
+	for (unsigned int i = 0; i < _cacheCount; i++) {
+		if ((_cache[i].type == ie.type) && _sameName(_cache[i], ie)) {
+			_cache[i] = ie;
+			return true;
+		}
+	}
+	if (_cacheCount >= PSTORAGE_INDEX_CACHE_MAXENTRIES) {
+		PSTORAGE_DEBUG("_logIndex(): RAM index is full");
+		_freeIndexCache();
+		return false;
+	}
+	_cacheUpdate(ie);
+	if (_cacheOverflow) {  // out of heap, the log needs every key in the RAM index
+		_freeIndexCache();
+	}
+	return _cache != NULL;
+}
+
+unsigned int PStorage::_logDistance(unsigned int from, unsigned int to) {
+	return (to >= from) ? to - from : _params.size - (from - to);
+}
+
+unsigned int PStorage::_logFree() {
+	return (_logHead == _logTail) ? _params.size : _logDistance(_logTail, _logHead);
+}
+
+unsigned int PStorage::_logEnd() {
+	return _params.firstEntry + _params.size;
+}
@@ -0,0 +1,250 @@
+/*
+ * PStorageMany.cpp
+ *
+ *  getMany() and mapMany(): several values resolved with one pass over the chain instead of a search each.
+ *
+ *  With the RAM index the items are looked up there. Without it, or for the misses of one that overflowed, one walk
+ *  over the chain matches every entry against all open items. Without the free bins mapMany() keeps the largest free
+ *  entries of the same walk, as many as there are items, and allocates the missing values best fit from them,
+ *  next-fit in stores with wear counts: the largest free entry is always among them, so no other one could fit if
+ *  none of them does. Values that outgrew their entry or are stored compressed, missing scalars, which may be in a
+ *  slab page, batches naming a value twice and the log engine, which has all keys in RAM anyway, go through the
+ *  single value calls. mapMany() flushes once.
+ */
+
+#include "PStorage.h"
+
+boolean PStorage::getMany(PStorageItem items[], unsigned int count) {
+	PSTORAGE_DEBUG("getMany(): Called");
+	PStorageLock lock(*this, true);
+
+	if (count == 0) {
+		return true;
+	}
+	PStorageIndexEntry *entries = (PStorageIndexEntry *) malloc(count * sizeof(PStorageIndexEntry));
+	boolean result = (entries != NULL) && _resolveMany(items, count, entries, NULL, NULL);
+	for (unsigned int i = 0; i < count; i++) {
+		if (_queueGet(items[i].name, items[i].type, (byte *) items[i].value, items[i].size, &items[i].done)) {
+			continue;  // newer than the store
+		}
+		items[i].done = result && ((entries[i].type != P_FREE) ? _readItem(items[i], entries[i]) :
+				_slabGet(items[i].type, items[i].name, (byte *) items[i].value, items[i].size));
+	}
+	free(entries);
+	for (unsigned int i = 0; i < count; i++) {
+		result = result && items[i].done;
+	}
+	return result;
+}
+
+boolean PStorage::mapMany(PStorageItem items[], unsigned int count) {
+	PSTORAGE_DEBUG("mapMany(): Called");
+	PStorageLock lock(*this, false);
+
+	for (unsigned int i = 0; i < count; i++) {
+		items[i].done = false;
+		_queueDrop(items[i].name, items[i].type);  // would overwrite it later
+	}
+	boolean single = (_params.engine == P_LOG);
+	for (unsigned int i = 0; (i < count) && !single; i++) {
+		for (unsigned int j = 0; j < i; j++) {
+			if ((items[i].type == items[j].type) && (strcasecmp(items[i].name, items[j].name) == 0)) {
+				single = true;
+			}
+		}
+	}
+	PStorageIndexEntry *entries = NULL, *candidates = NULL;
+	unsigned int candidateCount = 0;
+	if (!single && (count > 0)) {
+		entries = (PStorageIndexEntry *) malloc(count * sizeof(PStorageIndexEntry));
+		if (_freeBlocks == NULL) {  // otherwise the bins find free entries without a walk
+			candidates = (PStorageIndexEntry *) malloc(count * sizeof(PStorageIndexEntry));
+		}
+		single = (entries == NULL) || ((_freeBlocks == NULL) && (candidates == NULL)) ||
+				!_resolveMany(items, count, entries, candidates, &candidateCount);
+	}
+
+	beginBatch();
+	// present values first, allocations rewire entries and would leave their copies in entries stale
+	for (unsigned int pass = 0; (pass < 2) && !single; pass++) {
+		for (unsigned int i = 0; i < count; i++) {
+			PStorageItem &item = items[i];
+			PStorageIndexEntry &ie = entries[i];
+			if (item.done || ((ie.type == P_FREE) != (pass == 1))) {
+				continue;
+			}
+			if ((item.type == P_FREE) || (strlen(item.name) == 0) || (strlen(item.name) > _nameMaxSize())) {
+				PSTORAGE_DEBUG("mapMany(): Invalid item %s", item.name);
+				continue;
+			}
+			const unsigned int size = (item.type == P_STRING) ? strlen((const char *) item.value) : item.size;
+			if ((pass == 0) && (ie.type != item.type)) {
+				continue;  // stored compressed, replaced below
+			}
+			if ((pass == 0) && (((item.type == P_ARRAY) || (item.type == P_STRING)) ?
+					((_size(ie) < size) || (_size(ie) - size > PSTORAGE_SLACK_MAX)) : !_holds(ie, size))) {
+				continue;  // reallocated below, a free now would spoil the candidates
+			}
+			if ((pass == 1) && (_slabbed(item.type, size) || !_allocateMany(item.name, size, item.type, candidates, &candidateCount, &ie))) {
+				continue;  // a scalar may be in a slab, it goes through _mapValue() below
+			}
+			const unsigned int bytes = (item.type == P_STRING) ? size + 1 : size;  // the \0 only if there is room
+			item.done = _writeEntry(ie, (byte *) item.value, bytes) && _setLength(&ie, min(_size(ie), bytes));
+		}
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		if (single || (!items[i].done && ((entries[i].type != P_FREE) || _slabbed(items[i].type, items[i].size)))) {  // outgrown, slab, or with the log
+			items[i].done = _mapItem(items[i]);
+		}
+	}
+	free(entries);
+	free(candidates);
+
+	boolean result = commit();
+	for (unsigned int i = 0; i < count; i++) {
+		result = result && items[i].done;
+	}
+	return result;
+}
+
+/*
+ * Sets entries[i] to the entry of items[i], to type P_FREE if there is none. With candidates it also collects the
+ * largest free entries, at most count.
+ */
+boolean PStorage::_resolveMany(PStorageItem items[], unsigned int count, PStorageIndexEntry *entries,
+		PStorageIndexEntry *candidates, unsigned int *candidateCount) {
+	PSTORAGE_DEBUG("_resolveMany(): Called");
+
+	const boolean complete = (_cache != NULL) && !_cacheOverflow;  // otherwise misses walk the chain
+	unsigned int open = count;
+	for (unsigned int i = 0; i < count; i++) {
+		entries[i].type = P_FREE;
+		if ((_cache != NULL) && (items[i].type != P_FREE) && _cacheSearch(items[i].type, items[i].name, &entries[i])) {
+			open--;
+		}
+	}
+	if ((open == 0) || (complete && (candidates == NULL))) {
+		return true;
+	}
+	if (_params.engine == P_LOG) {  // the log has no chain to walk
+		return false;
+	}
+	if (candidates != NULL) {
+		*candidateCount = 0;
+	}
+	PStorageIndexEntry ie;
+	unsigned int *hashes = (unsigned int *) malloc(count * sizeof(unsigned int));  // matched against the entries
+	if ((hashes == NULL) || !_readFirstIndexEntry(&ie)) {
+		free(hashes);
+		return false;
+	}
+	for (unsigned int i = 0; i < count; i++) {
+		hashes[i] = _nameHash(items[i].name);
+	}
+	boolean result = true;
+	while (result) {
+		if ((ie.type == P_FREE) && (candidates != NULL)) {
+			if (*candidateCount < count) {
+				candidates[(*candidateCount)++] = ie;
+			}
+			else {
+				unsigned int smallest = 0;
+				for (unsigned int c = 1; c < count; c++) {
+					if (_size(candidates[c]) < _size(candidates[smallest])) {
+						smallest = c;
+					}
+				}
+				if (_size(ie) > _size(candidates[smallest])) {
+					candidates[smallest] = ie;
+				}
+			}
+		}
+		else if ((ie.type != P_FREE) && !complete) {
+			for (unsigned int i = 0; i < count; i++) {
+				if ((entries[i].type == P_FREE) && _typeMatches(items[i].type, ie.type) && _nameMatches(ie, items[i].name, hashes[i])) {
+					entries[i] = ie;
+					open--;
+				}
+			}
+			if ((open == 0) && (candidates == NULL)) {
+				break;
+			}
+		}
+		if (_isLastIndexEntry(ie)) {
+			break;
+		}
+		if ((ie.nextEntry <= ie.thisEntry) || !_seek(ie.nextEntry) || !_readIndexEntry(&ie)) {
+			PSTORAGE_DEBUG("_resolveMany(): Corruption, could not read entry at %d", ie.nextEntry);
+			result = false;
+		}
+	}
+	free(hashes);
+	return result;
+}
+
+/*
+ * Allocates a missing value in the candidate that fits best, next-fit in stores with wear counts, with the free bins
+ * (no candidates) like map().
+ */
+boolean PStorage::_allocateMany(const char *name, unsigned int size, EntryType type, PStorageIndexEntry *candidates,
+		unsigned int *candidateCount, PStorageIndexEntry *ie) {
+	if (candidates == NULL) {
+		return _allocate(name, size, type, ie);
+	}
+	const unsigned int area = size + _nameSize(name);
+	const boolean nextFit = (_wearCounts != NULL);
+	unsigned int best = *candidateCount;
+	for (unsigned int c = 0; c < *candidateCount; c++) {
+		const boolean better = (best == *candidateCount) || (nextFit ?
+				(_wearDistance(candidates[c].thisEntry) < _wearDistance(candidates[best].thisEntry)) :
+				(_size(candidates[c]) < _size(candidates[best])));
+		if ((_size(candidates[c]) >= area) && better) {
+			best = c;  // next-fit: nearer behind the cursor, which _allocateIn() moves behind the new value
+		}
+	}
+	if (best == *candidateCount) {
+		PSTORAGE_DEBUG("_allocateMany(): No free entry for %d bytes", size);
+		return false;
+	}
+	*ie = candidates[best];
+	if (!_allocateIn(name, size, type, ie)) {
+		return false;
+	}
+	if (ie->nextEntry != candidates[best].nextEntry) {  // split, the rest stays a candidate
+		candidates[best].thisEntry = ie->nextEntry;
+		candidates[best].previousEntry = ie->thisEntry;
+	}
+	else {
+		candidates[best] = candidates[--(*candidateCount)];
+	}
+	return true;
+}
+
+boolean PStorage::_readItem(PStorageItem &item, PStorageIndexEntry ie) {
+	switch (item.type) {
+	case P_ARRAY:
+		return (_readEntry(ie, (byte *) item.value, item.size) >= 0);
+	case P_STRING: {
+		int bytesRead = (item.size > 0) ? _readEntry(ie, (byte *) item.value, item.size - 1) : -1;
+		if (bytesRead >= 0) {
+			((char *) item.value)[bytesRead] = '\0';
+		}
+		return (bytesRead >= 0);
+	}
+	default:
+		return _holds(ie, item.size) && (_readEntry(ie, (byte *) item.value, item.size) >= 0);
+	}
+}
+
+boolean PStorage::_mapItem(PStorageItem &item) {
+	switch (item.type) {
+	case P_FREE:
+		return false;
+	case P_ARRAY:
+		return _mapArray(item.name, (const byte *) item.value, item.size, false);
+	case P_STRING:
+		return _mapString(item.name, (const char *) item.value, false);
+	default:
+		return _mapValue(item.name, item.type, (const byte *) item.value, item.size);
+	}
+}
@@ -0,0 +1,373 @@
+/*
+ * PStorageQueue.cpp
+ *
+ *  Write-behind: after beginWriteBehind() map() copies the value into a queue of PSTORAGE_QUEUE_SIZE bytes and returns
+ *  without touching the file. poll() called from loop() or a task of its own (PSTORAGE_CONCURRENCY_ENABLED, on the
+ *  ESP32 a FreeRTOS task through its pthreads) writes the queued values oldest first, all of one call in a batch with
+ *  one flush. A write of a name and type that is already queued replaces the value of its record, a counter updated
+ *  a hundred times between two polls is written once. A full queue makes map() wait for the task or write all
+ *  queued values itself, a value larger than the queue is written at once.
+ *
+ *  get() and getMany() look into the queue first, a queued value is newer than the stored one. remove() and mapMany()
+ *  drop the queued values they replace, write() and append() write the queue first. sync() waits until the values
+ *  queued before it are written: records keep their place when their value is replaced, so these are the first
+ *  ones. A failed write is lost, sync() reports it. Values of deferred keys (see PStorageDeferred.cpp) are queued
+ *  when they are due.
+ *
+ *  Records are only removed by a task holding the lock of the store exclusively, so a reader holding it sees the
+ *  queue and the store consistent. The record being written stays queued until it is in the store, later writes of
+ *  its name get a record of their own.
+ */
+
+#include "PStorage.h"
+
+#define PSTORAGE_QUEUE_ALL	0xFFFFFFFF	// records or milliseconds of _queueApply()
+
+boolean PStorage::beginWriteBehind(boolean task) {
+	PSTORAGE_DEBUG("beginWriteBehind(): Called");
+
+	if (_queue != NULL) {
+		return false;
+	}
+#if(!PSTORAGE_CONCURRENCY_ENABLED)
+	if (task) {
+		PSTORAGE_DEBUG("beginWriteBehind(): A task needs PSTORAGE_CONCURRENCY_ENABLED");
+		return false;
+	}
+#endif
+	_queue = (byte *) malloc(PSTORAGE_QUEUE_SIZE);
+	if (_queue == NULL) {
+		PSTORAGE_DEBUG("beginWriteBehind(): Could not allocate %d bytes", PSTORAGE_QUEUE_SIZE);
+		return false;
+	}
+	_queueUsed = 0;
+	_queueFailed = false;
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	_queueStop = false;
+	_queueStarted = task && (pthread_create(&_queueThread, NULL, _queueTask, this) == 0);
+	if (task && !_queueStarted) {
+		PSTORAGE_DEBUG("beginWriteBehind(): Could not start the task");
+		free(_queue);
+		_queue = NULL;
+		return false;
+	}
+#endif
+	return true;
+}
+
+boolean PStorage::poll(unsigned long maxMillis) {
+	const boolean result = _deferredDue(false);
+	if (_queue == NULL) {
+		return result;
+	}
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	if (_queueStarted) {  // the task writes them
+		return result;
+	}
+#endif
+	return _queueApply(PSTORAGE_QUEUE_ALL, maxMillis) && result;
+}
+
+boolean PStorage::sync() {
+	PSTORAGE_DEBUG("sync(): Called");
+
+	boolean result = _deferredDue(true);  // queued now if there is a queue
+	if (_queue != NULL) {
+		_queueLock();
+		const unsigned int sequence = _queueSequence;
+		while ((_queueUsed > 0) && ((int) (((PStorageQueued *) _queue)->sequence - sequence) <= 0)) {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+			if (_queueStarted) {
+				pthread_cond_wait(&_queueChanged, &_queueMutex);
+				continue;
+			}
+#endif
+			_queueUnlock();
+			_queueApply(PSTORAGE_QUEUE_ALL, PSTORAGE_QUEUE_ALL);
+			_queueLock();
+		}
+		result = result && !_queueFailed;
+		_queueFailed = false;
+		_queueUnlock();
+	}
+	PStorageLock lock(*this, false);
+	return _checkpointSave() && result;  // the next open() need not walk the chain
+}
+
+boolean PStorage::endWriteBehind() {
+	PSTORAGE_DEBUG("endWriteBehind(): Called");
+
+	if (_queue == NULL) {
+		return true;
+	}
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	if (_queueStarted) {
+		_queueLock();
+		_queueStop = true;
+		pthread_cond_broadcast(&_queueChanged);
+		_queueUnlock();
+		pthread_join(_queueThread, NULL);
+		_queueStarted = false;
+	}
+#endif
+	PStorageLock lock(*this, false);
+	_queueDrain();
+	free(_queue);
+	_queue = NULL;
+	return !_queueFailed;
+}
+
+boolean PStorage::_queuePush(const char *name, EntryType type, const byte *buf, unsigned int size, boolean compress) {
+	if (strlen(name) > _nameMaxSize()) {
+		PSTORAGE_DEBUG("_queuePush(): Name %s exceeds max length of %d bytes", name, _nameMaxSize());
+		return false;
+	}
+	PStorageQueued header;
+	header.size = size;
+	header.nameSize = strlen(name) + 1;
+	if (_queueLength(&header) > PSTORAGE_QUEUE_SIZE) {  // never fits, written now instead of the queued values of its name
+		PStorageLock lock(*this, false);
+		_queueDrop(name, type);
+		return _queueWrite(name, type, buf, size, compress);
+	}
+	_queueLock();
+	while (!_queueInsert(name, type, buf, size, compress)) {
+		_queueWait();
+	}
+	_queueUnlock();
+	return true;
+}
+
+/*
+ * Queues the value or replaces the queued one of name and type, false if the queue has no room. The caller holds the
+ * mutex of the queue.
+ */
+boolean PStorage::_queueInsert(const char *name, EntryType type, const byte *buf, unsigned int size, boolean compress) {
+	PStorageQueued header;
+	header.size = size;
+	header.type = type;
+	header.nameSize = strlen(name) + 1;
+	header.compress = compress;
+	header.applying = false;
+	const unsigned int length = _queueLength(&header);
+	PStorageQueued *record = _queueFind(name, type, true);
+	const unsigned int replaced = (record != NULL) ? _queueLength(record) : 0;
+	if (_queueUsed - replaced + length > PSTORAGE_QUEUE_SIZE) {
+		return false;
+	}
+	if (record == NULL) {
+		record = (PStorageQueued *) (_queue + _queueUsed);
+		header.sequence = ++_queueSequence;
+		strcpy((char *) (record + 1), name);
+		_queueUsed += length;
+	}
+	else {  // keeps its place and name, the records behind move with its length
+		byte *behind = (byte *) record + replaced;
+		memmove((byte *) record + length, behind, _queue + _queueUsed - behind);
+		_queueUsed = _queueUsed - replaced + length;
+		header.sequence = record->sequence;
+		_pStorageCount(_stats.writesAvoided);
+	}
+	*record = header;
+	memcpy((byte *) (record + 1) + header.nameSize, buf, size);
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_cond_broadcast(&_queueChanged);
+#endif
+	return true;
+}
+
+/*
+ * Makes room in a full queue: waits until the task wrote it, not one wakeup per record, or writes it in one batch.
+ * The caller holds the mutex of the queue, it is released meanwhile.
+ */
+void PStorage::_queueWait() {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	if (_queueStarted) {
+		while (_queueStarted && (_queueUsed > 0)) {
+			pthread_cond_wait(&_queueChanged, &_queueMutex);
+		}
+		return;
+	}
+#endif
+	_queueUnlock();
+	_queueApply(PSTORAGE_QUEUE_ALL, PSTORAGE_QUEUE_ALL);
+	_queueLock();
+}
+
+boolean PStorage::_queueGet(const char *name, EntryType type, byte *buf, unsigned int size, boolean *result) {
+	if ((_queue == NULL) && (_deferred == NULL)) {
+		return false;
+	}
+	_queueLock();
+	const byte *value = NULL;
+	unsigned int length = 0;
+	const PStorageDeferred *key = _deferredFind(name);
+	const PStorageQueued *record;
+	if ((key != NULL) && (key->type == type)) {  // newer than a queued one
+		value = key->value;
+		length = key->size;
+	}
+	else if ((record = _queueFind(name, type, false)) != NULL) {
+		value = (const byte *) (record + 1) + record->nameSize;
+		length = record->size;
+	}
+	if (value != NULL) {
+		switch (type) {
+		case P_ARRAY:
+			memcpy(buf, value, min(size, length));
+			*result = true;
+			break;
+		case P_STRING:  // like get(): up to size - 1 characters and the \0
+			*result = (size > 0);
+			if (*result) {
+				memcpy(buf, value, min(size - 1, length - 1));
+				buf[min(size - 1, length - 1)] = '\0';
+			}
+			break;
+		default:
+			*result = (length == size);
+			if (*result) {
+				memcpy(buf, value, size);
+			}
+		}
+	}
+	_queueUnlock();
+	return value != NULL;
+}
+
+PStorageQueued *PStorage::_queueFind(const char *name, EntryType type, boolean writable) {
+	PStorageQueued *result = NULL;
+	for (unsigned int position = 0; position < _queueUsed; ) {
+		PStorageQueued *record = (PStorageQueued *) (_queue + position);
+		if (((type == P_FREE) || (record->type == type)) && (!writable || !record->applying) &&
+				(strcasecmp((const char *) (record + 1), name) == 0)) {
+			result = record;
+		}
+		position += _queueLength(record);
+	}
+	return result;
+}
+
+boolean PStorage::_queueApply(unsigned int count, unsigned long maxMillis) {
+	PStorageLock lock(*this, false);
+
+	const unsigned long start = millis();
+	boolean result = true, written;
+	beginBatch();  // one flush
+	for (unsigned int i = 0; (i < count) && ((i == 0) || (millis() - start < maxMillis)); i++) {
+		if (!_queueApplyFirst(&written)) {
+			break;
+		}
+		result = result && written;
+	}
+	if (!commit()) {
+		PSTORAGE_DEBUG("_queueApply(): Could not flush the written values");
+		_queueLock();
+		_queueFailed = true;
+		_queueUnlock();
+		return false;
+	}
+	return result;
+}
+
+boolean PStorage::_queueApplyFirst(boolean *written) {
+	_queueLock();
+	PStorageQueued *record = (PStorageQueued *) _queue;
+	if (_queueUsed == 0) {
+		_queueUnlock();
+		return false;
+	}
+	record->applying = true;  // the value stays readable
+	_queueUnlock();
+
+	const char *name = (const char *) (record + 1);
+	*written = _queueWrite(name, record->type, (const byte *) name + record->nameSize, record->size, record->compress);
+	_queueLock();
+	if (!*written) {
+		PSTORAGE_DEBUG("_queueApplyFirst(): Could not write %s, it is lost", name);
+		_queueFailed = true;
+	}
+	_queueRemove(record);
+	_queueUnlock();
+	return true;
+}
+
+void PStorage::_queueDrain() {
+	if (_queue != NULL) {
+		_queueApply(PSTORAGE_QUEUE_ALL, PSTORAGE_QUEUE_ALL);
+	}
+}
+
+void PStorage::_queueDrop(const char *name, EntryType type) {
+	if ((_queue == NULL) && (_deferred == NULL)) {
+		return;
+	}
+	_queueLock();
+	PStorageQueued *record;
+	while ((record = _queueFind(name, type, false)) != NULL) {
+		_queueRemove(record);
+	}
+	PStorageDeferred *key = _deferredFind(name);
+	if ((key != NULL) && ((type == P_FREE) || (key->type == type))) {
+		key->type = P_FREE;
+	}
+	_queueUnlock();
+}
+
+void PStorage::_queueRemove(PStorageQueued *record) {
+	const unsigned int length = _queueLength(record);
+	byte *behind = (byte *) record + length;
+	memmove(record, behind, _queue + _queueUsed - behind);
+	_queueUsed -= length;
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_cond_broadcast(&_queueChanged);  // room for a waiting map(), progress for sync()
+#endif
+}
+
+boolean PStorage::_queueWrite(const char *name, EntryType type, const byte *value, unsigned int size, boolean compress) {
+	switch (type) {
+	case P_ARRAY:
+		return _mapArray(name, value, size, compress);
+	case P_STRING:
+		return _mapString(name, (const char *) value, compress);
+	default:
+		return _mapValue(name, type, value, size);
+	}
+}
+
+unsigned int PStorage::_queueLength(const PStorageQueued *record) {
+	return (sizeof(PStorageQueued) + record->nameSize + record->size + 3) & ~3;
+}
+
+void PStorage::_queueLock() {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_mutex_lock(&_queueMutex);
+#endif
+}
+
+void PStorage::_queueUnlock() {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	pthread_mutex_unlock(&_queueMutex);
+#endif
+}
+
+void *PStorage::_queueTask(void *storage) {
+	((PStorage *) storage)->_queueRun();
+	return NULL;
+}
+
+void PStorage::_queueRun() {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	_queueLock();
+	while (!_queueStop) {
+		if (_queueUsed == 0) {
+			pthread_cond_wait(&_queueChanged, &_queueMutex);
+			continue;
+		}
+		_queueUnlock();
+		_queueApply(PSTORAGE_QUEUE_SIZE / sizeof(PStorageQueued), PSTORAGE_QUEUE_ALL);  // a queue full at most, readers wait
+		_queueLock();
+	}
+	_queueUnlock();
+#endif
+}
@@ -0,0 +1,300 @@
+/*
+ * PStorageSlab.cpp
+ *
+ *  Slab pages of P_INPLACE stores with PSTORAGE_FEATURE_SLABS: scalars (P_INT to P_FLOAT) with names of at most
+ *  PSTORAGE_SLAB_KEY_SIZE bytes are slots of a P_SLAB entry instead of entries of their own. A slab page holds the
+ *  slots of one type, it is the value of a P_SLAB entry without a name:
+ *
+ *  	type, slots, key size, 0		1 byte each
+ *  	occupancy					one bit per slot, (slots + 7) / 8 bytes
+ *  	slots						the name zero padded to the key size, then the value (PSTORAGE_SLAB_VALUE_SIZE)
+ *
+ *  A scalar thus costs its name and value instead of an index entry, its name and a value of at least
+ *  PSTORAGE_ENTRY_MINSIZE bytes, and it is looked up in one page instead of a walk or the sorted index.
+ *
+ *  open() collects the pages with the walk of the RAM index into _slabs, at most PSTORAGE_SLAB_MAXPAGES. With each
+ *  page it keeps the occupancy and a byte of the hash of every name, so a lookup only reads the slots of a matching
+ *  name. If the pages cannot be held (out of memory, too many), lookups walk the chain for them and no slots are
+ *  added.
+ *
+ *  A new slot is written before its occupancy bit, a new page before its entry is allocated, both with the value in
+ *  it, and a page is freed with its last slot. Each of these is a single write or chain update, so a power loss
+ *  leaves a value either stored or not. The value of a slot is rewritten in place like the one of an entry.
+ */
+
+#include "PStorage.h"
+
+#define PSTORAGE_SLAB_HEADER		4  // type, slots, key size and a reserved byte
+
+boolean PStorage::_slabbed(EntryType type, unsigned int size) {
+	return (_params.features & PSTORAGE_FEATURE_SLABS) && (_params.engine == P_INPLACE) && (type >= P_INT) &&
+			(type <= P_FLOAT) && (size == PSTORAGE_SLAB_VALUE_SIZE);
+}
+
+boolean PStorage::_slabSearch(EntryType type, const char *name, PStorageSlab *page, unsigned int *slot) {
+	if (!(_params.features & PSTORAGE_FEATURE_SLABS) || (_params.engine != P_INPLACE)) {
+		return false;
+	}
+	const unsigned int hash = _nameHash(name);
+	if (_slabsTracked) {
+		for (unsigned int i = 0; i < _slabCount; i++) {
+			if (_slabFind(_slabs[i], type, name, hash, slot)) {
+				*page = _slabs[i];
+				return true;
+			}
+		}
+		return false;
+	}
+	PStorageIndexEntry ie;
+	if (!_readFirstIndexEntry(&ie)) {
+		return false;
+	}
+	while (true) {
+		if ((ie.type == P_SLAB) && _slabRead(ie, page) && _slabFind(*page, type, name, hash, slot)) {
+			return true;
+		}
+		if (_isLastIndexEntry(ie)) {
+			return false;
+		}
+		if ((ie.nextEntry <= ie.thisEntry) || !_seek(ie.nextEntry) || !_readIndexEntry(&ie)) {
+			PSTORAGE_DEBUG("_slabSearch(): Corruption, could not read entry at %d", ie.nextEntry);
+			return false;
+		}
+	}
+}
+
+boolean PStorage::_slabFind(const PStorageSlab &page, EntryType type, const char *name, unsigned int hash, unsigned int *slot) {
+	const unsigned int length = strlen(name);
+	if (((type != P_FREE) && (type != page.type)) || (length == 0) || (length > page.keySize)) {
+		return false;
+	}
+	for (unsigned int i = 0; i < page.slots; i++) {
+		if (!(page.used & (1U << i)) || (page.tags[i] != (byte) hash)) {
+			continue;
+		}
+		char key[PSTORAGE_NAME_MAXSIZE + 1];
+		if (!_seek(_slabSlot(page, i)) || !_read((byte *) key, page.keySize)) {
+			PSTORAGE_DEBUG("_slabFind(): Could not read slot %d of %d", i, page.entry);
+			return false;
+		}
+		key[page.keySize] = '\0';
+		if (strcasecmp(key, name) == 0) {
+			*slot = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+boolean PStorage::_slabGet(EntryType type, const char *name, byte *buf, unsigned int size) {
+	PStorageSlab page;
+	unsigned int slot;
+	if (!_slabbed(type, size) || !_slabSearch(type, name, &page, &slot)) {
+		return false;
+	}
+	return _seek(_slabSlot(page, slot) + page.keySize) && _read(buf, size);
+}
+
+boolean PStorage::_slabWrite(const PStorageSlab &page, unsigned int slot, const byte *buf) {
+	if (!_seek(_slabSlot(page, slot) + page.keySize) || !_write(buf, PSTORAGE_SLAB_VALUE_SIZE)) {
+		PSTORAGE_DEBUG("_slabWrite(): Could not write slot %d of %d", slot, page.entry);
+		return false;
+	}
+	return _flush();
+}
+
+/*
+ * Stores a new scalar in a free slot of a page of its type, or in a new page. False leaves it to an entry of its own.
+ */
+boolean PStorage::_slabInsert(EntryType type, const char *name, const byte *buf) {
+	PSTORAGE_DEBUG("_slabInsert(): Called");
+
+	const unsigned int length = strlen(name);
+	if (!_slabsTracked || (length == 0) || (length > PSTORAGE_SLAB_KEY_SIZE)) {
+		return false;
+	}
+	for (unsigned int i = 0; i < _slabCount; i++) {
+		PStorageSlab &page = _slabs[i];
+		const unsigned int full = (page.slots < 32) ? (1U << page.slots) - 1 : 0xFFFFFFFF;
+		if ((page.type != type) || (page.used == full) || (length > page.keySize)) {
+			continue;
+		}
+		unsigned int slot = 0;
+		while (page.used & (1U << slot)) {
+			slot++;
+		}
+		char key[PSTORAGE_NAME_MAXSIZE + 1];
+		memset(key, 0, sizeof(key));
+		memcpy(key, name, length);
+		const byte bits = (byte) ((page.used | (1U << slot)) >> (slot & ~7U));
+		if (!_seek(_slabSlot(page, slot)) || !_write((byte *) key, page.keySize) || !_write(buf, PSTORAGE_SLAB_VALUE_SIZE) ||
+				!_flush() || !_seek(page.entry + _headerSize() + PSTORAGE_SLAB_HEADER + slot / 8) || !_write(&bits, 1) ||
+				!_flush()) {
+			PSTORAGE_DEBUG("_slabInsert(): Could not write slot %d of %d", slot, page.entry);
+			return false;
+		}
+		page.used |= 1U << slot;
+		page.tags[slot] = (byte) _nameHash(name);
+		return true;
+	}
+	return (_slabCount < PSTORAGE_SLAB_MAXPAGES) && _slabCreate(type, name, buf);
+}
+
+boolean PStorage::_slabCreate(EntryType type, const char *name, const byte *buf) {
+	PSTORAGE_DEBUG("_slabCreate(): Called");
+
+	const unsigned int size = _slabSize(PSTORAGE_SLAB_SLOTS, PSTORAGE_SLAB_KEY_SIZE);
+	PStorageIndexEntry ie;
+	if (!_searchFreeIndexEntry(size, &ie)) {
+		return false;
+	}
+	// written while the entry is still free, so the page only appears with the value in its first slot
+	byte header[PSTORAGE_SLAB_HEADER + 4] = {(byte) type, PSTORAGE_SLAB_SLOTS, PSTORAGE_SLAB_KEY_SIZE, 0, 1, 0, 0, 0};
+	char key[PSTORAGE_SLAB_KEY_SIZE];
+	memset(key, 0, sizeof(key));
+	memcpy(key, name, strlen(name));
+	if (!_seek(ie.thisEntry + _headerSize()) || !_write(header, PSTORAGE_SLAB_HEADER + (PSTORAGE_SLAB_SLOTS + 7) / 8) ||
+			!_write((byte *) key, sizeof(key)) || !_write(buf, PSTORAGE_SLAB_VALUE_SIZE) || !_flush()) {
+		PSTORAGE_DEBUG("_slabCreate(): Could not write the page at %d", ie.thisEntry);
+		return false;
+	}
+	if (!_allocateIn("", size, P_SLAB, &ie)) {
+		return false;
+	}
+	PStorageSlab page;
+	page.entry = ie.thisEntry;
+	page.used = 1;
+	page.type = type;
+	page.slots = PSTORAGE_SLAB_SLOTS;
+	page.keySize = PSTORAGE_SLAB_KEY_SIZE;
+	page.tags[0] = (byte) _nameHash(name);
+	_slabTrack(page);
+	return true;
+}
+
+boolean PStorage::_slabErase(const PStorageSlab &page, unsigned int slot) {
+	PSTORAGE_DEBUG("_slabErase(): Called");
+
+	const unsigned int used = page.used & ~(1U << slot);
+	if (used == 0) {  // the page goes with its last slot
+		PStorageIndexEntry ie;
+		if (!_seek(page.entry) || !_readIndexEntry(&ie)) {
+			PSTORAGE_DEBUG("_slabErase(): Could not read index entry at %d", page.entry);
+			return false;
+		}
+		_slabUntrack(page.entry);
+		return _free(&ie);
+	}
+	const byte bits = (byte) (used >> (slot & ~7U));
+	if (!_seek(page.entry + _headerSize() + PSTORAGE_SLAB_HEADER + slot / 8) || !_write(&bits, 1) || !_flush()) {
+		PSTORAGE_DEBUG("_slabErase(): Could not clear slot %d of %d", slot, page.entry);
+		return false;
+	}
+	for (unsigned int i = 0; i < _slabCount; i++) {
+		if (_slabs[i].entry == page.entry) {
+			_slabs[i].used = used;
+		}
+	}
+	return true;
+}
+
+boolean PStorage::_slabClear(const char *name) {
+	PStorageSlab page;
+	unsigned int slot;
+	while (_slabSearch(P_FREE, name, &page, &slot)) {
+		if (!_slabErase(page, slot)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+boolean PStorage::_slabRead(const PStorageIndexEntry ie, PStorageSlab *page) {
+	byte header[PSTORAGE_SLAB_HEADER + 4];
+	if (!_seek(ie.thisEntry + _headerSize()) || !_read(header, PSTORAGE_SLAB_HEADER)) {
+		PSTORAGE_DEBUG("_slabRead(): Could not read the page at %d", ie.thisEntry);
+		return false;
+	}
+	page->entry = ie.thisEntry;
+	page->type = header[0];
+	page->slots = header[1];
+	page->keySize = header[2];
+	if ((page->slots == 0) || (page->slots > PSTORAGE_SLAB_SLOTS) || (page->keySize == 0) ||
+			(page->keySize > PSTORAGE_NAME_MAXSIZE) || (_size(ie) < _slabSize(page->slots, page->keySize)) ||
+			!_read(header + PSTORAGE_SLAB_HEADER, (page->slots + 7) / 8)) {
+		PSTORAGE_DEBUG("_slabRead(): Invalid page at %d", ie.thisEntry);
+		return false;
+	}
+	page->used = 0;
+	for (unsigned int i = 0; i < page->slots; i++) {
+		if (!(header[PSTORAGE_SLAB_HEADER + i / 8] & (1 << (i % 8)))) {
+			continue;
+		}
+		char key[PSTORAGE_NAME_MAXSIZE + 1];
+		if (!_seek(_slabSlot(*page, i)) || !_read((byte *) key, page->keySize)) {
+			PSTORAGE_DEBUG("_slabRead(): Could not read slot %d of %d", i, ie.thisEntry);
+			return false;
+		}
+		key[page->keySize] = '\0';
+		page->used |= 1U << i;
+		page->tags[i] = (byte) _nameHash(key);
+	}
+	return true;
+}
+
+unsigned int PStorage::_slabSlot(const PStorageSlab &page, unsigned int slot) {
+	return page.entry + _headerSize() + PSTORAGE_SLAB_HEADER + (page.slots + 7) / 8 +
+			slot * (page.keySize + PSTORAGE_SLAB_VALUE_SIZE);
+}
+
+unsigned int PStorage::_slabSize(unsigned int slots, unsigned int keySize) {
+	return PSTORAGE_SLAB_HEADER + (slots + 7) / 8 + slots * (keySize + PSTORAGE_SLAB_VALUE_SIZE);
+}
+
+void PStorage::_slabTrack(const PStorageSlab &page) {
+	if (!_slabsTracked) {
+		return;
+	}
+	if (_slabCount == _slabCapacity) {
+		unsigned int newCapacity = min(max(2 * _slabCapacity, 4U), (unsigned int) PSTORAGE_SLAB_MAXPAGES);
+		PStorageSlab *newSlabs = NULL;
+		if (newCapacity > _slabCapacity) {
+			newSlabs = (PStorageSlab *) realloc(_slabs, newCapacity * sizeof(PStorageSlab));
+		}
+		if (newSlabs == NULL) {
+			PSTORAGE_DEBUG("_slabTrack(): Slab pages exhausted, falling back to chain search");
+			_slabDrop();
+			return;
+		}
+		_slabs = newSlabs;
+		_slabCapacity = newCapacity;
+	}
+	_slabs[_slabCount++] = page;
+}
+
+void PStorage::_slabUntrack(unsigned int entry) {
+	for (unsigned int i = 0; i < _slabCount; i++) {
+		if (_slabs[i].entry == entry) {
+			_slabs[i] = _slabs[--_slabCount];
+			return;
+		}
+	}
+}
+
+void PStorage::_slabMoved(unsigned int from, unsigned int to) {
+	for (unsigned int i = 0; i < _slabCount; i++) {
+		if (_slabs[i].entry == from) {
+			_slabs[i].entry = to;
+		}
+	}
+}
+
+void PStorage::_slabDrop() {
+	if (_slabs != NULL) {
+		free(_slabs);
+		_slabs = NULL;
+	}
+	_slabCount = 0;
+	_slabCapacity = 0;
+	_slabsTracked = false;
+}
@@ -0,0 +1,447 @@
+/*
+ * PStorageSortedIndex.cpp
+ *
+ *  Sorted index of P_INPLACE, the addition of file format v2.
+ *
+ *  Without the RAM index (more entries than PSTORAGE_INDEX_CACHE_MAXENTRIES) a lookup walks the chain. A v2 store
+ *  created with an expected number of keys also keeps a PStorageSortedRecord of every allocated entry in pages of
+ *  its own: a PStorageSortedHeader followed
+ *  by buckets of PSTORAGE_SORTED_BUCKET slots. Each bucket covers an equal range of hashes and holds its records
+ *  ordered by hash and position, the unused slots at its end. A full bucket spills its largest records to the front
+ *  of the next one, so all records stay in order. A lookup is a binary search in the bucket of the hash, which reads
+ *  a few slots of one or two pages, and then the index entries of the candidates.
+ *
+ *  Inserting and removing shift the records behind the slot within the bucket only, at most 256 bytes. A record
+ *  that falls off a full bucket goes on to the next one, removing from a full bucket takes its spilled record back.
+ *  Such cascades stay short as long as the index has room, like linear probing.
+ *
+ *  create() with keys > 0 puts the index page aligned in front of the first entry (_params.indexStart), with room
+ *  for half as many keys more in whole buckets, and leaves its slots filler, which reads as empty. Without keys the
+ *  store has no index and its file nothing but the params in front of the first entry. open() migrates a v1 store
+ *  that holds more keys than the RAM index with two walks of its chain, one to count the records and one to insert
+ *  them: v1 stores have no room in front of their first entry and are not journaled, so the index is appended behind
+ *  the data area. It is not part of getPStorageSize(), the file grows by 8 bytes per slot, see getFileSize(). The
+ *  new magic cookie is written last, so an interrupted migration starts over.
+ *
+ *  The chain updates note the record they add and the one they remove in _sortedAdded/_sortedRemoved, which
+ *  _journalCommit() applies between writing the journal record and the index entries. A power loss may tear a
+ *  shift, so if open() has to repeat an update, the index is marked stale first and built again by a walk of the
+ *  chain. A candidate still only counts if it is an allocated entry of that name its predecessor links to, stores
+ *  without the journal have no such guarantee.
+ *  Packed entries have no back pointer, there the candidate is taken as found.
+ *
+ *  A full index is given up (capacity 0 on disk), lookups walk the chain again.
+ */
+
+#include "PStorage.h"
+
+#define PSTORAGE_SORTED_MAGIC		0x42444950  // "PIDB"
+#define PSTORAGE_SORTED_STALE		0x454C5453  // "STLE", to be built again by open()
+#define PSTORAGE_SORTED_EMPTY		0xFFFFFFFF  // hash and entry of an unused slot
+#define PSTORAGE_SORTED_BUCKET		32  // slots per bucket, part of the format
+
+static boolean _sortedLess(const PStorageSortedRecord &a, const PStorageSortedRecord &b) {
+	return (a.hash < b.hash) || ((a.hash == b.hash) && (a.entry < b.entry));
+}
+
+void PStorage::_sortedPlan(unsigned int keys) {
+	PSTORAGE_DEBUG("_sortedPlan(): Called");
+
+	_sortedStart = _sortedCapacity = 0;
+	if ((_params.engine != P_INPLACE) || (keys == 0)) {
+		return;
+	}
+	const unsigned int page = PSTORAGE_IO_BUFFER_SIZE;
+	_sortedStart = (_params.firstEntry + page - 1) / page * page;
+	unsigned int end = _sortedSlot(_sortedSlots(keys));
+	end = (end + page - 1) / page * page;  // the rest of the last page holds slots too
+	_sortedCapacity = (end - _sortedSlot(0)) / sizeof(PStorageSortedRecord) / PSTORAGE_SORTED_BUCKET * PSTORAGE_SORTED_BUCKET;
+	_params.indexStart = _sortedStart;
+	_params.firstEntry = end;
+}
+
+boolean PStorage::_sortedFormat() {
+	PSTORAGE_DEBUG("_sortedFormat(): Called");
+
+	if (_sortedCapacity == 0) {
+		return true;
+	}
+	// the slots still hold the filler of create(), which _sortedRead() takes for empty
+	PStorageSortedHeader header = {PSTORAGE_SORTED_MAGIC, _sortedCapacity};
+	return _seek(_sortedStart) && _write((byte *) &header, sizeof(PStorageSortedHeader)) && _flush();
+}
+
+boolean PStorage::_sortedLoad() {
+	PSTORAGE_DEBUG("_sortedLoad(): Called");
+
+	_sortedStart = _sortedCapacity = 0;
+	if (_params.engine != P_INPLACE) {
+		return true;
+	}
+	// v1 stores have no room for indexStart in front of their first entry, their index follows the data area
+	const boolean inFront = (_params.firstEntry >= offsetof(PStorageParams, indexStart) + sizeof(_params.indexStart));
+	const unsigned int start = inFront ? _params.indexStart : _params.firstEntry + _params.size;
+	if (start == 0) {
+		return true;
+	}
+	PStorageSortedHeader header;
+	if (!_seek(start) || !_read((byte *) &header, sizeof(PStorageSortedHeader))) {
+		PSTORAGE_DEBUG("_sortedLoad(): Could not read the header at %d", start);
+		return false;
+	}
+	_sortedStart = start;
+	if (inFront) {  // the slots end at the wear counts, the checkpoint or the first entry, a torn header only costs a rebuild
+		unsigned int end = _params.firstEntry;
+		if ((_params.features & PSTORAGE_FEATURE_WEAR) && (_params.wearStart > start)) {
+			end = min(end, _params.wearStart);
+		}
+		if ((_params.features & PSTORAGE_FEATURE_CHECKPOINT) && (_params.checkpointStart > start)) {
+			end = min(end, _params.checkpointStart);
+		}
+		const unsigned int slots = (end - _sortedSlot(0)) / sizeof(PStorageSortedRecord);
+		_sortedCapacity = ((header.magic == PSTORAGE_SORTED_MAGIC) ? min(header.capacity, slots) : slots) /
+				PSTORAGE_SORTED_BUCKET * PSTORAGE_SORTED_BUCKET;
+	}
+	else if ((header.magic == PSTORAGE_SORTED_MAGIC) || (header.magic == PSTORAGE_SORTED_STALE)) {
+		_sortedCapacity = header.capacity / PSTORAGE_SORTED_BUCKET * PSTORAGE_SORTED_BUCKET;
+	}
+	else {  // migrated without one, the filler behind the end of the file is no header
+		_sortedStart = 0;
+	}
+	return true;
+}
+
+boolean PStorage::_sortedCheck() {
+	PSTORAGE_DEBUG("_sortedCheck(): Called");
+
+	PStorageSortedHeader header;
+	if ((_sortedCapacity == 0) || !_seek(_sortedStart) || !_read((byte *) &header, sizeof(PStorageSortedHeader))) {
+		return _sortedCapacity == 0;
+	}
+	return (header.magic == PSTORAGE_SORTED_MAGIC) || _sortedBuild(_sortedStart, _sortedCapacity);
+}
+
+boolean PStorage::_sortedInvalidate() {
+	PSTORAGE_DEBUG("_sortedInvalidate(): Called");
+
+	const PStorageSortedHeader header = {PSTORAGE_SORTED_STALE, _sortedCapacity};
+	return (_sortedCapacity == 0) ||
+			(_seek(_sortedStart) && _write((byte *) &header, sizeof(PStorageSortedHeader)) && _flush());
+}
+
+boolean PStorage::_sortedMigrate() {
+	PSTORAGE_DEBUG("_sortedMigrate(): Called");
+
+	_sortedStart = _sortedCapacity = 0;
+	if ((_params.engine == P_INPLACE) && !_sortedBuild(_params.firstEntry + _params.size, 0)) {  // v1 stores have no room in front of their first entry
+		return false;
+	}
+	_params.magicCookie = PSTORAGE_MAGIC_COOKIE_V2;  // v1 stores have no hashed names, v2 firmware still opens them
+	_params.indexStart = _sortedStart;  // only written if the params have room for it
+	return _writeParams() && _flush();
+}
+
+/*
+ * Inserts the records of all allocated entries with one walk of the chain into the cleared index at start. A
+ * capacity of 0 counts them with a first walk and leaves room for half as many more, or, if the RAM index holds
+ * them all, builds no index. The header goes last.
+ */
+boolean PStorage::_sortedBuild(unsigned int start, unsigned int capacity) {
+	PSTORAGE_DEBUG("_sortedBuild(): Called");
+
+	_sortedStart = start;
+	_sortedCapacity = 0;
+	unsigned int count = 0;
+	for (boolean counting = (capacity == 0); true; counting = false) {
+		unsigned int previousEntry = 0;
+		PStorageIndexEntry ie;
+		if (!counting) {
+			_sortedCapacity = capacity / PSTORAGE_SORTED_BUCKET * PSTORAGE_SORTED_BUCKET;
+			if (!_sortedClear(0, _sortedCapacity)) {
+				return false;
+			}
+		}
+		if (!_readFirstIndexEntry(&ie)) {
+			return false;
+		}
+		while (true) {
+			if (!counting && !_packed() && (ie.previousEntry != previousEntry)) {  // stale back pointers of earlier versions, _sortedMatch() relies on them
+				ie.previousEntry = previousEntry;
+				if (!_seek(ie.thisEntry) || !_writeIndexEntry(ie)) {
+					return false;
+				}
+			}
+			if ((ie.type != P_FREE) && (_nameLength(ie) > 0)) {  // slab pages and the nameless entry of an interrupted write() have no record
+				if (counting) {
+					count++;
+				}
+				else if (!_sortedInsert(_sortedRecord(ie))) {
+					return false;
+				}
+				else if (_sortedCapacity == 0) {  // full, given up
+					return true;
+				}
+			}
+			if (_isLastIndexEntry(ie)) {
+				break;
+			}
+			previousEntry = ie.thisEntry;
+			if ((ie.nextEntry <= ie.thisEntry) || !_seek(ie.nextEntry) || !_readIndexEntry(&ie)) {
+				PSTORAGE_DEBUG("_sortedBuild(): Corruption, could not read entry at %d", ie.nextEntry);
+				return false;
+			}
+		}
+		if (!counting) {
+			break;
+		}
+		if (count <= PSTORAGE_INDEX_CACHE_MAXENTRIES) {  // lookups are served from RAM, the file does not grow
+			_sortedStart = 0;
+			return true;
+		}
+		capacity = _sortedSlots(count);
+	}
+	PStorageSortedHeader header = {PSTORAGE_SORTED_MAGIC, _sortedCapacity};
+	if (!_seek(_sortedStart) || !_write((byte *) &header, sizeof(PStorageSortedHeader)) || !_flush()) {
+		PSTORAGE_DEBUG("_sortedBuild(): Could not write the sorted index at %d", _sortedStart);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Applies the changes noted by the running chain update, written back before its index entries
+ */
+boolean PStorage::_sortedApply() {
+	if (_sortedCapacity == 0) {
+		return true;
+	}
+	return ((_sortedAdded.hash == PSTORAGE_SORTED_EMPTY) || _sortedInsert(_sortedAdded)) &&
+			((_sortedRemoved.hash == PSTORAGE_SORTED_EMPTY) || _sortedRemove(_sortedRemoved)) && _writeBackIOBuffer();
+}
+
+boolean PStorage::_sortedSearch(EntryType type, const char *name, PStorageIndexEntry *ie) {
+	PSTORAGE_DEBUG("_sortedSearch(): Called");
+
+	PStorageSortedRecord key = {_sortedHash(_nameHash(name)), 0}, record;
+	unsigned int slot;
+	if (!_sortedFind(key, &slot)) {
+		return false;
+	}
+	for (; slot < _sortedCapacity; slot++) {
+		if (!_sortedRead(slot, &record) || (record.hash != key.hash)) {
+			return false;
+		}
+		_pStorageCount(_stats.chainHops);
+		PSTORAGE_TRACE(P_TRACE_HOP, record.entry);
+		if (_sortedMatch(record.entry, type, name, ie)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+boolean PStorage::_sortedMatch(unsigned int entry, EntryType type, const char *name, PStorageIndexEntry *ie) {
+	if ((entry < _params.firstEntry) || (entry + _headerSize() > _params.firstEntry + _params.size) ||
+			!_seek(entry) || !_readIndexEntry(ie)) {
+		return false;
+	}
+	if ((ie->thisEntry != entry) || (ie->type == P_FREE) || ((type != P_FREE) && !_typeMatches(type, ie->type)) ||
+			!_nameMatches(*ie, name, _nameHash(name))) {
+		return false;
+	}
+	// the outdated index entry of a moved or freed value may still look allocated, but it is no longer linked
+	if (_packed()) {  // no back pointer to check, the journal keeps the index exact
+		return true;
+	}
+	if (_isFirstIndexEntry(*ie)) {
+		return entry == _params.firstEntry;
+	}
+	PStorageIndexEntry previousIE;
+	return (ie->previousEntry >= _params.firstEntry) && (ie->previousEntry < entry) &&
+			_seek(ie->previousEntry) && _readIndexEntry(&previousIE) && (previousIE.nextEntry == entry);
+}
+
+boolean PStorage::_sortedInsert(PStorageSortedRecord key) {
+	PSTORAGE_DEBUG("_sortedInsert(): Called");
+
+	const PStorageSortedRecord empty = {PSTORAGE_SORTED_EMPTY, PSTORAGE_SORTED_EMPTY};
+	PStorageSortedRecord record;
+	unsigned int slot;
+	if (!_sortedFind(key, &slot)) {
+		return false;
+	}
+	if (slot < _sortedCapacity) {
+		if (!_sortedRead(slot, &record)) {
+			return false;
+		}
+		if ((record.hash == key.hash) && (record.entry == key.entry)) {
+			return true;
+		}
+	}
+	while (slot < _sortedCapacity) {  // the largest record of a full bucket moves to the front of the next one
+		const unsigned int last = (slot / PSTORAGE_SORTED_BUCKET + 1) * PSTORAGE_SORTED_BUCKET - 1;
+		unsigned int used;
+		if (!_sortedRead(last, &record) || !_sortedBound(slot / PSTORAGE_SORTED_BUCKET, empty, &used) ||
+				!_copyBytes(_sortedSlot(slot), _sortedSlot(slot + 1), (min(used, last) - slot) * sizeof(PStorageSortedRecord)) ||
+				!_sortedWrite(slot, key)) {
+			return false;
+		}
+		if (record.hash == PSTORAGE_SORTED_EMPTY) {
+			return true;
+		}
+		key = record;
+		slot = last + 1;
+	}
+	return _sortedDrop();
+}
+
+boolean PStorage::_sortedRemove(const PStorageSortedRecord key) {
+	PSTORAGE_DEBUG("_sortedRemove(): Called");
+
+	if (_sortedCapacity == 0) {  // given up by the insertion
+		return true;
+	}
+	const PStorageSortedRecord empty = {PSTORAGE_SORTED_EMPTY, PSTORAGE_SORTED_EMPTY};
+	PStorageSortedRecord record;
+	unsigned int slot;
+	if (!_sortedFind(key, &slot)) {
+		return false;
+	}
+	if (slot == _sortedCapacity) {
+		return true;
+	}
+	if (!_sortedRead(slot, &record)) {
+		return false;
+	}
+	if ((record.hash != key.hash) || (record.entry != key.entry)) {  // not there
+		return true;
+	}
+	while (true) {  // a full bucket takes back the first record of the next one if that belongs to it or before
+		const unsigned int bucket = slot / PSTORAGE_SORTED_BUCKET, last = (bucket + 1) * PSTORAGE_SORTED_BUCKET - 1;
+		unsigned int used;
+		if (!_sortedBound(bucket, empty, &used) ||
+				!_copyBytes(_sortedSlot(slot + 1), _sortedSlot(slot), (used - slot - 1) * sizeof(PStorageSortedRecord))) {
+			return false;
+		}
+		record = empty;
+		if ((used == last + 1) && (last + 1 < _sortedCapacity) && !_sortedRead(last + 1, &record)) {
+			return false;
+		}
+		if ((record.hash == PSTORAGE_SORTED_EMPTY) || (_sortedHome(record.hash) > bucket)) {
+			return _sortedWrite(used - 1, empty);
+		}
+		if (!_sortedWrite(last, record)) {
+			return false;
+		}
+		slot = last + 1;
+	}
+}
+
+/*
+ * The first slot not less than key from the home bucket of its hash on, records only spill over the end of a full
+ * bucket. The first unused slot of a bucket that is not full, or the capacity if key is beyond all records.
+ */
+boolean PStorage::_sortedFind(const PStorageSortedRecord key, unsigned int *slot) {
+	for (unsigned int bucket = _sortedHome(key.hash); bucket < _sortedCapacity / PSTORAGE_SORTED_BUCKET; bucket++) {
+		if (!_sortedBound(bucket, key, slot)) {
+			return false;
+		}
+		if (*slot < (bucket + 1) * PSTORAGE_SORTED_BUCKET) {
+			return true;
+		}
+	}
+	*slot = _sortedCapacity;
+	return true;
+}
+
+boolean PStorage::_sortedBound(unsigned int bucket, const PStorageSortedRecord key, unsigned int *slot) {
+	unsigned int low = bucket * PSTORAGE_SORTED_BUCKET, high = low + PSTORAGE_SORTED_BUCKET;
+	while (low < high) {
+		unsigned int middle = low + (high - low) / 2;
+		PStorageSortedRecord record;
+		if (!_sortedRead(middle, &record)) {
+			return false;
+		}
+		if (_sortedLess(record, key)) {
+			low = middle + 1;
+		}
+		else {
+			high = middle;
+		}
+	}
+	*slot = low;
+	return true;
+}
+
+unsigned int PStorage::_sortedHome(unsigned int hash) {
+	return (unsigned int) (((unsigned long long) hash * (_sortedCapacity / PSTORAGE_SORTED_BUCKET)) >> 32);
+}
+
+boolean PStorage::_sortedRead(unsigned int slot, PStorageSortedRecord *record) {
+	if (!_seek(_sortedSlot(slot)) || !_read((byte *) record, sizeof(PStorageSortedRecord))) {
+		PSTORAGE_DEBUG("_sortedRead(): Could not read slot %d", slot);
+		return false;
+	}
+	PStorageSortedRecord filler;
+	memset(&filler, PSTORAGE_FILLER, sizeof(PStorageSortedRecord));
+	if ((record->hash == filler.hash) && (record->entry == filler.entry)) {  // not written since create(), no entry lies that far
+		record->hash = record->entry = PSTORAGE_SORTED_EMPTY;
+	}
+	return true;
+}
+
+boolean PStorage::_sortedWrite(unsigned int slot, const PStorageSortedRecord record) {
+	if (!_seek(_sortedSlot(slot)) || !_write((byte *) &record, sizeof(PStorageSortedRecord))) {
+		PSTORAGE_DEBUG("_sortedWrite(): Could not write slot %d", slot);
+		return false;
+	}
+	return true;
+}
+
+boolean PStorage::_sortedClear(unsigned int from, unsigned int to) {
+	const PStorageSortedRecord empty = {PSTORAGE_SORTED_EMPTY, PSTORAGE_SORTED_EMPTY};
+	for (unsigned int slot = from; slot < to; slot++) {
+		if (!_sortedWrite(slot, empty)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+boolean PStorage::_sortedDrop() {
+	PSTORAGE_DEBUG("_sortedDrop(): Sorted index is full, falling back to chain search");
+
+	const PStorageSortedHeader header = {PSTORAGE_SORTED_MAGIC, 0};
+	_sortedCapacity = 0;
+	return _seek(_sortedStart) && _write((byte *) &header, sizeof(PStorageSortedHeader)) && _flush();
+}
+
+unsigned int PStorage::_sortedSlot(unsigned int slot) {
+	return _sortedStart + sizeof(PStorageSortedHeader) + slot * sizeof(PStorageSortedRecord);
+}
+
+unsigned int PStorage::_sortedSlots(unsigned int keys) {  // half as many more, in whole buckets
+	return (keys + keys / 2 + PSTORAGE_SORTED_BUCKET - 1) / PSTORAGE_SORTED_BUCKET * PSTORAGE_SORTED_BUCKET;
+}
+
+PStorageSortedRecord PStorage::_sortedRecord(const PStorageIndexEntry ie) {
+	PStorageSortedRecord record = {PSTORAGE_SORTED_EMPTY, PSTORAGE_SORTED_EMPTY};
+	if (_nameLength(ie) > 0) {
+		record.hash = _sortedHash(_entryHash(ie));
+		record.entry = ie.thisEntry;
+	}
+	return record;
+}
+
+unsigned int PStorage::_sortedHash(unsigned int hash) {  // of _nameHash(), the high bits pick the bucket
+	// FNV-1a hardly spreads the last characters of a name into the high bits
+	hash = (hash ^ (hash >> 16)) * 0x85EBCA6BU;
+	hash = (hash ^ (hash >> 13)) * 0xC2B2AE35U;
+	hash ^= hash >> 16;
+	return (hash == PSTORAGE_SORTED_EMPTY) ? hash - 1 : hash;
+}
+
+void PStorage::_sortedReset() {
+	_sortedAdded.hash = _sortedAdded.entry = PSTORAGE_SORTED_EMPTY;
+	_sortedRemoved = _sortedAdded;
+}
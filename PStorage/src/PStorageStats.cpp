@@ -0,0 +1,58 @@
+/*
+ * PStorageStats.cpp
+ *
+ *  Counters of the store for tuning on the device: lookups and the index entries they read, File reads and writes
+ *  with their bytes, flushes, allocations with their splits, merges and failures, and the writes avoided by deferred
+ *  keys and the write-behind queue. map(), get() and remove() add their duration to a latency histogram with
+ *  logarithmic buckets.
+ *
+ *  The counters are kept in RAM, unsigned int that wrap, and cost an increment each, with
+ *  PSTORAGE_CONCURRENCY_ENABLED an atomic one, as shared readers count side by side. getStats() copies them,
+ *  resetStats() starts them from 0 again. They are not stored.
+ */
+
+#include "PStorage.h"
+
+PStorageTimer::~PStorageTimer() {
+	unsigned long elapsed = micros() - _start;
+	PSTORAGE_TRACE((PStorageTraceEvent) (_event + 1), elapsed);
+	unsigned int bucket = 0;
+	while ((elapsed > 1) && (bucket < PSTORAGE_STATS_BUCKETS - 1)) {
+		elapsed >>= 1;
+		bucket++;
+	}
+	_pStorageCount(_histogram[bucket]);
+}
+
+void PStorage::getStats(PStorageStats *stats) {
+	const unsigned int *from = (const unsigned int *) &_stats;
+	unsigned int *to = (unsigned int *) stats;
+	for (unsigned int i = 0; i < sizeof(PStorageStats) / sizeof(unsigned int); i++) {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+		to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+#else
+		to[i] = from[i];
+#endif
+	}
+}
+
+void PStorage::resetStats() {
+	PSTORAGE_DEBUG("resetStats(): Called");
+
+	unsigned int *counters = (unsigned int *) &_stats;
+	for (unsigned int i = 0; i < sizeof(PStorageStats) / sizeof(unsigned int); i++) {
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+#else
+		counters[i] = 0;
+#endif
+	}
+}
+
+boolean PStorage::_allocationFailed(unsigned int minSize) {
+	PSTORAGE_DEBUG("_allocationFailed(): No free entry of %d bytes", minSize);
+	(void) minSize;
+	_pStorageCount(_stats.allocationFailures);
+	PSTORAGE_TRACE(P_TRACE_ALLOCATION_FAILED, minSize);
+	return false;
+}
@@ -0,0 +1,171 @@
+/*
+ * PStorageStream.cpp
+ *
+ *  Partial access to values: read() and write() at an offset, append() and read() in chunks through a callback,
+ *  so large P_ARRAY and P_STRING values can be patched or streamed without a full rewrite or a full size copy in RAM.
+ *
+ *  The length of a value is the allocated size minus the slack its index entry records (PSTORAGE_FEATURE_LENGTH),
+ *  in stores created before, it is the allocated size.
+ *
+ *  A write() within the allocated size patches the value in place and updates the slack if the value grows. A
+ *  larger value moves to a new entry: it is allocated without a name, gets the old bytes and the new ones, and
+ *  only then takes over the name from the old entry in one journal record before the old entry is freed. An
+ *  interrupted move thus leaves the old or the new value and a nameless entry, which the next open() that walks the
+ *  chain or compact() frees. P_LOG appends a new version like map().
+ *
+ *  Compressed values are decoded by read() from the start, an offset skips decoded bytes. write() and append()
+ *  reject them, they are replaced with map().
+ *
+ *  With write-behind read() and getSize() see a queued value once it is written, write() and append() write the
+ *  queue first.
+ */
+
+#include "PStorage.h"
+
+int PStorage::read(const char *name, unsigned int offset, byte buf[], unsigned int size) {
+	PSTORAGE_DEBUG("read(): Called");
+	PStorageLock lock(*this, true);
+
+	unsigned int start, length;
+	EntryType type;
+	if (!_searchValue(name, &start, &length, &type)) {
+		return -1;
+	}
+	if (_compressed(type)) {
+		return _lzDecode(start, length, offset, buf, size, NULL, NULL);
+	}
+	if (offset > length) {
+		PSTORAGE_DEBUG("read(): Offset %d is behind the value of %d bytes", offset, length);
+		return -1;
+	}
+	unsigned int bytes = min(size, length - offset);
+	if (!_seek(start + offset) || !_read(buf, bytes)) {
+		PSTORAGE_DEBUG("read(): Could not read %d bytes at %d", bytes, _position);
+		return -1;
+	}
+	return bytes;
+}
+
+boolean PStorage::read(const char *name, PStorageChunkCallback callback, void *context) {
+	PSTORAGE_DEBUG("read(): Called");
+	PStorageLock lock(*this, true);
+
+	unsigned int start, length;
+	EntryType type;
+	if (!_searchValue(name, &start, &length, &type)) {
+		return false;
+	}
+	if (_compressed(type)) {
+		return (_lzDecode(start, length, 0, NULL, 0xFFFFFFFF, callback, context) >= 0);
+	}
+	byte chunk[PSTORAGE_STREAM_CHUNK_SIZE];
+	for (unsigned int offset = 0; offset < length; offset += sizeof(chunk)) {
+		unsigned int bytes = min(length - offset, (unsigned int) sizeof(chunk));
+		if (!_seek(start + offset) || !_read(chunk, bytes)) {
+			PSTORAGE_DEBUG("read(): Could not read %d bytes at %d", bytes, _position);
+			return false;
+		}
+		if (!callback(chunk, bytes, offset, context)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+boolean PStorage::write(const char *name, unsigned int offset, const byte buf[], unsigned int size) {
+	PSTORAGE_DEBUG("write(): Called");
+	PStorageLock lock(*this, false);
+
+	_queueDrain();  // the write builds on queued values
+
+	PStorageIndexEntry ie;
+	unsigned int start, length;
+	EntryType type;
+	if (!_searchIndexEntry(name, &ie)) {
+		if (_searchValue(name, &start, &length, &type)) {  // a scalar in a slab
+			PSTORAGE_DEBUG("write(): %s is no P_ARRAY or P_STRING", name);
+			return false;
+		}
+		if (offset > 0) {
+			PSTORAGE_DEBUG("write(): No value %s to write at offset %d", name, offset);
+			return false;
+		}
+		return _mapArray(name, buf, size, false);  // under the lock already, the queue is drained
+	}
+	if (_compressed(ie.type)) {
+		PSTORAGE_DEBUG("write(): %s is stored compressed", name);
+		return false;
+	}
+	if ((ie.type != P_ARRAY) && (ie.type != P_STRING)) {
+		PSTORAGE_DEBUG("write(): %s is no P_ARRAY or P_STRING", name);
+		return false;
+	}
+	length = _length(ie);
+	if (offset > length) {
+		PSTORAGE_DEBUG("write(): Offset %d is behind the value of %d bytes", offset, length);
+		return false;
+	}
+	const unsigned int newLength = (offset + size > length) ? offset + size : length;
+	if (_params.engine == P_LOG) {
+		return _logAppend(name, ie.type, buf, size, &ie, true, offset, newLength) && _logIndex(ie);
+	}
+	if (newLength <= _size(ie)) {
+		if (!_seek(ie.thisEntry + _headerSize() + offset) || !_write(buf, size) || !_flush()) {
+			PSTORAGE_DEBUG("write(): Could not write %d bytes at %d", size, _position);
+			return false;
+		}
+		return _setLength(&ie, newLength);
+	}
+	PStorageIndexEntry moved;
+	if (!_allocate("", newLength + _nameSize(name), ie.type, &moved)) {  // with room for the name
+		return false;
+	}
+	if (!_copyBytes(ie.thisEntry + _headerSize(), moved.thisEntry + _headerSize(), offset) ||
+			!_seek(moved.thisEntry + _headerSize() + offset) || !_write(buf, size) || !_flush()) {
+		PSTORAGE_DEBUG("write(): Could not move %s to %d", name, moved.thisEntry);
+		return false;
+	}
+	// the allocation may have rewired the old entry, it is read again. One journal record names the new entry and
+	// makes the old one nameless, a reset before its free leaves it to _freeOrphans()
+	if (!_seek(ie.thisEntry) || !_readIndexEntry(&ie)) {
+		return false;
+	}
+	_setName(&moved, name);
+	moved.slack = _size(moved) - newLength;
+	const PStorageSortedRecord removed = _sortedRecord(ie);
+	_setName(&ie, "");
+	_journalBegin();
+	_sortedAdded = _sortedRecord(moved);
+	_sortedRemoved = removed;
+	if (!_writeName(moved, name) || !_journalAdd(moved) || !_journalAdd(ie) || !_journalCommit()) {
+		PSTORAGE_DEBUG("write(): Could not name %s at %d", name, moved.thisEntry);
+		_freeIndexCache();
+		return false;
+	}
+	_cacheUpdate(ie);
+	_cacheUpdate(moved);
+	return _free(&ie);
+}
+
+boolean PStorage::append(const char *name, const byte buf[], unsigned int size) {
+	PSTORAGE_DEBUG("append(): Called");
+	PStorageLock lock(*this, false);
+
+	_queueDrain();  // getSize() sees written values only
+
+	unsigned int length = 0;  // a missing value is created
+	getSize(name, &length);
+	return write(name, length, buf, size);
+}
+
+boolean PStorage::getSize(const char *name, unsigned int *size) {
+	PSTORAGE_DEBUG("getSize(): Called");
+	PStorageLock lock(*this, true);
+
+	unsigned int start;
+	EntryType type;
+	if (!_searchValue(name, &start, size, &type)) {
+		return false;
+	}
+	return !_compressed(type) || _lzLength(start, size);
+}
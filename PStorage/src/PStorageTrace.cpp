@@ -0,0 +1,74 @@
+/*
+ * PStorageTrace.cpp
+ *
+ *  Binary trace of the stores for timing-sensitive bugs PSTORAGE_DEBUG would hide: with PSTORAGE_TRACE_RECORDS > 0
+ *  every trace point writes a PStorageTraceRecord of micros(), the PStorageTraceEvent and up to three integers into a
+ *  ring buffer in RAM. A trace point costs a micros() and 16 bytes of stores, no formatting and no Serial. Without
+ *  PSTORAGE_TRACE_RECORDS the trace points compile to nothing.
+ *
+ *  The ring is shared by all stores and keeps the last PSTORAGE_TRACE_RECORDS records. dumpTrace() passes a
+ *  PStorageTraceHeader and then the records, oldest first, to the callback, which may write them to Serial or a file.
+ *  host/PStorageTraceDump.cpp (pstorage_trace) decodes such a dump into a timeline. With PSTORAGE_CONCURRENCY_ENABLED
+ *  tasks trace side by side, a record traced during the dump may show up torn.
+ */
+
+#include "PStorage.h"
+
+#if(PSTORAGE_TRACE_RECORDS > 0)
+static PStorageTraceRecord _pStorageTraceRing[PSTORAGE_TRACE_RECORDS];
+static unsigned int _pStorageTraceNext = 0;  // records traced so far, the next one goes to this modulo PSTORAGE_TRACE_RECORDS
+#endif
+
+void _pStorageTrace(PStorageTraceEvent event, unsigned int arg0, unsigned int arg1, unsigned int arg2) {
+#if(PSTORAGE_TRACE_RECORDS > 0)
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	const unsigned int next = __atomic_fetch_add(&_pStorageTraceNext, 1, __ATOMIC_RELAXED);
+#else
+	const unsigned int next = _pStorageTraceNext++;
+#endif
+	PStorageTraceRecord &record = _pStorageTraceRing[next % PSTORAGE_TRACE_RECORDS];
+	record.micros = micros();
+	record.event = event;
+	record.arg2 = arg2;
+	record.arg0 = arg0;
+	record.arg1 = arg1;
+#else
+	(void) event;
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+#endif
+}
+
+boolean PStorage::dumpTrace(PStorageChunkCallback callback, void *context) {
+	PSTORAGE_DEBUG("dumpTrace(): Called");
+
+#if(PSTORAGE_TRACE_RECORDS > 0)
+#if(PSTORAGE_CONCURRENCY_ENABLED)
+	const unsigned int next = __atomic_load_n(&_pStorageTraceNext, __ATOMIC_RELAXED);
+#else
+	const unsigned int next = _pStorageTraceNext;
+#endif
+	PStorageTraceHeader header;
+	header.magic = PSTORAGE_TRACE_MAGIC;
+	header.recordSize = sizeof(PStorageTraceRecord);
+	header.records = min(next, (unsigned int) PSTORAGE_TRACE_RECORDS);
+	header.lost = next - header.records;
+	if (!callback((const byte *) &header, sizeof(header), 0, context)) {
+		return false;
+	}
+	unsigned int offset = sizeof(header);
+	for (unsigned int i = header.lost; i != next; i++) {  // oldest first
+		if (!callback((const byte *) &_pStorageTraceRing[i % PSTORAGE_TRACE_RECORDS], sizeof(PStorageTraceRecord), offset, context)) {
+			return false;
+		}
+		offset += sizeof(PStorageTraceRecord);
+	}
+	return true;
+#else
+	PSTORAGE_DEBUG("dumpTrace(): Compiled without PSTORAGE_TRACE_RECORDS");
+	(void) callback;
+	(void) context;
+	return false;
+#endif
+}
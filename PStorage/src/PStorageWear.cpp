@@ -0,0 +1,185 @@
+/*
+ * PStorageWear.cpp
+ *
+ *  Wear accounting and next-fit allocation of stores created with PSTORAGE_FEATURE_WEAR.
+ *
+ *  The file is divided into _wear.regions regions of _wear.regionSize bytes. Every write of the page buffer and
+ *  every direct write counts once for each region it touches, so the counts follow the program cycles of the flash
+ *  pages, the params and the journal records in region 0 included. getWearHistogram() returns them.
+ *
+ *  The counts and the allocation cursor are kept in RAM and written to one of two copies in front of the first
+ *  entry (_params.wearStart) after PSTORAGE_WEAR_SAVE_WRITES counted writes and when the store is closed. Like the
+ *  journal, every save goes to the other copy with the next sequence number, a torn one fails its checksum and
+ *  the previous copy is taken. A reset loses at most the counts since the last save.
+ *
+ *  Best-fit allocation takes the smallest fitting free entry, which tends to be the same one at a low offset again
+ *  and again. With the wear header the allocation is next-fit instead: the first fitting free entry at or behind the
+ *  cursor, which then moves behind the new value, so new values rotate through the store. Values overwritten in
+ *  place stay where they are, their writes show in the counts.
+ */
+
+#include "PStorage.h"
+
+#define PSTORAGE_WEAR_MAGIC		0x52414557  // "WEAR"
+
+unsigned int PStorage::getWearHistogram(unsigned int counts[], unsigned int maxRegions, unsigned int *regionSize) {
+	PSTORAGE_DEBUG("getWearHistogram(): Called");
+	PStorageLock lock(*this, true);
+
+	if (_wearCounts == NULL) {
+		return 0;
+	}
+	memcpy(counts, _wearCounts, min(maxRegions, _wear.regions) * sizeof(unsigned int));
+	if (regionSize != NULL) {
+		*regionSize = _wear.regionSize;
+	}
+	return _wear.regions;
+}
+
+void PStorage::_wearPlan() {
+	PSTORAGE_DEBUG("_wearPlan(): Called");
+
+#if(PSTORAGE_WEAR_REGIONS > 0)
+	const unsigned int page = PSTORAGE_IO_BUFFER_SIZE;
+	_params.wearStart = _params.firstEntry;
+	_params.wearRegions = PSTORAGE_WEAR_REGIONS;
+	_params.firstEntry = (_params.wearStart + 2 * _wearCopySize() + page - 1) / page * page;
+	_params.features |= PSTORAGE_FEATURE_WEAR;
+#endif
+}
+
+boolean PStorage::_wearFormat() {
+	PSTORAGE_DEBUG("_wearFormat(): Called");
+
+	if (!(_params.features & PSTORAGE_FEATURE_WEAR)) {
+		return true;
+	}
+	_wearCounts = (unsigned int *) calloc(_params.wearRegions, sizeof(unsigned int));
+	if (_wearCounts == NULL) {
+		PSTORAGE_DEBUG("_wearFormat(): Could not allocate %d counts", _params.wearRegions);
+		return false;
+	}
+	_wear.magic = PSTORAGE_WEAR_MAGIC;
+	_wear.sequence = 0;
+	_wear.cursor = _params.firstEntry;
+	_wear.regions = _params.wearRegions;
+	_wear.regionSize = (_params.firstEntry + _params.size + _wear.regions - 1) / _wear.regions;
+	_wearUnsaved = 0;
+	return _wearSave();
+}
+
+/*
+ * Takes the latest valid copy. A store whose copies are both invalid counts from 0 again.
+ */
+boolean PStorage::_wearLoad() {
+	PSTORAGE_DEBUG("_wearLoad(): Called");
+
+	_wearDrop();
+	if (!(_params.features & PSTORAGE_FEATURE_WEAR) || (_params.wearRegions == 0)) {
+		return true;
+	}
+	_wearCounts = (unsigned int *) calloc(_params.wearRegions, sizeof(unsigned int));
+	unsigned int *counts = (unsigned int *) malloc(_params.wearRegions * sizeof(unsigned int));
+	if ((_wearCounts == NULL) || (counts == NULL)) {
+		PSTORAGE_DEBUG("_wearLoad(): Could not allocate %d counts", _params.wearRegions);
+		free(counts);
+		_wearDrop();
+		return false;
+	}
+	boolean found = false;
+	for (unsigned int copy = 0; copy < 2; copy++) {
+		PStorageWearHeader header;
+		unsigned int checksum;
+		if (!_seek(_params.wearStart + copy * _wearCopySize()) || !_read((byte *) &header, sizeof(header)) ||
+				!_read((byte *) counts, _params.wearRegions * sizeof(unsigned int)) || !_read((byte *) &checksum, sizeof(checksum))) {
+			PSTORAGE_DEBUG("_wearLoad(): Could not read copy %d", copy);
+			continue;
+		}
+		if ((header.magic == PSTORAGE_WEAR_MAGIC) && (header.regions == _params.wearRegions) &&
+				(checksum == _wearChecksum(header, counts)) && (!found || ((int) (header.sequence - _wear.sequence) > 0))) {
+			_wear = header;
+			memcpy(_wearCounts, counts, _params.wearRegions * sizeof(unsigned int));
+			found = true;
+		}
+	}
+	free(counts);
+	if (!found) {
+		PSTORAGE_DEBUG("_wearLoad(): No valid copy, counting from 0");
+		_wear.magic = PSTORAGE_WEAR_MAGIC;
+		_wear.sequence = 0;
+		_wear.cursor = _params.firstEntry;
+		_wear.regions = _params.wearRegions;
+		_wear.regionSize = (_params.firstEntry + _params.size + _wear.regions - 1) / _wear.regions;
+	}
+	_wearUnsaved = 0;
+	return true;
+}
+
+/*
+ * Writes the counts into the older copy and flushes them, _position is kept, so _flush() can call it. The write of
+ * the copy is counted ahead, so the saved counts include it and the store closes without unsaved ones.
+ */
+boolean PStorage::_wearSave() {
+	if ((_wearCounts == NULL) || !_writeBackIOBuffer()) {  // other pending writes are counted as usual
+		return _wearCounts == NULL;
+	}
+	unsigned int *counts = _wearCounts;
+	const unsigned int position = _position, start = _params.wearStart + ((_wear.sequence + 1) % 2) * _wearCopySize();
+	_wear.sequence++;
+	_wearCount(start, _wearCopySize());
+	_wearUnsaved = 0;
+	const unsigned int checksum = _wearChecksum(_wear, counts);
+	_wearCounts = NULL;  // counted already
+	const boolean result = _seek(start) && _write((byte *) &_wear, sizeof(_wear)) &&
+			_write((byte *) counts, _wear.regions * sizeof(unsigned int)) && _write((byte *) &checksum, sizeof(checksum)) &&
+			_writeBackIOBuffer();
+	_wearCounts = counts;
+	_position = position;
+	if (!result) {
+		PSTORAGE_DEBUG("_wearSave(): Could not write the counts at %d", _params.wearStart);
+		return false;
+	}
+	_storageFile.flush();
+	_pStorageCount(_stats.flushes);
+	PSTORAGE_TRACE(P_TRACE_FLUSH);
+	return true;
+}
+
+void PStorage::_wearCount(unsigned int position, unsigned int length) {
+	if ((_wearCounts == NULL) || (length == 0)) {
+		return;
+	}
+	const unsigned int last = min((position + length - 1) / _wear.regionSize, _wear.regions - 1);
+	for (unsigned int region = min(position / _wear.regionSize, last); region <= last; region++) {
+		_wearCounts[region]++;
+	}
+	_wearUnsaved++;
+}
+
+void PStorage::_wearDrop() {  // saves the pending counts of the open store
+	if ((_wearCounts != NULL) && (_wearUnsaved > 0)) {
+		_wearSave();
+	}
+	free(_wearCounts);
+	_wearCounts = NULL;
+	_wearUnsaved = 0;
+}
+
+unsigned int PStorage::_wearCopySize() {
+	return sizeof(PStorageWearHeader) + (_params.wearRegions + 1) * sizeof(unsigned int);
+}
+
+unsigned int PStorage::_wearChecksum(const PStorageWearHeader &header, const unsigned int *counts) {  // FNV-1a
+	unsigned int hash = 2166136261U;
+	for (unsigned int i = 0; i < sizeof(PStorageWearHeader); i++) {
+		hash = (hash ^ ((const byte *) &header)[i]) * 16777619U;
+	}
+	for (unsigned int i = 0; i < header.regions * sizeof(unsigned int); i++) {
+		hash = (hash ^ ((const byte *) counts)[i]) * 16777619U;
+	}
+	return hash;
+}
+
+unsigned int PStorage::_wearDistance(unsigned int entry) {  // behind the cursor, next-fit order
+	return (entry >= _wear.cursor) ? entry - _wear.cursor : entry + _wear.regions * _wear.regionSize - _wear.cursor;
+}